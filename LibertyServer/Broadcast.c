@@ -0,0 +1,170 @@
+/**
+ * @file Broadcast.c
+ * Broadcast.hで宣言された関数の定義を記述したファイル。
+ *
+ * 書き手はイベントを書き込んでから公開番号を設定し、読み手は読み出した後に
+ * 公開番号が変わっていないことを確かめる。変わっていれば上書きされたと判断する。
+ * 読み手が待機しているときだけ条件変数で通知するため、
+ * 読み手が追いついていない間の書き込みはロックを取らない。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "Broadcast.h"
+
+/**
+ * リングバッファを初期化。
+ * @param broadcast 初期化するリングバッファ。
+ * @param length 格納できるイベント数。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int
+initializeBroadcast(Broadcast *broadcast, unsigned int length)
+{
+    unsigned int i;
+    unsigned int rounded = 1;
+
+    while (rounded < length) {
+        rounded <<= 1;
+    }
+    broadcast->frames = (BroadcastFrame*)calloc(rounded, sizeof(BroadcastFrame));
+    if (broadcast->frames == NULL) {
+        return -1;
+    }
+    /* 未使用の領域を公開済みと誤認しないよう、番号を存在しない値にしておく */
+    for (i = 0; i < rounded; ++i) {
+        broadcast->frames[i].sequence = ~0ULL;
+    }
+    broadcast->length = rounded;
+    broadcast->published = 0;
+    broadcast->waiting = 0;
+    broadcast->stopped = 0;
+    pthread_mutex_init(&broadcast->mutex, NULL);
+    pthread_cond_init(&broadcast->cond, NULL);
+
+    return 0;
+}
+
+/**
+ * リングバッファのリソースを解放。
+ * @param broadcast リソースを解放するリングバッファ。
+ */
+void
+finalizeBroadcast(Broadcast *broadcast)
+{
+    pthread_cond_destroy(&broadcast->cond);
+    pthread_mutex_destroy(&broadcast->mutex);
+    free(broadcast->frames);
+    broadcast->frames = NULL;
+}
+
+/**
+ * 待機中の読み手を起こす。
+ * @param broadcast 対象のリングバッファ。
+ */
+static void
+wakeReaders(Broadcast *broadcast)
+{
+    /* 読み手が待機を始めたことと公開番号の更新のどちらかは必ず互いに見える */
+    if (__atomic_load_n(&broadcast->waiting, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&broadcast->mutex);
+        pthread_cond_broadcast(&broadcast->cond);
+        pthread_mutex_unlock(&broadcast->mutex);
+    }
+}
+
+/**
+ * イベントを公開し、待機中の読み手を起こす。
+ * @param broadcast 公開先のリングバッファ。
+ * @param event 公開するイベント。
+ */
+void
+publishBroadcast(Broadcast *broadcast, const BroadcastFrame *event)
+{
+    unsigned long long sequence = broadcast->published;
+    BroadcastFrame *frame = &broadcast->frames[sequence & (broadcast->length - 1)];
+
+    /* 書き込み中であることを示してから内容を更新 */
+    __atomic_store_n(&frame->sequence, ~0ULL, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    frame->device = event->device;
+    frame->size = event->size;
+    frame->origin = event->origin;
+    frame->record = event->record;
+    frame->recordTime = event->recordTime;
+    frame->encoding = event->encoding;
+    frame->keyframe = event->keyframe;
+    memcpy(frame->data, event->data, event->size);
+    __atomic_store_n(&frame->sequence, sequence, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&broadcast->published, sequence + 1, __ATOMIC_SEQ_CST);
+    wakeReaders(broadcast);
+}
+
+/**
+ * 次のイベントが公開されるまで待機して読み出し。
+ * @param broadcast 読み出し元のリングバッファ。
+ * @param next 次に読む公開番号。
+ * @param frame 読み出したイベントの格納先。
+ * @return 読み出した場合は読み飛ばしたイベント数、停止した場合は負数。
+ */
+long long
+receiveBroadcast(Broadcast *broadcast, unsigned long long *next, BroadcastFrame *frame)
+{
+    long long skipped = 0;
+
+    while (1) {
+        unsigned long long published =
+            __atomic_load_n(&broadcast->published, __ATOMIC_ACQUIRE);
+        BroadcastFrame *slot;
+
+        if (__atomic_load_n(&broadcast->stopped, __ATOMIC_ACQUIRE)) {
+            return -1;
+        }
+        if (*next == published) {
+            /* 公開されるまで待機 */
+            pthread_mutex_lock(&broadcast->mutex);
+            __atomic_add_fetch(&broadcast->waiting, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&broadcast->published, __ATOMIC_SEQ_CST) == *next &&
+                   !broadcast->stopped) {
+                pthread_cond_wait(&broadcast->cond, &broadcast->mutex);
+            }
+            __atomic_sub_fetch(&broadcast->waiting, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&broadcast->mutex);
+            continue;
+        }
+        /* 一周以上遅れていれば、残っている最も古いイベントまで読み飛ばす */
+        if (published - *next > broadcast->length) {
+            skipped += published - broadcast->length - *next;
+            *next = published - broadcast->length;
+        }
+
+        slot = &broadcast->frames[*next & (broadcast->length - 1)];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == *next) {
+            *frame = *slot;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            /* 読み出し中に上書きされていなければ完了 */
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == *next) {
+                ++*next;
+                return skipped;
+            }
+        }
+        /* 上書きされていたので読み飛ばす */
+        ++skipped;
+        ++*next;
+    }
+}
+
+/**
+ * 待機中の読み手を全て起こし、以降の読み出しを停止。
+ * @param broadcast 停止するリングバッファ。
+ */
+void
+stopBroadcast(Broadcast *broadcast)
+{
+    pthread_mutex_lock(&broadcast->mutex);
+    __atomic_store_n(&broadcast->stopped, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&broadcast->cond);
+    pthread_mutex_unlock(&broadcast->mutex);
+}
@@ -0,0 +1,83 @@
+/**
+ * @file Broadcast.h
+ * 取得スレッドが1度だけ書き込んだイベントを、複数の配信スレッドが
+ * それぞれ読み出すためのリングバッファの定義と、その操作関数の宣言を
+ * 記述したファイル。
+ *
+ * 書き手は1スレッドに限る。読み手は自分が次に読む番号を各自で保持する。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef BROADCAST_H
+#define BROADCAST_H /**< インクルードガード用定数 */
+
+#include <stddef.h>
+#include <pthread.h>
+#include "Latency.h"
+#include "MessagePool.h"
+
+#define BROADCAST_DATA_MAX 64 /**< 1イベントの最大バイト数 */
+
+/** リングバッファに格納するイベント */
+typedef struct {
+    unsigned long long sequence;             /**< 公開番号（書き込み完了後に設定） */
+    int device;                              /**< デバイス番号 */
+    size_t size;                             /**< イベントのバイト数 */
+    LatencyTime origin;                      /**< 遅延計測の起点時刻 */
+    unsigned long long record;               /**< デバイスレコードの番号（0なら間引かない） */
+    long long recordTime;                    /**< デバイスレコードの取得時刻（マイクロ秒） */
+    MessageEncoding encoding;                /**< 符号化形式 */
+    int keyframe;                            /**< 圧縮イベントのキーフレームかどうか */
+    unsigned char data[BROADCAST_DATA_MAX];  /**< 符号化済みのイベント */
+} BroadcastFrame;
+
+/** イベントのリングバッファ */
+typedef struct {
+    BroadcastFrame *frames;       /**< イベントの格納領域 */
+    unsigned int length;          /**< 格納できるイベント数（2のべき乗） */
+    unsigned long long published; /**< 公開済みのイベント数 */
+    unsigned int waiting;         /**< 待機中の読み手の数 */
+    int stopped;                  /**< 停止要求フラグ */
+    pthread_mutex_t mutex;        /**< 待機用ミューテックス */
+    pthread_cond_t cond;          /**< 待機用条件変数 */
+} Broadcast;
+
+/**
+ * リングバッファを初期化。
+ * @param broadcast 初期化するリングバッファ。
+ * @param length 格納できるイベント数（2のべき乗に切り上げる）。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int initializeBroadcast(Broadcast *broadcast, unsigned int length);
+
+/**
+ * リングバッファのリソースを解放。
+ * @param broadcast リソースを解放するリングバッファ。
+ */
+void finalizeBroadcast(Broadcast *broadcast);
+
+/**
+ * イベントを公開し、待機中の読み手を起こす。
+ * @param broadcast 公開先のリングバッファ。
+ * @param event 公開するイベント（公開番号は無視される）。
+ */
+void publishBroadcast(Broadcast *broadcast, const BroadcastFrame *event);
+
+/**
+ * 次のイベントが公開されるまで待機して読み出し。
+ * 読み手が遅れて上書きされたイベントは読み飛ばす。
+ * @param broadcast 読み出し元のリングバッファ。
+ * @param next 次に読む公開番号。読み出し後に更新される。
+ * @param frame 読み出したイベントの格納先。
+ * @return 読み出した場合は読み飛ばしたイベント数（0以上）、停止した場合は負数。
+ */
+long long receiveBroadcast(Broadcast *broadcast, unsigned long long *next,
+                           BroadcastFrame *frame);
+
+/**
+ * 待機中の読み手を全て起こし、以降の読み出しを停止。
+ * @param broadcast 停止するリングバッファ。
+ */
+void stopBroadcast(Broadcast *broadcast);
+
+#endif
@@ -0,0 +1,178 @@
+/**
+ * @file ClientSet.c
+ * ClientSet.hで宣言された関数の定義を記述したファイル。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "ClientSet.h"
+
+/**
+ * 指定した要素数のスナップショットのメモリ領域を割り当て。
+ * @param size 要素数。
+ * @return 割り当てたスナップショット。
+ */
+static ClientSnapshot *
+allocateSnapshot(int size)
+{
+    ClientSnapshot *snapshot =
+        (ClientSnapshot*)malloc(sizeof(ClientSnapshot) + sizeof(int) * size);
+    if (snapshot != NULL) {
+        snapshot->release = NULL;
+        snapshot->removed = -1;
+        snapshot->size = size;
+    }
+    return snapshot;
+}
+
+/**
+ * 読み手が居なくなった古いスナップショットの解放処理。
+ * 差し替え時に削除したクライアントがあれば、その解放処理も行う。
+ * @param head スナップショットに埋め込んだ登録情報。
+ */
+static void
+releaseSnapshot(RcuHead *head)
+{
+    ClientSnapshot *snapshot = (ClientSnapshot*)head;
+
+    if (snapshot->removed >= 0 && snapshot->release != NULL) {
+        (*snapshot->release)(snapshot->removed);
+    }
+    free(snapshot);
+}
+
+/**
+ * 新しいスナップショットを公開し、古いスナップショットを解放待ちにする。
+ * 書き手のミューテックスを取得した状態で呼び出すこと。
+ * @param set 公開先の集合。
+ * @param snapshot 公開するスナップショット。
+ * @param removed 削除したクライアント（無ければ-1）。
+ */
+static void
+publishSnapshot(ClientSet *set, ClientSnapshot *snapshot, int removed)
+{
+    ClientSnapshot *old = set->snapshot;
+    __atomic_store_n(&set->snapshot, snapshot, __ATOMIC_SEQ_CST);
+    /* 古いスナップショットを参照している読み手が居なくなるまで解放を遅らせる */
+    old->release = set->release;
+    old->removed = removed;
+    deferRcu(&set->rcu, &old->head, releaseSnapshot);
+}
+
+/**
+ * 集合を空の状態で初期化。
+ * @param set 初期化する集合。
+ * @param release 削除したクライアントの解放処理。
+ */
+void
+initializeClientSet(ClientSet *set, void (*release)(int client))
+{
+    set->snapshot = allocateSnapshot(0);
+    set->release = release;
+    pthread_mutex_init(&set->mutex, NULL);
+    initializeRcu(&set->rcu);
+}
+
+/**
+ * 集合のリソースを解放。
+ * @param set リソースを解放する集合。
+ */
+void
+finalizeClientSet(ClientSet *set)
+{
+    finalizeRcu(&set->rcu);
+    pthread_mutex_destroy(&set->mutex);
+    free(set->snapshot);
+    set->snapshot = NULL;
+}
+
+/**
+ * 集合にクライアントを追加。
+ * @param set 追加先の集合。
+ * @param client 追加するクライアントソケット。
+ */
+void
+addClientSet(ClientSet *set, int client)
+{
+    ClientSnapshot *old;
+    ClientSnapshot *snapshot;
+
+    pthread_mutex_lock(&set->mutex);
+    old = set->snapshot;
+    snapshot = allocateSnapshot(old->size + 1);
+    if (snapshot != NULL) {
+        memcpy(snapshot->elements, old->elements, sizeof(int) * old->size);
+        snapshot->elements[old->size] = client;
+        publishSnapshot(set, snapshot, -1);
+    }
+    pthread_mutex_unlock(&set->mutex);
+}
+
+/**
+ * 集合からクライアントを削除。
+ * @param set 削除元の集合。
+ * @param client 削除するクライアントソケット。
+ * @return 削除した場合は1、含まれていなかった場合は0。
+ */
+int
+removeClientSet(ClientSet *set, int client)
+{
+    ClientSnapshot *old;
+    ClientSnapshot *snapshot;
+    int i;
+    int removed = 0;
+
+    pthread_mutex_lock(&set->mutex);
+    old = set->snapshot;
+    for (i = 0; i < old->size; ++i) {
+        if (old->elements[i] == client) {
+            break;
+        }
+    }
+    if (i < old->size && (snapshot = allocateSnapshot(old->size - 1)) != NULL) {
+        /* 削除対象の前後をまとめてコピー */
+        memcpy(snapshot->elements, old->elements, sizeof(int) * i);
+        memcpy(snapshot->elements + i, old->elements + i + 1,
+               sizeof(int) * (old->size - i - 1));
+        publishSnapshot(set, snapshot, client);
+        removed = 1;
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    return removed;
+}
+
+/**
+ * 読み手が居なくなった古いスナップショットと削除したクライアントを解放。
+ * @param set 対象の集合。
+ */
+void
+pollClientSet(ClientSet *set)
+{
+    pollRcu(&set->rcu);
+}
+
+/**
+ * 読み取り区間を開始し、公開中のスナップショットを取得。
+ * @param set 読み取る集合。
+ * @param token endReadClientSet()に渡す値の格納先。
+ * @return スナップショット。
+ */
+const ClientSnapshot *
+beginReadClientSet(ClientSet *set, int *token)
+{
+    *token = enterRcu(&set->rcu);
+    return __atomic_load_n(&set->snapshot, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * 読み取り区間を終了。
+ * @param set 読み取った集合。
+ * @param token beginReadClientSet()で得た値。
+ */
+void
+endReadClientSet(ClientSet *set, int token)
+{
+    leaveRcu(&set->rcu, token);
+}
@@ -0,0 +1,91 @@
+/**
+ * @file ClientSet.h
+ * 書き込み時にコピーするクライアントソケット集合の定義と、
+ * その操作関数の宣言を記述したファイル。
+ *
+ * 読み手（配信スレッド）は公開中のスナップショットをロックを取らずに走査し、
+ * 書き手（接続の受理や切断）は新しいスナップショットを作って差し替える。
+ * 差し替えた古いスナップショットと削除したクライアントは待機せずに解放待ちとし、
+ * 読み手が居なくなった後のpollClientSet()で解放する。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef CLIENT_SET_H
+#define CLIENT_SET_H /**< インクルードガード用定数 */
+
+#include <pthread.h>
+#include "Rcu.h"
+
+/** 変更されないクライアントソケット集合のスナップショット */
+typedef struct {
+    RcuHead head;             /**< 差し替え後の解放処理の登録情報 */
+    void (*release)(int client); /**< 削除したクライアントの解放処理 */
+    int removed;              /**< 差し替え時に削除したクライアント（無ければ-1） */
+    int size;                 /**< 要素数 */
+    int elements[];           /**< クライアントソケット */
+} ClientSnapshot;
+
+/** クライアントソケット集合 */
+typedef struct {
+    ClientSnapshot *snapshot; /**< 公開中のスナップショット */
+    void (*release)(int client); /**< 削除したクライアントの解放処理 */
+    pthread_mutex_t mutex;    /**< 書き手同士の排他用ミューテックス */
+    Rcu rcu;                  /**< 古いスナップショットの解放時期の管理 */
+} ClientSet;
+
+/**
+ * 集合を空の状態で初期化。
+ * @param set 初期化する集合。
+ * @param release 削除したクライアントを参照する読み手が居なくなった後に
+ *                呼び出す関数（ソケットを閉じるなど）。不要ならNULL。
+ */
+void initializeClientSet(ClientSet *set, void (*release)(int client));
+
+/**
+ * 集合のリソースを解放。解放待ちのクライアントは全てreleaseに渡す。
+ * 公開中のスナップショットに含まれるクライアントは渡さない。
+ * @param set リソースを解放する集合。
+ */
+void finalizeClientSet(ClientSet *set);
+
+/**
+ * 集合にクライアントを追加。
+ * @param set 追加先の集合。
+ * @param client 追加するクライアントソケット。
+ */
+void addClientSet(ClientSet *set, int client);
+
+/**
+ * 集合からクライアントを削除。待機はしない。
+ * 戻った時点では削除前のスナップショットを参照している読み手が残っている
+ * 可能性があるので、クライアントの後始末は初期化時に渡したreleaseで行う。
+ * @param set 削除元の集合。
+ * @param client 削除するクライアントソケット。
+ * @return 削除した場合は1、含まれていなかった場合は0。
+ */
+int removeClientSet(ClientSet *set, int client);
+
+/**
+ * 読み手が居なくなった古いスナップショットと削除したクライアントを解放。
+ * 待機はしないので、配信のたびに呼び出してよい。
+ * 読み取り区間の中から呼び出してはならない。
+ * @param set 対象の集合。
+ */
+void pollClientSet(ClientSet *set);
+
+/**
+ * 読み取り区間を開始し、公開中のスナップショットを取得。
+ * @param set 読み取る集合。
+ * @param token endReadClientSet()に渡す値の格納先。
+ * @return スナップショット。endReadClientSet()を呼ぶまで有効。
+ */
+const ClientSnapshot *beginReadClientSet(ClientSet *set, int *token);
+
+/**
+ * 読み取り区間を終了。
+ * @param set 読み取った集合。
+ * @param token beginReadClientSet()で得た値。
+ */
+void endReadClientSet(ClientSet *set, int token);
+
+#endif
@@ -0,0 +1,280 @@
+/**
+ * @file CompactEncoding.c
+ * CompactEncoding.hで宣言された関数の定義を記述したファイル。
+ *
+ * 四元数は絶対値が最大の成分の番号（2ビット）と、残り3成分を
+ * [-1/√2, 1/√2]の範囲で10ビットずつ量子化した値で表す。
+ * qと-qは同じ姿勢なので、最大成分が正になるよう符号を揃えて省略する。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdlib.h>
+#include <math.h>
+#include "CompactEncoding.h"
+
+#define QUATERNION_BITS 10 /**< 四元数の1成分のビット数 */
+#define QUATERNION_MAX ((1 << QUATERNION_BITS) - 1) /**< 四元数の1成分の最大値 */
+#define DELTA_MAX 32767 /**< 差分で表せる位置の最大値 */
+#define DELTA_TIME_MAX 65535 /**< 差分で表せる経過時間の最大値 */
+
+/**
+ * 32ビット整数をビッグエンディアンで書き込み。
+ * @param data 書き込み先。
+ * @param value 書き込む値。
+ */
+static void
+putUint32(unsigned char *data, unsigned long value)
+{
+    data[0] = (unsigned char)(value >> 24);
+    data[1] = (unsigned char)(value >> 16);
+    data[2] = (unsigned char)(value >> 8);
+    data[3] = (unsigned char)value;
+}
+
+/**
+ * 32ビット整数をビッグエンディアンで読み出し。
+ * @param data 読み出し元。
+ * @return 読み出した値。
+ */
+static unsigned long
+getUint32(const unsigned char *data)
+{
+    return ((unsigned long)data[0] << 24) | ((unsigned long)data[1] << 16) |
+           ((unsigned long)data[2] << 8) | data[3];
+}
+
+/**
+ * 16ビット整数をビッグエンディアンで書き込み。
+ * @param data 書き込み先。
+ * @param value 書き込む値。
+ */
+static void
+putUint16(unsigned char *data, unsigned int value)
+{
+    data[0] = (unsigned char)(value >> 8);
+    data[1] = (unsigned char)value;
+}
+
+/**
+ * 16ビット整数をビッグエンディアンで読み出し。
+ * @param data 読み出し元。
+ * @return 読み出した値。
+ */
+static unsigned int
+getUint16(const unsigned char *data)
+{
+    return ((unsigned int)data[0] << 8) | data[1];
+}
+
+/**
+ * オイラー角を単位四元数に変換。
+ * 方位角（Z軸）、仰角（Y軸）、回転角（X軸）の順に回転したものとして扱う。
+ * @param posture オイラー角（度）を格納した長さ3の配列。
+ * @param quaternion 単位四元数（w, x, y, z）の格納先。
+ */
+void
+convertEulerToQuaternion(const double posture[], double quaternion[])
+{
+    const double RADIANS = M_PI / 180.0 / 2.0;
+    double cy = cos(posture[0] * RADIANS);
+    double sy = sin(posture[0] * RADIANS);
+    double cp = cos(posture[1] * RADIANS);
+    double sp = sin(posture[1] * RADIANS);
+    double cr = cos(posture[2] * RADIANS);
+    double sr = sin(posture[2] * RADIANS);
+
+    quaternion[0] = cr * cp * cy + sr * sp * sy;
+    quaternion[1] = sr * cp * cy - cr * sp * sy;
+    quaternion[2] = cr * sp * cy + sr * cp * sy;
+    quaternion[3] = cr * cp * sy - sr * sp * cy;
+}
+
+/**
+ * 単位四元数を32ビットに量子化。
+ * @param quaternion 単位四元数（w, x, y, z）。
+ * @return 量子化した値。
+ */
+static unsigned long
+packQuaternion(const double quaternion[])
+{
+    int largest = 0;
+    int i;
+    double sign;
+    unsigned long packed;
+
+    for (i = 1; i < 4; ++i) {
+        if (fabs(quaternion[i]) > fabs(quaternion[largest])) {
+            largest = i;
+        }
+    }
+    /* 最大成分が正になるように符号を揃える */
+    sign = quaternion[largest] < 0 ? -1.0 : 1.0;
+    packed = (unsigned long)largest;
+    for (i = 0; i < 4; ++i) {
+        long value;
+        if (i == largest) {
+            continue;
+        }
+        value = lround((sign * quaternion[i] * M_SQRT2 + 1.0) * QUATERNION_MAX / 2.0);
+        if (value < 0) {
+            value = 0;
+        } else if (value > QUATERNION_MAX) {
+            value = QUATERNION_MAX;
+        }
+        packed = (packed << QUATERNION_BITS) | (unsigned long)value;
+    }
+    return packed;
+}
+
+/**
+ * 32ビットに量子化した四元数を復元。
+ * @param packed 量子化した値。
+ * @param quaternion 単位四元数（w, x, y, z）の格納先。
+ */
+static void
+unpackQuaternion(unsigned long packed, double quaternion[])
+{
+    int largest = (int)((packed >> (QUATERNION_BITS * 3)) & 3);
+    double sum = 0.0;
+    int shift = QUATERNION_BITS * 2;
+    int i;
+
+    for (i = 0; i < 4; ++i) {
+        if (i == largest) {
+            continue;
+        }
+        quaternion[i] = ((double)((packed >> shift) & QUATERNION_MAX) * 2.0 /
+                         QUATERNION_MAX - 1.0) / M_SQRT2;
+        sum += quaternion[i] * quaternion[i];
+        shift -= QUATERNION_BITS;
+    }
+    quaternion[largest] = sum < 1.0 ? sqrt(1.0 - sum) : 0.0;
+}
+
+/**
+ * 符号化の状態を初期化。
+ * @param encoder 初期化する状態。
+ */
+void
+initializeCompactEncoder(CompactEncoder *encoder)
+{
+    encoder->valid = 0;
+    encoder->sinceKey = 0;
+}
+
+/**
+ * デバイスレコードを圧縮イベントに符号化。
+ * @param encoder 符号化の状態。
+ * @param position 位置（cm）を格納した長さ3の配列。
+ * @param posture オイラー角（度）を格納した長さ3の配列。
+ * @param time 時刻（ミリ秒）。
+ * @param keyframe キーフレームを強制する場合は0以外。
+ * @param data 出力先。
+ * @return 出力したバイト数。
+ */
+size_t
+encodeCompactRecord(CompactEncoder *encoder, const double position[],
+                    const double posture[], long long time, int keyframe,
+                    unsigned char *data)
+{
+    double quaternion[4];
+    int quantized[3];
+    int i;
+
+    for (i = 0; i < 3; ++i) {
+        quantized[i] = (int)lround(position[i] * COMPACT_POSITION_SCALE);
+    }
+    convertEulerToQuaternion(posture, quaternion);
+
+    /* 差分で表せなければキーフレームにする */
+    if (!encoder->valid || encoder->sinceKey >= COMPACT_KEYFRAME_INTERVAL ||
+        time < encoder->keyTime || time - encoder->keyTime > DELTA_TIME_MAX) {
+        keyframe = 1;
+    }
+    for (i = 0; i < 3 && !keyframe; ++i) {
+        if (abs(quantized[i] - encoder->key[i]) > DELTA_MAX) {
+            keyframe = 1;
+        }
+    }
+
+    if (keyframe) {
+        data[0] = COMPACT_KEYFRAME_HEADER;
+        for (i = 0; i < 3; ++i) {
+            putUint32(data + 1 + i * 4, (unsigned long)quantized[i]);
+            encoder->key[i] = quantized[i];
+        }
+        putUint32(data + 13, packQuaternion(quaternion));
+        putUint32(data + 17, (unsigned long)((unsigned long long)time >> 32));
+        putUint32(data + 21, (unsigned long)time);
+        encoder->keyTime = time;
+        encoder->sinceKey = 0;
+        encoder->valid = 1;
+        return COMPACT_KEYFRAME_SIZE;
+    }
+
+    data[0] = COMPACT_DELTA_HEADER;
+    for (i = 0; i < 3; ++i) {
+        putUint16(data + 1 + i * 2, (unsigned int)(quantized[i] - encoder->key[i]));
+    }
+    putUint32(data + 7, packQuaternion(quaternion));
+    putUint16(data + 11, (unsigned int)(time - encoder->keyTime));
+    ++encoder->sinceKey;
+    return COMPACT_DELTA_SIZE;
+}
+
+/**
+ * 復号の状態を初期化。
+ * @param decoder 初期化する状態。
+ */
+void
+initializeCompactDecoder(CompactDecoder *decoder)
+{
+    decoder->valid = 0;
+}
+
+/**
+ * 圧縮イベントを復号。
+ * @param decoder 復号の状態。
+ * @param data 受信したデータ。
+ * @param size 受信したデータのバイト数。
+ * @param record 復号したデバイスレコードの格納先。
+ * @return 消費したバイト数。キーフレームを受信する前の差分は読み飛ばして
+ *         COMPACT_DELTA_SIZEを返し、record->validを0にする。
+ *         データが足りないか圧縮イベントでなければ負数。
+ */
+int
+decodeCompactRecord(CompactDecoder *decoder, const unsigned char *data, size_t size,
+                    CompactRecord *record)
+{
+    int i;
+
+    if (size >= COMPACT_KEYFRAME_SIZE && data[0] == COMPACT_KEYFRAME_HEADER) {
+        for (i = 0; i < 3; ++i) {
+            decoder->key[i] = (int)getUint32(data + 1 + i * 4);
+            record->position[i] = decoder->key[i] / COMPACT_POSITION_SCALE;
+        }
+        unpackQuaternion(getUint32(data + 13), record->quaternion);
+        decoder->keyTime = (long long)(((unsigned long long)getUint32(data + 17) << 32) |
+                                       getUint32(data + 21));
+        decoder->valid = 1;
+        record->time = decoder->keyTime;
+        record->valid = 1;
+        return COMPACT_KEYFRAME_SIZE;
+    }
+    if (size >= COMPACT_DELTA_SIZE && data[0] == COMPACT_DELTA_HEADER) {
+        /* 基準が無いので復号できないが、次のイベントに進めるよう消費はする */
+        if (!decoder->valid) {
+            record->valid = 0;
+            return COMPACT_DELTA_SIZE;
+        }
+        for (i = 0; i < 3; ++i) {
+            short delta = (short)getUint16(data + 1 + i * 2);
+            record->position[i] = (decoder->key[i] + delta) / COMPACT_POSITION_SCALE;
+        }
+        unpackQuaternion(getUint32(data + 7), record->quaternion);
+        record->time = decoder->keyTime + getUint16(data + 11);
+        record->valid = 1;
+        return COMPACT_DELTA_SIZE;
+    }
+    return -1;
+}
@@ -0,0 +1,104 @@
+/**
+ * @file CompactEncoding.h
+ * 帯域の限られたクライアント向けの圧縮イベントの符号化と復号を行う
+ * 関数の宣言を記述したファイル。
+ *
+ * 圧縮イベントは1件のデバイスレコードの位置と姿勢をまとめて表す。
+ * 位置は0.01mm単位の固定小数点、姿勢は最大成分を省いた32ビットの四元数で表し、
+ * キーフレーム以外は直前のキーフレームとの差分のみを送る。
+ * 多バイトの値は全てビッグエンディアンで格納する。
+ *
+ * キーフレーム（25バイト）:
+ *   ヘッダ(4) | x,y,z (int32) | 四元数 (uint32) | 時刻 (int64, ミリ秒)
+ * 差分（13バイト）:
+ *   ヘッダ(5) | dx,dy,dz (int16) | 四元数 (uint32) | キーフレームからの経過時間 (uint16, ミリ秒)
+ *
+ * 位置の誤差は0.005mm以内、姿勢の誤差は0.3度以内となる（四元数の4成分が
+ * 近い姿勢で最も大きく、最悪でおよそ0.27度）。
+ * クライアントはこのファイルとCompactEncoding.cを使用して復号できる。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef COMPACT_ENCODING_H
+#define COMPACT_ENCODING_H /**< インクルードガード用定数 */
+
+#include <stddef.h>
+
+#define COMPACT_KEYFRAME_HEADER 4    /**< キーフレームを表すヘッダ */
+#define COMPACT_DELTA_HEADER 5       /**< 差分を表すヘッダ */
+#define COMPACT_KEYFRAME_SIZE 25     /**< キーフレームのバイト数 */
+#define COMPACT_DELTA_SIZE 13        /**< 差分のバイト数 */
+#define COMPACT_KEYFRAME_INTERVAL 32 /**< キーフレームを送り直すデバイスレコード数 */
+#define COMPACT_POSITION_SCALE 1000.0 /**< 位置（cm）を固定小数点（0.01mm）に変換する倍率 */
+
+/** 圧縮イベントの符号化の状態 */
+typedef struct {
+    int key[3];             /**< 直前のキーフレームの位置（0.01mm単位） */
+    long long keyTime;      /**< 直前のキーフレームの時刻（ミリ秒） */
+    int sinceKey;           /**< 直前のキーフレームから符号化した差分の数 */
+    int valid;              /**< キーフレームを符号化済みかどうか */
+} CompactEncoder;
+
+/** 圧縮イベントの復号の状態 */
+typedef struct {
+    int key[3];             /**< 直前のキーフレームの位置（0.01mm単位） */
+    long long keyTime;      /**< 直前のキーフレームの時刻（ミリ秒） */
+    int valid;              /**< キーフレームを復号済みかどうか */
+} CompactDecoder;
+
+/** 復号したデバイスレコード */
+typedef struct {
+    double position[3];     /**< 位置（cm） */
+    double quaternion[4];   /**< 姿勢を表す単位四元数（w, x, y, z） */
+    long long time;         /**< 時刻（ミリ秒） */
+    int valid;              /**< 復号できた場合は1、キーフレームより前の差分を読み飛ばした場合は0 */
+} CompactRecord;
+
+/**
+ * 符号化の状態を初期化。
+ * @param encoder 初期化する状態。
+ */
+void initializeCompactEncoder(CompactEncoder *encoder);
+
+/**
+ * デバイスレコードを圧縮イベントに符号化。
+ * 一定数ごと、または差分が表現できない場合はキーフレームを出力する。
+ * @param encoder 符号化の状態。
+ * @param position 位置（cm）を格納した長さ3の配列。
+ * @param posture オイラー角（方位角、仰角、回転角、度）を格納した長さ3の配列。
+ * @param time 時刻（ミリ秒）。
+ * @param keyframe キーフレームを強制する場合は0以外。
+ * @param data 出力先（COMPACT_KEYFRAME_SIZEバイト以上）。
+ * @return 出力したバイト数。
+ */
+size_t encodeCompactRecord(CompactEncoder *encoder, const double position[],
+                           const double posture[], long long time, int keyframe,
+                           unsigned char *data);
+
+/**
+ * 復号の状態を初期化。
+ * @param decoder 初期化する状態。
+ */
+void initializeCompactDecoder(CompactDecoder *decoder);
+
+/**
+ * 圧縮イベントを復号。
+ * @param decoder 復号の状態。
+ * @param data 受信したデータ。
+ * @param size 受信したデータのバイト数。
+ * @param record 復号したデバイスレコードの格納先。
+ * @return 消費したバイト数。キーフレームを受信する前の差分は読み飛ばして
+ *         COMPACT_DELTA_SIZEを返し、record->validを0にする。
+ *         データが足りないか圧縮イベントでなければ負数。
+ */
+int decodeCompactRecord(CompactDecoder *decoder, const unsigned char *data, size_t size,
+                        CompactRecord *record);
+
+/**
+ * オイラー角を単位四元数に変換。
+ * @param posture オイラー角（方位角、仰角、回転角、度）を格納した長さ3の配列。
+ * @param quaternion 単位四元数（w, x, y, z）の格納先。
+ */
+void convertEulerToQuaternion(const double posture[], double quaternion[]);
+
+#endif
@@ -45,6 +45,29 @@ finalizeIntList(IntList *list)
     free(list->elements);
 }
 
+/**
+ * リストの容量を指定した要素数まで予め拡大。
+ * @param list 容量を拡大するリストのポインタ。
+ * @param capacity 確保する要素数。
+ * @return 正常に確保できた場合は0、できなかった場合は0以外。
+ */
+int
+reserveIntList(IntList *list, int capacity)
+{
+    int *elements;
+
+    if (capacity <= list->capacity) {
+        return 0;
+    }
+    elements = (int*)realloc(list->elements, sizeof(int) * capacity);
+    if (elements == NULL) {
+        return -1;
+    }
+    list->elements = elements;
+    list->capacity = capacity;
+    return 0;
+}
+
 /**
  * リストの末尾に要素を追加。
  * リストの容量が足りない場合には、容量を拡大してから要素を追加する。
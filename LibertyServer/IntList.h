@@ -29,6 +29,15 @@ void initializeIntList(IntList *list);
  */
 void finalizeIntList(IntList *list);
 
+/**
+ * リストの容量を指定した要素数まで予め拡大。
+ * 以後、その要素数までは追加時に再割り当てが起こらない。
+ * @param list 容量を拡大するリストのポインタ。
+ * @param capacity 確保する要素数。
+ * @return 正常に確保できた場合は0、できなかった場合は0以外。
+ */
+int reserveIntList(IntList *list, int capacity);
+
 /**
  * リストの末尾に要素を追加。
  * リストの容量が足りない場合には、容量を拡大してから要素を追加する。
@@ -0,0 +1,443 @@
+/**
+ * @file IoUring.c
+ * IoUring.hで宣言された関数の定義を記述したファイル。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include "IoUring.h"
+
+#if !defined(LIBERTY_NO_URING) && defined(__NR_io_uring_setup)
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/**
+ * io_uring_setupシステムコールの呼び出し。
+ * @param entries 投入キューの長さ。
+ * @param params 設定値と結果の格納先。
+ * @return io_uringのファイルディスクリプタ、失敗した場合は-1。
+ */
+static int
+setupIoUring(unsigned int entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+/**
+ * io_uring_enterシステムコールの呼び出し。
+ * @param fd io_uringのファイルディスクリプタ。
+ * @param submit 投入する要求の数。
+ * @param wait 完了を待つ要求の数。
+ * @param flags フラグ。
+ * @return 投入した要求の数、失敗した場合は-1。
+ */
+static int
+enterIoUring(int fd, unsigned int submit, unsigned int wait, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+/**
+ * io_uring_registerシステムコールの呼び出し。
+ * @param fd io_uringのファイルディスクリプタ。
+ * @param opcode 登録の種類。
+ * @param arg 登録内容。
+ * @param num 登録内容の要素数。
+ * @return 成功した場合は0以上、失敗した場合は-1。
+ */
+static int
+registerIoUring(int fd, unsigned int opcode, const void *arg, unsigned int num)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, num);
+}
+
+/**
+ * io_uringを初期化。
+ * @param uring 初期化するio_uring。
+ * @param entries 投入キューの長さ。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int
+initializeIoUring(IoUring *uring, unsigned int entries)
+{
+    struct io_uring_params params;
+    char *sq;
+    char *cq;
+
+    memset(uring, 0, sizeof(IoUring));
+    memset(&params, 0, sizeof(params));
+    uring->fd = setupIoUring(entries, &params);
+    if (uring->fd == -1) {
+        return -1;
+    }
+
+    /* 投入キューと完了キューをマップ（対応していれば1度にまとめる） */
+    uring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    uring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (uring->cqRingSize > uring->sqRingSize) {
+            uring->sqRingSize = uring->cqRingSize;
+        }
+        uring->cqRingSize = uring->sqRingSize;
+    }
+    uring->sqRing = mmap(NULL, uring->sqRingSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (uring->sqRing == MAP_FAILED) {
+        close(uring->fd);
+        return -2;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cqRing = uring->sqRing;
+    } else {
+        uring->cqRing = mmap(NULL, uring->cqRingSize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+        if (uring->cqRing == MAP_FAILED) {
+            munmap(uring->sqRing, uring->sqRingSize);
+            close(uring->fd);
+            return -2;
+        }
+    }
+    uring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqesSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        if (uring->cqRing != uring->sqRing) {
+            munmap(uring->cqRing, uring->cqRingSize);
+        }
+        munmap(uring->sqRing, uring->sqRingSize);
+        close(uring->fd);
+        return -3;
+    }
+
+    sq = (char*)uring->sqRing;
+    cq = (char*)uring->cqRing;
+    uring->sqHead = (unsigned int*)(sq + params.sq_off.head);
+    uring->sqTail = (unsigned int*)(sq + params.sq_off.tail);
+    uring->sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    uring->sqArray = (unsigned int*)(sq + params.sq_off.array);
+    uring->cqHead = (unsigned int*)(cq + params.cq_off.head);
+    uring->cqTail = (unsigned int*)(cq + params.cq_off.tail);
+    uring->cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    uring->cqes = cq + params.cq_off.cqes;
+    uring->entries = params.sq_entries;
+
+    return 0;
+}
+
+/**
+ * io_uringのリソースを解放。
+ * @param uring リソースを解放するio_uring。
+ */
+void
+finalizeIoUring(IoUring *uring)
+{
+    munmap(uring->sqes, uring->sqesSize);
+    if (uring->cqRing != uring->sqRing) {
+        munmap(uring->cqRing, uring->cqRingSize);
+    }
+    munmap(uring->sqRing, uring->sqRingSize);
+    /* 登録済みのバッファとファイル表はio_uringを閉じると解放される */
+    close(uring->fd);
+    free(uring->files);
+    uring->files = NULL;
+}
+
+/**
+ * 書き込み元のバッファを固定バッファとして登録。
+ * @param uring 登録先のio_uring。
+ * @param buffer バッファの先頭。
+ * @param size バッファのバイト数。
+ * @return 登録できた場合は0、できなかった場合は0以外。
+ */
+int
+registerIoUringBuffer(IoUring *uring, const void *buffer, size_t size)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)buffer;
+    iov.iov_len = size;
+    if (registerIoUring(uring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+        return -1;
+    }
+    uring->buffer = (const char*)buffer;
+    uring->bufferSize = size;
+    return 0;
+}
+
+/**
+ * 空の固定ファイル表を登録。
+ * @param uring 登録先のio_uring。
+ * @param filesNum 表の長さ。
+ * @return 登録できた場合は0、できなかった場合は0以外。
+ */
+int
+registerIoUringFiles(IoUring *uring, int filesNum)
+{
+    int *fds = (int*)malloc(sizeof(int) * filesNum);
+    int result;
+
+    uring->files = (unsigned char*)calloc(filesNum, sizeof(unsigned char));
+    if (fds == NULL || uring->files == NULL) {
+        free(fds);
+        free(uring->files);
+        uring->files = NULL;
+        return -1;
+    }
+    /* 全ての要素を空（-1）にして登録 */
+    memset(fds, 0xff, sizeof(int) * filesNum);
+    result = registerIoUring(uring->fd, IORING_REGISTER_FILES, fds, filesNum);
+    free(fds);
+    if (result < 0) {
+        free(uring->files);
+        uring->files = NULL;
+        return -1;
+    }
+    uring->filesNum = filesNum;
+    return 0;
+}
+
+/**
+ * 固定ファイル表の要素を設定。
+ * @param uring 対象のio_uring。
+ * @param fd 設定するファイルディスクリプタ。
+ * @param registered 登録する場合は0以外、登録を外す場合は0。
+ */
+void
+updateIoUringFile(IoUring *uring, int fd, int registered)
+{
+    struct io_uring_files_update update;
+    int value = registered ? fd : -1;
+
+    if (fd < 0 || fd >= uring->filesNum) {
+        return;
+    }
+    /* 書き込みに使われないよう、登録を外す場合は先に印を消す */
+    if (!registered) {
+        __atomic_store_n(&uring->files[fd], 0, __ATOMIC_RELEASE);
+    }
+    memset(&update, 0, sizeof(update));
+    update.offset = fd;
+    update.fds = (unsigned long)&value;
+    if (registerIoUring(uring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1 &&
+        registered) {
+        __atomic_store_n(&uring->files[fd], 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * 書き込み要求を準備。
+ * @param uring 対象のio_uring。
+ * @param fd 書き込み先のファイルディスクリプタ。
+ * @param data 書き込むデータ。
+ * @param size 書き込むバイト数。
+ * @param userData 完了時に返される値。
+ * @return 準備できた場合は0、投入キューが満杯の場合は0以外。
+ */
+int
+prepareIoUringWrite(IoUring *uring, int fd, const void *data, size_t size,
+                    unsigned long long userData)
+{
+    unsigned int tail = *uring->sqTail;
+    unsigned int index;
+    struct io_uring_sqe *sqe;
+    const char *bytes = (const char*)data;
+
+    if (tail - __atomic_load_n(uring->sqHead, __ATOMIC_ACQUIRE) >= uring->entries) {
+        return -1;
+    }
+    index = tail & *uring->sqMask;
+    sqe = (struct io_uring_sqe*)uring->sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+
+    /* 登録済みバッファ内のデータなら固定バッファとして書き込む */
+    if (uring->buffer != NULL && bytes >= uring->buffer &&
+        bytes + size <= uring->buffer + uring->bufferSize) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = 0;
+    } else {
+        sqe->opcode = IORING_OP_WRITE;
+    }
+    /* 固定ファイル表に設定済みなら添字で指定する */
+    if (fd < uring->filesNum && __atomic_load_n(&uring->files[fd], __ATOMIC_ACQUIRE)) {
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)data;
+    sqe->len = size;
+    sqe->user_data = userData;
+
+    uring->sqArray[index] = index;
+    __atomic_store_n(uring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++uring->pending;
+    return 0;
+}
+
+/**
+ * 準備済みの要求を1回のシステムコールで投入し、全ての完了を待つ。
+ * @param uring 対象のio_uring。
+ * @return 投入した要求の数、失敗した場合は負数。
+ */
+int
+submitIoUring(IoUring *uring)
+{
+    unsigned int pending = uring->pending;
+    int result;
+
+    if (pending == 0) {
+        return 0;
+    }
+    do {
+        result = enterIoUring(uring->fd, pending, pending + uring->inflight,
+                              IORING_ENTER_GETEVENTS);
+    } while (result == -1 && errno == EINTR);
+    if (result < 0) {
+        return -1;
+    }
+    uring->pending -= result;
+    uring->inflight += result;
+    return result;
+}
+
+/**
+ * 投入済みの要求が全て完了するまで待つ。
+ * @param uring 対象のio_uring。
+ * @return 待機できた場合は0、失敗した場合は負数。
+ */
+int
+waitIoUring(IoUring *uring)
+{
+    unsigned int ready = __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE) - *uring->cqHead;
+    int result;
+
+    if (uring->inflight <= ready) {
+        return 0;
+    }
+    do {
+        result = enterIoUring(uring->fd, 0, uring->inflight, IORING_ENTER_GETEVENTS);
+    } while (result == -1 && errno == EINTR);
+    return result < 0 ? -1 : 0;
+}
+
+/**
+ * 準備済みで未投入の要求を1つ取り下げる。
+ * SQPOLLを使用しないので、カーネルが投入キューを読むのはio_uring_enterの
+ * 呼び出し中だけであり、未投入の末尾を巻き戻してよい。
+ * @param uring 対象のio_uring。
+ * @param userData 取り下げた要求の準備時に指定した値の格納先。
+ * @return 取り下げた場合は1、未投入の要求が無い場合は0。
+ */
+int
+withdrawIoUring(IoUring *uring, unsigned long long *userData)
+{
+    unsigned int tail = *uring->sqTail - 1;
+    struct io_uring_sqe *sqe;
+
+    if (uring->pending == 0) {
+        return 0;
+    }
+    sqe = (struct io_uring_sqe*)uring->sqes + uring->sqArray[tail & *uring->sqMask];
+    *userData = sqe->user_data;
+    __atomic_store_n(uring->sqTail, tail, __ATOMIC_RELEASE);
+    --uring->pending;
+    return 1;
+}
+
+/**
+ * 完了した要求を1つ取り出す。
+ * @param uring 対象のio_uring。
+ * @param userData 要求の準備時に指定した値の格納先。
+ * @param result 要求の結果の格納先。
+ * @return 取り出した場合は1、完了した要求が無い場合は0。
+ */
+int
+completeIoUring(IoUring *uring, unsigned long long *userData, int *result)
+{
+    unsigned int head = *uring->cqHead;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    cqe = (struct io_uring_cqe*)uring->cqes + (head & *uring->cqMask);
+    *userData = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(uring->cqHead, head + 1, __ATOMIC_RELEASE);
+    if (uring->inflight > 0) {
+        --uring->inflight;
+    }
+    return 1;
+}
+
+#else
+
+/* io_uringを使用しない場合は常に初期化に失敗し、write()に切り替えさせる */
+
+int
+initializeIoUring(IoUring *uring, unsigned int entries)
+{
+    memset(uring, 0, sizeof(IoUring));
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+finalizeIoUring(IoUring *uring)
+{
+}
+
+int
+registerIoUringBuffer(IoUring *uring, const void *buffer, size_t size)
+{
+    return -1;
+}
+
+int
+registerIoUringFiles(IoUring *uring, int filesNum)
+{
+    return -1;
+}
+
+void
+updateIoUringFile(IoUring *uring, int fd, int registered)
+{
+}
+
+int
+prepareIoUringWrite(IoUring *uring, int fd, const void *data, size_t size,
+                    unsigned long long userData)
+{
+    return -1;
+}
+
+int
+submitIoUring(IoUring *uring)
+{
+    return -1;
+}
+
+int
+waitIoUring(IoUring *uring)
+{
+    return -1;
+}
+
+int
+withdrawIoUring(IoUring *uring, unsigned long long *userData)
+{
+    return 0;
+}
+
+int
+completeIoUring(IoUring *uring, unsigned long long *userData, int *result)
+{
+    return 0;
+}
+
+#endif
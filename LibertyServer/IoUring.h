@@ -0,0 +1,130 @@
+/**
+ * @file IoUring.h
+ * クライアントへの書き込みをまとめて発行するio_uringの定義と、
+ * その操作関数の宣言を記述したファイル。
+ *
+ * liburingには依存せず、システムコールを直接呼び出す。
+ * カーネルがio_uringに対応していない場合は初期化に失敗するので、
+ * 呼び出し側は通常のwrite()に切り替えること。
+ * -DLIBERTY_NO_URINGを指定した場合は常に初期化に失敗する。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef IO_URING_H
+#define IO_URING_H /**< インクルードガード用定数 */
+
+#include <stddef.h>
+
+/** io_uringのインスタンス */
+typedef struct {
+    int fd;                  /**< io_uringのファイルディスクリプタ */
+    unsigned int entries;    /**< 投入キューの長さ */
+    unsigned int *sqHead;    /**< 投入キューの先頭 */
+    unsigned int *sqTail;    /**< 投入キューの末尾 */
+    unsigned int *sqMask;    /**< 投入キューの添字のマスク */
+    unsigned int *sqArray;   /**< 投入キューの要素の番号 */
+    void *sqes;              /**< 投入キューの要素 */
+    unsigned int *cqHead;    /**< 完了キューの先頭 */
+    unsigned int *cqTail;    /**< 完了キューの末尾 */
+    unsigned int *cqMask;    /**< 完了キューの添字のマスク */
+    void *cqes;              /**< 完了キューの要素 */
+    void *sqRing;            /**< 投入キューのマップ先 */
+    size_t sqRingSize;       /**< 投入キューのマップサイズ */
+    void *cqRing;            /**< 完了キューのマップ先（投入キューと共有なら同じ値） */
+    size_t cqRingSize;       /**< 完了キューのマップサイズ */
+    size_t sqesSize;         /**< 投入キューの要素のマップサイズ */
+    unsigned int pending;    /**< 準備済みで未投入の要素数 */
+    unsigned int inflight;   /**< 投入済みで完了を取り出していない要素数 */
+    const char *buffer;      /**< 登録済みバッファの先頭（未登録ならNULL） */
+    size_t bufferSize;       /**< 登録済みバッファのバイト数 */
+    int filesNum;            /**< 登録済みファイル表の長さ（未登録なら0） */
+    unsigned char *files;    /**< ファイル表の各要素が設定済みかどうか */
+} IoUring;
+
+/**
+ * io_uringを初期化。
+ * @param uring 初期化するio_uring。
+ * @param entries 投入キューの長さ。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int initializeIoUring(IoUring *uring, unsigned int entries);
+
+/**
+ * io_uringのリソースを解放。
+ * @param uring リソースを解放するio_uring。
+ */
+void finalizeIoUring(IoUring *uring);
+
+/**
+ * 書き込み元のバッファを固定バッファとして登録。
+ * @param uring 登録先のio_uring。
+ * @param buffer バッファの先頭。
+ * @param size バッファのバイト数。
+ * @return 登録できた場合は0、できなかった場合は0以外。
+ */
+int registerIoUringBuffer(IoUring *uring, const void *buffer, size_t size);
+
+/**
+ * 空の固定ファイル表を登録。表の添字はファイルディスクリプタの値と一致させる。
+ * @param uring 登録先のio_uring。
+ * @param filesNum 表の長さ。
+ * @return 登録できた場合は0、できなかった場合は0以外。
+ */
+int registerIoUringFiles(IoUring *uring, int filesNum);
+
+/**
+ * 固定ファイル表の要素を設定。
+ * 設定できなかった要素への書き込みは通常のファイルディスクリプタで行う。
+ * @param uring 対象のio_uring。
+ * @param fd 設定するファイルディスクリプタ。
+ * @param registered 登録する場合は0以外、登録を外す場合は0。
+ */
+void updateIoUringFile(IoUring *uring, int fd, int registered);
+
+/**
+ * 書き込み要求を準備。登録済みの固定ファイルと固定バッファは自動で使用する。
+ * @param uring 対象のio_uring。
+ * @param fd 書き込み先のファイルディスクリプタ。
+ * @param data 書き込むデータ。
+ * @param size 書き込むバイト数。
+ * @param userData 完了時に返される値。
+ * @return 準備できた場合は0、投入キューが満杯の場合は0以外。
+ */
+int prepareIoUringWrite(IoUring *uring, int fd, const void *data, size_t size,
+                        unsigned long long userData);
+
+/**
+ * 準備済みの要求を1回のシステムコールで投入し、全ての完了を待つ。
+ * 投入後の待機がシグナルで中断された場合は、完了していない要求が残る。
+ * 失敗した場合、未投入の要求は投入キューに残るので、
+ * 再度投入するかwithdrawIoUring()で取り下げること。
+ * @param uring 対象のio_uring。
+ * @return 投入した要求の数、失敗した場合は負数。
+ */
+int submitIoUring(IoUring *uring);
+
+/**
+ * 投入済みの要求が全て完了するまで待つ。
+ * @param uring 対象のio_uring。
+ * @return 待機できた場合は0、失敗した場合は負数。
+ */
+int waitIoUring(IoUring *uring);
+
+/**
+ * 準備済みで未投入の要求を1つ取り下げる。
+ * @param uring 対象のio_uring。
+ * @param userData 取り下げた要求の準備時に指定した値の格納先。
+ * @return 取り下げた場合は1、未投入の要求が無い場合は0。
+ */
+int withdrawIoUring(IoUring *uring, unsigned long long *userData);
+
+/**
+ * 完了した要求を1つ取り出す。
+ * @param uring 対象のio_uring。
+ * @param userData 要求の準備時に指定した値の格納先。
+ * @param result 要求の結果（書き込んだバイト数か、負のエラー番号）の格納先。
+ * @return 取り出した場合は1、完了した要求が無い場合は0。
+ */
+int completeIoUring(IoUring *uring, unsigned long long *userData, int *result);
+
+#endif
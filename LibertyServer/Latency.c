@@ -0,0 +1,225 @@
+/**
+ * @file Latency.c
+ * Latency.hで宣言された関数の定義を記述したファイル。
+ *
+ * ヒストグラムは2のべき乗ごとの区間を16個の小区間に分けた対数線形の
+ * 階級（相対誤差約6%）を持ち、各階級の度数はロックを使わずに
+ * アトミックに加算する。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <string.h>
+#include <time.h>
+#include "Latency.h"
+
+#define SUB_BUCKET_BITS 4                        /**< 小区間の数を表すビット数 */
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)       /**< 2のべき乗区間あたりの小区間の数 */
+#define MAX_SHIFT 36                             /**< 記録できる最大値のシフト量（約19分） */
+#define BUCKETS_NUM ((MAX_SHIFT + 2) * SUB_BUCKETS) /**< 階級の数 */
+
+/** 遅延のヒストグラム */
+typedef struct {
+    unsigned long long counts[BUCKETS_NUM]; /**< 階級ごとの度数 */
+    unsigned long long sum;                 /**< 遅延の合計 */
+    unsigned long long max;                 /**< 遅延の最大値 */
+} LatencyHistogram;
+
+#ifndef LIBERTY_NO_LATENCY
+/** 計測区間の名前 */
+static const char *STAGE_NAMES[LATENCY_STAGE_NUM] = {
+    "usb_read", "validate", "dispatch", "write", "relay", "probe_wakeup"
+};
+#endif
+
+/** 計測区間ごとのヒストグラム */
+static LatencyHistogram histograms[LATENCY_STAGE_NUM];
+
+/** スレッドごとの処理中のサンプルの起点時刻 */
+static __thread LatencyTime currentOrigin;
+
+/**
+ * 単調増加する現在時刻の取得。
+ * @return ナノ秒単位の現在時刻。
+ */
+LatencyTime
+getLatencyTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * 遅延に対応する階級の番号の取得。
+ * @param value 遅延（ナノ秒）。
+ * @return 階級の番号。
+ */
+static int
+getBucketIndex(unsigned long long value)
+{
+    int shift;
+    if (value < SUB_BUCKETS) {
+        return (int)value;
+    }
+    /* 最上位ビットの下位SUB_BUCKET_BITSビットで小区間を決める */
+    shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+    if (shift > MAX_SHIFT) {
+        return BUCKETS_NUM - 1;
+    }
+    return (shift + 1) * SUB_BUCKETS + (int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+#ifndef LIBERTY_NO_LATENCY
+/**
+ * 階級に含まれる遅延の上限値の取得。
+ * @param index 階級の番号。
+ * @return 遅延の上限値（ナノ秒）。
+ */
+static unsigned long long
+getBucketUpperBound(int index)
+{
+    int shift;
+    unsigned long long sub;
+    if (index < SUB_BUCKETS) {
+        return (unsigned long long)index;
+    }
+    shift = index / SUB_BUCKETS - 1;
+    sub = (unsigned long long)(index % SUB_BUCKETS);
+    return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+#endif
+
+/**
+ * 遅延を記録。
+ * @param stage 計測区間。
+ * @param nanos 遅延（ナノ秒）。
+ */
+void
+recordLatencyValue(LatencyStage stage, LatencyTime nanos)
+{
+    LatencyHistogram *histogram = &histograms[stage];
+    unsigned long long value = nanos > 0 ? (unsigned long long)nanos : 0;
+    unsigned long long max;
+
+    __atomic_fetch_add(&histogram->counts[getBucketIndex(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+    /* 最大値は更新が必要な場合のみ比較交換 */
+    max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (value > max &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * 起点時刻から現在時刻までの遅延を記録。
+ * @param stage 計測区間。
+ * @param origin 起点時刻。
+ */
+void
+recordLatency(LatencyStage stage, LatencyTime origin)
+{
+    recordLatencyValue(stage, getLatencyTime() - origin);
+}
+
+/**
+ * 呼び出したスレッドで処理中のサンプルの起点時刻を設定。
+ * @param origin 起点時刻。
+ */
+void
+setLatencyOrigin(LatencyTime origin)
+{
+    currentOrigin = origin;
+}
+
+/**
+ * 呼び出したスレッドで処理中のサンプルの起点時刻の取得。
+ * @return 起点時刻。
+ */
+LatencyTime
+getLatencyOrigin(void)
+{
+    return currentOrigin;
+}
+
+#ifndef LIBERTY_NO_LATENCY
+/**
+ * ヒストグラムの百分位点の取得。
+ * @param counts 階級ごとの度数の写し。
+ * @param total 度数の合計。
+ * @param percentile 百分位（0〜100）。
+ * @param max 遅延の最大値。階級の上限値がこれを超える場合はこちらを返す。
+ * @return 百分位点（ナノ秒）。
+ */
+static unsigned long long
+getPercentile(const unsigned long long *counts, unsigned long long total,
+              double percentile, unsigned long long max)
+{
+    unsigned long long rank = (unsigned long long)(total * percentile / 100.0 + 0.5);
+    unsigned long long seen = 0;
+    int i;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (i = 0; i < BUCKETS_NUM; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return i < BUCKETS_NUM && getBucketUpperBound(i) < max ? getBucketUpperBound(i) : max;
+}
+#endif
+
+/**
+ * 計測区間ごとの遅延の分布（p50/p99/p99.9/max）を出力。
+ * @param stream 出力先。
+ */
+void
+printLatencyReport(FILE *stream)
+{
+#ifdef LIBERTY_NO_LATENCY
+    fprintf(stream, "latency measurement is disabled at compile time.\n");
+#else
+    int stage;
+
+    fprintf(stream, "%-12s %10s %10s %10s %10s %10s %10s\n",
+            "stage(us)", "count", "mean", "p50", "p99", "p99.9", "max");
+    for (stage = 0; stage < LATENCY_STAGE_NUM; ++stage) {
+        LatencyHistogram *histogram = &histograms[stage];
+        unsigned long long counts[BUCKETS_NUM];
+        unsigned long long total = 0;
+        unsigned long long max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+        int i;
+
+        /* 記録中の値と混ざらないよう度数を写してから集計 */
+        for (i = 0; i < BUCKETS_NUM; ++i) {
+            counts[i] = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+            total += counts[i];
+        }
+        if (total == 0) {
+            fprintf(stream, "%-12s %10d\n", STAGE_NAMES[stage], 0);
+            continue;
+        }
+        fprintf(stream, "%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                STAGE_NAMES[stage], total,
+                __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / 1000.0 / total,
+                getPercentile(counts, total, 50.0, max) / 1000.0,
+                getPercentile(counts, total, 99.0, max) / 1000.0,
+                getPercentile(counts, total, 99.9, max) / 1000.0,
+                max / 1000.0);
+    }
+#endif
+    fflush(stream);
+}
+
+/**
+ * 記録した遅延を全て破棄。
+ */
+void
+resetLatency(void)
+{
+    memset(histograms, 0, sizeof(histograms));
+}
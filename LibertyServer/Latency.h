@@ -0,0 +1,87 @@
+/**
+ * @file Latency.h
+ * USB受信からクライアントへの書き込みまでの遅延を計測する
+ * ヒストグラムの定義と、その操作関数の宣言を記述したファイル。
+ *
+ * LIBERTY_NO_LATENCYを定義してコンパイルすると、計測処理は全て取り除かれる。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef LATENCY_H
+#define LATENCY_H /**< インクルードガード用定数 */
+
+#include <stdio.h>
+
+/** 計測区間 */
+typedef enum {
+    LATENCY_STAGE_USB_READ,  /**< USB受信の要求から完了まで */
+    LATENCY_STAGE_VALIDATE,  /**< USB受信完了からレコードの検証完了まで */
+    LATENCY_STAGE_DISPATCH,  /**< USB受信完了からコールバック呼び出しまで */
+    LATENCY_STAGE_WRITE,     /**< USB受信完了からクライアントへの書き込み完了まで */
+    LATENCY_STAGE_RELAY,     /**< 中継での上流からの受信完了から配信の受け渡しまで */
+    LATENCY_STAGE_PROBE_WAKEUP, /**< 計測スレッドの起床の遅れ（取得スレッド自身の遅れではない） */
+    LATENCY_STAGE_NUM        /**< 計測区間の数 */
+} LatencyStage;
+
+/** 単調増加する時刻（ナノ秒） */
+typedef long long LatencyTime;
+
+/**
+ * 単調増加する現在時刻の取得。
+ * @return ナノ秒単位の現在時刻。
+ */
+LatencyTime getLatencyTime(void);
+
+/**
+ * 起点時刻から現在時刻までの遅延を記録。
+ * @param stage 計測区間。
+ * @param origin 起点時刻。
+ */
+void recordLatency(LatencyStage stage, LatencyTime origin);
+
+/**
+ * 遅延を記録。
+ * @param stage 計測区間。
+ * @param nanos 遅延（ナノ秒）。
+ */
+void recordLatencyValue(LatencyStage stage, LatencyTime nanos);
+
+/**
+ * 呼び出したスレッドで処理中のサンプルの起点時刻を設定。
+ * @param origin 起点時刻。
+ */
+void setLatencyOrigin(LatencyTime origin);
+
+/**
+ * 呼び出したスレッドで処理中のサンプルの起点時刻の取得。
+ * @return 起点時刻。
+ */
+LatencyTime getLatencyOrigin(void);
+
+/**
+ * 計測区間ごとの遅延の分布（p50/p99/p99.9/max）を出力。
+ * @param stream 出力先。
+ */
+void printLatencyReport(FILE *stream);
+
+/**
+ * 記録した遅延を全て破棄。コンソールの"latency reset"から呼び出され、
+ * 計測区間を区切って分布を取り直すのに使う。
+ */
+void resetLatency(void);
+
+#ifndef LIBERTY_NO_LATENCY
+#define LATENCY_NOW() getLatencyTime()                          /**< 現在時刻 */
+#define LATENCY_RECORD(stage, origin) recordLatency(stage, origin) /**< 遅延の記録 */
+#define LATENCY_RECORD_VALUE(stage, nanos) recordLatencyValue(stage, nanos) /**< 遅延の記録 */
+#define LATENCY_SET_ORIGIN(origin) setLatencyOrigin(origin)     /**< 起点時刻の設定 */
+#define LATENCY_ORIGIN() getLatencyOrigin()                     /**< 起点時刻の取得 */
+#else
+#define LATENCY_NOW() ((LatencyTime)0)
+#define LATENCY_RECORD(stage, origin) ((void)(origin))
+#define LATENCY_RECORD_VALUE(stage, nanos) ((void)(nanos))
+#define LATENCY_SET_ORIGIN(origin) ((void)(origin))
+#define LATENCY_ORIGIN() ((LatencyTime)0)
+#endif
+
+#endif
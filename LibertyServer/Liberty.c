@@ -8,11 +8,24 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <libusb-1.0/libusb.h>
 #include "Liberty.h"
-
-#define BUFFER_LENGTH 512 /**< Libertyの受信バッファの長さ */
+#include "Latency.h"
+#include "Metrics.h"
+#include "Realtime.h"
+
+#define BUFFER_LENGTH LIBERTY_BUFFER_LENGTH /**< Libertyの受信バッファの長さ */
+#define LIBERTY_VID 0x0f44 /**< LibertyのベンダID */
+#define LIBERTY_PID 0xff20 /**< LibertyのプロダクトID */
+#define RECORD_HEADER 0x594c /**< デバイスレコードのヘッダ（"LY"） */
+#define STATION_STATE_COMMAND 21 /**< ステーション状態コマンド(^U)の番号 */
+#define STATION_STATE_SIZE 12 /**< ステーション状態の応答のバイト数 */
+#define QUERY_INTERVAL 1000000LL /**< ステーションを問い合わせる間隔（マイクロ秒） */
+#define QUERY_RETRIES 20 /**< 初期化時の問い合わせで応答を待つ受信回数 */
+#define READ_ENDPOINT 0x88 /**< Libertyの読み込みエンドポイント */
+#define READ_TIMEOUT 50 /**< 受信のタイムアウトまでの時間（ミリ秒） */
 
 /** Libertyから受信するデバイスレコードを格納する構造体 */
 typedef struct {
@@ -28,39 +41,16 @@ typedef struct {
     char lf;                  /**< 復帰 */
 } LibertyDeviceRecord;
 
-/** Libertyから受信したデータを格納するバッファ */
-static char buffer[BUFFER_LENGTH];
-/** バッファに格納されているデータの大きさ */
-static size_t dataSizeInBuffer = 0;
-
-/** Libertyが接続されたUSBポートのハンドル */
-static libusb_device_handle *handle = NULL;
-/** Libertyに使用するUSBコンテキスト */
-static libusb_context *context = NULL;
-
-/** Libertyのデバイスムーブイベントに対するコールバック関数 */
-static void (*deviceMovedFunc)(int device, double x, double y, double z);
-/** Libertyのデバイススウェイイベントに対するコールバック関数 */
-static void (*deviceSwayedFunc)(int device, double x, double y, double z);
-/** Libertyのデバイスプレスイベントに対するコールバック関数 */
-static void (*devicePressedFunc)(int device);
-/** Libertyのデバイスリリースイベントに対するコールバック関数 */
-static void (*deviceReleasedFunc)(int device);
-
-/** 直近のボタン押下状態 */
-static int recentButtonStates[LIBERTY_SENSOR_NUM];
-/** メインループ終了フラグ */
-static volatile int loopEnd = 0;
-
 /**
  * Libertyのデバイスムーブイベントに対するデフォルトのコールバック関数。
  * @param device デバイス番号。
  * @param x x座標値。
  * @param y y座標値。
  * @param z z座標値。
+ * @param time 時刻。
  */
 static void
-doNothingDeviceMoved(int device, double x, double y, double z)
+doNothingDeviceMoved(int device, double x, double y, double z, long long time)
 {
 }
 
@@ -70,36 +60,50 @@ doNothingDeviceMoved(int device, double x, double y, double z)
  * @param x x軸周りの回転量。
  * @param y y軸周りの回転量。
  * @param z z軸周りの回転量。
+ * @param time 時刻。
  */
 static void
-doNothingDeviceSwayed(int device, double x, double y, double z)
+doNothingDeviceSwayed(int device, double x, double y, double z, long long time)
 {
 }
 
 /**
  * Libertyのデバイスプレスイベントに対する、デフォルトのコールバック関数。
  * @param device デバイス番号。
+ * @param time 時刻。
  */
 static void
-doNothingDevicePressed(int device)
+doNothingDevicePressed(int device, long long time)
 {
 }
 
 /**
  * Libertyのデバイスリリースイベントに対する、デフォルトのコールバック関数。
  * @param device デバイス番号。
+ * @param time 時刻。
  */
 static void
-doNothingDeviceReleased(int device)
+doNothingDeviceReleased(int device, long long time)
 {
 }
 
+/** Libertyのデバイスムーブイベントに対するコールバック関数 */
+static void (*deviceMovedFunc)(int device, double x, double y, double z, long long time) =
+    doNothingDeviceMoved;
+/** Libertyのデバイススウェイイベントに対するコールバック関数 */
+static void (*deviceSwayedFunc)(int device, double x, double y, double z, long long time) =
+    doNothingDeviceSwayed;
+/** Libertyのデバイスプレスイベントに対するコールバック関数 */
+static void (*devicePressedFunc)(int device, long long time) = doNothingDevicePressed;
+/** Libertyのデバイスリリースイベントに対するコールバック関数 */
+static void (*deviceReleasedFunc)(int device, long long time) = doNothingDeviceReleased;
+
 /**
  * Libertyのデバイスムーブイベントに対するコールバック関数の設定。
  * @param func コールバック関数。
  */
 void
-setLibertyMovedFunc(void (*func)(int device, double x, double y, double z))
+setLibertyMovedFunc(void (*func)(int device, double x, double y, double z, long long time))
 {
     if (func == NULL) {
         deviceMovedFunc = doNothingDeviceMoved;
@@ -113,7 +117,7 @@ setLibertyMovedFunc(void (*func)(int device, double x, double y, double z))
  * @param func コールバック関数。
  */
 void
-setLibertySwayedFunc(void (*func)(int device, double x, double y, double z))
+setLibertySwayedFunc(void (*func)(int device, double x, double y, double z, long long time))
 {
     if (func == NULL) {
         deviceSwayedFunc = doNothingDeviceSwayed;
@@ -127,7 +131,7 @@ setLibertySwayedFunc(void (*func)(int device, double x, double y, double z))
  * @param func コールバック関数。
  */
 void
-setLibertyPressedFunc(void (*func)(int device))
+setLibertyPressedFunc(void (*func)(int device, long long time))
 {
     if (func == NULL) {
         devicePressedFunc = doNothingDevicePressed;
@@ -141,7 +145,7 @@ setLibertyPressedFunc(void (*func)(int device))
  * @param func コールバック関数。
  */
 void
-setLibertyReleasedFunc(void (*func)(int device))
+setLibertyReleasedFunc(void (*func)(int device, long long time))
 {
     if (func == NULL) {
         deviceReleasedFunc = doNothingDeviceReleased;
@@ -150,14 +154,29 @@ setLibertyReleasedFunc(void (*func)(int device))
     }
 }
 
+/**
+ * 単調増加する時刻の取得（マイクロ秒）。
+ * 全てのLibertyで共通の時計を使うことで、台数をまたいで時刻を比較できる。
+ * @return マイクロ秒単位の時刻。
+ */
+static long long
+getMonotonicMicros(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL;
+}
+
 /**
  * Libertyへのデータの送信。
+ * @param liberty 送信先のLiberty。
  * @param buf 送信するデータ。
  * @param size 送信するデータのバイト数。
  * @return 送信に成功した場合は送信したデータのバイト数、失敗した場合は負数。
  */
 static int
-sendData(unsigned char *buf, int size)
+sendData(LibertyDevice *liberty, unsigned char *buf, int size)
 {
     int result;
     int actualWrite;
@@ -166,57 +185,106 @@ sendData(unsigned char *buf, int size)
     /* Libertyの書き込みエンドポイント */
     const int writeEp = 0x04;
 
-    result = libusb_bulk_transfer(handle, writeEp, buf, size, &actualWrite, timeout);
+    if (liberty->emulated) {
+        return sendLibertyEmulator(&liberty->emulator, buf, size);
+    }
+    result = libusb_bulk_transfer(liberty->handle, writeEp, buf, size, &actualWrite, timeout);
     return result == 0 ? actualWrite : result;
 }
 
 /**
  * Libertyからのデータの受信。
+ * @param liberty 受信元のLiberty。
  * @param buf 受信データの格納先。
  * @param size 受信データの許容バイト数。
  * @return 受信に成功した場合は受信したデータのバイト数、失敗した場合は負数。
  */
 static int
-receiveData(unsigned char *buf, int size)
+receiveData(LibertyDevice *liberty, unsigned char *buf, int size)
 {
     int result;
     int actualRead;
-    /* タイムアウトまでの時間(ms) */
-    const int timeout = 50;
-    /* Libertyの読み込みエンドポイント */
-    const int readEp = 0x88;
 
-    result = libusb_bulk_transfer(handle, readEp, buf, size, &actualRead, timeout);
+    if (liberty->emulated) {
+        return receiveLibertyEmulator(&liberty->emulator, buf, size, READ_TIMEOUT);
+    }
+    /* 次の受信は前の受信の完了時に発行済みなので、応答はすぐに届く */
+    result = libusb_bulk_reader_read(liberty->reader, buf, size, &actualRead);
     return result == 0 ? actualRead : result;
 }
 
 /**
  * Libertyへのコマンドの送信。
+ * @param liberty 送信先のLiberty。
  * @param command 送信するコマンド。
  * @return 送信に成功した場合は送信したコマンドのバイト数、失敗した場合は負数。
  */
 static int
-sendCommand(char *command)
+sendCommand(LibertyDevice *liberty, char *command)
 {
+    int result;
+
     /* Libertyの処理速度を考慮して5msスリープ */
     usleep(5000);
 
-    return sendData((unsigned char*)command, strlen(command));
+    result = sendData(liberty, (unsigned char*)command, strlen(command));
+    if (result < 0) {
+        addMetric(METRIC_LIBERTY_USB_ERRORS, 1);
+    }
+    return result;
+}
+
+/**
+ * 次のデータ要請とまとめて送信するコマンドを追加。
+ * @param liberty 送信先のLiberty。
+ * @param command 追加するコマンド。
+ */
+static void
+queueCommand(LibertyDevice *liberty, const char *command)
+{
+    size_t length = strlen(command);
+
+    /* 入りきらなければ溜まった分を先に送信 */
+    if (liberty->commandsLength + length >= LIBERTY_COMMANDS_LENGTH) {
+        sendCommand(liberty, liberty->commands);
+        liberty->commandsLength = 0;
+    }
+    memcpy(liberty->commands + liberty->commandsLength, command, length + 1);
+    liberty->commandsLength += length;
+}
+
+/**
+ * 溜まったコマンドを1回の送信でまとめて送信。
+ * @param liberty 送信先のLiberty。
+ * @return 送信に成功した場合は送信したバイト数、失敗した場合は負数。
+ */
+static int
+flushCommands(LibertyDevice *liberty)
+{
+    int result;
+
+    if (liberty->commandsLength == 0) {
+        return 0;
+    }
+    result = sendCommand(liberty, liberty->commands);
+    liberty->commandsLength = 0;
+    return result;
 }
 
 /**
  * Libertyから反応が返ってくるまで待機。
+ * @param liberty 対象のLiberty。
  */
 static void
-waitForResponse()
+waitForResponse(LibertyDevice *liberty)
 {
     unsigned char buf[BUFFER_LENGTH];
     int received = 0;
     int sent = 0;
     /* 送受信に成功するまでループ */
     do { 
-        sent = sendCommand("\r");
-        received = receiveData(buf, BUFFER_LENGTH);
+        sent = sendCommand(liberty, "\r");
+        received = receiveData(liberty, buf, BUFFER_LENGTH);
         usleep(1000000);
     } while (received < 0 || sent < 0);
 }
@@ -229,98 +297,288 @@ waitForResponse()
 static int
 validate(LibertyDeviceRecord* record)
 {
-    return record->header != 0x594c || 
-        record->stationNum <= 0 || record->stationNum > LIBERTY_SENSOR_NUM ||
+    return record->header != RECORD_HEADER ||
+        record->stationNum <= 0 || record->stationNum > LIBERTY_STATION_MAX ||
         record->command != 'P' ||
         (record->button != 1 && record->button != 0) ||
         record->cr != 0x0d ||
         record->lf != 0x0a;
 }
 
+/**
+ * 解析済みのデータをバッファの先頭から削除。
+ * @param liberty 対象のLiberty。
+ * @param size 削除するバイト数。
+ */
+static void
+consumeBuffer(LibertyDevice *liberty, size_t size)
+{
+    liberty->data += size;
+    liberty->dataSizeInBuffer -= size;
+}
+
 /**
  * Libertyからデータを受信し、バッファに追加。
+ * 未解析のデータが無ければ、リーダの受信バッファをコピーせずにそのまま解析する。
+ * @param liberty 受信元のLiberty。
  */
 static void
-appendBuffer(void)
+appendBuffer(LibertyDevice *liberty)
 {
-    /* バッファの末尾 */
-    char* tail = buffer + dataSizeInBuffer;
-    /* バッファの空き容量 */
-    size_t remain = BUFFER_LENGTH - dataSizeInBuffer;
-    int received = receiveData((unsigned char*)tail, remain);
+    LatencyTime requestedTime = LATENCY_NOW();
+    int received;
+
+    if (!liberty->emulated && liberty->dataSizeInBuffer == 0) {
+        unsigned char *chunk;
+        int result = libusb_bulk_reader_read_buffer(liberty->reader, &chunk, &received);
+        if (result != 0) {
+            received = result;
+        } else {
+            /* 次の受信を呼び出すまで、受信したデータはリーダのバッファ内で有効 */
+            liberty->data = (const char*)chunk;
+        }
+    } else {
+        /* 次の受信でリーダのバッファが上書きされるので、残りのデータを先頭へ移動 */
+        memmove(liberty->buffer, liberty->data, liberty->dataSizeInBuffer);
+        liberty->data = liberty->buffer;
+        received = receiveData(liberty,
+                               (unsigned char*)liberty->buffer + liberty->dataSizeInBuffer,
+                               BUFFER_LENGTH - liberty->dataSizeInBuffer);
+    }
     if (received > 0) {
         /* 受信に成功したらバッファ内のデータの大きさを更新 */
-        dataSizeInBuffer += received;
+        liberty->dataSizeInBuffer += received;
+        /* 受信完了時刻をこれから解析するレコードの起点時刻とする */
+        liberty->receivedTime = LATENCY_NOW();
+        liberty->frameTime = getMonotonicMicros();
+        LATENCY_RECORD_VALUE(LATENCY_STAGE_USB_READ, liberty->receivedTime - requestedTime);
+        addMetric(METRIC_LIBERTY_USB_BYTES, received);
+    } else if (received == LIBUSB_ERROR_TIMEOUT) {
+        addMetric(METRIC_LIBERTY_USB_TIMEOUTS, 1);
+    } else if (received < 0) {
+        addMetric(METRIC_LIBERTY_USB_ERRORS, 1);
     }
 }
 
 /**
- * Libertyのメインループの開始。
+ * 検出済みのステーションの問い合わせ(^U0)を、次の送信に追加。
+ * @param liberty 送信先のLiberty。
  */
-void
-startLibertyMainLoop(void)
+static void
+queryStations(LibertyDevice *liberty)
+{
+    const char queryStationState[] = {'\025', '0', '\r', '\0'};
+
+    queueCommand(liberty, queryStationState);
+    liberty->nextQueryTime = getMonotonicMicros() + QUERY_INTERVAL;
+}
+
+/**
+ * バッファの先頭がステーション状態の応答かどうかの判定。
+ * @param liberty 対象のLiberty。
+ * @return 応答の場合は0以外。
+ */
+static int
+isStationState(const LibertyDevice *liberty)
+{
+    const unsigned char *data = (const unsigned char*)liberty->data;
+
+    return liberty->dataSizeInBuffer >= STATION_STATE_SIZE &&
+        data[0] == 'L' && data[1] == 'Y' && data[3] == STATION_STATE_COMMAND;
+}
+
+/**
+ * ステーション状態の応答に従い、検出済みのステーションだけを出力対象にする。
+ * 有効化・無効化のコマンドは次のデータ要請とまとめて送信する。
+ * 外されたステーションのボタンが押されていれば、リリースイベントを配信する。
+ * @param liberty 対象のLiberty。
+ */
+static void
+updateStations(LibertyDevice *liberty)
 {
+    unsigned short detected;
+    unsigned short active;
+    int station;
+
+    memcpy(&detected, liberty->data + 8, 2);
+    memcpy(&active, liberty->data + 10, 2);
+
+    /* 差分だけ有効化・無効化して、出力されるフレームを検出済みのものに絞る */
+    for (station = 1; station <= LIBERTY_STATION_MAX; ++station) {
+        unsigned short bit = (unsigned short)(1u << (station - 1));
+        char command[16];
+        if ((detected & bit) == (active & bit)) {
+            continue;
+        }
+        snprintf(command, sizeof(command), "\025%d,%d\r", station, (detected & bit) != 0);
+        queueCommand(liberty, command);
+        if (!(detected & bit) && liberty->recentButtonStates[station - 1]) {
+            liberty->recentButtonStates[station - 1] = 0;
+            (*deviceReleasedFunc)(liberty->deviceBase + station - 1, liberty->frameTime);
+        }
+    }
+    if (detected != liberty->detectedStations) {
+        printf("### liberty #%d stations: detected %04x, active %04x\n",
+               liberty->unit, detected, detected);
+    }
+    liberty->detectedStations = detected;
+    liberty->activeStations = detected;
+
+    /* 応答をバッファから削除 */
+    consumeBuffer(liberty, STATION_STATE_SIZE);
+}
+
+/**
+ * 検出済みのステーションを問い合わせ、応答を待って出力対象を決める。
+ * 問い合わせ前に届いたデータは捨てる。
+ * @param liberty 対象のLiberty。
+ * @return 応答があった場合は0、無かった場合は0以外。
+ */
+static int
+discoverStations(LibertyDevice *liberty)
+{
+    int i;
+
+    queryStations(liberty);
+    flushCommands(liberty);
+    for (i = 0; i < QUERY_RETRIES; ++i) {
+        appendBuffer(liberty);
+        /* 応答の先頭まで読み飛ばす */
+        while (liberty->dataSizeInBuffer >= STATION_STATE_SIZE && !isStationState(liberty)) {
+            consumeBuffer(liberty, 1);
+        }
+        if (isStationState(liberty)) {
+            updateStations(liberty);
+            liberty->dataSizeInBuffer = 0;
+            return 0;
+        }
+    }
+    liberty->dataSizeInBuffer = 0;
+    return -1;
+}
+
+/**
+ * Libertyのメインループ。
+ * @param arg 対象のLiberty。
+ * @return 使用しない。
+ */
+static void *
+runLibertyMainLoop(void *arg)
+{
+    LibertyDevice *liberty = (LibertyDevice*)arg;
     /* Libertyのデバイスレコード1件分のバイト数 */
     const int recordSize = 38;
-    /* メインループ終了フラグを解除 */
-    loopEnd = 0;
-    while (!loopEnd) {
+
+    enterRealtimeThread(REALTIME_ACQUISITION,
+                        getRealtimeCpu(REALTIME_ACQUISITION, liberty->unit));
+    while (!liberty->loopEnd) {
+        /* ステーション状態の応答ならば出力対象を更新 */
+        if (isStationState(liberty)) {
+            updateStations(liberty);
+            continue;
+        }
         /* バッファ内にデバイスレコード1件分のデータが存在しているかどうかで分岐 */
-        if (dataSizeInBuffer < recordSize) {
-            /* 存在しない場合、データを要請 */
-            sendCommand("P");
-            appendBuffer();
+        if (liberty->dataSizeInBuffer < recordSize) {
+            /* 存在しない場合、データを要請する。センサの抜き差しの確認や
+               出力対象の切り替えのコマンドは、要請と同じ1回の送信にまとめる */
+            if (getMonotonicMicros() >= liberty->nextQueryTime) {
+                queryStations(liberty);
+            }
+            queueCommand(liberty, "P");
+            flushCommands(liberty);
+            appendBuffer(liberty);
         } else {
             /* 存在する場合、バッファからデータを取得して解析 */
             LibertyDeviceRecord record;
-            memcpy(&record, buffer, recordSize);
+            memcpy(&record, liberty->data, recordSize);
             if (validate(&record)) {
+                /* 同期を失った回数と破棄したバイト数を記録 */
+                if (!liberty->resynchronizing) {
+                    liberty->resynchronizing = 1;
+                    addMetric(METRIC_LIBERTY_VALIDATE_FAILURES, 1);
+                }
+                addMetric(METRIC_LIBERTY_RESYNC_BYTES, 1);
+
                 /* バッファの先頭1バイトを削除 */
-                --dataSizeInBuffer;
-                memmove(buffer, buffer + 1, dataSizeInBuffer);
+                consumeBuffer(liberty, 1);
             } else {
-                /* デバイス番号を0番から開始するように調整 */
-                int device = record.stationNum - 1;
+                /* ステーション番号を0番から開始するように調整 */
+                int station = record.stationNum - 1;
+                /* 全てのLibertyで通し番号となるデバイス番号 */
+                int device = liberty->deviceBase + station;
+                long long time = liberty->frameTime;
+
+                /* 検証とコールバック呼び出しまでの遅延を記録 */
+                LATENCY_RECORD(LATENCY_STAGE_VALIDATE, liberty->receivedTime);
+                LATENCY_SET_ORIGIN(liberty->receivedTime);
+                LATENCY_RECORD(LATENCY_STAGE_DISPATCH, liberty->receivedTime);
+                liberty->resynchronizing = 0;
+                addMetric(METRIC_LIBERTY_RECORDS, 1);
 
                 /* ボタン状態の更新を確認 */
-                if (recentButtonStates[device] != record.button) {
+                if (liberty->recentButtonStates[station] != record.button) {
                     if (record.button) {
                         /* デバイスプレスイベントを配信 */
-		        (*devicePressedFunc)(device);
+                        (*devicePressedFunc)(device, time);
                     } else {
                         /* デバイスリリースイベントを配信 */
-                        (*deviceReleasedFunc)(device);
+                        (*deviceReleasedFunc)(device, time);
                     }
                 }
                 /* ボタン状態の更新 */
-                recentButtonStates[device] = record.button;
+                liberty->recentButtonStates[station] = record.button;
 
                 /* デバイスムーブイベント、デバイススウェイイベントを配信 */
-                (*deviceMovedFunc)(device, record.data[0], record.data[1], record.data[2]);
-                (*deviceSwayedFunc)(device, record.data[3], record.data[4], record.data[5]);
+                (*deviceMovedFunc)(device, record.data[0], record.data[1],
+                                   record.data[2], time);
+                (*deviceSwayedFunc)(device, record.data[3], record.data[4],
+                                    record.data[5], time);
 
                 /* 取得したデータをバッファから削除 */
-                dataSizeInBuffer -= recordSize;
-                memmove(buffer, buffer + recordSize, dataSizeInBuffer);
+                consumeBuffer(liberty, recordSize);
             }
         }
     }
+    return NULL;
 }
 
 /**
- * Libertyのメインループの停止。
+ * Libertyのメインループを新しいスレッドで開始。
+ * @param liberty 対象のLiberty。
+ * @return 開始できた場合は0、できなかった場合は0以外。
+ */
+int
+startLibertyMainLoop(LibertyDevice *liberty)
+{
+    /* メインループ終了フラグを解除 */
+    liberty->loopEnd = 0;
+    if (pthread_create(&liberty->thread, NULL, runLibertyMainLoop, liberty)) {
+        return -1;
+    }
+    liberty->running = 1;
+    return 0;
+}
+
+/**
+ * Libertyのメインループを停止し、スレッドの終了を待つ。
+ * @param liberty 対象のLiberty。
  */
 void
-stopLibertyMainLoop(void)
+stopLibertyMainLoop(LibertyDevice *liberty)
 {
-    loopEnd = 1;
+    liberty->loopEnd = 1;
+    if (liberty->running) {
+        pthread_join(liberty->thread, NULL);
+        liberty->running = 0;
+    }
 }
 
 /**
  * Libertyへの初期化コマンドの送信。
+ * @param liberty 送信先のLiberty。
  */
 static void
-sendInitializeCommands()
+sendInitializeCommands(LibertyDevice *liberty)
 {
     char setOutputUnitAsCm[] = "U1\r";
     char setOutputDataAsFloatBinary[] = "F1\r";
@@ -351,79 +609,250 @@ sendInitializeCommands()
     char setReceiverRotation[] = "G0,0,0\r";
     char setDisableContinuousPrinting[] = "P";
     printf("### begin initialize\n");
-    sendCommand(resetReferenceFrames);
-    sendCommand(setReferenceFrame1);
-    sendCommand(setReferenceFrame2);
-    sendCommand(setReferenceFrame3);
-    sendCommand(setReferenceFrame4);
-    sendCommand(setReferenceFrame5);
-    sendCommand(setReferenceFrame6);
-    sendCommand(setReferenceFrame7);
-    sendCommand(setReferenceFrame8);
-    sendCommand(setReferenceFrame9);
-    sendCommand(setReferenceFrame10);
-    sendCommand(setHemispheres);
-    sendCommand(setReceiverRotation);
-    sendCommand(setOutputUnitAsCm);
-    sendCommand(setOutputFormats);
-    sendCommand(setStylusMouseMode);
-    sendCommand(setOutputDataAsFloatBinary);
-    sendCommand(setDisableContinuousPrinting);
+    sendCommand(liberty, resetReferenceFrames);
+    sendCommand(liberty, setReferenceFrame1);
+    sendCommand(liberty, setReferenceFrame2);
+    sendCommand(liberty, setReferenceFrame3);
+    sendCommand(liberty, setReferenceFrame4);
+    sendCommand(liberty, setReferenceFrame5);
+    sendCommand(liberty, setReferenceFrame6);
+    sendCommand(liberty, setReferenceFrame7);
+    sendCommand(liberty, setReferenceFrame8);
+    sendCommand(liberty, setReferenceFrame9);
+    sendCommand(liberty, setReferenceFrame10);
+    sendCommand(liberty, setHemispheres);
+    sendCommand(liberty, setReceiverRotation);
+    sendCommand(liberty, setOutputUnitAsCm);
+    sendCommand(liberty, setOutputFormats);
+    sendCommand(liberty, setStylusMouseMode);
+    sendCommand(liberty, setOutputDataAsFloatBinary);
+    sendCommand(liberty, setDisableContinuousPrinting);
     printf("### finished initialize\n");
 }
 
+/**
+ * Libertyの状態を初期化。
+ * @param liberty 初期化するLiberty。
+ * @param unit 台数の中での番号。
+ */
+static void
+initializeState(LibertyDevice *liberty, int unit)
+{
+    memset(liberty->recentButtonStates, 0, sizeof(liberty->recentButtonStates));
+    liberty->unit = unit;
+    liberty->deviceBase = unit * LIBERTY_STATION_MAX;
+    liberty->context = NULL;
+    liberty->handle = NULL;
+    liberty->reader = NULL;
+    liberty->emulated = 0;
+    liberty->data = liberty->buffer;
+    liberty->dataSizeInBuffer = 0;
+    liberty->receivedTime = 0;
+    liberty->frameTime = 0;
+    liberty->resynchronizing = 0;
+    liberty->detectedStations = 0;
+    liberty->activeStations = 0;
+    liberty->commandsLength = 0;
+    liberty->nextQueryTime = 0;
+    liberty->loopEnd = 0;
+    liberty->running = 0;
+}
+
+/**
+ * 検出済みのステーションを問い合わせて出力対象を決める。
+ * 応答が無い場合は全てのステーションが接続されているものとして扱う。
+ * @param liberty 対象のLiberty。
+ */
+static void
+initializeStations(LibertyDevice *liberty)
+{
+    if (discoverStations(liberty)) {
+        fprintf(stderr, "no station state from liberty #%d, assume all stations.\n",
+                liberty->unit);
+        liberty->detectedStations = (unsigned short)((1u << LIBERTY_STATION_MAX) - 1);
+        liberty->activeStations = liberty->detectedStations;
+    }
+}
+
+/**
+ * Libertyかどうかの判定。
+ * @param device 判定するUSBデバイス。
+ * @return Libertyなら0以外。
+ */
+static int
+isLiberty(libusb_device *device)
+{
+    struct libusb_device_descriptor descriptor;
+
+    return libusb_get_device_descriptor(device, &descriptor) == 0 &&
+        descriptor.idVendor == LIBERTY_VID && descriptor.idProduct == LIBERTY_PID;
+}
+
+/**
+ * 接続されているLibertyの台数の取得。
+ * @return 台数。
+ */
+int
+countLibertyDevices(void)
+{
+    libusb_context *context;
+    libusb_device **list;
+    ssize_t listSize;
+    ssize_t i;
+    int count = 0;
+
+    if (libusb_init(&context)) {
+        return 0;
+    }
+    listSize = libusb_get_device_list(context, &list);
+    for (i = 0; i < listSize; ++i) {
+        if (isLiberty(list[i])) {
+            ++count;
+        }
+    }
+    if (listSize >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    libusb_exit(context);
+    return count;
+}
+
+/**
+ * 接続されているLibertyのうち指定した台数目を開く。
+ * @param context 使用するUSBコンテキスト。
+ * @param unit 何台目を開くか（0から数える）。
+ * @return 開いたハンドル、見つからないか開けない場合はNULL。
+ */
+static libusb_device_handle *
+openLibertyHandle(libusb_context *context, int unit)
+{
+    libusb_device **list;
+    libusb_device_handle *handle = NULL;
+    ssize_t listSize = libusb_get_device_list(context, &list);
+    ssize_t i;
+
+    for (i = 0; i < listSize; ++i) {
+        if (isLiberty(list[i]) && unit-- == 0) {
+            if (libusb_open(list[i], &handle)) {
+                handle = NULL;
+            }
+            break;
+        }
+    }
+    if (listSize >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    return handle;
+}
+
 /**
  * Libertyの初期化。
+ * @param liberty 初期化するLiberty。
+ * @param unit 接続されているLibertyのうち何台目を使用するか（0から数える）。
  * @return 初期化に成功した場合は0、失敗した場合は0以外。
  */
 int
-initializeLiberty()
+initializeLiberty(LibertyDevice *liberty, int unit)
 {
     int result;
-    /* LibertyのベンダID */
-    const int vid = 0x0f44;
-    /* LibertyのプロダクトID */
-    const int pid = 0xff20;
-
-    /* コールバック関数を初期化 */
-    deviceMovedFunc = doNothingDeviceMoved;
-    deviceSwayedFunc = doNothingDeviceSwayed;
-    devicePressedFunc = doNothingDevicePressed;
-    deviceReleasedFunc = doNothingDeviceReleased;
-
-    /* libusbライブラリを初期化 */
-    result = libusb_init(&context);
+
+    initializeState(liberty, unit);
+
+    /* 台ごとに独立したlibusbコンテキストを初期化 */
+    result = libusb_init(&liberty->context);
     if (result) {
         fprintf(stderr, "libusb initialize error.\n");
-        context = NULL;
+        liberty->context = NULL;
         return -1;
     }
 
     /* Libertyのハンドラを生成 */
-    handle = libusb_open_device_with_vid_pid(context, vid, pid);
-    if (!handle) {
-        fprintf(stderr, "cannot open device (vid: %04x, pid: %04x).\n", vid, pid);
-        libusb_exit(context);
+    liberty->handle = openLibertyHandle(liberty->context, unit);
+    if (!liberty->handle) {
+        fprintf(stderr, "cannot open device #%d (vid: %04x, pid: %04x).\n",
+                unit, LIBERTY_VID, LIBERTY_PID);
+        libusb_exit(liberty->context);
+        liberty->context = NULL;
         return -2;
     }
 
+    /* 読み込みエンドポイントは同じ大きさで繰り返し受信するので、
+       転送を使い回し、次の受信を先に発行しておくリーダを用意する */
+    result = libusb_open_bulk_reader(liberty->handle, READ_ENDPOINT, BUFFER_LENGTH,
+                                     READ_TIMEOUT, LIBUSB_BULK_READER_DOUBLE_BUFFER,
+                                     &liberty->reader);
+    if (result) {
+        fprintf(stderr, "cannot prepare reads from liberty #%d.\n", unit);
+        libusb_close(liberty->handle);
+        liberty->handle = NULL;
+        libusb_exit(liberty->context);
+        liberty->context = NULL;
+        return -3;
+    }
+
     /* Libertyから応答があるまで待機 */
-    puts("### wait for a responce from liberty...");
-    waitForResponse();
-    puts("### get a response from liberty.");
+    printf("### wait for a responce from liberty #%d...\n", unit);
+    waitForResponse(liberty);
+    printf("### get a response from liberty #%d.\n", unit);
 
-    /* Libertyへ初期化コマンドを送信 */
-    sendInitializeCommands();
+    /* Libertyへ初期化コマンドを送信し、接続されているステーションを確認 */
+    sendInitializeCommands(liberty);
+    initializeStations(liberty);
+
+    return 0;
+}
+
+/**
+ * 実機の代わりにエミュレータを使用したLibertyの初期化。
+ * @param liberty 初期化するLiberty。
+ * @param unit 台数の中での番号。
+ * @param config エミュレータの設定。
+ * @return 初期化に成功した場合は0、失敗した場合は0以外。
+ */
+int
+initializeLibertyEmulated(LibertyDevice *liberty, int unit,
+                          const LibertyEmulatorConfig *config)
+{
+    initializeState(liberty, unit);
+
+    if (initializeLibertyEmulator(&liberty->emulator, config)) {
+        fprintf(stderr, "invalid emulator config (sensors: %d).\n", config->sensorsNum);
+        return -1;
+    }
+    liberty->emulated = 1;
+
+    /* 実機と同じ手順でエミュレータを初期化 */
+    printf("### wait for a responce from liberty emulator #%d...\n", unit);
+    waitForResponse(liberty);
+    printf("### get a response from liberty emulator #%d.\n", unit);
+    sendInitializeCommands(liberty);
+    initializeStations(liberty);
 
     return 0;
 }
 
 /**
  * Libertyのリソースの開放。
+ * @param liberty リソースを開放するLiberty。
  */
 void
-finalizeLiberty()
+finalizeLiberty(LibertyDevice *liberty)
 {
-    libusb_close(handle);
-    libusb_exit(context);
+    if (liberty->emulated) {
+        finalizeLibertyEmulator(&liberty->emulator);
+        liberty->emulated = 0;
+        return;
+    }
+    if (liberty->reader) {
+        libusb_close_bulk_reader(liberty->reader);
+        liberty->reader = NULL;
+    }
+    if (liberty->handle) {
+        libusb_close(liberty->handle);
+        liberty->handle = NULL;
+    }
+    if (liberty->context) {
+        libusb_exit(liberty->context);
+        liberty->context = NULL;
+    }
 }
@@ -1,59 +1,127 @@
 /**
  * @file Liberty.h
- * Libertyを扱う関数の宣言を記述したファイル。
+ * Libertyを扱う構造体の定義と、その操作関数の宣言を記述したファイル。
+ *
+ * Liberty1台ごとにLibertyDeviceを用意し、それぞれが自分のスレッドで
+ * USBからの受信とデバイスレコードの解析を行う。
+ * n台目（0から数える）のステーションsは、デバイス番号
+ * n * LIBERTY_STATION_MAX + s - 1 としてコールバック関数に渡される。
+ * 時刻は全ての台数で共通のCLOCK_MONOTONICで計測する。
+ *
+ * 初期化時に^U0で検出済みのステーションを問い合わせ、検出されたものだけを
+ * 出力対象にする。メインループ中も定期的に問い合わせ、センサの抜き差しに追従する。
  *
  * Oct. 2010 by Muroran Institute of Technology
  */
 #ifndef LIBERTY_H
 #define LIBERTY_H /**< インクルードガード用定数 */
 
-#ifndef LIBERTY_SENSOR_NUM
-#define LIBERTY_SENSOR_NUM 10 /**< Libertyに接続されているセンサの数 */
-#endif
+#include <stddef.h>
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+#include "Latency.h"
+#include "LibertyEmulator.h"
+
+#define LIBERTY_STATION_MAX 16 /**< Liberty1台に接続できるセンサの最大数 */
+#define LIBERTY_UNITS_MAX 4 /**< 1つのサーバで扱えるLibertyの台数 */
+#define LIBERTY_BUFFER_LENGTH 512 /**< Libertyの受信バッファの長さ */
+#define LIBERTY_COMMANDS_LENGTH 128 /**< まとめて送信するコマンドのバッファの長さ */
+
+/** Liberty1台分の状態 */
+typedef struct {
+    int unit;                         /**< 台数の中での番号 */
+    int deviceBase;                   /**< ステーション1に割り当てるデバイス番号 */
+    libusb_context *context;          /**< 使用するUSBコンテキスト */
+    libusb_device_handle *handle;     /**< Libertyが接続されたUSBポートのハンドル */
+    libusb_bulk_reader *reader;       /**< 読み込みエンドポイントからの受信に使用するリーダ */
+    LibertyEmulator emulator;         /**< 実機の代わりに使用するエミュレータ */
+    int emulated;                     /**< エミュレータを使用しているかどうか */
+    char buffer[LIBERTY_BUFFER_LENGTH]; /**< 受信したデータを格納するバッファ */
+    const char *data;                 /**< 未解析のデータの先頭（bufferかリーダの受信バッファ内） */
+    size_t dataSizeInBuffer;          /**< 未解析のデータの大きさ */
+    LatencyTime receivedTime;         /**< 直近のUSB受信が完了した時刻（遅延計測用） */
+    long long frameTime;              /**< 直近のUSB受信が完了した時刻（マイクロ秒） */
+    int resynchronizing;              /**< レコードの区切りを見失って再同期中かどうか */
+    unsigned short detectedStations;  /**< 検出済みのステーションのビットマスク */
+    unsigned short activeStations;    /**< 出力対象のステーションのビットマスク */
+    char commands[LIBERTY_COMMANDS_LENGTH]; /**< 次のデータ要請とまとめて送信するコマンド */
+    size_t commandsLength;            /**< まとめて送信するコマンドのバイト数 */
+    long long nextQueryTime;          /**< 次にステーションを問い合わせる時刻（マイクロ秒） */
+    int recentButtonStates[LIBERTY_STATION_MAX]; /**< 直近のボタン押下状態 */
+    volatile int loopEnd;             /**< メインループ終了フラグ */
+    pthread_t thread;                 /**< メインループを実行するスレッド */
+    int running;                      /**< スレッドを開始したかどうか */
+} LibertyDevice;
+
+/**
+ * 接続されているLibertyの台数の取得。
+ * @return 台数。
+ */
+int countLibertyDevices(void);
 
 /**
  * Libertyの初期化。
+ * @param liberty 初期化するLiberty。
+ * @param unit 接続されているLibertyのうち何台目を使用するか（0から数える）。
+ * @return 初期化に成功した場合は0、失敗した場合は0以外。
+ */
+int initializeLiberty(LibertyDevice *liberty, int unit);
+
+/**
+ * 実機の代わりにエミュレータを使用したLibertyの初期化。
+ * @param liberty 初期化するLiberty。
+ * @param unit 台数の中での番号（デバイス番号の割り当てに使用する）。
+ * @param config エミュレータの設定。
  * @return 初期化に成功した場合は0、失敗した場合は0以外。
  */
-int initializeLiberty();
+int initializeLibertyEmulated(LibertyDevice *liberty, int unit,
+                              const LibertyEmulatorConfig *config);
 
 /**
- * Libertyのリソースの開放。
+ * Libertyのリソースの開放。メインループを停止してから呼び出すこと。
+ * @param liberty リソースを開放するLiberty。
  */
-void finalizeLiberty();
+void finalizeLiberty(LibertyDevice *liberty);
 
 /**
- * Libertyのメインループの開始。
+ * Libertyのメインループを新しいスレッドで開始。
+ * @param liberty 対象のLiberty。
+ * @return 開始できた場合は0、できなかった場合は0以外。
  */
-void startLibertyMainLoop();
+int startLibertyMainLoop(LibertyDevice *liberty);
 
 /**
- * Libertyのメインループの停止。
+ * Libertyのメインループを停止し、スレッドの終了を待つ。
+ * @param liberty 対象のLiberty。
  */
-void stopLibertyMainLoop(void);
+void stopLibertyMainLoop(LibertyDevice *liberty);
 
 /**
  * Libertyのデバイスムーブイベントに対するコールバック関数の設定。
+ * 全てのLibertyで共通で、各Libertyのスレッドから呼び出される。
+ * timeはUSB受信が完了した時刻（CLOCK_MONOTONIC、マイクロ秒）。
  * @param func コールバック関数。
  */
-void setLibertyMovedFunc(void (*func)(int device, double x, double y, double z));
+void setLibertyMovedFunc(void (*func)(int device, double x, double y, double z,
+                                      long long time));
 
 /**
  * Libertyのデバイススウェイイベントに対するコールバック関数の設定。
  * @param func コールバック関数。
  */
-void setLibertySwayedFunc(void (*func)(int device, double x, double y, double z));
+void setLibertySwayedFunc(void (*func)(int device, double x, double y, double z,
+                                       long long time));
 
 /**
  * Libertyのデバイスプレスイベントに対するコールバック関数の設定。
  * @param func コールバック関数。
  */
-void setLibertyPressedFunc(void (*func)(int device));
+void setLibertyPressedFunc(void (*func)(int device, long long time));
 
 /**
  * Libertyのデバイスリリースイベントに対するコールバック関数の設定。
  * @param func コールバック関数。
  */
-void setLibertyReleasedFunc(void (*func)(int device));
+void setLibertyReleasedFunc(void (*func)(int device, long long time));
 
 #endif
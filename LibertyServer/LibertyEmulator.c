@@ -0,0 +1,610 @@
+/**
+ * @file LibertyEmulator.c
+ * LibertyEmulator.hで宣言された関数の定義を記述したファイル。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <libusb-1.0/libusb.h>
+#include "LibertyEmulator.h"
+
+#define NANOS_PER_SECOND 1000000000LL /**< 1秒あたりのナノ秒数 */
+#define RECORD_SIZE 38                /**< デバイスレコード1件分のバイト数 */
+#define RECORD_BODY_SIZE 30           /**< デバイスレコードの本体のバイト数 */
+#define STATION_STATE_COMMAND 21      /**< ステーション状態コマンド(^U)の番号 */
+
+/** 円周率 */
+static const double PI = 3.14159265358979323846;
+
+/**
+ * エミュレータの設定を既定値で初期化。
+ * @param config 初期化する設定。
+ */
+void
+initializeLibertyEmulatorConfig(LibertyEmulatorConfig *config)
+{
+    config->sensorsNum = 10;
+    config->rate = 240.0;
+    config->motion = LIBERTY_EMULATOR_MOTION_ORBIT;
+    config->corruptionRate = 0.0;
+    config->partialReadRate = 0.0;
+    config->disconnectRate = 0.0;
+    config->disconnectMillis = 1000;
+    config->hotplugMillis = 0;
+    config->seed = 1;
+}
+
+/**
+ * 時刻にナノ秒を加算。
+ * @param time 加算対象の時刻。
+ * @param nanos 加算するナノ秒。
+ */
+static void
+addNanos(struct timespec *time, long long nanos)
+{
+    long long total = time->tv_nsec + nanos;
+    time->tv_sec += total / NANOS_PER_SECOND;
+    time->tv_nsec = total % NANOS_PER_SECOND;
+}
+
+/**
+ * 2つの時刻の差の取得。
+ * @param a 時刻A。
+ * @param b 時刻B。
+ * @return 時刻Aから時刻Bを引いたナノ秒。
+ */
+static long long
+diffNanos(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) * NANOS_PER_SECOND + (a->tv_nsec - b->tv_nsec);
+}
+
+/**
+ * 0以上1未満の乱数の取得。
+ * @param emulator 乱数の状態を持つエミュレータ。
+ * @return 乱数。
+ */
+static double
+nextRandom(LibertyEmulator *emulator)
+{
+    return rand_r(&emulator->random) / ((double)RAND_MAX + 1.0);
+}
+
+/**
+ * 指定した確率で真となる事象の判定。
+ * @param emulator 乱数の状態を持つエミュレータ。
+ * @param probability 確率。
+ * @return 事象が起きた場合は0以外。
+ */
+static int
+happens(LibertyEmulator *emulator, double probability)
+{
+    return probability > 0.0 && nextRandom(emulator) < probability;
+}
+
+/**
+ * エミュレータを初期化。
+ * @param emulator 初期化するエミュレータ。
+ * @param config エミュレータの設定。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int
+initializeLibertyEmulator(LibertyEmulator *emulator, const LibertyEmulatorConfig *config)
+{
+    if (config->sensorsNum <= 0 || config->sensorsNum > LIBERTY_EMULATOR_STATION_MAX) {
+        return -1;
+    }
+
+    memset(emulator, 0, sizeof(LibertyEmulator));
+    emulator->config = *config;
+    emulator->random = config->seed;
+    emulator->activeStations = (unsigned short)((1u << config->sensorsNum) - 1);
+    clock_gettime(CLOCK_MONOTONIC, &emulator->nextFrameTime);
+    emulator->startTime = emulator->nextFrameTime;
+    pthread_mutex_init(&emulator->mutex, NULL);
+
+    return 0;
+}
+
+/**
+ * エミュレータのリソースを解放。
+ * @param emulator リソースを解放するエミュレータ。
+ */
+void
+finalizeLibertyEmulator(LibertyEmulator *emulator)
+{
+    pthread_mutex_destroy(&emulator->mutex);
+}
+
+/**
+ * 送信待ちデータの末尾にデータを追加。
+ * バッファに収まらない場合は、実機のFIFOと同様に溢れた分を捨てる。
+ * @param emulator 追加先のエミュレータ。
+ * @param data 追加するデータ。
+ * @param size 追加するデータのバイト数。
+ */
+static void
+appendOutput(LibertyEmulator *emulator, const void *data, size_t size)
+{
+    size_t remain = LIBERTY_EMULATOR_BUFFER_LENGTH - emulator->outputSize;
+    if (size > remain) {
+        size = remain;
+    }
+    memcpy(emulator->output + emulator->outputSize, data, size);
+    emulator->outputSize += size;
+}
+
+/**
+ * デバイスレコードのヘッダを書き込み。
+ * @param header 書き込み先（8バイト）。
+ * @param station ステーション番号。
+ * @param command コマンド番号。
+ * @param bodySize 本体のバイト数。
+ */
+static void
+writeHeader(unsigned char *header, int station, int command, int bodySize)
+{
+    header[0] = 'L';
+    header[1] = 'Y';
+    header[2] = (unsigned char)station;
+    header[3] = (unsigned char)command;
+    header[4] = 0;
+    header[5] = 0;
+    header[6] = (unsigned char)(bodySize & 0xff);
+    header[7] = (unsigned char)((bodySize >> 8) & 0xff);
+}
+
+/**
+ * 指定時刻におけるセンサの位置と姿勢の計算。
+ * @param emulator 動きの設定を持つエミュレータ。
+ * @param station ステーション番号。
+ * @param t 経過時間(s)。
+ * @param data 位置(cm)とオイラー角(度)の格納先（長さ6）。
+ */
+static void
+computePose(LibertyEmulator *emulator, int station, double t, float data[6])
+{
+    /* ステーションごとに原点と位相をずらす */
+    double phase = 2.0 * PI * station / LIBERTY_EMULATOR_STATION_MAX;
+    double baseX = 10.0 * station;
+    double w = 2.0 * PI * 0.25;
+
+    switch (emulator->config.motion) {
+    case LIBERTY_EMULATOR_MOTION_ORBIT:
+        data[0] = (float)(baseX + 20.0 * cos(w * t + phase));
+        data[1] = (float)(20.0 * sin(w * t + phase));
+        data[2] = (float)(-10.0 + 5.0 * sin(2.0 * w * t));
+        data[3] = (float)fmod(90.0 * t + 360.0 * station / LIBERTY_EMULATOR_STATION_MAX, 360.0) - 180.0f;
+        data[4] = (float)(30.0 * sin(w * t));
+        data[5] = (float)(45.0 * cos(w * t + phase));
+        break;
+    case LIBERTY_EMULATOR_MOTION_WAVE:
+        data[0] = (float)(baseX + 30.0 * sin(w * t + phase));
+        data[1] = (float)(30.0 * sin(0.5 * w * t + phase));
+        data[2] = (float)(-10.0 + 10.0 * sin(0.25 * w * t + phase));
+        data[3] = (float)(60.0 * sin(w * t));
+        data[4] = (float)(60.0 * sin(0.5 * w * t));
+        data[5] = (float)(60.0 * sin(0.25 * w * t));
+        break;
+    default:
+        data[0] = (float)baseX;
+        data[1] = 0.0f;
+        data[2] = -10.0f;
+        data[3] = 0.0f;
+        data[4] = 0.0f;
+        data[5] = 0.0f;
+        break;
+    }
+}
+
+/**
+ * 指定時刻におけるボタン押下状態の計算。
+ * ステーションごとにずらしつつ、3秒ごとに0.5秒間押下する。
+ * @param emulator 動きの設定を持つエミュレータ。
+ * @param station ステーション番号。
+ * @param t 経過時間(s)。
+ * @return 押下されている場合は1、そうでない場合は0。
+ */
+static int
+computeButton(LibertyEmulator *emulator, int station, double t)
+{
+    if (emulator->config.motion == LIBERTY_EMULATOR_MOTION_STILL) {
+        return 0;
+    }
+    return fmod(t + 0.3 * station, 3.0) < 0.5;
+}
+
+/**
+ * 検出済みのステーションのビットマスクの取得。
+ * 抜き差しを指定した場合、最後のセンサは指定間隔ごとに抜かれた状態と
+ * 挿された状態を繰り返す（最初は抜かれた状態）。
+ * @param emulator 対象のエミュレータ。
+ * @return 検出済みのステーションのビットマスク。
+ */
+static unsigned short
+getDetectedStations(LibertyEmulator *emulator)
+{
+    unsigned short detected = (unsigned short)((1u << emulator->config.sensorsNum) - 1);
+
+    if (emulator->config.hotplugMillis > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (diffNanos(&now, &emulator->startTime) / 1000000LL /
+            emulator->config.hotplugMillis % 2 == 0) {
+            detected &= (unsigned short)~(1u << (emulator->config.sensorsNum - 1));
+        }
+    }
+    return detected;
+}
+
+/**
+ * 1フレーム分のデバイスレコードを生成して送信待ちデータに追加。
+ * @param emulator フレームを生成するエミュレータ。
+ */
+static void
+generateFrame(LibertyEmulator *emulator)
+{
+    /* フレームの時刻はフレーム番号から決定し、実時間の揺らぎに依存させない */
+    double rate = emulator->config.rate > 0.0 ? emulator->config.rate : 240.0;
+    double t = emulator->frameCount / rate;
+    unsigned short stations = emulator->activeStations & getDetectedStations(emulator);
+    int station;
+
+    for (station = 1; station <= emulator->config.sensorsNum; ++station) {
+        float data[6];
+        int button;
+
+        if (!(stations & (1u << (station - 1)))) {
+            continue;
+        }
+        computePose(emulator, station, t, data);
+        button = computeButton(emulator, station, t);
+
+        if (emulator->binary) {
+            unsigned char record[RECORD_SIZE];
+            writeHeader(record, station, 'P', RECORD_BODY_SIZE);
+            memcpy(record + 8, &button, 4);
+            memcpy(record + 12, data, sizeof(float) * 6);
+            record[36] = '\r';
+            record[37] = '\n';
+            /* 指定した確率でレコード中の1バイトを破損させる */
+            if (happens(emulator, emulator->config.corruptionRate)) {
+                int index = (int)(nextRandom(emulator) * RECORD_SIZE);
+                record[index] ^= (unsigned char)(1 + (int)(nextRandom(emulator) * 255));
+            }
+            appendOutput(emulator, record, RECORD_SIZE);
+        } else {
+            char line[128];
+            int length = snprintf(line, sizeof(line),
+                                  "%2d %d %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\r\n",
+                                  station, button, data[0], data[1], data[2],
+                                  data[3], data[4], data[5]);
+            appendOutput(emulator, line, length);
+        }
+    }
+    ++emulator->frameCount;
+}
+
+/**
+ * アクティブステーションの状態の応答を送信待ちデータに追加。
+ * @param emulator 応答するエミュレータ。
+ */
+static void
+respondStationState(LibertyEmulator *emulator)
+{
+    unsigned short detected = getDetectedStations(emulator);
+    unsigned short active = emulator->activeStations;
+
+    if (emulator->binary) {
+        unsigned char response[12];
+        writeHeader(response, 0, STATION_STATE_COMMAND, 4);
+        memcpy(response + 8, &detected, 2);
+        memcpy(response + 10, &active, 2);
+        appendOutput(emulator, response, sizeof(response));
+    } else {
+        char line[32];
+        int length = snprintf(line, sizeof(line), "%04X%04X\r\n", detected, active);
+        appendOutput(emulator, line, length);
+    }
+}
+
+/**
+ * 改行で終端されたコマンドの解釈。
+ * 実機の初期化で使用するコマンドは受理し、出力形式に関わるものだけを反映する。
+ * @param emulator コマンドを解釈するエミュレータ。
+ * @param command コマンド（改行は含まない）。
+ */
+static void
+executeCommand(LibertyEmulator *emulator, const char *command)
+{
+    switch (command[0]) {
+    case '\0':
+        /* 空のコマンドには改行を返す */
+        appendOutput(emulator, "\r\n", 2);
+        break;
+    case 'F':
+    case 'f':
+        emulator->binary = command[1] == '1';
+        break;
+    case 'C':
+    case 'c':
+        emulator->continuous = 1;
+        clock_gettime(CLOCK_MONOTONIC, &emulator->nextFrameTime);
+        break;
+    case '\025': {
+        /* ^U0は状態の問い合わせ、^Un,sはステーションnの有効化・無効化 */
+        int station = 0;
+        int state = 1;
+        if (sscanf(command + 1, "%d,%d", &station, &state) == 2 &&
+            station > 0 && station <= emulator->config.sensorsNum) {
+            if (state) {
+                emulator->activeStations |= (unsigned short)(1u << (station - 1));
+            } else {
+                emulator->activeStations &= (unsigned short)~(1u << (station - 1));
+            }
+        } else if (station == 0) {
+            respondStationState(emulator);
+        }
+        break;
+    }
+    default:
+        /* U, O, L, H, A, G, ^R などは受理のみ */
+        break;
+    }
+}
+
+/**
+ * 受理中のコマンドに1文字追加し、コマンドが完成したら解釈。
+ * @param emulator コマンドを受理するエミュレータ。
+ * @param c 追加する文字。
+ */
+static void
+acceptCommandChar(LibertyEmulator *emulator, char c)
+{
+    /* P(単一フレーム出力)は改行を待たずに処理する */
+    if (emulator->commandSize == 0 && (c == 'P' || c == 'p')) {
+        emulator->continuous = 0;
+        ++emulator->pendingFrames;
+        return;
+    }
+    if (c == '\r') {
+        emulator->command[emulator->commandSize] = '\0';
+        executeCommand(emulator, emulator->command);
+        emulator->commandSize = 0;
+        return;
+    }
+    if (emulator->commandSize < LIBERTY_EMULATOR_COMMAND_LENGTH - 1) {
+        emulator->command[emulator->commandSize] = c;
+        ++emulator->commandSize;
+    }
+}
+
+/**
+ * 切断状態の確認と、必要であれば切断状態からの復帰。
+ * ミューテックスを取得した状態で呼び出すこと。
+ * @param emulator 確認するエミュレータ。
+ * @return 切断状態の場合は0以外。
+ */
+static int
+isDisconnected(LibertyEmulator *emulator)
+{
+    struct timespec now;
+    if (!emulator->disconnected) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (diffNanos(&now, &emulator->reconnectTime) < 0) {
+        return 1;
+    }
+    /* 復帰時は実機の再起動と同様に連続出力を停止した状態に戻す */
+    emulator->disconnected = 0;
+    emulator->continuous = 0;
+    emulator->pendingFrames = 0;
+    return 0;
+}
+
+/**
+ * エミュレータへデータを送信。
+ * @param emulator 送信先のエミュレータ。
+ * @param buf 送信するデータ。
+ * @param size 送信するデータのバイト数。
+ * @return 送信に成功した場合は送信したバイト数、失敗した場合はlibusbのエラーコード。
+ */
+int
+sendLibertyEmulator(LibertyEmulator *emulator, const unsigned char *buf, int size)
+{
+    int i;
+
+    pthread_mutex_lock(&emulator->mutex);
+    if (isDisconnected(emulator)) {
+        pthread_mutex_unlock(&emulator->mutex);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    for (i = 0; i < size; ++i) {
+        acceptCommandChar(emulator, (char)buf[i]);
+    }
+    pthread_mutex_unlock(&emulator->mutex);
+
+    return size;
+}
+
+/**
+ * 指定した絶対時刻まで待機。
+ * @param time 待機を終える時刻。
+ */
+static void
+sleepUntil(const struct timespec *time)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, time, NULL) == EINTR) {
+    }
+}
+
+/**
+ * 次のフレームを生成すべき時刻まで待機してフレームを生成。
+ * ミューテックスを取得した状態で呼び出すこと。
+ * @param emulator フレームを生成するエミュレータ。
+ * @param deadline 待機できる最終時刻。
+ * @return フレームを生成した場合は0以外、期限内に生成時刻が来ない場合は0。
+ */
+static int
+waitForFrame(LibertyEmulator *emulator, const struct timespec *deadline)
+{
+    struct timespec frameTime;
+
+    if (emulator->config.rate > 0.0) {
+        long long period = (long long)(NANOS_PER_SECOND / emulator->config.rate);
+        struct timespec now;
+        /* 要求が途絶えていた間のフレームはまとめて生成しない */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (diffNanos(&now, &emulator->nextFrameTime) > period) {
+            emulator->nextFrameTime = now;
+        }
+        frameTime = emulator->nextFrameTime;
+        if (diffNanos(&frameTime, deadline) > 0) {
+            return 0;
+        }
+        /* 待機中も送信を受け付けられるようにロックを解放 */
+        pthread_mutex_unlock(&emulator->mutex);
+        sleepUntil(&frameTime);
+        pthread_mutex_lock(&emulator->mutex);
+        if (emulator->disconnected) {
+            return 0;
+        }
+        addNanos(&emulator->nextFrameTime, period);
+    }
+    if (!emulator->continuous && emulator->pendingFrames <= 0) {
+        return 0;
+    }
+    if (!emulator->continuous) {
+        --emulator->pendingFrames;
+    }
+    generateFrame(emulator);
+    return 1;
+}
+
+/**
+ * エミュレータからデータを受信。
+ * @param emulator 受信元のエミュレータ。
+ * @param buf 受信データの格納先。
+ * @param size 受信データの許容バイト数。
+ * @param timeout タイムアウトまでの時間(ms)。
+ * @return 受信に成功した場合は受信したバイト数、失敗した場合はlibusbのエラーコード。
+ */
+int
+receiveLibertyEmulator(LibertyEmulator *emulator, unsigned char *buf, int size,
+                       int timeout)
+{
+    struct timespec deadline;
+    int length;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    addNanos(&deadline, timeout * 1000000LL);
+
+    pthread_mutex_lock(&emulator->mutex);
+    if (isDisconnected(emulator)) {
+        pthread_mutex_unlock(&emulator->mutex);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    /* 指定した確率で切断状態に移行し、送信待ちデータを破棄 */
+    if (happens(emulator, emulator->config.disconnectRate)) {
+        emulator->disconnected = 1;
+        emulator->outputSize = 0;
+        clock_gettime(CLOCK_MONOTONIC, &emulator->reconnectTime);
+        addNanos(&emulator->reconnectTime, emulator->config.disconnectMillis * 1000000LL);
+        pthread_mutex_unlock(&emulator->mutex);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    /* 送信待ちデータが無ければフレームの生成を待つ */
+    if (emulator->outputSize == 0 &&
+        (emulator->continuous || emulator->pendingFrames > 0)) {
+        waitForFrame(emulator, &deadline);
+    }
+    if (emulator->outputSize == 0) {
+        pthread_mutex_unlock(&emulator->mutex);
+        sleepUntil(&deadline);
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    /* 指定した確率で送信待ちデータの一部のみを返す */
+    length = emulator->outputSize < (size_t)size ? (int)emulator->outputSize : size;
+    if (length > 1 && happens(emulator, emulator->config.partialReadRate)) {
+        length = 1 + (int)(nextRandom(emulator) * (length - 1));
+    }
+    memcpy(buf, emulator->output, length);
+    emulator->outputSize -= length;
+    memmove(emulator->output, emulator->output + length, emulator->outputSize);
+    pthread_mutex_unlock(&emulator->mutex);
+
+    return length;
+}
+
+/**
+ * エミュレータの設定文字列を解析。
+ * @param config 解析結果の格納先。
+ * @param options 設定文字列。
+ * @return 解析に成功した場合は0、失敗した場合は0以外。
+ */
+int
+parseLibertyEmulatorConfig(LibertyEmulatorConfig *config, char *options)
+{
+    enum { SENSORS, RATE, MOTION, CORRUPT, PARTIAL, DISCONNECT, DOWNTIME, HOTPLUG, SEED };
+    char *const tokens[] = {
+        "sensors", "rate", "motion", "corrupt", "partial", "disconnect", "downtime",
+        "hotplug", "seed", NULL
+    };
+    char *value;
+
+    while (*options != '\0') {
+        int token = getsubopt(&options, tokens, &value);
+        if (token != MOTION && (token < 0 || value == NULL)) {
+            return -1;
+        }
+        switch (token) {
+        case SENSORS:
+            config->sensorsNum = atoi(value);
+            break;
+        case RATE:
+            config->rate = atof(value);
+            break;
+        case MOTION:
+            if (value == NULL) {
+                return -1;
+            } else if (strcmp(value, "still") == 0) {
+                config->motion = LIBERTY_EMULATOR_MOTION_STILL;
+            } else if (strcmp(value, "orbit") == 0) {
+                config->motion = LIBERTY_EMULATOR_MOTION_ORBIT;
+            } else if (strcmp(value, "wave") == 0) {
+                config->motion = LIBERTY_EMULATOR_MOTION_WAVE;
+            } else {
+                return -1;
+            }
+            break;
+        case CORRUPT:
+            config->corruptionRate = atof(value);
+            break;
+        case PARTIAL:
+            config->partialReadRate = atof(value);
+            break;
+        case DISCONNECT:
+            config->disconnectRate = atof(value);
+            break;
+        case DOWNTIME:
+            config->disconnectMillis = atoi(value);
+            break;
+        case HOTPLUG:
+            config->hotplugMillis = atoi(value);
+            break;
+        case SEED:
+            config->seed = (unsigned int)strtoul(value, NULL, 10);
+            break;
+        }
+    }
+
+    return config->sensorsNum > 0 && config->sensorsNum <= LIBERTY_EMULATOR_STATION_MAX ? 0 : -1;
+}
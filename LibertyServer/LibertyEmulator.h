@@ -0,0 +1,111 @@
+/**
+ * @file LibertyEmulator.h
+ * 実機を使わずにLibertyの応答を模倣するエミュレータ構造体の定義と、
+ * その操作関数の宣言を記述したファイル。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef LIBERTY_EMULATOR_H
+#define LIBERTY_EMULATOR_H /**< インクルードガード用定数 */
+
+#include <pthread.h>
+#include <time.h>
+
+#define LIBERTY_EMULATOR_STATION_MAX 16   /**< エミュレートできるセンサの最大数 */
+#define LIBERTY_EMULATOR_BUFFER_LENGTH 4096 /**< 送信待ちデータのバッファ長 */
+#define LIBERTY_EMULATOR_COMMAND_LENGTH 128 /**< 受理中コマンドのバッファ長 */
+
+/** センサの動きの種類 */
+typedef enum {
+    LIBERTY_EMULATOR_MOTION_STILL, /**< 静止 */
+    LIBERTY_EMULATOR_MOTION_ORBIT, /**< 円軌道を描きながら回転 */
+    LIBERTY_EMULATOR_MOTION_WAVE   /**< 各軸に沿って往復 */
+} LibertyEmulatorMotion;
+
+/** エミュレータの設定 */
+typedef struct {
+    int sensorsNum;                 /**< センサの数（1〜16） */
+    double rate;                    /**< フレームの生成レート(Hz)。0以下なら待たずに応答 */
+    LibertyEmulatorMotion motion;   /**< センサの動き */
+    double corruptionRate;          /**< 1レコードあたりのデータ破損確率 */
+    double partialReadRate;         /**< 1受信あたりの分割受信確率 */
+    double disconnectRate;          /**< 1受信あたりの切断確率 */
+    int disconnectMillis;           /**< 切断状態の継続時間(ms) */
+    int hotplugMillis;              /**< 最後のセンサを抜き差しする間隔(ms)。0なら抜き差ししない */
+    unsigned int seed;              /**< 乱数の種 */
+} LibertyEmulatorConfig;
+
+/** エミュレータ構造体 */
+typedef struct {
+    LibertyEmulatorConfig config;   /**< 設定 */
+    pthread_mutex_t mutex;          /**< ミューテックス */
+    unsigned int random;            /**< 乱数の状態 */
+    int binary;                     /**< バイナリ出力モードかどうか */
+    int continuous;                 /**< 連続出力モードかどうか */
+    int pendingFrames;              /**< 要求済みで未生成のフレーム数 */
+    unsigned short activeStations;  /**< 出力対象のステーションのビットマスク */
+    unsigned long long frameCount;  /**< 生成したフレームの数 */
+    struct timespec startTime;      /**< 初期化した時刻 */
+    struct timespec nextFrameTime;  /**< 次のフレームの生成時刻 */
+    struct timespec reconnectTime;  /**< 切断状態から復帰する時刻 */
+    int disconnected;               /**< 切断状態かどうか */
+    char command[LIBERTY_EMULATOR_COMMAND_LENGTH]; /**< 受理中のコマンド */
+    size_t commandSize;             /**< 受理中のコマンドの大きさ */
+    unsigned char output[LIBERTY_EMULATOR_BUFFER_LENGTH]; /**< 送信待ちデータ */
+    size_t outputSize;              /**< 送信待ちデータの大きさ */
+} LibertyEmulator;
+
+/**
+ * エミュレータの設定を既定値で初期化。
+ * @param config 初期化する設定。
+ */
+void initializeLibertyEmulatorConfig(LibertyEmulatorConfig *config);
+
+/**
+ * エミュレータを初期化。
+ * @param emulator 初期化するエミュレータ。
+ * @param config エミュレータの設定。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int initializeLibertyEmulator(LibertyEmulator *emulator,
+                              const LibertyEmulatorConfig *config);
+
+/**
+ * エミュレータのリソースを解放。
+ * @param emulator リソースを解放するエミュレータ。
+ */
+void finalizeLibertyEmulator(LibertyEmulator *emulator);
+
+/**
+ * エミュレータへデータを送信。
+ * 実機と同様にコマンドとして解釈される。
+ * @param emulator 送信先のエミュレータ。
+ * @param buf 送信するデータ。
+ * @param size 送信するデータのバイト数。
+ * @return 送信に成功した場合は送信したバイト数、失敗した場合はlibusbのエラーコード。
+ */
+int sendLibertyEmulator(LibertyEmulator *emulator, const unsigned char *buf, int size);
+
+/**
+ * エミュレータからデータを受信。
+ * データが無ければ、フレームの生成時刻かタイムアウトまで待機する。
+ * @param emulator 受信元のエミュレータ。
+ * @param buf 受信データの格納先。
+ * @param size 受信データの許容バイト数。
+ * @param timeout タイムアウトまでの時間(ms)。
+ * @return 受信に成功した場合は受信したバイト数、失敗した場合はlibusbのエラーコード。
+ */
+int receiveLibertyEmulator(LibertyEmulator *emulator, unsigned char *buf, int size,
+                           int timeout);
+
+/**
+ * エミュレータの設定文字列を解析。
+ * 文字列は "sensors=8,rate=240,motion=orbit,corrupt=0.01,hotplug=3000" のような
+ * カンマ区切りのkey=value形式とする。
+ * @param config 解析結果の格納先。
+ * @param options 設定文字列。
+ * @return 解析に成功した場合は0、失敗した場合は0以外。
+ */
+int parseLibertyEmulatorConfig(LibertyEmulatorConfig *config, char *options);
+
+#endif
@@ -0,0 +1,138 @@
+/**
+ * @file MessagePool.c
+ * MessagePool.hで宣言された関数の定義を記述したファイル。
+ *
+ * フリーリストはロックを取らないスタックとし、先頭には要素の番号と世代番号を
+ * まとめて保持する。取り出した要素が再び積まれても世代番号が変わるため、
+ * 比較交換が古い先頭を正しいものと誤認することは無い。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdlib.h>
+#include "MessagePool.h"
+#include "Metrics.h"
+
+/**
+ * フリーリストの先頭の値を作成。
+ * @param tag 世代番号。
+ * @param index 要素の番号+1（0なら空）。
+ * @return 先頭の値。
+ */
+static unsigned long long
+makeHead(unsigned long long tag, unsigned int index)
+{
+    return (tag << 32) | index;
+}
+
+/**
+ * メモリプールを初期化し、全てのメッセージをフリーリストに登録。
+ * @param pool 初期化するメモリプール。
+ * @param length 格納できるメッセージ数。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int
+initializeMessagePool(MessagePool *pool, unsigned int length)
+{
+    unsigned int i;
+
+    pool->messages = (Message*)calloc(length, sizeof(Message));
+    if (pool->messages == NULL) {
+        return -1;
+    }
+    /* 各要素が次の要素を指すように連結 */
+    for (i = 0; i < length; ++i) {
+        pool->messages[i].pool = pool;
+        pool->messages[i].next = i + 1 < length ? i + 2 : 0;
+    }
+    pool->length = length;
+    pool->head = makeHead(0, length > 0 ? 1 : 0);
+
+    return 0;
+}
+
+/**
+ * メモリプールのリソースを解放。
+ * @param pool リソースを解放するメモリプール。
+ */
+void
+finalizeMessagePool(MessagePool *pool)
+{
+    free(pool->messages);
+    pool->messages = NULL;
+    pool->length = 0;
+}
+
+/**
+ * 参照カウント1のメッセージを割り当て。
+ * @param pool 割り当て元のメモリプール。
+ * @return 割り当てたメッセージ、失敗した場合はNULL。
+ */
+Message *
+allocateMessage(MessagePool *pool)
+{
+    unsigned long long head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    Message *message;
+
+    while ((head & 0xffffffffULL) != 0) {
+        unsigned int index = (unsigned int)(head & 0xffffffffULL);
+        unsigned int next;
+
+        message = &pool->messages[index - 1];
+        next = __atomic_load_n(&message->next, __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&pool->head, &head,
+                                        makeHead((head >> 32) + 1, next), 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            message->refs = 1;
+            return message;
+        }
+    }
+
+    /* プールが枯渇していればヒープから割り当てる */
+    addMetric(METRIC_SERVER_POOL_MISSES, 1);
+    message = (Message*)malloc(sizeof(Message));
+    if (message != NULL) {
+        message->refs = 1;
+        message->pool = NULL;
+    }
+    return message;
+}
+
+/**
+ * メッセージの参照カウントを増やす。
+ * @param message 対象のメッセージ。
+ */
+void
+retainMessage(Message *message)
+{
+    __atomic_add_fetch(&message->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * メッセージの参照カウントを減らし、0になれば割り当て元へ返却。
+ * @param message 対象のメッセージ。
+ */
+void
+releaseMessage(Message *message)
+{
+    MessagePool *pool = message->pool;
+    unsigned int index;
+    unsigned long long head;
+
+    if (__atomic_sub_fetch(&message->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    if (pool == NULL) {
+        free(message);
+        return;
+    }
+
+    /* フリーリストの先頭に積む */
+    index = (unsigned int)(message - pool->messages) + 1;
+    head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&message->next, (unsigned int)(head & 0xffffffffULL),
+                         __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head,
+                                          makeHead((head >> 32) + 1, index), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
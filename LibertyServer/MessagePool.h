@@ -0,0 +1,86 @@
+/**
+ * @file MessagePool.h
+ * 複数のクライアントで共有する参照カウント付きの送信メッセージと、
+ * その割り当て元となるメモリプールの定義、およびその操作関数の宣言を
+ * 記述したファイル。
+ *
+ * イベントは1度だけ符号化してメッセージに格納し、
+ * 各クライアントの送信待ちキューはそのメッセージへのポインタを保持する。
+ * 参照が無くなったメッセージはフリーリストを通して再利用する。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef MESSAGE_POOL_H
+#define MESSAGE_POOL_H /**< インクルードガード用定数 */
+
+#include <stddef.h>
+#include "Latency.h"
+
+#define MESSAGE_DATA_MAX 64 /**< 1メッセージの最大バイト数 */
+
+struct MessagePool;
+
+/** メッセージの符号化形式 */
+typedef enum {
+    MESSAGE_ENCODING_ANY,     /**< 全てのクライアントへ配信 */
+    MESSAGE_ENCODING_FULL,    /**< 通常のイベントを受け取るクライアントへ配信 */
+    MESSAGE_ENCODING_COMPACT  /**< 圧縮イベントを受け取るクライアントへ配信 */
+} MessageEncoding;
+
+/** 参照カウント付きの送信メッセージ */
+typedef struct {
+    unsigned int refs;                      /**< 参照カウント */
+    unsigned int next;                      /**< フリーリストの次の要素の番号+1 */
+    struct MessagePool *pool;               /**< 割り当て元（プール外ならNULL） */
+    size_t size;                            /**< メッセージのバイト数 */
+    LatencyTime origin;                     /**< 遅延計測の起点時刻 */
+    unsigned long long record;              /**< デバイスレコードの番号（0なら間引かない） */
+    long long recordTime;                   /**< デバイスレコードの取得時刻（マイクロ秒） */
+    MessageEncoding encoding;               /**< 符号化形式 */
+    int keyframe;                           /**< 圧縮イベントのキーフレームかどうか */
+    unsigned char data[MESSAGE_DATA_MAX];   /**< 符号化済みのイベント */
+} Message;
+
+/** メッセージのメモリプール */
+typedef struct MessagePool {
+    Message *messages;       /**< メッセージの格納領域 */
+    unsigned int length;     /**< 格納できるメッセージ数 */
+    unsigned long long head; /**< フリーリストの先頭（上位32ビットは世代番号） */
+} MessagePool;
+
+/**
+ * メモリプールを初期化し、全てのメッセージをフリーリストに登録。
+ * @param pool 初期化するメモリプール。
+ * @param length 格納できるメッセージ数。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int initializeMessagePool(MessagePool *pool, unsigned int length);
+
+/**
+ * メモリプールのリソースを解放。
+ * 全てのメッセージが返却された後に呼び出すこと。
+ * @param pool リソースを解放するメモリプール。
+ */
+void finalizeMessagePool(MessagePool *pool);
+
+/**
+ * 参照カウント1のメッセージを割り当て。
+ * プールが枯渇している場合はヒープから割り当てる。
+ * @param pool 割り当て元のメモリプール。
+ * @return 割り当てたメッセージ、失敗した場合はNULL。
+ */
+Message *allocateMessage(MessagePool *pool);
+
+/**
+ * メッセージの参照カウントを増やす。
+ * @param message 対象のメッセージ。
+ */
+void retainMessage(Message *message);
+
+/**
+ * メッセージの参照カウントを減らし、0になれば割り当て元へ返却。
+ * @param message 対象のメッセージ。
+ */
+void releaseMessage(Message *message);
+
+#endif
@@ -0,0 +1,229 @@
+/**
+ * @file Metrics.c
+ * Metrics.hで宣言された関数の定義を記述したファイル。
+ *
+ * カウンタはスレッドごとのブロックに保持し、書き込むのはそのスレッドのみとする。
+ * そのため加算はロック命令を伴わないアトミックな読み書きで済み、
+ * 公開時にだけ全ブロックを合計する。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "Metrics.h"
+
+/** スレッドごとのカウンタ */
+typedef struct MetricsBlock {
+    unsigned long long values[METRIC_COUNTER_NUM]; /**< カウンタの値 */
+    struct MetricsBlock *next;                     /**< 次のブロック */
+} MetricsBlock;
+
+/** メトリクスの定義 */
+typedef struct {
+    const char *name; /**< 名前 */
+    const char *help; /**< 説明 */
+} MetricDefinition;
+
+/** カウンタの定義 */
+static const MetricDefinition COUNTERS[METRIC_COUNTER_NUM] = {
+    {"liberty_records_total", "Device records parsed successfully."},
+    {"liberty_validate_failures_total", "Times the record stream lost synchronisation."},
+    {"liberty_resync_discarded_bytes_total", "Bytes discarded while resynchronising."},
+    {"liberty_usb_received_bytes_total", "Bytes received from the USB device."},
+    {"liberty_usb_errors_total", "USB transfer errors other than timeouts."},
+    {"liberty_usb_timeouts_total", "USB reads that timed out."},
+    {"server_events_sent_total", "Events written to clients."},
+    {"server_bytes_sent_total", "Bytes written to clients."},
+    {"server_write_stalls_total", "Client writes that could not complete in one call."},
+    {"server_client_disconnects_total", "Clients dropped after a failed write."},
+    {"server_fanout_dropped_events_total", "Events skipped by a lagging network worker."},
+    {"server_queue_dropped_events_total", "Events dropped because a client send queue was full."},
+    {"server_message_pool_misses_total", "Messages allocated from the heap because the pool was empty."},
+    {"server_send_syscalls_total", "write() and io_uring_enter() calls made to send to clients."},
+    {"relay_events_received_total", "Events received from the upstream server."},
+    {"relay_connects_total", "Connection attempts to the upstream server."}
+};
+
+/** ゲージの定義 */
+static const MetricDefinition GAUGES[METRIC_GAUGE_NUM] = {
+    {"server_clients", "Clients subscribed to a device."},
+    {"server_waiting_clients", "Connected clients that have not chosen a device yet."},
+    {"server_client_backlog_bytes", "Unsent bytes queued in client sockets."}
+};
+
+/** 登録済みのスレッドごとのカウンタの先頭 */
+static MetricsBlock *blocks = NULL;
+/** ブロックの登録を保護するミューテックス */
+static pthread_mutex_t blocksMutex = PTHREAD_MUTEX_INITIALIZER;
+/** 呼び出したスレッドのカウンタ */
+static __thread MetricsBlock *localBlock = NULL;
+/** ゲージの値 */
+static long long gauges[METRIC_GAUGE_NUM];
+
+/**
+ * 呼び出したスレッドのカウンタを作成して登録。
+ * スレッドごとに最初の1回だけ呼び出される。
+ * @return 作成したカウンタ。
+ */
+static MetricsBlock *
+registerBlock(void)
+{
+    MetricsBlock *block = (MetricsBlock*)calloc(1, sizeof(MetricsBlock));
+    if (block == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&blocksMutex);
+    block->next = blocks;
+    __atomic_store_n(&blocks, block, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&blocksMutex);
+    localBlock = block;
+    return block;
+}
+
+/**
+ * 呼び出したスレッドのカウンタに値を加算。
+ * @param counter カウンタの種類。
+ * @param value 加算する値。
+ */
+void
+addMetric(MetricCounter counter, unsigned long long value)
+{
+    MetricsBlock *block = localBlock;
+    unsigned long long *target;
+
+    if (block == NULL && (block = registerBlock()) == NULL) {
+        return;
+    }
+    /* 書き込むのはこのスレッドのみなので、読み出しと書き込みを分けてよい */
+    target = &block->values[counter];
+    __atomic_store_n(target, __atomic_load_n(target, __ATOMIC_RELAXED) + value,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * 全スレッドのカウンタの合計値の取得。
+ * @param counter カウンタの種類。
+ * @return 合計値。
+ */
+unsigned long long
+getMetric(MetricCounter counter)
+{
+    unsigned long long sum = 0;
+    MetricsBlock *block;
+
+    for (block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block != NULL;
+         block = block->next) {
+        sum += __atomic_load_n(&block->values[counter], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+/**
+ * ゲージの値を設定。
+ * @param gauge ゲージの種類。
+ * @param value 設定する値。
+ */
+void
+setMetricGauge(MetricGauge gauge, long long value)
+{
+    __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+/**
+ * 全てのカウンタとゲージをPrometheusのテキスト形式で書き出し。
+ * @param buf 書き出し先。
+ * @param size 書き出し先のバイト数。
+ * @return 書き出したバイト数。
+ */
+int
+formatMetrics(char *buf, int size)
+{
+    int length = 0;
+    int i;
+
+    for (i = 0; i < METRIC_COUNTER_NUM && length < size; ++i) {
+        length += snprintf(buf + length, size - length,
+                           "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                           COUNTERS[i].name, COUNTERS[i].help, COUNTERS[i].name,
+                           COUNTERS[i].name, getMetric((MetricCounter)i));
+    }
+    for (i = 0; i < METRIC_GAUGE_NUM && length < size; ++i) {
+        length += snprintf(buf + length, size - length,
+                           "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n",
+                           GAUGES[i].name, GAUGES[i].help, GAUGES[i].name,
+                           GAUGES[i].name,
+                           __atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+    }
+    return length < size ? length : size - 1;
+}
+
+/**
+ * メトリクス公開用のソケットを作成。
+ * @param port 待ち受けポート番号。
+ * @return 作成したソケット、失敗した場合は-1。
+ */
+int
+openMetricsSocket(int port)
+{
+    const int ONE = 1;
+    struct sockaddr_in addr;
+    int metricsSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (metricsSocket == -1) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    setsockopt(metricsSocket, SOL_SOCKET, SO_REUSEADDR, &ONE, sizeof(int));
+    if (bind(metricsSocket, (struct sockaddr*)&addr, sizeof(addr)) ||
+        listen(metricsSocket, 8)) {
+        close(metricsSocket);
+        return -1;
+    }
+    return metricsSocket;
+}
+
+/**
+ * メトリクス公開用のソケットへの接続を受理し、HTTPで応答。
+ * 要求の内容に関わらず、常にメトリクスを返して接続を閉じる。
+ * @param socket メトリクス公開用のソケット。
+ */
+void
+serveMetrics(int socket)
+{
+    char request[1024];
+    char body[8192];
+    char header[256];
+    int bodyLength;
+    int headerLength;
+    /* 応答の遅いクライアントでメインループが止まらないよう待ち時間を制限 */
+    struct timeval timeout = {0, 100000};
+    int client = accept(socket, NULL, NULL);
+
+    if (client == -1) {
+        return;
+    }
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (read(client, request, sizeof(request)) > 0) {
+        bodyLength = formatMetrics(body, sizeof(body));
+        headerLength = snprintf(header, sizeof(header),
+                                "HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %d\r\n"
+                                "Connection: close\r\n\r\n", bodyLength);
+        if (write(client, header, headerLength) == headerLength) {
+            write(client, body, bodyLength);
+        }
+    }
+    close(client);
+}
@@ -0,0 +1,84 @@
+/**
+ * @file Metrics.h
+ * 稼働状況を表すカウンタの定義と、その操作関数および
+ * Prometheus形式での公開を行う関数の宣言を記述したファイル。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef METRICS_H
+#define METRICS_H /**< インクルードガード用定数 */
+
+/** 単調増加するカウンタの種類 */
+typedef enum {
+    METRIC_LIBERTY_RECORDS,           /**< 正常に解析したレコード数 */
+    METRIC_LIBERTY_VALIDATE_FAILURES, /**< レコードの検証に失敗して同期を失った回数 */
+    METRIC_LIBERTY_RESYNC_BYTES,      /**< 再同期のために破棄したバイト数 */
+    METRIC_LIBERTY_USB_BYTES,         /**< USBから受信したバイト数 */
+    METRIC_LIBERTY_USB_ERRORS,        /**< USB送受信のエラー回数（タイムアウトを除く） */
+    METRIC_LIBERTY_USB_TIMEOUTS,      /**< USB受信のタイムアウト回数 */
+    METRIC_SERVER_EVENTS,             /**< クライアントへ送信したイベント数 */
+    METRIC_SERVER_BYTES,              /**< クライアントへ送信したバイト数 */
+    METRIC_SERVER_WRITE_STALLS,       /**< 1回の書き込みで送り切れなかった回数 */
+    METRIC_SERVER_DISCONNECTS,        /**< 書き込みに失敗して切断したクライアント数 */
+    METRIC_SERVER_FANOUT_DROPS,       /**< 配信スレッドが遅れて読み飛ばしたイベント数 */
+    METRIC_SERVER_QUEUE_DROPS,        /**< 送信待ちキューが溢れて破棄したイベント数 */
+    METRIC_SERVER_POOL_MISSES,        /**< メモリプールが枯渇してヒープから割り当てた回数 */
+    METRIC_SERVER_SEND_SYSCALLS,      /**< 送信のために呼び出したシステムコールの回数 */
+    METRIC_RELAY_EVENTS,              /**< 上流のサーバから受信したイベント数 */
+    METRIC_RELAY_CONNECTS,            /**< 上流のサーバへの接続を試みた回数 */
+    METRIC_COUNTER_NUM                /**< カウンタの種類の数 */
+} MetricCounter;
+
+/** 公開時に値を設定するゲージの種類 */
+typedef enum {
+    METRIC_GAUGE_CLIENTS,         /**< デバイスに関連付けられたクライアント数 */
+    METRIC_GAUGE_WAITING_CLIENTS, /**< デバイスの指定を待っているクライアント数 */
+    METRIC_GAUGE_BACKLOG_BYTES,   /**< クライアントのソケットに溜まっている未送信バイト数 */
+    METRIC_GAUGE_NUM              /**< ゲージの種類の数 */
+} MetricGauge;
+
+/**
+ * 呼び出したスレッドのカウンタに値を加算。
+ * カウンタはスレッドごとに独立しているため、加算はロックを必要としない。
+ * @param counter カウンタの種類。
+ * @param value 加算する値。
+ */
+void addMetric(MetricCounter counter, unsigned long long value);
+
+/**
+ * 全スレッドのカウンタの合計値の取得。
+ * @param counter カウンタの種類。
+ * @return 合計値。
+ */
+unsigned long long getMetric(MetricCounter counter);
+
+/**
+ * ゲージの値を設定。
+ * @param gauge ゲージの種類。
+ * @param value 設定する値。
+ */
+void setMetricGauge(MetricGauge gauge, long long value);
+
+/**
+ * 全てのカウンタとゲージをPrometheusのテキスト形式で書き出し。
+ * @param buf 書き出し先。
+ * @param size 書き出し先のバイト数。
+ * @return 書き出したバイト数。
+ */
+int formatMetrics(char *buf, int size);
+
+/**
+ * メトリクス公開用のソケットを作成。
+ * ローカルホストからの接続のみを受け付ける。
+ * @param port 待ち受けポート番号。
+ * @return 作成したソケット、失敗した場合は-1。
+ */
+int openMetricsSocket(int port);
+
+/**
+ * メトリクス公開用のソケットへの接続を受理し、HTTPで応答。
+ * @param socket メトリクス公開用のソケット。
+ */
+void serveMetrics(int socket);
+
+#endif
@@ -0,0 +1,176 @@
+/**
+ * @file Rcu.c
+ * Rcu.hで宣言された関数の定義を記述したファイル。
+ *
+ * 読み手は世代の偶奇ごとのカウンタを増減するだけで、ロックは取らない。
+ * 書き手は世代を進めて古い側のカウンタが0になるのを待つ。
+ * 世代を読んでからカウンタを増やすまでの間に世代が進んだ読み手を
+ * 取りこぼさないよう、世代の切り替えと待機を2回繰り返す。
+ *
+ * 登録された解放処理も同じ理由で、登録後に始まった世代の切り替えを2回経てから
+ * 実行する。pollRcu()は1回の呼び出しで古い世代の読み手が居なくなったかを
+ * 確かめるだけで、居なくなっていれば解放処理を1段階進めて次の世代に切り替える。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <sched.h>
+#include "Rcu.h"
+
+/**
+ * 猶予期間管理構造体を初期化。
+ * @param rcu 初期化する構造体。
+ */
+void
+initializeRcu(Rcu *rcu)
+{
+    int i;
+
+    rcu->epoch = 0;
+    rcu->readers[0] = 0;
+    rcu->readers[1] = 0;
+    for (i = 0; i < RCU_STAGES; ++i) {
+        rcu->callbacks[i] = NULL;
+    }
+    rcu->waiting = -1;
+    rcu->pending = 0;
+    pthread_mutex_init(&rcu->mutex, NULL);
+}
+
+/**
+ * 猶予期間管理構造体のリソースを解放。登録済みの解放処理は全て実行する。
+ * @param rcu リソースを解放する構造体。
+ */
+void
+finalizeRcu(Rcu *rcu)
+{
+    barrierRcu(rcu);
+    pthread_mutex_destroy(&rcu->mutex);
+}
+
+/**
+ * 読み取り区間の開始。
+ * @param rcu 猶予期間管理構造体。
+ * @return leaveRcu()に渡す値。
+ */
+int
+enterRcu(Rcu *rcu)
+{
+    int token = __atomic_load_n(&rcu->epoch, __ATOMIC_ACQUIRE) & 1;
+    /* 以降の公開データの読み出しがこの加算より前に行われないよう順序を保証 */
+    __atomic_fetch_add(&rcu->readers[token], 1, __ATOMIC_SEQ_CST);
+    return token;
+}
+
+/**
+ * 読み取り区間の終了。
+ * @param rcu 猶予期間管理構造体。
+ * @param token enterRcu()が返した値。
+ */
+void
+leaveRcu(Rcu *rcu, int token)
+{
+    __atomic_fetch_sub(&rcu->readers[token], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * 世代を進め、古い世代の読み手が居なくなるまで待機。
+ * @param rcu 猶予期間管理構造体。
+ */
+static void
+flipAndWait(Rcu *rcu)
+{
+    int old = __atomic_fetch_add(&rcu->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&rcu->readers[old], __ATOMIC_SEQ_CST) != 0) {
+        sched_yield();
+    }
+}
+
+/**
+ * この呼び出しより前に開始された読み取り区間が全て終了するまで待機。
+ * @param rcu 猶予期間管理構造体。
+ */
+void
+synchronizeRcu(Rcu *rcu)
+{
+    pthread_mutex_lock(&rcu->mutex);
+    flipAndWait(rcu);
+    flipAndWait(rcu);
+    pthread_mutex_unlock(&rcu->mutex);
+}
+
+/**
+ * 猶予期間後に実行する解放処理を登録。
+ * @param rcu 猶予期間管理構造体。
+ * @param head 解放するデータに埋め込んだ登録情報。
+ * @param func 解放処理。
+ */
+void
+deferRcu(Rcu *rcu, RcuHead *head, void (*func)(RcuHead *head))
+{
+    head->func = func;
+    pthread_mutex_lock(&rcu->mutex);
+    head->next = rcu->callbacks[0];
+    rcu->callbacks[0] = head;
+    __atomic_add_fetch(&rcu->pending, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&rcu->mutex);
+}
+
+/**
+ * 猶予期間を進め、実行できるようになった解放処理を実行。
+ * @param rcu 猶予期間管理構造体。
+ */
+void
+pollRcu(Rcu *rcu)
+{
+    RcuHead *done;
+    unsigned int count = 0;
+
+    if (__atomic_load_n(&rcu->pending, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+    /* 他のスレッドが進めている最中なら任せる */
+    if (pthread_mutex_trylock(&rcu->mutex)) {
+        return;
+    }
+    /* 前回切り替えた世代の読み手が残っていれば、次の呼び出しで確かめ直す */
+    if (rcu->waiting >= 0 &&
+        __atomic_load_n(&rcu->readers[rcu->waiting], __ATOMIC_SEQ_CST) != 0) {
+        pthread_mutex_unlock(&rcu->mutex);
+        return;
+    }
+    /* 切り替えを2回経た解放処理を取り出し、残りを1段階進める */
+    done = rcu->callbacks[2];
+    rcu->callbacks[2] = rcu->callbacks[1];
+    rcu->callbacks[1] = rcu->callbacks[0];
+    rcu->callbacks[0] = NULL;
+    if (rcu->callbacks[1] != NULL || rcu->callbacks[2] != NULL) {
+        rcu->waiting = __atomic_fetch_add(&rcu->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    } else {
+        rcu->waiting = -1;
+    }
+    pthread_mutex_unlock(&rcu->mutex);
+
+    /* 解放処理が再び登録を行ってもよいよう、ロックを外してから実行 */
+    while (done != NULL) {
+        RcuHead *next = done->next;
+        (*done->func)(done);
+        done = next;
+        ++count;
+    }
+    if (count > 0) {
+        __atomic_sub_fetch(&rcu->pending, count, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * 登録済みの解放処理が全て実行されるまで待機。
+ * @param rcu 猶予期間管理構造体。
+ */
+void
+barrierRcu(Rcu *rcu)
+{
+    while (__atomic_load_n(&rcu->pending, __ATOMIC_ACQUIRE) != 0) {
+        synchronizeRcu(rcu);
+        pollRcu(rcu);
+    }
+}
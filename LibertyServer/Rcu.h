@@ -0,0 +1,96 @@
+/**
+ * @file Rcu.h
+ * 読み手がロックを取らずに共有データを参照するための、
+ * RCU（Read-Copy-Update）の猶予期間管理構造体の定義と、
+ * その操作関数の宣言を記述したファイル。
+ *
+ * 読み手はenterRcu()とleaveRcu()の間でのみ公開中のデータを参照する。
+ * 書き手は新しいデータを公開した後、古いデータの解放処理をdeferRcu()で登録する。
+ * 登録した処理は、古いデータを参照している読み手が居なくなった後の
+ * pollRcu()の呼び出しで実行される。pollRcu()は待機しないので、
+ * 配信スレッドのような優先度の高いスレッドから呼び出してもよい。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef RCU_H
+#define RCU_H /**< インクルードガード用定数 */
+
+#include <pthread.h>
+
+#define RCU_STAGES 3 /**< 解放処理が実行されるまでに経る段階の数 */
+
+/** 猶予期間後に実行する解放処理。解放するデータに埋め込んで使う */
+typedef struct RcuHead {
+    struct RcuHead *next;              /**< 同じ段階の次の解放処理 */
+    void (*func)(struct RcuHead *head); /**< 解放処理 */
+} RcuHead;
+
+/** 猶予期間管理構造体 */
+typedef struct {
+    unsigned int epoch;      /**< 現在の世代（下位1ビットで読み手の数える先を決める） */
+    unsigned int readers[2]; /**< 世代ごとの読み手の数 */
+    RcuHead *callbacks[RCU_STAGES]; /**< 段階ごとの解放処理（登録直後、1回目、2回目の世代の切り替え後） */
+    int waiting;             /**< 読み手が居なくなるのを待っている世代の偶奇（待っていなければ-1） */
+    unsigned int pending;    /**< 登録済みで未実行の解放処理の数 */
+    pthread_mutex_t mutex;   /**< 書き手同士の排他用ミューテックス */
+} Rcu;
+
+/**
+ * 猶予期間管理構造体を初期化。
+ * @param rcu 初期化する構造体。
+ */
+void initializeRcu(Rcu *rcu);
+
+/**
+ * 猶予期間管理構造体のリソースを解放。
+ * @param rcu リソースを解放する構造体。
+ */
+void finalizeRcu(Rcu *rcu);
+
+/**
+ * 読み取り区間の開始。
+ * @param rcu 猶予期間管理構造体。
+ * @return leaveRcu()に渡す値。
+ */
+int enterRcu(Rcu *rcu);
+
+/**
+ * 読み取り区間の終了。
+ * @param rcu 猶予期間管理構造体。
+ * @param token enterRcu()が返した値。
+ */
+void leaveRcu(Rcu *rcu, int token);
+
+/**
+ * この呼び出しより前に開始された読み取り区間が全て終了するまで待機。
+ * 読み取り区間の中から呼び出してはならない。
+ * 待機中は他のスレッドに実行を譲りながら繰り返し確認するので、
+ * 終了処理など待ってもよい場面でのみ使用すること。
+ * @param rcu 猶予期間管理構造体。
+ */
+void synchronizeRcu(Rcu *rcu);
+
+/**
+ * 猶予期間後に実行する解放処理を登録。待機はしない。
+ * @param rcu 猶予期間管理構造体。
+ * @param head 解放するデータに埋め込んだ登録情報。
+ * @param func 解放処理。この呼び出しより前に開始された読み取り区間が
+ *             全て終了した後、pollRcu()かbarrierRcu()の中から呼び出される。
+ */
+void deferRcu(Rcu *rcu, RcuHead *head, void (*func)(RcuHead *head));
+
+/**
+ * 猶予期間を進め、実行できるようになった解放処理を実行。
+ * 読み手が残っていれば何もせずに戻り、次の呼び出しで続きを行う。
+ * 読み取り区間の中から呼び出してはならない。
+ * @param rcu 猶予期間管理構造体。
+ */
+void pollRcu(Rcu *rcu);
+
+/**
+ * 登録済みの解放処理が全て実行されるまで待機。終了処理で使用する。
+ * @param rcu 猶予期間管理構造体。
+ */
+void barrierRcu(Rcu *rcu);
+
+#endif
@@ -0,0 +1,347 @@
+/**
+ * @file Realtime.c
+ * Realtime.hで宣言された関数の定義を記述したファイル。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "Realtime.h"
+#include "Latency.h"
+
+#define DEFAULT_PRIORITY 80 /**< 取得スレッドの既定のSCHED_FIFO優先度 */
+#define STACK_PREFAULT_SIZE (256 * 1024) /**< 開始時に書き込むスタックのバイト数 */
+#define PROBE_INTERVAL 1000000L /**< 計測スレッドの起床間隔（ナノ秒） */
+
+/** 使用中の設定 */
+static RealtimeConfig currentConfig;
+/** 計測スレッド */
+static pthread_t probeThread;
+/** 計測スレッドを開始したかどうか */
+static int probeRunning;
+/** 計測スレッドの終了フラグ */
+static volatile int probeEnd;
+/** SCHED_FIFOを設定できなかったことを表示済みかどうか */
+static int schedulingWarned;
+
+/**
+ * リアルタイムモードの設定を既定値（使用しない）で初期化。
+ * @param config 初期化する設定。
+ */
+void
+initializeRealtimeConfig(RealtimeConfig *config)
+{
+    memset(config, 0, sizeof(RealtimeConfig));
+    config->priority = DEFAULT_PRIORITY;
+}
+
+/**
+ * ':'で区切られたCPU番号の並びを解析。
+ * @param config 解析結果の格納先。
+ * @param role 対象の役割。
+ * @param value CPU番号の並び。
+ * @return 正常に解析できた場合は0、できなかった場合は0以外。
+ */
+static int
+parseCpuList(RealtimeConfig *config, RealtimeRole role, const char *value)
+{
+    long cpusNum = sysconf(_SC_NPROCESSORS_CONF);
+
+    config->cpusNum[role] = 0;
+    while (value != NULL && *value != '\0') {
+        char *end;
+        long cpu = strtol(value, &end, 10);
+        if (end == value || cpu < 0 || (cpusNum > 0 && cpu >= cpusNum) ||
+            config->cpusNum[role] >= REALTIME_CPUS_MAX) {
+            return -1;
+        }
+        config->cpus[role][config->cpusNum[role]++] = (int)cpu;
+        if (*end == ':') {
+            ++end;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        value = end;
+    }
+    return config->cpusNum[role] > 0 ? 0 : -1;
+}
+
+/**
+ * リアルタイムモードの設定を解析し、リアルタイムモードを有効にする。
+ * @param config 解析結果の格納先。
+ * @param spec 設定の指定。解析中に書き換えられる。
+ * @return 正常に解析できた場合は0、できなかった場合は0以外。
+ */
+int
+parseRealtimeConfig(RealtimeConfig *config, char *spec)
+{
+    enum { PRIORITY, ACQUISITION, NETWORK, PROBE };
+    char *const tokens[] = { "priority", "acq", "net", "probe", NULL };
+    char *value;
+    int minimum = sched_get_priority_min(SCHED_FIFO);
+    int maximum = sched_get_priority_max(SCHED_FIFO);
+
+    config->enabled = 1;
+    while (*spec != '\0') {
+        switch (getsubopt(&spec, tokens, &value)) {
+        case PRIORITY:
+            if (value == NULL) {
+                return -1;
+            }
+            config->priority = atoi(value);
+            /* 配信スレッドは1つ下の優先度で実行する */
+            if (config->priority <= minimum || config->priority > maximum) {
+                return -1;
+            }
+            break;
+        case ACQUISITION:
+            if (parseCpuList(config, REALTIME_ACQUISITION, value)) {
+                return -1;
+            }
+            break;
+        case NETWORK:
+            if (parseCpuList(config, REALTIME_NETWORK, value)) {
+                return -1;
+            }
+            break;
+        case PROBE:
+            config->probe = 1;
+            if (value != NULL && parseCpuList(config, REALTIME_PROBE, value)) {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 役割に対応するSCHED_FIFO優先度の取得。
+ * @param role スレッドの役割。
+ * @return 優先度。
+ */
+static int
+getPriority(RealtimeRole role)
+{
+    return role == REALTIME_ACQUISITION ? currentConfig.priority : currentConfig.priority - 1;
+}
+
+/**
+ * スタックに書き込み、ページフォールトを先に済ませる。
+ */
+static void
+prefaultStack(void)
+{
+    volatile unsigned char stack[STACK_PREFAULT_SIZE];
+    size_t i;
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    for (i = 0; i < sizeof(stack); i += pageSize > 0 ? (size_t)pageSize : 4096) {
+        stack[i] = 0;
+    }
+}
+
+/**
+ * 呼び出したスレッドをリアルタイムに実行するよう設定。
+ * @param role スレッドの役割。
+ * @param cpu 固定するCPU番号（負数なら固定しない）。
+ */
+void
+enterRealtimeThread(RealtimeRole role, int cpu)
+{
+    struct sched_param param;
+    int result;
+
+    if (!currentConfig.enabled) {
+        return;
+    }
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+            printf("### realtime: cannot pin thread to cpu %d\n", cpu);
+        }
+    }
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = getPriority(role);
+    result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (result && !__atomic_exchange_n(&schedulingWarned, 1, __ATOMIC_RELAXED)) {
+        printf("### realtime: SCHED_FIFO not permitted (%s), using normal scheduling\n",
+               strerror(result));
+    }
+    prefaultStack();
+}
+
+/**
+ * 実行可能なCPUのうち取得スレッドに割り当てていないCPUの中から、
+ * 番号順に指定した番目のCPUを選ぶ。足りなければ先頭から順に使い回す。
+ * @param index 選ぶCPUの番目。
+ * @return CPU番号。選べるCPUが無ければ-1。
+ */
+static int
+getSpareCpu(int index)
+{
+    cpu_set_t allowed;
+    int count;
+    int cpu;
+    int i;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        return -1;
+    }
+    for (i = 0; i < currentConfig.cpusNum[REALTIME_ACQUISITION]; ++i) {
+        CPU_CLR(currentConfig.cpus[REALTIME_ACQUISITION][i], &allowed);
+    }
+    count = CPU_COUNT(&allowed);
+    if (count == 0) {
+        return -1;
+    }
+    index %= count;
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/**
+ * 役割に割り当てられたCPU番号の取得。
+ * 配信スレッドと計測スレッドは、指定が無ければ取得スレッドに割り当てていない
+ * CPUから選ぶ。取得スレッドのCPUも指定されていなければ固定しない。
+ * @param role スレッドの役割。
+ * @param index 同じ役割のスレッドの中での番号。
+ * @return CPU番号。リアルタイムモードでないか、固定しない場合は-1。
+ */
+int
+getRealtimeCpu(RealtimeRole role, int index)
+{
+    if (!currentConfig.enabled) {
+        return -1;
+    }
+    if (currentConfig.cpusNum[role] > 0) {
+        return currentConfig.cpus[role][index % currentConfig.cpusNum[role]];
+    }
+    if (role == REALTIME_ACQUISITION ||
+        currentConfig.cpusNum[REALTIME_ACQUISITION] == 0) {
+        return -1;
+    }
+    return getSpareCpu(index);
+}
+
+/**
+ * リアルタイムモードが有効かどうかの取得。
+ * @return 有効ならば0以外。
+ */
+int
+isRealtimeEnabled(void)
+{
+    return currentConfig.enabled;
+}
+
+/**
+ * プロセスのメモリを固定。
+ * 上限が設定されている場合に以後の割り当てが失敗しないよう、
+ * 固定できる量に制限が無い場合だけ固定する。
+ */
+static void
+lockMemory(void)
+{
+    struct rlimit limit;
+
+    if (geteuid() != 0 &&
+        (getrlimit(RLIMIT_MEMLOCK, &limit) || limit.rlim_cur != RLIM_INFINITY)) {
+        printf("### realtime: RLIMIT_MEMLOCK is limited, memory is not locked\n");
+        return;
+    }
+    if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+        printf("### realtime: mlockall failed (%s), memory is not locked\n",
+               strerror(errno));
+    }
+}
+
+/**
+ * 計測スレッドのメインループ。
+ * 一定間隔の絶対時刻で起床し、予定からの遅れを記録する。
+ * 取得スレッドを妨げないよう、配信スレッドと同じ優先度で取得スレッド以外のCPUで実行する。
+ * そのため記録されるのは計測スレッドのCPUでの起床の遅れで、取得スレッドが受ける
+ * 遅れではない。USB受信を待つ取得スレッドの遅れはusb_readの区間に含まれる。
+ * @param arg 使用しない。
+ * @return 使用しない。
+ */
+static void *
+runProbe(void *arg)
+{
+    struct timespec next;
+
+    (void)arg;
+    enterRealtimeThread(REALTIME_PROBE, getRealtimeCpu(REALTIME_PROBE, 0));
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!probeEnd) {
+        LatencyTime expected;
+        next.tv_nsec += PROBE_INTERVAL;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            ++next.tv_sec;
+        }
+        if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL)) {
+            continue;
+        }
+        expected = next.tv_sec * 1000000000LL + next.tv_nsec;
+        LATENCY_RECORD_VALUE(LATENCY_STAGE_PROBE_WAKEUP, LATENCY_NOW() - expected);
+    }
+    return NULL;
+}
+
+/**
+ * リアルタイムモードを開始。
+ * @param config リアルタイムモードの設定。
+ */
+void
+initializeRealtime(const RealtimeConfig *config)
+{
+    sigset_t signalSet;
+    sigset_t oldSignalSet;
+
+    currentConfig = *config;
+    if (!currentConfig.enabled) {
+        return;
+    }
+    lockMemory();
+    if (!currentConfig.probe) {
+        return;
+    }
+
+    /* 計測スレッドではシグナルを受け取らない */
+    sigfillset(&signalSet);
+    pthread_sigmask(SIG_BLOCK, &signalSet, &oldSignalSet);
+    probeEnd = 0;
+    probeRunning = pthread_create(&probeThread, NULL, runProbe, NULL) == 0;
+    pthread_sigmask(SIG_SETMASK, &oldSignalSet, NULL);
+}
+
+/**
+ * リアルタイムモードを終了し、計測スレッドを停止。
+ */
+void
+finalizeRealtime(void)
+{
+    if (probeRunning) {
+        probeEnd = 1;
+        pthread_join(probeThread, NULL);
+        probeRunning = 0;
+    }
+}
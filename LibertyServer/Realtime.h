@@ -0,0 +1,91 @@
+/**
+ * @file Realtime.h
+ * 取得スレッドと配信スレッドをリアルタイムに実行するための設定と、
+ * その操作関数の宣言を記述したファイル。
+ *
+ * リアルタイムモードでは、各スレッドを指定したCPUに固定してSCHED_FIFOで実行し、
+ * プロセスのメモリをmlockallで固定する。スタックは開始時に書き込んで
+ * ページフォールトを先に済ませる。指定した場合は、配信スレッドと同じ優先度で
+ * 取得スレッド以外のCPUで周期的に起床する計測スレッドの起床の遅れを測り、
+ * 遅延の分布のprobe_wakeupに表示する。計測スレッドが取得スレッドを妨げることはなく、
+ * この値は計測スレッドのCPUの遅れで、取得スレッド自身の遅れではない。
+ * 権限が足りない場合は警告を表示し、通常のスケジューリングのまま動作を続ける。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef REALTIME_H
+#define REALTIME_H /**< インクルードガード用定数 */
+
+#define REALTIME_CPUS_MAX 16 /**< 役割ごとに指定できるCPUの最大数 */
+
+/** スレッドの役割 */
+typedef enum {
+    REALTIME_ACQUISITION, /**< Libertyまたは中継からの取得スレッド */
+    REALTIME_NETWORK,     /**< クライアントへの配信スレッド */
+    REALTIME_PROBE,       /**< 起床の遅れの計測スレッド */
+    REALTIME_ROLE_NUM     /**< 役割の数 */
+} RealtimeRole;
+
+/** リアルタイムモードの設定 */
+typedef struct {
+    int enabled;                              /**< リアルタイムモードを使用するかどうか */
+    int priority;                             /**< 取得スレッドのSCHED_FIFO優先度 */
+    int cpus[REALTIME_ROLE_NUM][REALTIME_CPUS_MAX]; /**< 役割ごとに固定するCPU番号 */
+    int cpusNum[REALTIME_ROLE_NUM];           /**< 役割ごとに指定されたCPUの数 */
+    int probe;                                /**< 計測スレッドを実行するかどうか */
+} RealtimeConfig;
+
+/**
+ * リアルタイムモードの設定を既定値（使用しない）で初期化。
+ * @param config 初期化する設定。
+ */
+void initializeRealtimeConfig(RealtimeConfig *config);
+
+/**
+ * リアルタイムモードの設定を解析し、リアルタイムモードを有効にする。
+ * 指定は "priority=N,acq=CPU[:CPU...],net=CPU[:CPU...],probe[=CPU]" の形式で、
+ * 全て省略できる。
+ * @param config 解析結果の格納先。
+ * @param spec 設定の指定。解析中に書き換えられる。
+ * @return 正常に解析できた場合は0、できなかった場合は0以外。
+ */
+int parseRealtimeConfig(RealtimeConfig *config, char *spec);
+
+/**
+ * リアルタイムモードを開始。メモリを固定し、指定されていれば計測スレッドを開始する。
+ * 設定が無効なら何もしない。他のスレッドを開始する前に呼び出すこと。
+ * @param config リアルタイムモードの設定。
+ */
+void initializeRealtime(const RealtimeConfig *config);
+
+/**
+ * リアルタイムモードを終了し、計測スレッドを停止。
+ */
+void finalizeRealtime(void);
+
+/**
+ * 役割に割り当てられたCPU番号の取得。
+ * 指定されたCPUが足りなければ先頭から順に使い回す。
+ * 配信スレッドと計測スレッドは、指定が無ければ取得スレッドに割り当てていない
+ * CPUから選ぶ。取得スレッドのCPUも指定されていなければ固定しない。
+ * @param role スレッドの役割。
+ * @param index 同じ役割のスレッドの中での番号。
+ * @return CPU番号。リアルタイムモードでないか、固定しない場合は-1。
+ */
+int getRealtimeCpu(RealtimeRole role, int index);
+
+/**
+ * リアルタイムモードが有効かどうかの取得。
+ * @return 有効ならば0以外。
+ */
+int isRealtimeEnabled(void);
+
+/**
+ * 呼び出したスレッドをリアルタイムに実行するよう設定。
+ * スレッドの開始直後に呼び出す。リアルタイムモードでなければ何もしない。
+ * @param role スレッドの役割。
+ * @param cpu 固定するCPU番号（負数なら固定しない）。
+ */
+void enterRealtimeThread(RealtimeRole role, int cpu);
+
+#endif
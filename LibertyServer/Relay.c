@@ -0,0 +1,441 @@
+/**
+ * @file Relay.c
+ * Relay.hで宣言された関数の定義を記述したファイル。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "Relay.h"
+#include "Latency.h"
+#include "Metrics.h"
+#include "Realtime.h"
+
+#define RETRY_INTERVAL 1000000LL /**< 再接続を試みる間隔（マイクロ秒） */
+#define RETRY_BACKOFF_MAX 6 /**< 拒否された接続の再接続間隔を倍にする最大回数 */
+#define POLL_TIMEOUT 100 /**< 1回の待機時間（ミリ秒） */
+#define BUTTON_EVENT_SIZE 10 /**< プレス・リリースイベントのバイト数 */
+#define MOTION_EVENT_SIZE 33 /**< ムーブ・スウェイイベントのバイト数 */
+
+/**
+ * 単調増加する時刻の取得（マイクロ秒）。
+ * @return マイクロ秒単位の時刻。
+ */
+static long long
+getMonotonicMicros(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL;
+}
+
+/**
+ * ビッグエンディアンの64ビット整数の読み出し。
+ * @param data 読み出し元。
+ * @return 読み出した値。
+ */
+static unsigned long long
+getUint64(const unsigned char *data)
+{
+    unsigned long long value = 0;
+    int i;
+
+    for (i = 0; i < 8; ++i) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+/**
+ * ビッグエンディアンの倍精度浮動小数点数の読み出し。
+ * @param data 読み出し元。
+ * @return 読み出した値。
+ */
+static double
+getDouble(const unsigned char *data)
+{
+    unsigned long long bits = getUint64(data);
+    double value;
+
+    memcpy(&value, &bits, sizeof(double));
+    return value;
+}
+
+/**
+ * 上流のサーバの指定を解析。
+ * @param config 解析結果の格納先。
+ * @param spec 上流のサーバの指定。解析中に書き換えられる。
+ * @return 正常に解析できた場合は0、できなかった場合は0以外。
+ */
+int
+parseRelayConfig(RelayConfig *config, char *spec)
+{
+    enum { DEVICES };
+    char *const tokens[] = { "devices", NULL };
+    char *options = strchr(spec, ',');
+    char *port;
+    char *value;
+
+    config->devicesNum = RELAY_DEVICES_DEFAULT;
+    if (options != NULL) {
+        *options++ = '\0';
+    }
+    port = strrchr(spec, ':');
+    if (port == NULL || port == spec || strlen(spec) >= RELAY_HOST_LENGTH) {
+        return -1;
+    }
+    *port++ = '\0';
+    strcpy(config->host, spec);
+    config->port = atoi(port);
+    if (config->port <= 0) {
+        return -1;
+    }
+
+    while (options != NULL && *options != '\0') {
+        switch (getsubopt(&options, tokens, &value)) {
+        case DEVICES:
+            if (value == NULL) {
+                return -1;
+            }
+            config->devicesNum = atoi(value);
+            break;
+        default:
+            return -1;
+        }
+    }
+    return config->devicesNum > 0 && config->devicesNum <= RELAY_DEVICES_MAX ? 0 : -1;
+}
+
+/**
+ * 中継を初期化。
+ * @param relay 初期化する中継。
+ * @param config 中継の設定。
+ * @param server 配信先のサーバ。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int
+initializeRelay(Relay *relay, const RelayConfig *config, Server *server)
+{
+    int i;
+
+    relay->config = *config;
+    relay->server = server;
+    relay->loopEnd = 0;
+    relay->running = 0;
+    relay->connections = (RelayConnection*)malloc(sizeof(RelayConnection) * config->devicesNum);
+    relay->pollFds = (struct pollfd*)malloc(sizeof(struct pollfd) * config->devicesNum);
+    relay->pollDevices = (int*)malloc(sizeof(int) * config->devicesNum);
+    if (relay->connections == NULL || relay->pollFds == NULL || relay->pollDevices == NULL) {
+        free(relay->connections);
+        free(relay->pollFds);
+        free(relay->pollDevices);
+        return -1;
+    }
+    for (i = 0; i < config->devicesNum; ++i) {
+        relay->connections[i].socket = -1;
+        relay->connections[i].connecting = 0;
+        relay->connections[i].size = 0;
+        relay->connections[i].retryTime = 0;
+        relay->connections[i].received = 0;
+        relay->connections[i].rejections = 0;
+    }
+    return 0;
+}
+
+/**
+ * 上流のサーバとの接続を閉じ、一定時間後に再接続する。
+ * 接続してからイベントを受信せずに切断された場合は、上流にそのデバイスが
+ * 無いとみなし、1度だけ表示して再接続の間隔を倍にしていく。
+ * @param relay 対象の中継。
+ * @param device デバイス番号。
+ */
+static void
+closeConnection(Relay *relay, int device)
+{
+    RelayConnection *connection = &relay->connections[device];
+    long long interval = RETRY_INTERVAL;
+
+    if (connection->socket != -1) {
+        if (!connection->connecting && !connection->received) {
+            if (connection->rejections == 0) {
+                printf("### relay: upstream closed device %d without events, "
+                       "retrying less often\n", device);
+            }
+            if (connection->rejections < RETRY_BACKOFF_MAX) {
+                ++connection->rejections;
+            }
+            interval <<= connection->rejections;
+        }
+        close(connection->socket);
+        connection->socket = -1;
+    }
+    connection->connecting = 0;
+    connection->size = 0;
+    connection->received = 0;
+    connection->retryTime = getMonotonicMicros() + interval;
+}
+
+/**
+ * 上流のサーバへの接続を開始。接続の完了はpoll()で待つ。
+ * @param relay 対象の中継。
+ * @param device デバイス番号。
+ */
+static void
+openConnection(Relay *relay, int device)
+{
+    RelayConnection *connection = &relay->connections[device];
+    struct addrinfo hints;
+    struct addrinfo *addresses;
+    char port[16];
+    int result;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", relay->config.port);
+    if (getaddrinfo(relay->config.host, port, &hints, &addresses)) {
+        closeConnection(relay, device);
+        return;
+    }
+    connection->socket = socket(addresses->ai_family, addresses->ai_socktype,
+                                addresses->ai_protocol);
+    if (connection->socket == -1) {
+        freeaddrinfo(addresses);
+        closeConnection(relay, device);
+        return;
+    }
+    /* 接続待ちで他のデバイスの中継が止まらないようノンブロッキングで接続 */
+    fcntl(connection->socket, F_SETFL, fcntl(connection->socket, F_GETFL) | O_NONBLOCK);
+    result = connect(connection->socket, addresses->ai_addr, addresses->ai_addrlen);
+    freeaddrinfo(addresses);
+    if (result == -1 && errno != EINPROGRESS) {
+        closeConnection(relay, device);
+        return;
+    }
+    connection->connecting = 1;
+    addMetric(METRIC_RELAY_CONNECTS, 1);
+}
+
+/**
+ * 接続の完了を確認し、購読要求を送信。
+ * @param relay 対象の中継。
+ * @param device デバイス番号。
+ */
+static void
+finishConnection(Relay *relay, int device)
+{
+    RelayConnection *connection = &relay->connections[device];
+    /** ソケットオプション変更用変数 */
+    const int ONE = 1;
+    unsigned char request = (unsigned char)device;
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    getsockopt(connection->socket, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0 || write(connection->socket, &request, 1) != 1) {
+        closeConnection(relay, device);
+        return;
+    }
+    setsockopt(connection->socket, IPPROTO_TCP, TCP_NODELAY, &ONE, sizeof(int));
+    connection->connecting = 0;
+}
+
+/**
+ * 受信したイベントをサーバへ渡す。
+ * 上流の時刻（紀元からのミリ秒）は、サーバの時計の基準に合わせて変換する。
+ * 中継で加わる遅延は、上流とは時計が異なるため中継の時計だけで計測する。
+ * @param relay 対象の中継。
+ * @param device デバイス番号。
+ * @param event 受信したイベント。
+ * @param receivedTime 受信を完了した時刻。
+ */
+static void
+dispatchEvent(Relay *relay, int device, const unsigned char *event,
+              LatencyTime receivedTime)
+{
+    double values[3];
+    long long millis;
+    long long time;
+    int i;
+
+    if (event[0] <= 1) {
+        millis = (long long)getUint64(event + 2);
+    } else {
+        millis = (long long)getUint64(event + 25);
+        for (i = 0; i < 3; ++i) {
+            values[i] = getDouble(event + 1 + i * 8);
+        }
+    }
+    time = millis * 1000LL - relay->server->clockOffset;
+    addMetric(METRIC_RELAY_EVENTS, 1);
+
+    switch (event[0]) {
+    case 0:
+        sendDevicePressed(relay->server, device, event[1], time);
+        break;
+    case 1:
+        sendDeviceReleased(relay->server, device, event[1], time);
+        break;
+    case 2:
+        sendDeviceMoved(relay->server, device, values, time);
+        break;
+    default:
+        sendDeviceSwayed(relay->server, device, values, time);
+        break;
+    }
+    /* 受信から配信の受け渡しまでの遅延を記録 */
+    LATENCY_RECORD(LATENCY_STAGE_RELAY, receivedTime);
+}
+
+/**
+ * 上流のサーバから受信し、揃ったイベントをサーバへ渡す。
+ * @param relay 対象の中継。
+ * @param device デバイス番号。
+ */
+static void
+receiveEvents(Relay *relay, int device)
+{
+    RelayConnection *connection = &relay->connections[device];
+    size_t offset = 0;
+    ssize_t received = read(connection->socket, connection->buffer + connection->size,
+                            RELAY_BUFFER_LENGTH - connection->size);
+    LatencyTime receivedTime = LATENCY_NOW();
+
+    if (received <= 0) {
+        if (received == 0 || (errno != EAGAIN && errno != EINTR)) {
+            closeConnection(relay, device);
+        }
+        return;
+    }
+    connection->size += received;
+    connection->received = 1;
+    connection->rejections = 0;
+    /* 受信完了時刻を中継での遅延計測の起点とする */
+    LATENCY_SET_ORIGIN(receivedTime);
+
+    while (offset < connection->size) {
+        unsigned char header = connection->buffer[offset];
+        size_t size = header <= 1 ? BUTTON_EVENT_SIZE : MOTION_EVENT_SIZE;
+        if (header > 3) {
+            /* 知らないイベントが届いたら同期を失ったとみなして接続し直す */
+            closeConnection(relay, device);
+            return;
+        }
+        if (connection->size - offset < size) {
+            break;
+        }
+        dispatchEvent(relay, device, connection->buffer + offset, receivedTime);
+        offset += size;
+    }
+    connection->size -= offset;
+    memmove(connection->buffer, connection->buffer + offset, connection->size);
+}
+
+/**
+ * 中継のメインループ。
+ * @param arg 対象の中継。
+ * @return 使用しない。
+ */
+static void *
+runRelay(void *arg)
+{
+    Relay *relay = (Relay*)arg;
+    int i;
+
+    enterRealtimeThread(REALTIME_ACQUISITION, getRealtimeCpu(REALTIME_ACQUISITION, 0));
+    while (!relay->loopEnd) {
+        long long now = getMonotonicMicros();
+        int fdsNum = 0;
+
+        /* 切断されている接続を張り直し、監視対象を集める */
+        for (i = 0; i < relay->config.devicesNum; ++i) {
+            RelayConnection *connection = &relay->connections[i];
+            if (connection->socket == -1 && now >= connection->retryTime) {
+                openConnection(relay, i);
+            }
+            if (connection->socket != -1) {
+                relay->pollFds[fdsNum].fd = connection->socket;
+                relay->pollFds[fdsNum].events = connection->connecting ? POLLOUT : POLLIN;
+                relay->pollFds[fdsNum].revents = 0;
+                relay->pollDevices[fdsNum] = i;
+                ++fdsNum;
+            }
+        }
+
+        if (poll(relay->pollFds, fdsNum, POLL_TIMEOUT) <= 0) {
+            continue;
+        }
+        for (i = 0; i < fdsNum; ++i) {
+            int device = relay->pollDevices[i];
+            if (relay->pollFds[i].revents == 0) {
+                continue;
+            }
+            if (relay->connections[device].connecting) {
+                finishConnection(relay, device);
+            } else {
+                receiveEvents(relay, device);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * 中継のメインループを新しいスレッドで開始。
+ * @param relay 対象の中継。
+ * @return 開始できた場合は0、できなかった場合は0以外。
+ */
+int
+startRelay(Relay *relay)
+{
+    relay->loopEnd = 0;
+    if (pthread_create(&relay->thread, NULL, runRelay, relay)) {
+        return -1;
+    }
+    relay->running = 1;
+    return 0;
+}
+
+/**
+ * 中継のメインループを停止し、スレッドの終了を待つ。
+ * @param relay 対象の中継。
+ */
+void
+stopRelay(Relay *relay)
+{
+    relay->loopEnd = 1;
+    if (relay->running) {
+        pthread_join(relay->thread, NULL);
+        relay->running = 0;
+    }
+}
+
+/**
+ * 中継のリソースを解放。
+ * @param relay リソースを解放する中継。
+ */
+void
+finalizeRelay(Relay *relay)
+{
+    int i;
+
+    for (i = 0; i < relay->config.devicesNum; ++i) {
+        if (relay->connections[i].socket != -1) {
+            close(relay->connections[i].socket);
+        }
+    }
+    free(relay->connections);
+    free(relay->pollFds);
+    free(relay->pollDevices);
+}
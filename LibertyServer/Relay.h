@@ -0,0 +1,94 @@
+/**
+ * @file Relay.h
+ * 上流のサーバからイベントを受信し、自分のクライアントへ配信し直す
+ * 中継の定義と、その操作関数の宣言を記述したファイル。
+ *
+ * 中継はデバイスごとに上流のサーバへ接続し、通常のクライアントと同じ
+ * 購読要求を送る。受信したイベントは上流の時刻を保ったままサーバへ渡すので、
+ * 中継の先のクライアントからは上流に直接接続した場合と同じに見える。
+ * 切断された接続は一定時間ごとに再接続する。イベントを受信する前に切断された
+ * 場合は上流にそのデバイスが無いとみなし、再接続の間隔を延ばしていく。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#ifndef RELAY_H
+#define RELAY_H /**< インクルードガード用定数 */
+
+#include <stddef.h>
+#include <pthread.h>
+#include <poll.h>
+#include "Server.h"
+
+#define RELAY_HOST_LENGTH 256 /**< 上流のホスト名の最大長 */
+#define RELAY_BUFFER_LENGTH 256 /**< 1接続あたりの受信バッファの長さ */
+#define RELAY_DEVICES_DEFAULT 16 /**< 中継するデバイスの数の既定値 */
+#define RELAY_DEVICES_MAX 64 /**< 購読要求で指定できるデバイスの数 */
+
+/** 中継の設定 */
+typedef struct {
+    char host[RELAY_HOST_LENGTH]; /**< 上流のサーバのホスト名 */
+    int port;                     /**< 上流のサーバのポート番号 */
+    int devicesNum;               /**< 中継するデバイスの数 */
+} RelayConfig;
+
+/** 上流のサーバとの1デバイス分の接続 */
+typedef struct {
+    int socket;                                 /**< ソケット（未接続なら-1） */
+    int connecting;                             /**< 接続の完了待ちかどうか */
+    unsigned char buffer[RELAY_BUFFER_LENGTH];  /**< 受信したデータ */
+    size_t size;                                /**< 受信したデータの大きさ */
+    long long retryTime;                        /**< 次に接続を試みる時刻（マイクロ秒） */
+    int received;                               /**< 接続してからイベントを受信したかどうか */
+    int rejections;                             /**< イベントを受信せずに切断された連続回数 */
+} RelayConnection;
+
+/** 中継 */
+typedef struct {
+    RelayConfig config;              /**< 設定 */
+    Server *server;                  /**< 配信先のサーバ */
+    RelayConnection *connections;    /**< デバイスごとの接続 */
+    struct pollfd *pollFds;          /**< poll()に渡す監視対象 */
+    int *pollDevices;                /**< 監視対象ごとのデバイス番号 */
+    volatile int loopEnd;            /**< メインループ終了フラグ */
+    pthread_t thread;                /**< メインループを実行するスレッド */
+    int running;                     /**< スレッドを開始したかどうか */
+} Relay;
+
+/**
+ * 上流のサーバの指定を解析。
+ * 指定は "host:port" または "host:port,devices=N" の形式とする。
+ * @param config 解析結果の格納先。
+ * @param spec 上流のサーバの指定。解析中に書き換えられる。
+ * @return 正常に解析できた場合は0、できなかった場合は0以外。
+ */
+int parseRelayConfig(RelayConfig *config, char *spec);
+
+/**
+ * 中継を初期化。接続はメインループの開始後に行う。
+ * @param relay 初期化する中継。
+ * @param config 中継の設定。
+ * @param server 配信先のサーバ。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int initializeRelay(Relay *relay, const RelayConfig *config, Server *server);
+
+/**
+ * 中継のリソースを解放。メインループを停止してから呼び出すこと。
+ * @param relay リソースを解放する中継。
+ */
+void finalizeRelay(Relay *relay);
+
+/**
+ * 中継のメインループを新しいスレッドで開始。
+ * @param relay 対象の中継。
+ * @return 開始できた場合は0、できなかった場合は0以外。
+ */
+int startRelay(Relay *relay);
+
+/**
+ * 中継のメインループを停止し、スレッドの終了を待つ。
+ * @param relay 対象の中継。
+ */
+void stopRelay(Relay *relay);
+
+#endif
@@ -4,14 +4,35 @@
  *
  * Oct. 2010 by Muroran Institute of Technology
  */
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include "Server.h"
+#include "Latency.h"
+#include "Metrics.h"
+#include "Realtime.h"
+
+#define FAILED_CLIENTS_MAX 64 /**< 1回の配信で切断処理するクライアントの最大数 */
+#define BROADCAST_LENGTH 4096 /**< 配信スレッドへ渡すリングバッファの長さ */
+#define MESSAGE_POOL_LENGTH 4096 /**< メッセージのメモリプールの長さ */
+#define QUEUES_MAX 65536 /**< 送信待ちキューを持てるソケットの上限 */
+#define URING_ENTRIES 256 /**< io_uringの投入キューの長さ */
+
+static void *runShard(void *arg);
 
 /**
  * サーバソケットをバインド。
@@ -39,16 +60,13 @@ setServerPort(int serverSocket, int port)
 }
 
 /**
- * サーバの設定を初期化。
- * @param server 初期化するサーバ。
- * @param deviceNum デバイスの数。
- * @param port サーバが使用するポート番号。
- * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ * 待ち受けソケットを作成。
+ * @param port 待ち受けポート番号。
+ * @return 作成したソケット、失敗した場合は負数。
  */
-int
-initializeServer(Server *server, int devicesNum, int port)
+static int
+openListener(int port)
 {
-    int i;
     int serverSocket;
 
     /* サーバソケットを作成 */
@@ -69,12 +87,480 @@ initializeServer(Server *server, int devicesNum, int port)
         return -3;
     }
 
-    /* クライアントソケット群を初期化 */
-    server->socket = serverSocket;
+    return serverSocket;
+}
+
+/**
+ * 全ての待ち受けソケットを閉鎖。
+ * @param server 対象のサーバ。
+ */
+static void
+closeListeners(Server *server)
+{
+    int i;
+
+    for (i = 0; i < server->listenersNum; ++i) {
+        close(server->listeners[i].socket);
+    }
+    server->listenersNum = 0;
+}
+
+/**
+ * 受理したクライアントソケットに設定を適用。
+ * 適用できなかった項目は既定値のまま使用する。
+ * @param client クライアントソケット。
+ * @param policy 適用する設定。
+ */
+static void
+applySocketPolicy(int client, const SocketPolicy *policy)
+{
+    /** ソケットオプション変更用変数 */
+    const int ONE = 1;
+
+    /* 小さなイベントがNagleアルゴリズムと遅延ACKで待たされないようにする */
+    if (policy->noDelay) {
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &ONE, sizeof(int));
+    }
+    /* 停滞したクライアントのためにカーネルが溜める量を制限 */
+    if (policy->sendBuffer > 0) {
+        setsockopt(client, SOL_SOCKET, SO_SNDBUF, &policy->sendBuffer, sizeof(int));
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    if (policy->notSentLowat > 0) {
+        setsockopt(client, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &policy->notSentLowat,
+                   sizeof(int));
+    }
+#endif
+#ifdef SO_BUSY_POLL
+    if (policy->busyPoll > 0) {
+        setsockopt(client, SOL_SOCKET, SO_BUSY_POLL, &policy->busyPoll, sizeof(int));
+    }
+#endif
+    if (policy->tos >= 0) {
+        setsockopt(client, IPPROTO_IP, IP_TOS, &policy->tos, sizeof(int));
+    }
+    if (policy->priority >= 0) {
+        setsockopt(client, SOL_SOCKET, SO_PRIORITY, &policy->priority, sizeof(int));
+    }
+}
+
+/**
+ * クライアントソケットの設定を既定値で初期化。
+ * @param policy 初期化する設定。
+ */
+static void
+initializeSocketPolicy(SocketPolicy *policy)
+{
+    policy->noDelay = 0;
+    policy->sendBuffer = 0;
+    policy->notSentLowat = 0;
+    policy->busyPoll = 0;
+    policy->tos = -1;
+    policy->priority = -1;
+}
+
+/**
+ * 送信待ちキューのメッセージを全て解放して空にする。
+ * @param queue 空にする送信待ちキュー。
+ */
+static void
+clearQueue(ClientQueue *queue)
+{
+    while (queue->count > 0) {
+        releaseMessage(queue->messages[queue->head]);
+        queue->messages[queue->head] = NULL;
+        queue->head = (queue->head + 1) % CLIENT_QUEUE_LENGTH;
+        --queue->count;
+    }
+    queue->head = 0;
+    queue->offset = 0;
+}
+
+/**
+ * 集合から削除したクライアントを、参照する読み手が居なくなってから閉じる。
+ * @param client 閉じるクライアントソケット。
+ */
+static void
+releaseClient(int client)
+{
+    close(client);
+}
+
+/**
+ * 分割されたクライアント群を初期化。
+ * @param shard 初期化するクライアント群。
+ * @param devicesNum デバイスの数。
+ * @param broadcast イベントの読み出し元。
+ * @param queues ソケットごとの送信待ちキュー。
+ * @param pool メッセージの割り当て元。
+ * @param compactClientsNum デバイスごとの圧縮イベントを受け取るクライアント数。
+ */
+static void
+initializeShard(ServerShard *shard, int devicesNum, Broadcast *broadcast,
+                ClientQueue **queues, MessagePool *pool, int *compactClientsNum)
+{
+    int i;
+
+    shard->clients = (ClientSet*)malloc(sizeof(ClientSet) * devicesNum);
+    for (i = 0; i < devicesNum; ++i) {
+        initializeClientSet(&shard->clients[i], releaseClient);
+    }
+    shard->clientsNum = 0;
+    shard->devicesNum = devicesNum;
+    shard->broadcast = broadcast;
+    shard->queues = queues;
+    shard->pool = pool;
+    shard->uring = NULL;
+    shard->uringSequence = 0;
+    shard->compactClientsNum = compactClientsNum;
+    shard->cpu = -1;
+}
+
+/**
+ * 分割されたクライアント群の接続を閉じてリソースを解放。
+ * @param shard 終了するクライアント群。
+ */
+static void
+finalizeShard(ServerShard *shard)
+{
+    int i;
+    int j;
+
+    for (i = 0; i < shard->devicesNum; ++i) {
+        /* クライアントとの接続を閉鎖 */
+        int token;
+        const ClientSnapshot *clients = beginReadClientSet(&shard->clients[i], &token);
+        for (j = 0; j < clients->size; ++j) {
+            clearQueue(shard->queues[clients->elements[j]]);
+            close(clients->elements[j]);
+        }
+        endReadClientSet(&shard->clients[i], token);
+
+        /* クライアントソケット群のリソースを解放 */
+        finalizeClientSet(&shard->clients[i]);
+    }
+    free(shard->clients);
+}
+
+/**
+ * 配信スレッドを開始し、CPUに固定。
+ * @param server 配信スレッドを開始するサーバ。
+ * @return 正常に開始できた場合は0、できなかった場合は0以外。
+ */
+static int
+startWorkers(Server *server)
+{
+    int i;
+    long cpusNum = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (i = 0; i < server->shardsNum; ++i) {
+        ServerShard *shard = &server->shards[i];
+        int cpu;
+        if (pthread_create(&shard->thread, NULL, runShard, shard)) {
+            /* 開始済みのスレッドを停止 */
+            stopBroadcast(&server->broadcast);
+            while (--i >= 0) {
+                pthread_join(server->shards[i].thread, NULL);
+            }
+            return -1;
+        }
+        /* 配信スレッドを順にCPUへ割り当て。リアルタイムモードでは取得スレッドの
+           CPUを避けるため、割り当てはリアルタイムモードの設定に従う */
+        cpu = getRealtimeCpu(REALTIME_NETWORK, i);
+        if (cpu < 0 && !isRealtimeEnabled() && cpusNum > 0) {
+            cpu = i % cpusNum;
+        }
+        if (cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(cpu, &cpus);
+            if (pthread_setaffinity_np(shard->thread, sizeof(cpus), &cpus) == 0) {
+                shard->cpu = cpu;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * 送信待ちキューを持てるソケットの上限の取得。
+ * @return 開けるファイルディスクリプタ数の上限（QUEUES_MAX以下）。
+ */
+static int
+getQueuesMax(void)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur == RLIM_INFINITY ||
+        limit.rlim_cur > QUEUES_MAX) {
+        return QUEUES_MAX;
+    }
+    return (int)limit.rlim_cur;
+}
+
+/**
+ * 配信スレッドごとのio_uringを初期化。
+ * 1つでも初期化できなければ全て解放し、write()で配信する。
+ * 固定バッファと固定ファイル表は登録できなくても使用を続ける。
+ * @param server 対象のサーバ。
+ */
+static void
+initializeUrings(Server *server)
+{
+    int i;
+
+    server->urings = (IoUring*)malloc(sizeof(IoUring) * server->shardsNum);
+    if (server->urings == NULL) {
+        return;
+    }
+    for (i = 0; i < server->shardsNum; ++i) {
+        IoUring *uring = &server->urings[i];
+        if (initializeIoUring(uring, URING_ENTRIES)) {
+            while (--i >= 0) {
+                finalizeIoUring(&server->urings[i]);
+            }
+            free(server->urings);
+            server->urings = NULL;
+            return;
+        }
+        registerIoUringBuffer(uring, server->pool.messages,
+                              sizeof(Message) * server->pool.length);
+        registerIoUringFiles(uring, server->queuesNum);
+    }
+    for (i = 0; i < server->shardsNum; ++i) {
+        server->shards[i].uring = &server->urings[i];
+    }
+}
+
+/**
+ * 配信スレッドごとのio_uringを解放。
+ * @param server 対象のサーバ。
+ */
+static void
+finalizeUrings(Server *server)
+{
+    int i;
+
+    if (server->urings == NULL) {
+        return;
+    }
+    for (i = 0; i < server->shardsNum; ++i) {
+        finalizeIoUring(&server->urings[i]);
+    }
+    free(server->urings);
+    server->urings = NULL;
+}
+
+/**
+ * 紀元（1970年1月1日00:00:00 UTC）からの経過時間の取得（マイクロ秒）。
+ * @return マイクロ秒単位の現在時刻。
+ */
+static long long
+getCurrentTimeMicros(void)
+{
+    struct timeval tv;
+    /* 秒とマイクロ秒単位で現在時刻を取得 */
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+/**
+ * 単調増加する時刻の取得（マイクロ秒）。
+ * @return マイクロ秒単位の時刻。
+ */
+static long long
+getMonotonicMicros(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL;
+}
+
+/**
+ * 取得スレッドが計測した単調増加する時刻を、紀元からの経過時間（ミリ秒）に変換。
+ * 変換にはサーバの初期化時に求めた差を使うので、全てのLibertyで同じ基準となる。
+ * @param server 対象のサーバ。
+ * @param time 単調増加する時刻（マイクロ秒）。
+ * @return ミリ秒単位の時刻。
+ */
+static long long
+convertToTimeMillis(const Server *server, long long time)
+{
+    return (time + server->clockOffset) / 1000LL;
+}
+
+/**
+ * サーバの設定を既定値で初期化。
+ * @param config 初期化する設定。
+ */
+void
+initializeServerConfig(ServerConfig *config)
+{
+    config->port = 11113;
+    config->listenersNum = 0;
+    config->workersNum = 0;
+    config->producersNum = 1;
+    config->transport = SERVER_TRANSPORT_WRITE;
+}
+
+/**
+ * 待ち受けソケットの指定を解析して設定に追加。
+ * @param config 追加先の設定。
+ * @param options 待ち受けソケットの指定。解析中に書き換えられる。
+ * @return 正常に解析できた場合は0、できなかった場合は0以外。
+ */
+int
+parseServerListener(ServerConfig *config, char *options)
+{
+    enum { NODELAY, SNDBUF, LOWAT, BUSYPOLL, TOS, PRIORITY };
+    char *const tokens[] = {
+        "nodelay", "sndbuf", "lowat", "busypoll", "tos", "priority", NULL
+    };
+    ServerListenerConfig *listener;
+    char *value;
+    char *end;
+
+    if (config->listenersNum >= SERVER_LISTENERS_MAX) {
+        return -1;
+    }
+    listener = &config->listeners[config->listenersNum];
+    initializeSocketPolicy(&listener->policy);
+
+    /* 先頭はポート番号 */
+    listener->port = (int)strtol(options, &end, 10);
+    if (end == options || listener->port <= 0 || (*end != '\0' && *end != ',')) {
+        return -1;
+    }
+    options = *end == ',' ? end + 1 : end;
+
+    while (*options != '\0') {
+        int token = getsubopt(&options, tokens, &value);
+        if (token < 0 || (token != NODELAY && value == NULL)) {
+            return -1;
+        }
+        switch (token) {
+        case NODELAY:
+            listener->policy.noDelay = 1;
+            break;
+        case SNDBUF:
+            listener->policy.sendBuffer = atoi(value);
+            break;
+        case LOWAT:
+            listener->policy.notSentLowat = atoi(value);
+            break;
+        case BUSYPOLL:
+            listener->policy.busyPoll = atoi(value);
+            break;
+        case TOS:
+            listener->policy.tos = (int)strtol(value, NULL, 0);
+            break;
+        case PRIORITY:
+            listener->policy.priority = atoi(value);
+            break;
+        }
+    }
+
+    ++config->listenersNum;
+    return 0;
+}
+
+/**
+ * サーバを初期化。
+ * @param server 初期化するサーバ。
+ * @param deviceNum デバイスの数。
+ * @param config サーバの設定。
+ * @return 正常に初期化できた場合は0、できなかった場合は0以外。
+ */
+int
+initializeServer(Server *server, int devicesNum, const ServerConfig *config)
+{
+    int i;
+    int workersNum = config->workersNum;
+
+    /* 待ち受けソケットを作成（指定が無ければ既定の設定で1つ作成） */
+    server->listenersNum = 0;
+    for (i = 0; i < (config->listenersNum > 0 ? config->listenersNum : 1); ++i) {
+        ServerListener *listener = &server->listeners[i];
+        if (config->listenersNum > 0) {
+            listener->socket = openListener(config->listeners[i].port);
+            listener->policy = config->listeners[i].policy;
+        } else {
+            listener->socket = openListener(config->port);
+            initializeSocketPolicy(&listener->policy);
+        }
+        if (listener->socket < 0) {
+            int result = listener->socket;
+            closeListeners(server);
+            return result;
+        }
+        ++server->listenersNum;
+    }
+
+    /* メッセージのメモリプールと送信待ちキューの表を初期化 */
+    server->queuesNum = getQueuesMax();
+    server->queues = (ClientQueue**)calloc(server->queuesNum, sizeof(ClientQueue*));
+    if (server->queues == NULL || initializeMessagePool(&server->pool, MESSAGE_POOL_LENGTH)) {
+        free(server->queues);
+        closeListeners(server);
+        return -4;
+    }
+
+    /* 配信スレッドへ渡すリングバッファを初期化 */
+    if (workersNum > 0 && initializeBroadcast(&server->broadcast, BROADCAST_LENGTH)) {
+        finalizeMessagePool(&server->pool);
+        free(server->queues);
+        closeListeners(server);
+        return -4;
+    }
+
+    /* 配信スレッドごとに分割したクライアントソケット群を初期化 */
     server->devicesNum = devicesNum;
-    server->clients = (IntList*)malloc(sizeof(IntList) * devicesNum);
-    for (i = 0; i < server->devicesNum; ++i) {
-        initializeIntList(&server->clients[i]);
+    server->records = (unsigned long long*)calloc(devicesNum, sizeof(unsigned long long));
+    server->recordTimes = (long long*)calloc(devicesNum, sizeof(long long));
+    server->positions = (double(*)[3])calloc(devicesNum, sizeof(double[3]));
+    server->encoders = (CompactEncoder*)malloc(sizeof(CompactEncoder) * devicesNum);
+    server->compactClientsNum = (int*)calloc(devicesNum, sizeof(int));
+    server->keyframeRequests = (int*)calloc(devicesNum, sizeof(int));
+    for (i = 0; i < devicesNum; ++i) {
+        initializeCompactEncoder(&server->encoders[i]);
+    }
+    server->clockOffset = getCurrentTimeMicros() - getMonotonicMicros();
+    server->producersNum = config->producersNum;
+    pthread_mutex_init(&server->producerMutex, NULL);
+    server->workersNum = workersNum;
+    server->shardsNum = workersNum > 0 ? workersNum : 1;
+    server->shards = (ServerShard*)malloc(sizeof(ServerShard) * server->shardsNum);
+    for (i = 0; i < server->shardsNum; ++i) {
+        initializeShard(&server->shards[i], devicesNum, &server->broadcast,
+                        server->queues, &server->pool, server->compactClientsNum);
+    }
+
+    /* 書き込みをまとめて発行するio_uringを初期化 */
+    server->urings = NULL;
+    if (config->transport == SERVER_TRANSPORT_URING) {
+        initializeUrings(server);
+    }
+
+    /* 配信スレッドを開始 */
+    if (workersNum > 0 && startWorkers(server)) {
+        for (i = 0; i < server->shardsNum; ++i) {
+            finalizeShard(&server->shards[i]);
+        }
+        free(server->shards);
+        finalizeUrings(server);
+        free(server->records);
+        free(server->recordTimes);
+        free(server->positions);
+        free(server->encoders);
+        free(server->compactClientsNum);
+        free(server->keyframeRequests);
+        pthread_mutex_destroy(&server->producerMutex);
+        finalizeBroadcast(&server->broadcast);
+        finalizeMessagePool(&server->pool);
+        free(server->queues);
+        closeListeners(server);
+        return -5;
     }
 
     return 0;
@@ -88,56 +574,126 @@ void
 finalizeServer(Server *server)
 {
     int i;
-    int j;
 
-    for (i = 0; i < server->devicesNum; ++i) {
-        /* クライアントとの接続を閉鎖 */
-        IntList *clients = &server->clients[i];
-        pthread_mutex_lock(&clients->mutex);
-        for (j = 0; j < clients->size; ++j) {
-            close(clients->elements[j]);
+    /* 配信スレッドを停止 */
+    if (server->workersNum > 0) {
+        stopBroadcast(&server->broadcast);
+        for (i = 0; i < server->shardsNum; ++i) {
+            pthread_join(server->shards[i].thread, NULL);
         }
-        pthread_mutex_unlock(&clients->mutex);
+        finalizeBroadcast(&server->broadcast);
+    }
 
-        /* クライアントソケット群のリソースを解放 */
-        finalizeIntList(&server->clients[i]);
+    /* クライアントとの接続を閉鎖してリソースを解放 */
+    for (i = 0; i < server->shardsNum; ++i) {
+        finalizeShard(&server->shards[i]);
+    }
+    free(server->shards);
+    finalizeUrings(server);
+    free(server->records);
+    free(server->recordTimes);
+    free(server->positions);
+    free(server->encoders);
+    free(server->compactClientsNum);
+    free(server->keyframeRequests);
+    pthread_mutex_destroy(&server->producerMutex);
+    /* 送信待ちキューとメモリプールを解放 */
+    for (i = 0; i < server->queuesNum; ++i) {
+        free(server->queues[i]);
     }
+    free(server->queues);
+    finalizeMessagePool(&server->pool);
     /* サーバソケットを閉鎖 */
-    close(server->socket);
+    closeListeners(server);
 }
 
 /**
- * クライアントからの接続を受理。
- * @param 接続を受理するサーバ。
+ * クライアントからの接続を受理し、待ち受けソケットの設定を適用。
+ * @param server 接続を受理するサーバ。
+ * @param listener 待ち受けソケットの番号。
  * @return 接続を受理した場合はそのソケット、失敗した場合は-1。
  */
 int
-acceptServer(Server *server)
+acceptServer(Server *server, int listener)
 {
     /* クライアントアドレス */
     struct sockaddr_in clientAddr; 
     /* クライアントアドレスの長さ */
     socklen_t clientAddrLength;
 
+    /* 受理したソケット */
+    int client;
+
     clientAddrLength = sizeof(clientAddr);
     /* 接続を受理 */
-    return accept(server->socket, (struct sockaddr*)&clientAddr, &clientAddrLength);
+    client = accept(server->listeners[listener].socket, (struct sockaddr*)&clientAddr,
+                    &clientAddrLength);
+    /* 送信待ちキューを持てない番号なら閉じる */
+    if (client >= server->queuesNum) {
+        close(client);
+        return -1;
+    }
+    if (client != -1) {
+        applySocketPolicy(client, &server->listeners[listener].policy);
+    }
+    return client;
 }
 
 /**
- * 紀元（1970年1月1日00:00:00 UTC）からの経過時間の取得（ミリ秒）。
- * @return ミリ秒単位の現在時刻。
+ * デバイスのイベントを配信するクライアントを追加。
+ * @param server 追加先のサーバ。
+ * @param device デバイス番号。
+ * @param client クライアントソケット。
+ * @return 追加した場合は0、デバイス番号が不正な場合は0以外。
  */
-static long long
-getCurrentTimeMillis()
+int
+addServerClient(Server *server, int client, const ServerSubscription *subscription)
 {
-    struct timeval tv;
-    long long mills;
-    /* 秒とマイクロ秒単位で現在時刻を取得 */
-    gettimeofday(&tv, NULL);
-    /* ミリ秒単位に変換 */
-    mills = tv.tv_sec * 1000LL + tv.tv_usec / 1000LL;
-    return mills;
+    ClientQueue *queue;
+    int i;
+    int device = subscription->device;
+    int rate = subscription->rate;
+    ServerShard *shard = &server->shards[0];
+
+    if (device < 0 || device >= server->devicesNum ||
+        client < 0 || client >= server->queuesNum || rate < 0) {
+        return -1;
+    }
+    /* 送信待ちキューを用意 */
+    if (server->queues[client] == NULL) {
+        server->queues[client] = (ClientQueue*)calloc(1, sizeof(ClientQueue));
+        if (server->queues[client] == NULL) {
+            return -1;
+        }
+    }
+    /* 配信間隔を設定（集合に追加する前に書き込むので配信スレッドからも見える） */
+    queue = server->queues[client];
+    queue->interval = rate > 0 ? 1000000LL / rate : 0;
+    queue->nextTime = 0;
+    queue->record = 0;
+    queue->compact = subscription->compact;
+    queue->synced = 0;
+    /* 圧縮イベントは次のデバイスレコードをキーフレームにして同期させる */
+    if (queue->compact) {
+        __atomic_add_fetch(&server->compactClientsNum[device], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&server->keyframeRequests[device], 1, __ATOMIC_RELAXED);
+    }
+    /* 遅いクライアントで配信が止まらないよう書き込みをノンブロッキングにする */
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+    /* 担当クライアントが最も少ない配信スレッドに割り当て */
+    for (i = 1; i < server->shardsNum; ++i) {
+        if (__atomic_load_n(&server->shards[i].clientsNum, __ATOMIC_RELAXED) <
+            __atomic_load_n(&shard->clientsNum, __ATOMIC_RELAXED)) {
+            shard = &server->shards[i];
+        }
+    }
+    /* 配信スレッドが参照する前にio_uringの固定ファイル表へ登録 */
+    if (shard->uring != NULL) {
+        updateIoUringFile(shard->uring, client, 1);
+    }
+    addClientSet(&shard->clients[device], client);
+    __atomic_add_fetch(&shard->clientsNum, 1, __ATOMIC_RELAXED);
+    return 0;
 }
 
 /**
@@ -161,35 +717,420 @@ reverse(unsigned char *dist, size_t size)
 }
 
 /**
- * クライアント群に指定したデータを送信。
- * @param list クライアントソケットのリスト。
- * @param data 送信データ。
- * @param size 送信データの大きさ（バイト）。
+ * メッセージの送信完了を記録。
+ * @param message 送信を完了したメッセージ。
+ */
+static void
+completeMessage(const Message *message)
+{
+    /* 書き込みが完了するまでの遅延を記録 */
+    LATENCY_RECORD(LATENCY_STAGE_WRITE, message->origin);
+    addMetric(METRIC_SERVER_EVENTS, 1);
+    addMetric(METRIC_SERVER_BYTES, message->size);
+}
+
+/**
+ * 送信待ちキューの末尾にメッセージを追加。
+ * @param queue 追加先の送信待ちキュー。
+ * @param message 追加するメッセージ。
+ * @param offset 送信済みのバイト数（キューが空の場合のみ有効）。
+ * @return 追加した場合は0、キューが満杯の場合は0以外。
+ */
+static int
+pushQueue(ClientQueue *queue, Message *message, size_t offset)
+{
+    if (queue->count == CLIENT_QUEUE_LENGTH) {
+        return -1;
+    }
+    if (queue->count == 0) {
+        queue->offset = offset;
+    }
+    retainMessage(message);
+    queue->messages[(queue->head + queue->count) % CLIENT_QUEUE_LENGTH] = message;
+    ++queue->count;
+    return 0;
+}
+
+/**
+ * 送信待ちキューのメッセージを書き込めるだけ送信。
+ * @param queue 送信する送信待ちキュー。
+ * @param client クライアントソケット。
+ * @return 正常な場合は0、クライアントから切断された場合は0以外。
+ */
+static int
+flushQueue(ClientQueue *queue, int client)
+{
+    while (queue->count > 0) {
+        Message *message = queue->messages[queue->head];
+        ssize_t result = write(client, message->data + queue->offset,
+                               message->size - queue->offset);
+        addMetric(METRIC_SERVER_SEND_SYSCALLS, 1);
+        if (result == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        queue->offset += result;
+        if (queue->offset < message->size) {
+            return 0;
+        }
+        /* 送り切ったメッセージをキューから外す */
+        completeMessage(message);
+        releaseMessage(message);
+        queue->messages[queue->head] = NULL;
+        queue->head = (queue->head + 1) % CLIENT_QUEUE_LENGTH;
+        --queue->count;
+        queue->offset = 0;
+    }
+    return 0;
+}
+
+/**
+ * 空の送信待ちキューを持つクライアントへの書き込み結果を処理。
+ * @param queue クライアントの送信待ちキュー。
+ * @param message 書き込んだメッセージ。
+ * @param result 書き込んだバイト数、失敗した場合は-1。
+ * @param error 失敗した場合のエラー番号。
+ * @return 正常な場合は0、クライアントから切断された場合は0以外。
+ */
+static int
+finishWrite(ClientQueue *queue, Message *message, ssize_t result, int error)
+{
+    if (result == (ssize_t)message->size) {
+        completeMessage(message);
+        return 0;
+    }
+    if (result >= 0 || error == EAGAIN || error == EWOULDBLOCK) {
+        /* 1回で送り切れなかった場合は書き込みの停滞として記録し、残りを待たせる */
+        addMetric(METRIC_SERVER_WRITE_STALLS, 1);
+        pushQueue(queue, message, result > 0 ? result : 0);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * 切断されたクライアントを後で削除するために記録。
+ * @param failed 切断されたクライアントの配列。
+ * @param failedNum 記録済みの数。
+ * @param client 切断されたクライアントソケット。
+ */
+static void
+addFailed(int *failed, int *failedNum, int client)
+{
+    if (*failedNum < FAILED_CLIENTS_MAX) {
+        failed[*failedNum] = client;
+        ++*failedNum;
+    }
+}
+
+/**
+ * io_uringの書き込み要求に付ける値の作成。
+ * 上位32ビットにメッセージの通し番号、下位32ビットにクライアントソケットを入れる。
+ * @param shard 対象のクライアント群。
+ * @param client 書き込み先のクライアントソケット。
+ * @return 要求に付ける値。
+ */
+static unsigned long long
+getUringData(const ServerShard *shard, int client)
+{
+    return ((unsigned long long)shard->uringSequence << 32) | (unsigned int)client;
+}
+
+/**
+ * io_uringで完了した書き込みの結果を処理。
+ * @param shard 対象のクライアント群。
+ * @param message 書き込んだメッセージ。
+ * @param failed 切断されたクライアントの配列。
+ * @param failedNum 記録済みの数。
+ */
+static void
+reapWrites(ServerShard *shard, Message *message, int *failed, int *failedNum)
+{
+    unsigned long long data;
+    int result;
+
+    while (completeIoUring(shard->uring, &data, &result)) {
+        int client = (int)(unsigned int)data;
+        ClientQueue *queue = shard->queues[client];
+        if ((unsigned int)(data >> 32) != shard->uringSequence) {
+            /* 前のメッセージの完了が遅れて届いた場合、どこまで送れたか分からないので切断する */
+            addFailed(failed, failedNum, client);
+            continue;
+        }
+        if (finishWrite(queue, message, result < 0 ? -1 : result,
+                        result < 0 ? -result : 0)) {
+            addFailed(failed, failedNum, client);
+        }
+    }
+}
+
+/**
+ * io_uringに準備した書き込みを投入し、完了した結果を処理。
+ * このメッセージの書き込みは全て、完了を処理するか取り下げてから戻る。
+ * @param shard 対象のクライアント群。
+ * @param message 書き込んだメッセージ。
+ * @param failed 切断されたクライアントの配列。
+ * @param failedNum 記録済みの数。
+ */
+static void
+submitWrites(ServerShard *shard, Message *message, int *failed, int *failedNum)
+{
+    IoUring *uring = shard->uring;
+    unsigned long long data;
+
+    while (uring->pending > 0) {
+        if (submitIoUring(uring) < 0) {
+            /* 投入できなかった書き込みは取り下げ、次のメッセージに持ち越さないようwrite()で送る */
+            while (withdrawIoUring(uring, &data)) {
+                int client = (int)(unsigned int)data;
+                ssize_t result = write(client, message->data, message->size);
+                addMetric(METRIC_SERVER_SEND_SYSCALLS, 1);
+                if (finishWrite(shard->queues[client], message, result, errno)) {
+                    addFailed(failed, failedNum, client);
+                }
+            }
+            break;
+        }
+        addMetric(METRIC_SERVER_SEND_SYSCALLS, 1);
+        reapWrites(shard, message, failed, failedNum);
+    }
+    /* 完了の待機がシグナルで中断されて残った書き込みも、ここで回収する */
+    while (uring->inflight > 0 && waitIoUring(uring) == 0) {
+        reapWrites(shard, message, failed, failedNum);
+    }
+}
+
+/**
+ * クライアントが受け取る符号化形式かどうかを判定。
+ * 圧縮イベントはキーフレームを受け取るまで配信しない。
+ * @param queue クライアントの送信待ちキュー。
+ * @param message 判定するメッセージ。
+ * @return 配信する場合は0以外、配信しない場合は0。
+ */
+static int
+acceptEncoding(ClientQueue *queue, const Message *message)
+{
+    switch (message->encoding) {
+    case MESSAGE_ENCODING_FULL:
+        return !queue->compact;
+    case MESSAGE_ENCODING_COMPACT:
+        return queue->compact && (queue->synced || message->keyframe);
+    default:
+        return 1;
+    }
+}
+
+/**
+ * クライアントの配信間隔に従い、メッセージを配信するかどうかを判定。
+ * 同じデバイスレコードのイベントはまとめて配信するか間引く。
+ * 圧縮イベントのキーフレームは差分の基準になるので間引かない。
+ * @param queue クライアントの送信待ちキュー。
+ * @param message 判定するメッセージ。
+ * @return 配信する場合は0以外、間引く場合は0。
+ */
+static int
+acceptRecord(ClientQueue *queue, const Message *message)
+{
+    if (queue->interval == 0 || message->record == 0 || message->keyframe ||
+        message->record == queue->record) {
+        return 1;
+    }
+    if (message->recordTime < queue->nextTime) {
+        return 0;
+    }
+    /* 平均の配信頻度を保つよう予定時刻を進め、大きく遅れていれば現在から数え直す */
+    queue->record = message->record;
+    if (message->recordTime - queue->nextTime < queue->interval) {
+        queue->nextTime += queue->interval;
+    } else {
+        queue->nextTime = message->recordTime + queue->interval;
+    }
+    return 1;
+}
+
+/**
+ * クライアント群に指定したメッセージを送信。
+ * クライアントの集合はロックを取らずに走査し、
+ * 切断されたクライアントは走査を終えてから集合より削除する。
+ * 書き込めなかったクライアントの送信待ちキューにはメッセージへの参照を積み、
+ * 次の配信の際に続きから送信する。
+ * io_uringを使用する場合は、全クライアントへの書き込みを1回のシステムコールで発行する。
+ * @param shard 送信先のクライアント群。
+ * @param device デバイス番号。
+ * @param message 送信するメッセージ。
  */
 static void
-sendToClients(IntList *list, unsigned char *data, size_t size)
+sendToClients(ServerShard *shard, int device, Message *message)
 {
+    ClientSet *set = &shard->clients[device];
     int i;
+    int token;
+    int failed[FAILED_CLIENTS_MAX];
+    int failedNum = 0;
+    const ClientSnapshot *clients = beginReadClientSet(set, &token);
+
+    if (shard->uring != NULL) {
+        ++shard->uringSequence;
+    }
+    for (i = 0; i < clients->size; ++i) {
+        int client = clients->elements[i];
+        ClientQueue *queue = shard->queues[client];
+        ssize_t result;
 
-    pthread_mutex_lock(&list->mutex);
-    for (i = 0; i < list->size; ++i) {
-        int client = list->elements[i];
-        int remain = size;
-        int wrote = 0;
-        /* 送信データが残っている間ループ */
-        while (remain > 0) {
-            int result = write(client, data + wrote, remain);
-            /* クライアントから切断されたらソケットを閉じてリストから削除 */
-            if (result == -1) {
-                removeIntList(list, client);
-                close(client);
-                break;
+        /* 符号化形式が合わないイベントは送らず、
+           配信頻度を指定したクライアントにはデバイスレコード単位で間引く */
+        if (!acceptEncoding(queue, message) || !acceptRecord(queue, message)) {
+            continue;
+        }
+        if (message->keyframe) {
+            queue->synced = 1;
+        }
+        /* 先に送信待ちのメッセージを送る */
+        if (queue->count > 0 && flushQueue(queue, client)) {
+            addFailed(failed, &failedNum, client);
+            continue;
+        }
+        if (queue->count > 0) {
+            /* 送信待ちが溢れていれば新しいイベントを破棄 */
+            if (pushQueue(queue, message, 0)) {
+                addMetric(METRIC_SERVER_QUEUE_DROPS, 1);
+                /* キーフレームを失った圧縮イベントは次のキーフレームまで止める */
+                if (message->keyframe) {
+                    queue->synced = 0;
+                }
             }
-            wrote += result;
-            remain -= result;
+            continue;
+        }
+        if (shard->uring != NULL) {
+            /* 投入キューが満杯なら、溜まった分を投入してから準備し直す */
+            if (prepareIoUringWrite(shard->uring, client, message->data,
+                                    message->size, getUringData(shard, client)) == 0) {
+                continue;
+            }
+            submitWrites(shard, message, failed, &failedNum);
+            if (prepareIoUringWrite(shard->uring, client, message->data,
+                                    message->size, getUringData(shard, client)) == 0) {
+                continue;
+            }
+        }
+        result = write(client, message->data, message->size);
+        addMetric(METRIC_SERVER_SEND_SYSCALLS, 1);
+        if (finishWrite(queue, message, result, errno)) {
+            /* クライアントから切断されたら後で削除する */
+            addFailed(failed, &failedNum, client);
+        }
+    }
+    if (shard->uring != NULL) {
+        submitWrites(shard, message, failed, &failedNum);
+    }
+    endReadClientSet(set, token);
+
+    /* 切断されたクライアントを集合から削除（ソケットは誰も参照しなくなってから閉じる） */
+    for (i = 0; i < failedNum; ++i) {
+        if (removeClientSet(set, failed[i])) {
+            if (shard->queues[failed[i]]->compact) {
+                __atomic_sub_fetch(&shard->compactClientsNum[device], 1, __ATOMIC_RELAXED);
+            }
+            clearQueue(shard->queues[failed[i]]);
+            if (shard->uring != NULL) {
+                updateIoUringFile(shard->uring, failed[i], 0);
+            }
+            __atomic_sub_fetch(&shard->clientsNum, 1, __ATOMIC_RELAXED);
+            addMetric(METRIC_SERVER_DISCONNECTS, 1);
+        }
+    }
+    /* 猶予期間を過ぎた古いスナップショットと削除したクライアントを解放 */
+    pollClientSet(set);
+}
+
+/**
+ * 符号化済みのイベントをメッセージに格納し、クライアント群へ送信。
+ * @param shard 送信先のクライアント群。
+ * @param event 送信するイベント。
+ */
+static void
+sendToShard(ServerShard *shard, const BroadcastFrame *event)
+{
+    Message *message = allocateMessage(shard->pool);
+
+    if (message == NULL) {
+        return;
+    }
+    memcpy(message->data, event->data, event->size);
+    message->size = event->size;
+    message->origin = event->origin;
+    message->record = event->record;
+    message->recordTime = event->recordTime;
+    message->encoding = event->encoding;
+    message->keyframe = event->keyframe;
+    sendToClients(shard, event->device, message);
+    /* 送信待ちキューに残った参照があれば、送信を終えるまで解放されない */
+    releaseMessage(message);
+}
+
+/**
+ * 配信スレッドのメインループ。
+ * リングバッファからイベントを読み出し、担当するクライアントへ送信する。
+ * @param arg 担当するクライアント群。
+ * @return 使用しない。
+ */
+static void *
+runShard(void *arg)
+{
+    ServerShard *shard = (ServerShard*)arg;
+    unsigned long long next = 0;
+    BroadcastFrame frame;
+    long long skipped;
+
+    /* CPUへの固定はstartWorkers()で済ませている */
+    enterRealtimeThread(REALTIME_NETWORK, -1);
+    while ((skipped = receiveBroadcast(shard->broadcast, &next, &frame)) >= 0) {
+        if (skipped > 0) {
+            addMetric(METRIC_SERVER_FANOUT_DROPS, skipped);
         }
+        sendToShard(shard, &frame);
+    }
+    return NULL;
+}
+
+/**
+ * 符号化したイベントをクライアント群へ配信。
+ * 配信スレッドを使用する場合はリングバッファへ1度だけ書き込み、
+ * 各配信スレッドが担当するクライアントへ並行して送信する。
+ * 複数の取得スレッドから呼び出される場合は、書き込みを1スレッドずつに制限する。
+ * @param server イベントを送信するサーバ。
+ * @param device デバイス番号。
+ * @param data 送信データ。
+ * @param size 送信データの大きさ（バイト）。
+ * @param record デバイスレコードのイベントなら0以外。
+ * @param encoding 符号化形式。
+ * @param keyframe 圧縮イベントのキーフレームなら0以外。
+ */
+static void
+deliver(Server *server, int device, const unsigned char *data, size_t size, int record,
+        MessageEncoding encoding, int keyframe)
+{
+    BroadcastFrame event;
+
+    event.device = device;
+    event.size = size;
+    event.origin = LATENCY_ORIGIN();
+    event.record = record ? server->records[device] : 0;
+    event.recordTime = server->recordTimes[device];
+    event.encoding = encoding;
+    event.keyframe = keyframe;
+    memcpy(event.data, data, size);
+
+    if (server->producersNum > 1) {
+        pthread_mutex_lock(&server->producerMutex);
+    }
+    if (server->workersNum > 0) {
+        publishBroadcast(&server->broadcast, &event);
+    } else {
+        sendToShard(&server->shards[0], &event);
+    }
+    if (server->producersNum > 1) {
+        pthread_mutex_unlock(&server->producerMutex);
     }
-    pthread_mutex_unlock(&list->mutex);
 }
 
 /**
@@ -197,23 +1138,24 @@ sendToClients(IntList *list, unsigned char *data, size_t size)
  * @param server イベントを送信するサーバ。
  * @param device デバイス番号。
  * @param button ボタン番号。
+ * @param time 取得時刻（CLOCK_MONOTONIC、マイクロ秒）。
  */
 void
-sendDevicePressed(Server *server, int device, unsigned char button)
+sendDevicePressed(Server *server, int device, unsigned char button, long long time)
 {
     /* デバイスプレスイベントを表すヘッダ */
     const unsigned char HEADER = 0;
     unsigned char data[10];
-    long long time = getCurrentTimeMillis();
+    long long millis = convertToTimeMillis(server, time);
 
     /* バイトオーダを考慮しつつ配列に送信データを格納 */
     data[0] = HEADER;
     data[1] = button;
-    memcpy(data + 2, &time, 8);
+    memcpy(data + 2, &millis, 8);
     reverse(data + 2, 8);
 
     /* クライアントへデータを送信 */
-    sendToClients(&server->clients[device], data, 10);
+    deliver(server, device, data, 10, 0, MESSAGE_ENCODING_ANY, 0);
 }
 
 /**
@@ -221,23 +1163,24 @@ sendDevicePressed(Server *server, int device, unsigned char button)
  * @param server イベントを送信するサーバ。
  * @param device デバイス番号。
  * @param button ボタン番号。
+ * @param time 取得時刻（CLOCK_MONOTONIC、マイクロ秒）。
  */
 void
-sendDeviceReleased(Server *server, int device, unsigned char button)
+sendDeviceReleased(Server *server, int device, unsigned char button, long long time)
 {
     /* デバイスリリースイベントを表すヘッダ */
     const unsigned char HEADER = 1;
     unsigned char data[10];
-    long long time = getCurrentTimeMillis();
+    long long millis = convertToTimeMillis(server, time);
 
     /* バイトオーダを考慮しつつ配列に送信データを格納 */
     data[0] = HEADER;
     data[1] = button;
-    memcpy(data + 2, &time, 8);
+    memcpy(data + 2, &millis, 8);
     reverse(data + 2, 8);
 
     /* クライアントへデータを送信 */
-    sendToClients(&server->clients[device], data, 10);
+    deliver(server, device, data, 10, 0, MESSAGE_ENCODING_ANY, 0);
 }
 
 
@@ -246,26 +1189,33 @@ sendDeviceReleased(Server *server, int device, unsigned char button)
  * @param server イベントを送信するサーバ。
  * @param device デバイス番号。
  * @param positioon デバイスの位置を格納した長さ3の配列。
+ * @param time 取得時刻（CLOCK_MONOTONIC、マイクロ秒）。
  */
 void
-sendDeviceMoved(Server *server, int device, double position[])
+sendDeviceMoved(Server *server, int device, double position[], long long time)
 {
     /* デバイスムーブイベントを表すヘッダ */
     const unsigned char HEADER = 2;
     unsigned char data[33];
-    long long time = getCurrentTimeMillis();
+    long long millis = convertToTimeMillis(server, time);
+
+    /* ムーブイベントは各デバイスレコードの最初のイベントなので、ここで番号を進める */
+    ++server->records[device];
+    server->recordTimes[device] = time;
+    /* 圧縮イベントは姿勢と合わせて符号化するので位置を保持しておく */
+    memcpy(server->positions[device], position, sizeof(double) * 3);
 
     /* バイトオーダを考慮しつつ配列に送信データを格納 */
     data[0] = HEADER;
     memcpy(data + 1, position, 8 * 3);
-    memcpy(data + 25, &time, 8);
+    memcpy(data + 25, &millis, 8);
     reverse(data + 1, 8);
     reverse(data + 9, 8);
     reverse(data + 17, 8);
     reverse(data + 25, 8);
 
     /* クライアントへデータを送信 */
-    sendToClients(&server->clients[device], data, 33);
+    deliver(server, device, data, 33, 1, MESSAGE_ENCODING_FULL, 0);
 }
 
 /**
@@ -273,24 +1223,84 @@ sendDeviceMoved(Server *server, int device, double position[])
  * @param server イベントを送信するサーバ。
  * @param device デバイス番号。
  * @param posture デバイスの姿勢を格納した長さ3の配列。
+ * @param time 取得時刻（CLOCK_MONOTONIC、マイクロ秒）。
  */
 void
-sendDeviceSwayed(Server *server, int device, double posture[])
+sendDeviceSwayed(Server *server, int device, double posture[], long long time)
 {
     /* デバイスウェイイベントを表すヘッダ */
     const unsigned char HEADER = 3;
     unsigned char data[33];
-    long long time = getCurrentTimeMillis();
+    long long millis = convertToTimeMillis(server, time);
 
     /* バイトオーダを考慮しつつ配列に送信データを格納 */
     data[0] = HEADER;
     memcpy(data + 1, posture, 8 * 3);
-    memcpy(data + 25, &time, 8);
+    memcpy(data + 25, &millis, 8);
     reverse(data + 1, 8);
     reverse(data + 9, 8);
     reverse(data + 17, 8);
     reverse(data + 25, 8);
 
     /* クライアントへデータを送信 */
-    sendToClients(&server->clients[device], data, 33);
+    deliver(server, device, data, 33, 1, MESSAGE_ENCODING_FULL, 0);
+
+    /* 圧縮イベントを受け取るクライアントがいれば、位置と姿勢をまとめて符号化 */
+    if (__atomic_load_n(&server->compactClientsNum[device], __ATOMIC_RELAXED) > 0) {
+        unsigned char compact[COMPACT_KEYFRAME_SIZE];
+        int keyframe = __atomic_exchange_n(&server->keyframeRequests[device], 0,
+                                           __ATOMIC_RELAXED);
+        size_t size = encodeCompactRecord(&server->encoders[device],
+                                          server->positions[device], posture, millis,
+                                          keyframe, compact);
+        deliver(server, device, compact, size, 1, MESSAGE_ENCODING_COMPACT,
+                compact[0] == COMPACT_KEYFRAME_HEADER);
+    }
+}
+
+/**
+ * デバイスに関連付けられたクライアント数の取得。
+ * @param server 対象のサーバ。
+ * @return クライアント数。
+ */
+int
+getServerClientsNum(Server *server)
+{
+    int i;
+    int num = 0;
+
+    for (i = 0; i < server->shardsNum; ++i) {
+        num += __atomic_load_n(&server->shards[i].clientsNum, __ATOMIC_RELAXED);
+    }
+    return num;
+}
+
+/**
+ * クライアントのソケットに溜まっている未送信バイト数の合計の取得。
+ * @param server 対象のサーバ。
+ * @return 未送信バイト数。
+ */
+long long
+getServerBacklogBytes(Server *server)
+{
+    int i;
+    int j;
+    int k;
+    long long backlog = 0;
+
+    for (k = 0; k < server->shardsNum; ++k) {
+        ClientSet *sets = server->shards[k].clients;
+        for (i = 0; i < server->devicesNum; ++i) {
+            int token;
+            const ClientSnapshot *clients = beginReadClientSet(&sets[i], &token);
+            for (j = 0; j < clients->size; ++j) {
+                int queued;
+                if (ioctl(clients->elements[j], SIOCOUTQ, &queued) == 0) {
+                    backlog += queued;
+                }
+            }
+            endReadClientSet(&sets[i], token);
+        }
+    }
+    return backlog;
 }
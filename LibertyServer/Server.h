@@ -8,23 +8,140 @@
 #ifndef SERVER_H
 #define SERVER_H /**< インクルードガード用定数  */
 
-#include "IntList.h"
+#include <pthread.h>
+#include "ClientSet.h"
+#include "Broadcast.h"
+#include "MessagePool.h"
+#include "IoUring.h"
+#include "CompactEncoding.h"
+
+#define CLIENT_QUEUE_LENGTH 16 /**< クライアントごとの送信待ちキューの長さ */
+
+/** クライアントごとの送信待ちキューと配信間隔 */
+typedef struct {
+  Message *messages[CLIENT_QUEUE_LENGTH]; /**< 送信待ちのメッセージ */
+  int head;               /**< 先頭の位置 */
+  int count;              /**< 送信待ちのメッセージ数 */
+  size_t offset;          /**< 先頭のメッセージのうち送信済みのバイト数 */
+  long long interval;     /**< デバイスレコードの配信間隔（マイクロ秒、0なら全て配信） */
+  long long nextTime;     /**< 次に配信するデバイスレコードの取得時刻 */
+  unsigned long long record; /**< 最後に配信すると決めたデバイスレコードの番号 */
+  int compact;            /**< 圧縮イベントで配信するかどうか */
+  int synced;             /**< 圧縮イベントのキーフレームを受け取ったかどうか */
+} ClientQueue;
+
+/** クライアントの購読内容 */
+typedef struct {
+  int device;             /**< デバイス番号 */
+  int rate;               /**< 配信頻度（Hz、0なら全てのデバイスレコードを配信） */
+  int compact;            /**< 圧縮イベントで配信するかどうか */
+} ServerSubscription;
+
+/** 1つの配信スレッドが担当するクライアント群 */
+typedef struct {
+  ClientSet *clients;     /**< デバイスごとのクライアントソケット群 */
+  ClientQueue **queues;   /**< ソケットごとの送信待ちキュー */
+  MessagePool *pool;      /**< メッセージの割り当て元 */
+  IoUring *uring;         /**< 書き込みをまとめて発行するio_uring（使用しないならNULL） */
+  unsigned int uringSequence; /**< io_uringで書き込み中のメッセージの通し番号 */
+  int *compactClientsNum; /**< デバイスごとの圧縮イベントを受け取るクライアント数 */
+  int clientsNum;         /**< 担当しているクライアントの数 */
+  int devicesNum;         /**< デバイスの数 */
+  Broadcast *broadcast;   /**< イベントの読み出し元 */
+  pthread_t thread;       /**< 配信スレッド */
+  int cpu;                /**< 配信スレッドを固定するCPU番号（負数なら固定しない） */
+} ServerShard;
+
+#define SERVER_LISTENERS_MAX 8 /**< 待ち受けソケットの最大数 */
+
+/** 受理したクライアントソケットに適用する設定 */
+typedef struct {
+  int noDelay;            /**< TCP_NODELAYを設定するかどうか */
+  int sendBuffer;         /**< SO_SNDBUFの値（0なら既定値） */
+  int notSentLowat;       /**< TCP_NOTSENT_LOWATの値（0なら既定値） */
+  int busyPoll;           /**< SO_BUSY_POLLの値（マイクロ秒、0なら使用しない） */
+  int tos;                /**< IP_TOSの値（負数なら既定値） */
+  int priority;           /**< SO_PRIORITYの値（負数なら既定値） */
+} SocketPolicy;
+
+/** 待ち受けソケットの設定 */
+typedef struct {
+  int port;               /**< 待ち受けポート番号 */
+  SocketPolicy policy;    /**< 受理したクライアントソケットに適用する設定 */
+} ServerListenerConfig;
+
+/** 待ち受けソケット */
+typedef struct {
+  int socket;             /**< サーバソケット */
+  SocketPolicy policy;    /**< 受理したクライアントソケットに適用する設定 */
+} ServerListener;
+
+/** クライアントへの書き込み方法 */
+typedef enum {
+  SERVER_TRANSPORT_WRITE, /**< クライアントごとにwrite()を呼び出す */
+  SERVER_TRANSPORT_URING  /**< io_uringで1イベント分の書き込みをまとめて発行する */
+} ServerTransport;
+
+/** サーバの設定 */
+typedef struct {
+  int port;                  /**< 待ち受けソケットの指定が無い場合のポート番号 */
+  ServerListenerConfig listeners[SERVER_LISTENERS_MAX]; /**< 待ち受けソケットの設定 */
+  int listenersNum;          /**< 待ち受けソケットの数 */
+  int workersNum;            /**< 配信スレッドの数（0なら取得スレッドから直接配信） */
+  ServerTransport transport; /**< クライアントへの書き込み方法 */
+  int producersNum;          /**< イベントを配信する取得スレッドの数 */
+} ServerConfig;
 
 /** サーバ構造体 */
 typedef struct {
-  int socket;       /**< サーバソケット */
-  int devicesNum;   /**< サーバで扱うデバイスの数 */
-  IntList *clients; /**< クライアントソケット群 */
+  ServerListener listeners[SERVER_LISTENERS_MAX]; /**< 待ち受けソケット */
+  int listenersNum;       /**< 待ち受けソケットの数 */
+  int devicesNum;         /**< サーバで扱うデバイスの数 */
+  int workersNum;         /**< 配信スレッドの数（0なら取得スレッドから直接配信） */
+  int shardsNum;          /**< クライアント群の分割数 */
+  ServerShard *shards;    /**< 分割されたクライアント群 */
+  Broadcast broadcast;    /**< 配信スレッドへ渡すイベントのリングバッファ */
+  ClientQueue **queues;   /**< ソケットごとの送信待ちキュー */
+  int queuesNum;          /**< 送信待ちキューを持てるソケットの上限 */
+  MessagePool pool;       /**< メッセージのメモリプール */
+  IoUring *urings;        /**< 配信スレッドごとのio_uring（使用しないならNULL） */
+  unsigned long long *records; /**< デバイスごとの最新のデバイスレコードの番号 */
+  long long *recordTimes; /**< デバイスごとの最新のデバイスレコードの取得時刻 */
+  double (*positions)[3]; /**< デバイスごとの最新の位置 */
+  CompactEncoder *encoders; /**< デバイスごとの圧縮イベントの符号化の状態 */
+  int *compactClientsNum; /**< デバイスごとの圧縮イベントを受け取るクライアント数 */
+  int *keyframeRequests;  /**< デバイスごとのキーフレームの要求 */
+  long long clockOffset;  /**< 単調増加する時刻から紀元からの経過時間への変換量 */
+  int producersNum;       /**< イベントを配信する取得スレッドの数 */
+  pthread_mutex_t producerMutex; /**< 取得スレッドが複数の場合の配信の排他 */
 } Server;
 
 /**
- * サーバの設定を初期化。
+ * サーバの設定を既定値で初期化。
+ * @param config 初期化する設定。
+ */
+void initializeServerConfig(ServerConfig *config);
+
+/**
+ * 待ち受けソケットの指定を解析して設定に追加。
+ * 指定は「ポート番号[,オプション...]」の形式で、オプションには
+ * nodelay、sndbuf=N、lowat=N、busypoll=US、tos=N、priority=Nを指定できる。
+ * @param config 追加先の設定。
+ * @param options 待ち受けソケットの指定。解析中に書き換えられる。
+ * @return 正常に解析できた場合は0、できなかった場合は0以外。
+ */
+int parseServerListener(ServerConfig *config, char *options);
+
+/**
+ * サーバを初期化。
+ * 配信スレッドを使用する場合は、各スレッドをCPUに固定して開始する。
+ * io_uringを指定してもカーネルが対応していない場合はwrite()で配信する。
  * @param server 初期化するサーバ。
  * @param deviceNum デバイスの数。
- * @param port サーバが使用するポート番号。
+ * @param config サーバの設定。
  * @return 正常に初期化できた場合は0、できなかった場合は0以外。
  */
-int initializeServer(Server *server, int deviceNum, int port);
+int initializeServer(Server *server, int deviceNum, const ServerConfig *config);
 
 /**
  * サーバのリソースの解放。
@@ -33,42 +150,76 @@ int initializeServer(Server *server, int deviceNum, int port);
 void finalizeServer(Server *server);
 
 /**
- * クライアントからの接続を受理。
- * @param 接続を受理するサーバ。
+ * クライアントからの接続を受理し、待ち受けソケットの設定を適用。
+ * 送信待ちキューを持てない番号のソケットは閉じる。
+ * @param server 接続を受理するサーバ。
+ * @param listener 待ち受けソケットの番号。
  * @return 接続を受理した場合はそのソケット、失敗した場合は-1。
  */
-int acceptServer(Server *server);
+int acceptServer(Server *server, int listener);
+
+/**
+ * デバイスのイベントを配信するクライアントを追加。
+ * クライアントソケットはノンブロッキングに設定される。
+ * 配信頻度を指定した場合、ムーブイベントとスウェイイベントはデバイスレコード単位で
+ * 間引いて配信する。プレスイベントとリリースイベントは間引かない。
+ * 圧縮イベントを指定した場合は、ムーブイベントとスウェイイベントの代わりに
+ * 圧縮イベントを配信する。最初に届くのは必ずキーフレームとなる。
+ * @param server 追加先のサーバ。
+ * @param client クライアントソケット。
+ * @param subscription 購読内容。
+ * @return 追加した場合は0、デバイス番号が不正な場合は0以外。
+ */
+int addServerClient(Server *server, int client, const ServerSubscription *subscription);
 
 /**
  * クライアント群へデバイスプレスイベントを配信。
  * @param server イベントを送信するサーバ。
  * @param device デバイス番号。
  * @param button ボタン番号。
+ * @param time 取得時刻（CLOCK_MONOTONIC、マイクロ秒）。
  */
-void sendDevicePressed(Server *server, int device, unsigned char button);
+void sendDevicePressed(Server *server, int device, unsigned char button, long long time);
 
 /**
  * クライアント群へデバイスリリースイベントを配信。
  * @param server イベントを送信するサーバ。
  * @param device デバイス番号。
  * @param button ボタン番号。
+ * @param time 取得時刻（CLOCK_MONOTONIC、マイクロ秒）。
  */
-void sendDeviceReleased(Server *server, int device, unsigned char button);
+void sendDeviceReleased(Server *server, int device, unsigned char button, long long time);
 
 /**
  * クライアント群へデバイスムーブイベントを配信。
  * @param server イベントを送信するサーバ。
  * @param device デバイス番号。
  * @param positioon デバイスの位置を格納した長さ3の配列。
+ * @param time 取得時刻（CLOCK_MONOTONIC、マイクロ秒）。
  */
-void sendDeviceMoved(Server *server, int device, double position[]);
+void sendDeviceMoved(Server *server, int device, double position[], long long time);
 
 /**
  * クライアント群へデバイススウェイイベントを配信する。
  * @param server イベントを送信するサーバ。
  * @param device デバイス番号。
  * @param posture デバイスの姿勢を格納した長さ3の配列。
+ * @param time 取得時刻（CLOCK_MONOTONIC、マイクロ秒）。
+ */
+void sendDeviceSwayed(Server *server, int device, double posture[], long long time);
+
+/**
+ * デバイスに関連付けられたクライアント数の取得。
+ * @param server 対象のサーバ。
+ * @return クライアント数。
+ */
+int getServerClientsNum(Server *server);
+
+/**
+ * クライアントのソケットに溜まっている未送信バイト数の合計の取得。
+ * @param server 対象のサーバ。
+ * @return 未送信バイト数。
  */
-void sendDeviceSwayed(Server *server, int device, double posture[]);
+long long getServerBacklogBytes(Server *server);
 
 #endif
@@ -0,0 +1,160 @@
+/**
+ * @file FanoutBench.c
+ * 配信スレッドの数に対する配信のスケーリングを計測するベンチマーク。
+ *
+ * 500のクライアントをソケットペアで模し、16デバイスに均等に割り当てる。
+ * 1フレーム（16デバイス分のムーブイベントとスウェイイベント）を配信し、
+ * 全クライアントへの書き込みが終わるまでを1回として繰り返す。
+ * 配信スレッドの数を0（取得スレッドから直接配信）から指定数まで変えて、
+ * 取得スレッドが配信に費やす時間、1フレームの配信にかかる時間、
+ * 1フレームあたりのCPU時間を比較する。
+ *
+ * 使い方: FanoutBench [最大の配信スレッド数] [write|uring]
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "../Server.h"
+#include "../Metrics.h"
+
+#define CLIENTS 500      /**< クライアントの数 */
+#define DEVICES 16       /**< デバイスの数 */
+#define FRAMES 2000      /**< 計測するフレーム数 */
+#define DRAIN_INTERVAL 50 /**< クライアント側のソケットを読み捨てる間隔（フレーム数） */
+
+/**
+ * 指定した時計の現在時刻の取得。
+ * @param clock 時計の種類。
+ * @return ナノ秒単位の時刻。
+ */
+static long long
+now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * クライアント側のソケットに届いたデータを全て読み捨てる。
+ * @param peers クライアント側のソケット。
+ */
+static void
+drain(const int *peers)
+{
+    char buffer[65536];
+    int i;
+
+    for (i = 0; i < CLIENTS; ++i) {
+        while (recv(peers[i], buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+        }
+    }
+}
+
+/**
+ * 指定した配信スレッド数で計測。
+ * @param workersNum 配信スレッドの数。
+ * @param transport クライアントへの書き込み方法。
+ * @return 計測できた場合は0、できなかった場合は0以外。
+ */
+static int
+run(int workersNum, ServerTransport transport)
+{
+    Server server;
+    ServerConfig config;
+    int peers[CLIENTS];
+    long long produce = 0;
+    long long drained = 0;
+    long long drainedCpu = 0;
+    long long start, wallStart, cpuStart;
+    unsigned long long expected;
+    int frame, i;
+
+    initializeServerConfig(&config);
+    config.port = 0;
+    config.workersNum = workersNum;
+    config.transport = transport;
+    if (initializeServer(&server, DEVICES, &config)) {
+        fprintf(stderr, "server initialize error\n");
+        return -1;
+    }
+    for (i = 0; i < CLIENTS; ++i) {
+        int pair[2];
+        ServerSubscription subscription = {i % DEVICES, 0, 0};
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+            perror("socketpair()");
+            return -1;
+        }
+        peers[i] = pair[1];
+        addServerClient(&server, pair[0], &subscription);
+    }
+
+    expected = getMetric(METRIC_SERVER_EVENTS);
+    wallStart = now(CLOCK_MONOTONIC);
+    cpuStart = now(CLOCK_PROCESS_CPUTIME_ID);
+    for (frame = 0; frame < FRAMES; ++frame) {
+        long long time = now(CLOCK_MONOTONIC) / 1000;
+        double value[3] = {frame, frame, frame};
+        int device;
+
+        start = now(CLOCK_MONOTONIC);
+        for (device = 0; device < DEVICES; ++device) {
+            sendDeviceMoved(&server, device, value, time);
+            sendDeviceSwayed(&server, device, value, time);
+        }
+        produce += now(CLOCK_MONOTONIC) - start;
+
+        /* 全クライアントへの書き込みが終わるまで待つ */
+        expected += CLIENTS * 2;
+        while (getMetric(METRIC_SERVER_EVENTS) < expected) {
+            sched_yield();
+        }
+        /* 読み捨ては計測から除く */
+        if (frame % DRAIN_INTERVAL == DRAIN_INTERVAL - 1) {
+            long long cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+            start = now(CLOCK_MONOTONIC);
+            drain(peers);
+            drained += now(CLOCK_MONOTONIC) - start;
+            drainedCpu += now(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+        }
+    }
+    printf("%7d %14.1f %14.1f %14.1f\n", workersNum,
+           produce / 1000.0 / FRAMES,
+           (now(CLOCK_MONOTONIC) - wallStart - drained) / 1000.0 / FRAMES,
+           (now(CLOCK_PROCESS_CPUTIME_ID) - cpuStart - drainedCpu) / 1000.0 / FRAMES);
+
+    finalizeServer(&server);
+    for (i = 0; i < CLIENTS; ++i) {
+        close(peers[i]);
+    }
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int maxWorkers = argc > 1 ? atoi(argv[1]) : 4;
+    ServerTransport transport = SERVER_TRANSPORT_WRITE;
+    int workersNum;
+
+    if (argc > 2 && strcmp(argv[2], "uring") == 0) {
+        transport = SERVER_TRANSPORT_URING;
+    }
+    printf("%d clients on %d devices, %d frames, %s, %ld CPUs online\n",
+           CLIENTS, DEVICES, FRAMES,
+           transport == SERVER_TRANSPORT_URING ? "io_uring" : "write()",
+           sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%7s %14s %14s %14s\n", "workers", "produce us/f", "fan-out us/f", "cpu us/f");
+    for (workersNum = 0; workersNum <= maxWorkers; workersNum = workersNum ? workersNum * 2 : 1) {
+        if (run(workersNum, transport)) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+/**
+ * @file MetricsBench.c
+ * カウンタの加算がレコード処理のスループットに与える影響を計測するベンチマーク。
+ *
+ * Liberty.cとServer.cが1レコードあたりに行う処理（38バイトの複写と検証、
+ * イベントの符号化）を模した処理を、カウンタの加算あり・なしで繰り返し、
+ * 1レコードあたりの時間と240Hz×16センサでのCPU使用率を比較する。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../Metrics.h"
+
+#define RECORD_SIZE 38          /**< デバイスレコード1件分のバイト数 */
+#define EVENT_SIZE 33           /**< デバイスムーブイベント1件分のバイト数 */
+#define SENSORS 16              /**< センサの数 */
+#define RATE 240                /**< 1秒あたりのフレーム数 */
+#define CLIENTS 4               /**< 1デバイスあたりのクライアント数 */
+#define ITERATIONS 2000000      /**< 計測するレコード数 */
+#define ROUNDS 5                /**< 計測の繰り返し回数（最小値を採用） */
+
+/** 最適化で処理が取り除かれないように結果を格納する変数 */
+static volatile unsigned long long sink;
+
+/**
+ * 単調増加する現在時刻の取得。
+ * @return ナノ秒単位の現在時刻。
+ */
+static long long
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * レコードの処理を模した処理を繰り返す。
+ * @param frames 受信したデータ（フレーム単位で並んだレコード）。
+ * @param count 処理するレコード数。
+ * @param metrics カウンタを加算する場合は0以外。
+ * @return 1レコードあたりの時間（ナノ秒）。
+ */
+static double
+run(const unsigned char *frames, int count, int metrics)
+{
+    unsigned char record[RECORD_SIZE];
+    unsigned char event[EVENT_SIZE];
+    unsigned long long check = 0;
+    long long start = now();
+    int i, j;
+
+    for (i = 0; i < count; ++i) {
+        const unsigned char *data = frames + (i % SENSORS) * RECORD_SIZE;
+
+        if (metrics && i % SENSORS == 0) {
+            addMetric(METRIC_LIBERTY_USB_BYTES, SENSORS * RECORD_SIZE);
+        }
+        memcpy(record, data, RECORD_SIZE);
+        if (record[0] != 'L' || record[36] != 0x0d || record[37] != 0x0a) {
+            continue;
+        }
+        if (metrics) {
+            addMetric(METRIC_LIBERTY_RECORDS, 1);
+        }
+        for (j = 0; j < CLIENTS; ++j) {
+            event[0] = 2;
+            memcpy(event + 1, record + 4, EVENT_SIZE - 1);
+            check += event[j + 1];
+            if (metrics) {
+                addMetric(METRIC_SERVER_EVENTS, 1);
+                addMetric(METRIC_SERVER_BYTES, EVENT_SIZE);
+            }
+        }
+    }
+    sink = check;
+    return (double)(now() - start) / count;
+}
+
+int
+main(void)
+{
+    unsigned char frames[SENSORS * RECORD_SIZE];
+    double best[2] = {1e9, 1e9};
+    double perRecord;
+    int round, i;
+
+    for (i = 0; i < SENSORS; ++i) {
+        unsigned char *record = frames + i * RECORD_SIZE;
+        memset(record, i, RECORD_SIZE);
+        record[0] = 'L';
+        record[36] = 0x0d;
+        record[37] = 0x0a;
+    }
+    /* ウォームアップ（スレッドごとのカウンタの登録を含む） */
+    run(frames, ITERATIONS / 10, 1);
+    for (round = 0; round < ROUNDS; ++round) {
+        for (i = 0; i < 2; ++i) {
+            double t = run(frames, ITERATIONS, i);
+            if (t < best[i]) {
+                best[i] = t;
+            }
+        }
+    }
+
+    printf("records per run       : %d (%d clients per device)\n", ITERATIONS, CLIENTS);
+    printf("without counters      : %8.1f ns/record\n", best[0]);
+    printf("with counters         : %8.1f ns/record (%d updates)\n", best[1],
+           2 + 2 * CLIENTS);
+    perRecord = best[1] - best[0];
+    printf("counter cost          : %8.1f ns/record\n", perRecord);
+    printf("at %dHz x %d sensors : %8.4f%% of one CPU (%.1f us/s)\n", RATE, SENSORS,
+           perRecord * RATE * SENSORS / 1e7, perRecord * RATE * SENSORS / 1e3);
+    if (getMetric(METRIC_LIBERTY_RECORDS) == 0) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/**
+ * @file SocketPolicyBench.c
+ * 待ち受けソケットごとの設定が配信の遅延に与える影響を計測するベンチマーク。
+ *
+ * 設定ごとにループバックで待ち受け、TCPで接続したクライアントを
+ * acceptServerで受理して設定を適用する。1フレーム（ムーブイベントと
+ * スウェイイベント）を配信してから、クライアントが2つとも受信し終えるまでの
+ * 時間を一定間隔で繰り返し計測し、分位点を比較する。
+ * 2つ目の小さな書き込みはNagleアルゴリズムと遅延ACKの影響を受けやすい。
+ *
+ * 使い方: SocketPolicyBench [先頭のポート番号] [フレーム数]
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "../Server.h"
+
+#define FRAMES 2000          /**< 既定の計測フレーム数 */
+#define INTERVAL 2000000     /**< フレームの間隔（ナノ秒） */
+#define FRAME_LENGTH 66      /**< 1フレームで届くバイト数 */
+
+/** 比較する設定（ポート番号以降のオプション） */
+static const char *const POLICIES[] = {
+    "",
+    "nodelay",
+    "sndbuf=4096",
+    "nodelay,lowat=4096",
+    "nodelay,busypoll=50",
+    "nodelay,tos=0x10,priority=6",
+    NULL
+};
+
+/**
+ * 現在時刻の取得。
+ * @return ナノ秒単位の時刻。
+ */
+static long long
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * qsort用の比較関数。
+ */
+static int
+compareLatency(const void *a, const void *b)
+{
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * 1つの設定で計測。
+ * @param port 待ち受けポート番号。
+ * @param policy ポート番号以降のオプション。
+ * @param framesNum 計測するフレーム数。
+ * @return 成功した場合は0、失敗した場合は0以外。
+ */
+static int
+run(int port, const char *policy, int framesNum)
+{
+    Server server;
+    ServerConfig config;
+    ServerSubscription subscription = {0, 0, 0};
+    struct sockaddr_in address;
+    struct timespec next;
+    char options[128];
+    char buffer[FRAME_LENGTH];
+    long long *latencies;
+    int peer;
+    int client;
+    int frame;
+
+    initializeServerConfig(&config);
+    snprintf(options, sizeof(options), "%d%s%s", port, *policy ? "," : "", policy);
+    if (parseServerListener(&config, options) || initializeServer(&server, 1, &config)) {
+        fprintf(stderr, "cannot listen on %d,%s\n", port, policy);
+        return -1;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    peer = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(peer, (struct sockaddr *)&address, sizeof(address))
+        || (client = acceptServer(&server, 0)) < 0) {
+        perror("connect");
+        finalizeServer(&server);
+        return -1;
+    }
+    addServerClient(&server, client, &subscription);
+
+    latencies = malloc(sizeof(long long) * framesNum);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (frame = 0; frame < framesNum; ++frame) {
+        double value[3] = {frame, frame, frame};
+        long long start;
+        long long time;
+
+        /* 取得周期を模して一定間隔で配信する */
+        next.tv_nsec += INTERVAL;
+        if (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            ++next.tv_sec;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        start = now();
+        time = start / 1000;
+        sendDeviceMoved(&server, 0, value, time);
+        sendDeviceSwayed(&server, 0, value, time);
+        if (recv(peer, buffer, FRAME_LENGTH, MSG_WAITALL) != FRAME_LENGTH) {
+            perror("recv");
+            break;
+        }
+        latencies[frame] = now() - start;
+    }
+
+    if (frame == framesNum) {
+        qsort(latencies, framesNum, sizeof(long long), compareLatency);
+        printf("%-28s %9.1f %9.1f %9.1f %9.1f\n", *policy ? policy : "(default)",
+               latencies[framesNum / 2] / 1000.0,
+               latencies[framesNum * 99 / 100] / 1000.0,
+               latencies[framesNum * 999 / 1000] / 1000.0,
+               latencies[framesNum - 1] / 1000.0);
+    }
+    free(latencies);
+    close(peer);
+    finalizeServer(&server);
+    return frame == framesNum ? 0 : -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int port = argc > 1 ? atoi(argv[1]) : 12500;
+    int framesNum = argc > 2 ? atoi(argv[2]) : FRAMES;
+    int i;
+
+    printf("loopback TCP, 1 client, %d frames every %d us\n", framesNum, INTERVAL / 1000);
+    printf("%-28s %9s %9s %9s %9s\n", "policy", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (i = 0; POLICIES[i] != NULL; ++i) {
+        if (run(port + i, POLICIES[i], framesNum)) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -13,11 +13,40 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include "IntList.h"
 #include "Server.h"
 #include "Liberty.h"
+#include "Relay.h"
+#include "Realtime.h"
+#include "Latency.h"
+#include "Metrics.h"
+
+/** 購読要求で配信頻度が続くことを示すビット */
+#define SUBSCRIBE_RATE_FLAG 0x80
+/** 購読要求で圧縮イベントを要求することを示すビット */
+#define SUBSCRIBE_COMPACT_FLAG 0x40
 
 /** サーバ */
 static Server server;
+/** 使用するLiberty */
+static LibertyDevice liberties[LIBERTY_UNITS_MAX];
+/** 待ちリストのクライアントごとの受信途中の購読要求（ソケット番号で引く、負数なら無し） */
+static int pendingRequests[FD_SETSIZE];
+/** 遅延の分布の出力要求フラグ */
+static volatile sig_atomic_t latencyReportRequested = 0;
+
+/**
+ * SIGUSR1に対するシグナルハンドラ。
+ * 遅延の分布の出力はメインループで行う。
+ * @param signum シグナル番号。
+ */
+static void
+requestLatencyReport(int signum)
+{
+    latencyReportRequested = 1;
+}
 
 /**
  * Libertyのデバイスムーブイベントに対するコールバック関数。
@@ -25,12 +54,13 @@ static Server server;
  * @param x x座標値。
  * @param y y座標値。
  * @param z z座標値。
+ * @param time 取得時刻。
  */
 static void
-moveDevice(int device, double x, double y, double z)
+moveDevice(int device, double x, double y, double z, long long time)
 {
     double position[] = {x, y, z};
-    sendDeviceMoved(&server, device, position);
+    sendDeviceMoved(&server, device, position, time);
 }
 
 /**
@@ -39,48 +69,50 @@ moveDevice(int device, double x, double y, double z)
  * @param x x軸周りの回転量。
  * @param y y軸周りの回転量。
  * @param z z軸周りの回転量。
+ * @param time 取得時刻。
  */
 static void
-swayDevice(int device, double x, double y, double z)
+swayDevice(int device, double x, double y, double z, long long time)
 {
     double posture[] = {x, y, z};
-    sendDeviceSwayed(&server, device, posture);
+    sendDeviceSwayed(&server, device, posture, time);
 }
 
 /**
  * Libertyのデバイスプレスイベントのコールバック関数。
  * @param device デバイス番号。
+ * @param time 取得時刻。
  */
 static void
-pressDevice(int device)
+pressDevice(int device, long long time)
 {
-    sendDevicePressed(&server, device, (unsigned char)0);
+    sendDevicePressed(&server, device, (unsigned char)0, time);
 }
 
 /**
  * Libertyのデバイスリリースイベントのコールバック関数。
  * @param device デバイス番号。
+ * @param time 取得時刻。
  */
 static void
-releaseDevice(int device)
+releaseDevice(int device, long long time)
 {
-    sendDeviceReleased(&server, device, (unsigned char)0);
+    sendDeviceReleased(&server, device, (unsigned char)0, time);
 }
 
 /**
- * Libertyのメインループを実行。
- * @param arg 使用しない。
- * @return arg。
+ * Libertyのメインループを停止してリソースを解放。
+ * @param unitsNum 停止するLibertyの台数。
  */
-void*
-doLibertyMainLoop(void* arg)
+static void
+finalizeLiberties(int unitsNum)
 {
-    /* Libertyのメインループを開始 */
-    startLibertyMainLoop();
-    /* メインループが終了したらリソースを解放 */
-    finalizeLiberty();
+    int i;
 
-    return arg;
+    for (i = 0; i < unitsNum; ++i) {
+        stopLibertyMainLoop(&liberties[i]);
+        finalizeLiberty(&liberties[i]);
+    }
 }
 
 /**
@@ -100,10 +132,11 @@ getMax(int a, int b)
  * @param fdSet 設定するファイルディスクリプタ集合。
  * @param server 監視するサーバ。
  * @param waitSet 監視する待ちリスト。
+ * @param metricsSocket 監視するメトリクス公開用のソケット。無い場合は-1。
  * @return 監視対象のファイルディスクリプタの値のうち最大の値+1。
  */
 static int
-initializeFdSet(fd_set *fdSet, Server *server, IntList *waitSet)
+initializeFdSet(fd_set *fdSet, Server *server, IntList *waitSet, int metricsSocket)
 {
     int i;
     int maxFdNum = 0;
@@ -116,8 +149,16 @@ initializeFdSet(fd_set *fdSet, Server *server, IntList *waitSet)
     maxFdNum = getMax(maxFdNum, STDIN_FILENO);
 
     /* サーバソケットを監視するように設定 */
-    FD_SET(server->socket, fdSet);
-    maxFdNum = getMax(maxFdNum, server->socket);
+    for (i = 0; i < server->listenersNum; ++i) {
+        FD_SET(server->listeners[i].socket, fdSet);
+        maxFdNum = getMax(maxFdNum, server->listeners[i].socket);
+    }
+
+    /* メトリクス公開用のソケットを監視するように設定 */
+    if (metricsSocket != -1) {
+        FD_SET(metricsSocket, fdSet);
+        maxFdNum = getMax(maxFdNum, metricsSocket);
+    }
 
     /* 待ちリストを監視するように設定 */
     for (i = 0; i < waitSet->size; ++i) {
@@ -128,6 +169,80 @@ initializeFdSet(fd_set *fdSet, Server *server, IntList *waitSet)
     return maxFdNum + 1;
 }
 
+/**
+ * クライアントから購読要求を受信。
+ * 購読要求はデバイス番号の1バイトで、SUBSCRIBE_RATE_FLAGが立っている場合は
+ * 続く1バイトを配信頻度（Hz）として受信する。
+ * SUBSCRIBE_COMPACT_FLAGが立っている場合は圧縮イベントで配信する。
+ * 配信頻度がまだ届いていない場合は先頭の1バイトを保持して戻り、
+ * 再び読み込み可能になった時に続きを受信する。
+ * @param socket クライアントソケット。
+ * @param pending 受信途中の先頭バイトの保持先。受信途中でなければ負数。
+ * @param subscription 購読内容の格納先。
+ * @return 受信できた場合は1、続きを待つ場合は2、切断された場合は0、失敗した場合は-1。
+ */
+static int
+receiveSubscription(int socket, int *pending, ServerSubscription *subscription)
+{
+    unsigned char request[2];
+    int result;
+
+    if (*pending < 0) {
+        result = read(socket, request, 1);
+        if (result != 1) {
+            return result;
+        }
+        if (!(request[0] & SUBSCRIBE_RATE_FLAG)) {
+            subscription->device = request[0] & ~SUBSCRIBE_COMPACT_FLAG;
+            subscription->compact = (request[0] & SUBSCRIBE_COMPACT_FLAG) != 0;
+            subscription->rate = 0;
+            return 1;
+        }
+        *pending = request[0];
+    }
+
+    /* 配信頻度が届かないクライアントでメインループが止まらないよう、待たずに読む */
+    result = recv(socket, request + 1, 1, MSG_DONTWAIT);
+    if (result != 1) {
+        return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 2 : result;
+    }
+    request[0] = (unsigned char)*pending;
+    *pending = -1;
+    subscription->device = request[0] & ~(SUBSCRIBE_RATE_FLAG | SUBSCRIBE_COMPACT_FLAG);
+    subscription->compact = (request[0] & SUBSCRIBE_COMPACT_FLAG) != 0;
+    subscription->rate = request[1];
+    return 1;
+}
+
+/**
+ * 使用方法の表示。
+ * @param name プログラム名。
+ */
+static void
+printUsage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p port] [-l port[,options]]... [-m port] [-w workers] [-t transport] [-n units] [-e emulator-options]... [-u host:port[,devices=N]] [-r realtime-options]\n", name);
+    fprintf(stderr, "  -p port       server port (default: 11113), used when no -l is given\n");
+    fprintf(stderr, "  -l port,opts  listen on port with client socket options (repeatable).\n");
+    fprintf(stderr, "                options: nodelay,sndbuf=BYTES,lowat=BYTES,busypoll=US,\n");
+    fprintf(stderr, "                tos=N,priority=N\n");
+    fprintf(stderr, "  -w workers    number of network threads sending to clients\n");
+    fprintf(stderr, "                (default: 0, send from the acquisition thread)\n");
+    fprintf(stderr, "  -t transport  how to write to clients: write (default) or uring\n");
+    fprintf(stderr, "  -m port       serve prometheus metrics on 127.0.0.1:port\n");
+    fprintf(stderr, "  -n units      number of liberty units to open (default: all connected)\n");
+    fprintf(stderr, "  -e options    use the liberty emulator instead of the device.\n");
+    fprintf(stderr, "                repeat to emulate several units.\n");
+    fprintf(stderr, "                options: sensors=N,rate=HZ,motion=still|orbit|wave,\n");
+    fprintf(stderr, "                corrupt=P,partial=P,disconnect=P,downtime=MS,\n");
+    fprintf(stderr, "                hotplug=MS,seed=N\n");
+    fprintf(stderr, "  -u host:port  relay events from another server instead of liberty.\n");
+    fprintf(stderr, "                options: devices=N (default: %d)\n", RELAY_DEVICES_DEFAULT);
+    fprintf(stderr, "  -r options    run threads with SCHED_FIFO, pinned CPUs and locked memory.\n");
+    fprintf(stderr, "                options: priority=N,acq=CPU[:CPU...],net=CPU[:CPU...],\n");
+    fprintf(stderr, "                probe[=CPU]\n");
+}
+
 /**
  * メイン関数。
  * @argc 引数の数。
@@ -138,29 +253,184 @@ main(int argc, char *argv[])
 {
     /* デバイスへの関連付けが完了していないクライアントのリスト */
     IntList waitSet;
-    /* サーバのポート番号 */
-    const int serverPort = 11113;
+    /* サーバの設定 */
+    ServerConfig serverConfig;
     /* サーバのデバイス数 */
-    const int devicesNum = LIBERTY_SENSOR_NUM;
-    /* Libertyのメインループを実行するスレッド */
-    pthread_t libertyThread;
+    int devicesNum;
+    /* 使用するLibertyの台数（0なら接続されている全て） */
+    int unitsNum = 0;
+    /* 初期化したLibertyの台数 */
+    int initializedNum;
+    /* エミュレータの設定 */
+    LibertyEmulatorConfig emulatorConfigs[LIBERTY_UNITS_MAX];
+    /* エミュレータの台数（0なら実機を使用） */
+    int emulatorsNum = 0;
+    /* 中継の設定 */
+    RelayConfig relayConfig;
+    /* 上流のサーバから中継するかどうか */
+    int relaying = 0;
+    /* 中継 */
+    Relay relay;
+    /* リアルタイムモードの設定 */
+    RealtimeConfig realtimeConfig;
+    int option;
+    int i;
+    int result;
+    /* メトリクス公開用のポート番号（0なら公開しない） */
+    int metricsPort = 0;
+    /* メトリクス公開用のソケット */
+    int metricsSocket = -1;
+    /* シグナルハンドラの設定 */
+    struct sigaction action;
+    /* Libertyのスレッドで受け取らないシグナルの集合 */
+    sigset_t signalSet;
+
+    /* コマンドライン引数を解析 */
+    initializeServerConfig(&serverConfig);
+    initializeRealtimeConfig(&realtimeConfig);
+    while ((option = getopt(argc, argv, "p:l:m:w:t:n:e:u:r:h")) != -1) {
+        switch (option) {
+        case 'p':
+            serverConfig.port = atoi(optarg);
+            break;
+        case 'l':
+            if (parseServerListener(&serverConfig, optarg)) {
+                printf("invalid listener options\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'm':
+            metricsPort = atoi(optarg);
+            break;
+        case 'w':
+            serverConfig.workersNum = atoi(optarg);
+            if (serverConfig.workersNum < 0) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            if (strcmp(optarg, "uring") == 0) {
+                serverConfig.transport = SERVER_TRANSPORT_URING;
+            } else if (strcmp(optarg, "write") == 0) {
+                serverConfig.transport = SERVER_TRANSPORT_WRITE;
+            } else {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            unitsNum = atoi(optarg);
+            if (unitsNum <= 0 || unitsNum > LIBERTY_UNITS_MAX) {
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'e':
+            if (emulatorsNum >= LIBERTY_UNITS_MAX) {
+                printf("too many emulators (max: %d)\n", LIBERTY_UNITS_MAX);
+                return EXIT_FAILURE;
+            }
+            initializeLibertyEmulatorConfig(&emulatorConfigs[emulatorsNum]);
+            if (parseLibertyEmulatorConfig(&emulatorConfigs[emulatorsNum], optarg)) {
+                printf("invalid emulator options\n");
+                return EXIT_FAILURE;
+            }
+            ++emulatorsNum;
+            break;
+        case 'u':
+            if (parseRelayConfig(&relayConfig, optarg)) {
+                printf("invalid relay options\n");
+                return EXIT_FAILURE;
+            }
+            relaying = 1;
+            break;
+        case 'r':
+            if (parseRealtimeConfig(&realtimeConfig, optarg)) {
+                printf("invalid realtime options\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* 以後に確保するメモリも固定されるよう、最初にリアルタイムモードを開始 */
+    initializeRealtime(&realtimeConfig);
+
+    /* 使用するLibertyの台数を決める（中継するなら使用しない） */
+    if (relaying) {
+        unitsNum = 0;
+    } else if (emulatorsNum > 0) {
+        unitsNum = emulatorsNum;
+    } else if (unitsNum == 0) {
+        unitsNum = countLibertyDevices();
+        if (unitsNum == 0) {
+            unitsNum = 1;
+        } else if (unitsNum > LIBERTY_UNITS_MAX) {
+            unitsNum = LIBERTY_UNITS_MAX;
+        }
+    }
+
+    /* Libertyを初期化し、接続されているステーションを確認 */
+    for (initializedNum = 0; initializedNum < unitsNum; ++initializedNum) {
+        LibertyDevice *liberty = &liberties[initializedNum];
+        if (emulatorsNum > 0
+            ? initializeLibertyEmulated(liberty, initializedNum,
+                                        &emulatorConfigs[initializedNum])
+            : initializeLiberty(liberty, initializedNum)) {
+            printf("liberty initialize error\n");
+            finalizeLiberty(liberty);
+            finalizeLiberties(initializedNum);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (relaying) {
+        /* 中継では中継スレッドだけがイベントを渡す */
+        devicesNum = relayConfig.devicesNum;
+        serverConfig.producersNum = 1;
+    } else {
+        /* 後から挿されたセンサも配信できるよう、全てのステーションの分を用意 */
+        devicesNum = unitsNum * LIBERTY_STATION_MAX;
+        serverConfig.producersNum = unitsNum;
+    }
 
     /* SIGPIPE検出時に何もしないように設定 */
     signal(SIGPIPE, SIG_IGN);
 
-    /* サーバを初期化 */
-    if (initializeServer(&server, devicesNum, serverPort)) {
+    /* SIGUSR1で遅延の分布を出力するように設定（selectを中断させるため再開はしない） */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestLatencyReport;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
+    /* サーバを初期化（配信スレッドではSIGUSR1を受け取らない） */
+    sigemptyset(&signalSet);
+    sigaddset(&signalSet, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signalSet, NULL);
+    result = initializeServer(&server, devicesNum, &serverConfig);
+    pthread_sigmask(SIG_UNBLOCK, &signalSet, NULL);
+    if (result) {
         printf("server initialize error\n");
+        finalizeLiberties(unitsNum);
         return EXIT_FAILURE;
     }
-    /* 待ちリストを初期化 */
+    if (serverConfig.transport == SERVER_TRANSPORT_URING && server.urings == NULL) {
+        printf("io_uring is not available, use write()\n");
+    }
+    /* 待ちリストを初期化（select()で扱える数まで確保し、接続時に再割り当てしない） */
     initializeIntList(&waitSet);
+    reserveIntList(&waitSet, FD_SETSIZE);
 
-    /* Libertyを初期化 */
-    if (initializeLiberty()) {
-        printf("liberty initialize error\n");
-        finalizeLiberty();
-        return EXIT_FAILURE;
+    /* メトリクス公開用のソケットを作成 */
+    if (metricsPort > 0) {
+        metricsSocket = openMetricsSocket(metricsPort);
+        if (metricsSocket == -1) {
+            printf("metrics socket error\n");
+        }
     }
 
     /* Libertyのコールバック関数を登録 */
@@ -169,24 +439,43 @@ main(int argc, char *argv[])
     setLibertyPressedFunc(pressDevice);
     setLibertyReleasedFunc(releaseDevice);
 
-    /* Libertyのメインループスレッドを開始 */
-    if (pthread_create(&libertyThread, NULL, doLibertyMainLoop, NULL)) {
+    /* 中継を初期化 */
+    if (relaying && initializeRelay(&relay, &relayConfig, &server)) {
+        printf("relay initialize error\n");
+        finalizeServer(&server);
+        finalizeIntList(&waitSet);
+        return EXIT_FAILURE;
+    }
+
+    /* Libertyごと、または中継のメインループスレッドを開始 */
+    pthread_sigmask(SIG_BLOCK, &signalSet, NULL);
+    for (i = 0, result = 0; i < unitsNum && result == 0; ++i) {
+        result = startLibertyMainLoop(&liberties[i]);
+    }
+    if (relaying) {
+        result = startRelay(&relay);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &signalSet, NULL);
+    if (result) {
         printf("thread creation error\n");
-        finalizeLiberty();
+        finalizeLiberties(unitsNum);
+        if (relaying) {
+            finalizeRelay(&relay);
+        }
         finalizeServer(&server);
         finalizeIntList(&waitSet);
         return EXIT_FAILURE;
     }
 
     /* サーバのループ */
-    puts("pressed [Enter], exit server.");
+    puts("pressed [Enter], exit server. type \"latency\" to show latency report, "
+         "\"latency reset\" to clear it.");
     while (1) {
         fd_set fdSet;
         int i;
-        int result;
 
         /* ファイルディスクリプタ集合の初期化 */
-        result = initializeFdSet(&fdSet, &server, &waitSet);
+        result = initializeFdSet(&fdSet, &server, &waitSet, metricsSocket);
 
         /* タイムアウトを設定 */
         struct timeval timeout;
@@ -194,16 +483,32 @@ main(int argc, char *argv[])
         timeout.tv_usec = 0;
 
         /* 入出力の選択 */
-        if (select(result, &fdSet, NULL, NULL, &timeout) < 0) {
-            perror("select()");
+        result = select(result, &fdSet, NULL, NULL, &timeout);
+
+        /* シグナルで要求されていれば遅延の分布を出力 */
+        if (latencyReportRequested) {
+            latencyReportRequested = 0;
+            printLatencyReport(stdout);
+        }
+        if (result < 0) {
+            if (errno != EINTR) {
+                perror("select()");
+            }
+            continue;
         }
 
-        /* 標準入力から読み込み可能ならループ終了 */
+        /* 標準入力から読み込み可能なら、コマンドを実行するかループ終了 */
         if (FD_ISSET(STDIN_FILENO, &fdSet)) {
             char buffer[256];
             if ((result = read(STDIN_FILENO, buffer, 256)) > 0) {
-                stopLibertyMainLoop();
-                break;
+                if (strncmp(buffer, "latency reset", 13) == 0) {
+                    resetLatency();
+                    puts("latency histograms cleared.");
+                } else if (strncmp(buffer, "latency", 7) == 0) {
+                    printLatencyReport(stdout);
+                } else {
+                    break;
+                }
             }
         } 
 
@@ -211,25 +516,25 @@ main(int argc, char *argv[])
         for (i = 0; i < waitSet.size; ++i) {
             int socket = waitSet.elements[i];
             if (FD_ISSET(socket, &fdSet)) {
-                /* 対象デバイス番号を受信 */
-                unsigned char deviceId;
-                int result = read(socket, &deviceId, 1);
+                /* 対象デバイス番号と配信頻度、符号化形式を受信 */
+                ServerSubscription subscription;
+                int result = receiveSubscription(socket, &pendingRequests[socket],
+                                                 &subscription);
                 switch (result) {
                 case 1:
-                    if (deviceId < server.devicesNum) {
-                        /* サーバのリストにクライアントを追加 */
-                        IntList *clients = &server.clients[deviceId];
-                        pthread_mutex_lock(&clients->mutex);
-                        addIntList(clients, socket);
-                        pthread_mutex_unlock(&clients->mutex);
-                        /* 待ちリストからクライアントを削除 */
-                        removeIntList(&waitSet, socket);
-                        --i;
+                    /* サーバのリストにクライアントを追加し、待ちリストから削除。
+                       存在しないデバイスの要求などで追加できなければ閉じる */
+                    if (addServerClient(&server, socket, &subscription)) {
+                        close(socket);
                     }
+                    removeIntList(&waitSet, socket);
+                    --i;
                     break;
+                case 0:
                 case -1: 
-                    /* 待ちリストからクライアントを削除 */
+                    /* 待ちリストからクライアントを削除して閉じる */
                     removeIntList(&waitSet, socket);
+                    close(socket);
                     --i;
                     break;
                 }
@@ -237,18 +542,40 @@ main(int argc, char *argv[])
         }
 
         /* 接続を受理 */
-        if (FD_ISSET(server.socket, &fdSet)) {
-            result = acceptServer(&server);
-            if (result != -1) {
-                addIntList(&waitSet, result);
+        for (i = 0; i < server.listenersNum; ++i) {
+            if (FD_ISSET(server.listeners[i].socket, &fdSet)) {
+                result = acceptServer(&server, i);
+                if (result >= FD_SETSIZE) {
+                    /* select()で監視できない番号なら閉じる */
+                    close(result);
+                } else if (result != -1) {
+                    pendingRequests[result] = -1;
+                    addIntList(&waitSet, result);
+                }
             }
         }
+
+        /* メトリクスの要求に応答 */
+        if (metricsSocket != -1 && FD_ISSET(metricsSocket, &fdSet)) {
+            setMetricGauge(METRIC_GAUGE_CLIENTS, getServerClientsNum(&server));
+            setMetricGauge(METRIC_GAUGE_WAITING_CLIENTS, waitSet.size);
+            setMetricGauge(METRIC_GAUGE_BACKLOG_BYTES, getServerBacklogBytes(&server));
+            serveMetrics(metricsSocket);
+        }
     }
 
     /* リソースの解放 */
-    pthread_join(libertyThread, NULL);
+    finalizeLiberties(unitsNum);
+    if (relaying) {
+        stopRelay(&relay);
+        finalizeRelay(&relay);
+    }
     finalizeServer(&server);
+    finalizeRealtime();
     finalizeIntList(&waitSet);
+    if (metricsSocket != -1) {
+        close(metricsSocket);
+    }
 
     return EXIT_SUCCESS;
 }
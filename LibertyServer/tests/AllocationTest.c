@@ -0,0 +1,211 @@
+/**
+ * @file AllocationTest.c
+ * 取得から配信までの定常状態でヒープを使用しないことのテスト。
+ *
+ * malloc、calloc、realloc、freeを差し替えて呼び出し回数を数える。
+ * エミュレータの16センサからのデバイスレコードを、全デバイスの購読者
+ * （全て配信、配信頻度の指定、圧縮イベント）へ配信し、
+ * 起動直後の準備が終わってから100000件のデバイスレコードを処理する間、
+ * 一度もヒープを使用しないことを確かめる。
+ * Libertyへのデータ要請ごとの5msの待機があるため、1分ほどかかる。
+ *
+ * 使い方: AllocationTest [配信スレッド数]
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "../Server.h"
+#include "../Liberty.h"
+#include "../Metrics.h"
+
+#define SENSORS 16             /**< エミュレータのセンサ数 */
+#define WARMUP_RECORDS 1000    /**< 計数を始めるまでに処理するデバイスレコード数 */
+#define RECORDS 100000         /**< 計数する間に処理するデバイスレコード数 */
+#define CLIENTS_PER_DEVICE 2   /**< デバイスごとの購読者の数 */
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *pointer, size_t size);
+void __libc_free(void *pointer);
+
+static Server server;
+static volatile int counting = 0;
+static unsigned long long allocations = 0;
+static unsigned long long frees = 0;
+
+/**
+ * mallocの差し替え。
+ */
+void *
+malloc(size_t size)
+{
+    if (counting) {
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    }
+    return __libc_malloc(size);
+}
+
+/**
+ * callocの差し替え。
+ */
+void *
+calloc(size_t count, size_t size)
+{
+    if (counting) {
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    }
+    return __libc_calloc(count, size);
+}
+
+/**
+ * reallocの差し替え。
+ */
+void *
+realloc(void *pointer, size_t size)
+{
+    if (counting) {
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    }
+    return __libc_realloc(pointer, size);
+}
+
+/**
+ * freeの差し替え。
+ */
+void
+free(void *pointer)
+{
+    if (counting && pointer != NULL) {
+        __atomic_add_fetch(&frees, 1, __ATOMIC_RELAXED);
+    }
+    __libc_free(pointer);
+}
+
+static void
+moveDevice(int device, double x, double y, double z, long long time)
+{
+    double position[] = {x, y, z};
+    sendDeviceMoved(&server, device, position, time);
+}
+
+static void
+swayDevice(int device, double x, double y, double z, long long time)
+{
+    double posture[] = {x, y, z};
+    sendDeviceSwayed(&server, device, posture, time);
+}
+
+static void
+pressDevice(int device, long long time)
+{
+    sendDevicePressed(&server, device, (unsigned char)0, time);
+}
+
+static void
+releaseDevice(int device, long long time)
+{
+    sendDeviceReleased(&server, device, (unsigned char)0, time);
+}
+
+/**
+ * 指定した数のデバイスレコードを処理するまで、クライアント側のソケットを読み捨てる。
+ * @param peers クライアント側のソケット。
+ * @param records 待つデバイスレコードの総数。
+ */
+static void
+drainUntil(const int *peers, unsigned long long records)
+{
+    static char buffer[65536];
+    int i;
+
+    while (getMetric(METRIC_LIBERTY_RECORDS) < records) {
+        for (i = 0; i < SENSORS * CLIENTS_PER_DEVICE; ++i) {
+            while (recv(peers[i], buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+            }
+        }
+        usleep(1000);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    ServerConfig config;
+    LibertyEmulatorConfig emulatorConfig;
+    LibertyDevice liberty;
+    char options[] = "sensors=16,rate=0";
+    int peers[SENSORS * CLIENTS_PER_DEVICE];
+    unsigned long long start;
+    void *volatile probe;
+    int i;
+
+    initializeServerConfig(&config);
+    config.port = 0;
+    config.workersNum = argc > 1 ? atoi(argv[1]) : 0;
+    if (initializeServer(&server, SENSORS, &config)) {
+        printf("AllocationTest: cannot initialize server\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < SENSORS * CLIENTS_PER_DEVICE; ++i) {
+        int pair[2];
+        ServerSubscription subscription;
+
+        /* デバイスごとに全て配信する購読者と、配信頻度を指定した購読者を用意 */
+        subscription.device = i % SENSORS;
+        subscription.rate = i < SENSORS ? 0 : 60;
+        subscription.compact = i >= SENSORS && i % 2 == 0;
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+        peers[i] = pair[1];
+        addServerClient(&server, pair[0], &subscription);
+    }
+
+    initializeLibertyEmulatorConfig(&emulatorConfig);
+    if (parseLibertyEmulatorConfig(&emulatorConfig, options)
+        || initializeLibertyEmulated(&liberty, 0, &emulatorConfig)) {
+        printf("AllocationTest: cannot initialize emulator\n");
+        return EXIT_FAILURE;
+    }
+    setLibertyMovedFunc(moveDevice);
+    setLibertySwayedFunc(swayDevice);
+    setLibertyPressedFunc(pressDevice);
+    setLibertyReleasedFunc(releaseDevice);
+    startLibertyMainLoop(&liberty);
+
+    /* 差し替えが効いていることを確かめる */
+    counting = 1;
+    probe = malloc(1);
+    free(probe);
+    counting = 0;
+    if (allocations != 1 || frees != 1) {
+        printf("AllocationTest: malloc is not interposed\n");
+        return EXIT_FAILURE;
+    }
+    allocations = frees = 0;
+
+    /* スレッドの開始やプールの準備が終わってから数え始める */
+    drainUntil(peers, WARMUP_RECORDS);
+    start = getMetric(METRIC_LIBERTY_RECORDS);
+    counting = 1;
+    drainUntil(peers, start + RECORDS);
+    counting = 0;
+
+    printf("%llu records with %d workers: %llu allocations, %llu frees, "
+           "%llu events sent\n",
+           getMetric(METRIC_LIBERTY_RECORDS) - start, config.workersNum,
+           allocations, frees, getMetric(METRIC_SERVER_EVENTS));
+    stopLibertyMainLoop(&liberty);
+    finalizeLiberty(&liberty);
+    finalizeServer(&server);
+
+    if (allocations > 0 || frees > 0) {
+        printf("AllocationTest: heap used in steady state\n");
+        return EXIT_FAILURE;
+    }
+    printf("AllocationTest: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,191 @@
+/**
+ * @file ClientSetTest.c
+ * ClientSetの接続・切断の繰り返しに対するストレステスト。
+ *
+ * 配信スレッドを模したスレッドが全速でスナップショットを走査し、
+ * 時々クライアントを切断（削除）する。同時にメインスレッドを模したスレッドが
+ * 接続（追加）を繰り返し、計測スレッドを模したスレッドも読み取り区間に入る。
+ * 次のことを確かめる。
+ *   - 走査中のスナップショットに、解放処理を終えたクライアントが現れない
+ *   - 削除したクライアントは全て、ちょうど1回ずつ解放処理に渡される
+ *   - 解放処理は配信中にも進む（終了処理まで溜め込まない）
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "../ClientSet.h"
+
+#define CLIENTS_MAX 256      /**< クライアント番号の数 */
+#define DURATION 2           /**< 実行時間（秒） */
+
+/** クライアント番号ごとの状態 */
+enum {
+    CLIENT_FREE,     /**< 未使用（解放処理を終えた） */
+    CLIENT_LIVE,     /**< 集合に含まれる */
+    CLIENT_REMOVED   /**< 集合から削除し、解放処理待ち */
+};
+
+static ClientSet set;
+static int states[CLIENTS_MAX];
+static volatile int finished = 0;
+static unsigned long long broadcasts = 0;
+static unsigned long long added = 0;
+static unsigned long long removed = 0;
+static unsigned long long released = 0;
+static unsigned long long releasedWhileRunning = 0;
+static int failures = 0;
+
+/**
+ * テストの失敗を記録。
+ * @param message 失敗の内容。
+ * @param client 対象のクライアント番号。
+ */
+static void
+fail(const char *message, int client)
+{
+    if (__atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED) < 10) {
+        fprintf(stderr, "FAIL: %s (client %d)\n", message, client);
+    }
+}
+
+/**
+ * 削除したクライアントの解放処理。
+ * @param client 解放するクライアント番号。
+ */
+static void
+releaseClient(int client)
+{
+    int expected = CLIENT_REMOVED;
+    if (!__atomic_compare_exchange_n(&states[client], &expected, CLIENT_FREE, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        fail("released a client that was not removed", client);
+    }
+    __atomic_add_fetch(&released, 1, __ATOMIC_RELAXED);
+    if (!finished) {
+        __atomic_add_fetch(&releasedWhileRunning, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * スナップショットを走査し、全ての要素が解放前であることを確かめる。
+ * @param yield 走査の途中で他のスレッドに実行を譲る場合は0以外。
+ * @return 走査したスナップショットの要素（無ければ-1）の1つ。
+ */
+static int
+scan(int yield)
+{
+    int token;
+    int i;
+    int picked = -1;
+    const ClientSnapshot *clients = beginReadClientSet(&set, &token);
+
+    for (i = 0; i < clients->size; ++i) {
+        int client = clients->elements[i];
+        if (__atomic_load_n(&states[client], __ATOMIC_SEQ_CST) == CLIENT_FREE) {
+            fail("reader saw a released client", client);
+        }
+        if (yield && i == clients->size / 2) {
+            sched_yield();
+        }
+    }
+    if (clients->size > 0) {
+        picked = clients->elements[rand() % clients->size];
+    }
+    endReadClientSet(&set, token);
+    return picked;
+}
+
+/**
+ * 配信スレッドを模したスレッド。全速で走査し、時々クライアントを削除する。
+ * @param arg 使用しない。
+ * @return 使用しない。
+ */
+static void *
+runBroadcaster(void *arg)
+{
+    unsigned int seed = 1;
+
+    while (!finished) {
+        int client = scan(0);
+        if (client >= 0 && rand_r(&seed) % 4 == 0) {
+            /* 書き込みに失敗したクライアントを読み取り区間の外で削除 */
+            if (removeClientSet(&set, client)) {
+                __atomic_store_n(&states[client], CLIENT_REMOVED, __ATOMIC_SEQ_CST);
+                ++removed;
+            }
+        }
+        pollClientSet(&set);
+        ++broadcasts;
+    }
+    return NULL;
+}
+
+/**
+ * メトリクスの集計を模したスレッド。読み取り区間の途中で実行を譲る。
+ * @param arg 使用しない。
+ * @return 使用しない。
+ */
+static void *
+runObserver(void *arg)
+{
+    while (!finished) {
+        scan(1);
+    }
+    return NULL;
+}
+
+int
+main(void)
+{
+    pthread_t broadcaster;
+    pthread_t observer;
+    time_t end;
+    int client = 0;
+    int i;
+
+    initializeClientSet(&set, releaseClient);
+    pthread_create(&broadcaster, NULL, runBroadcaster, NULL);
+    pthread_create(&observer, NULL, runObserver, NULL);
+
+    /* メインスレッドを模して、解放済みのクライアント番号を使い回しながら接続を繰り返す */
+    end = time(NULL) + DURATION;
+    while (time(NULL) < end) {
+        for (i = 0; i < CLIENTS_MAX; ++i) {
+            client = (client + 1) % CLIENTS_MAX;
+            if (__atomic_load_n(&states[client], __ATOMIC_SEQ_CST) == CLIENT_FREE) {
+                break;
+            }
+        }
+        if (i == CLIENTS_MAX) {
+            sched_yield();
+            continue;
+        }
+        __atomic_store_n(&states[client], CLIENT_LIVE, __ATOMIC_SEQ_CST);
+        addClientSet(&set, client);
+        ++added;
+    }
+    finished = 1;
+    pthread_join(broadcaster, NULL);
+    pthread_join(observer, NULL);
+    finalizeClientSet(&set);
+
+    printf("broadcasts %llu, added %llu, removed %llu, released %llu "
+           "(%llu while running)\n",
+           broadcasts, added, removed, released, releasedWhileRunning);
+    if (released != removed) {
+        fail("removed and released counts differ", -1);
+    }
+    if (removed == 0 || releasedWhileRunning == 0) {
+        fail("no client was released while running", -1);
+    }
+    if (failures > 0) {
+        printf("ClientSetTest: %d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("ClientSetTest: ok\n");
+    return EXIT_SUCCESS;
+}
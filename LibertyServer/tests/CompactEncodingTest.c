@@ -0,0 +1,180 @@
+/**
+ * @file CompactEncodingTest.c
+ * 圧縮イベントの符号化と復号のテスト。
+ *
+ * ランダムウォークするデバイスレコードを符号化して連結し、先頭から復号する。
+ * 次のことを確かめる。
+ *   - 位置の誤差が0.005mm以内、姿勢の誤差が0.3度以内で、時刻は一致する
+ *   - 差分とキーフレームの両方が使われる
+ *   - キーフレームより前の差分は読み飛ばされ、復号が先に進む
+ *   - データが足りない場合や圧縮イベントでない場合は負数が返る
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../CompactEncoding.h"
+
+#define RECORDS 100000               /**< 符号化するデバイスレコードの数 */
+#define POSITION_ERROR_MAX 0.0005    /**< 位置の誤差の上限（cm、0.005mm） */
+#define ORIENTATION_ERROR_MAX 0.3    /**< 姿勢の誤差の上限（度） */
+
+static unsigned char stream[RECORDS * COMPACT_KEYFRAME_SIZE];
+static double positions[RECORDS][3];
+static double postures[RECORDS][3];
+static long long times[RECORDS];
+static int failures = 0;
+
+/**
+ * 失敗の記録。
+ * @param message 失敗の内容。
+ * @param index デバイスレコードの番号。
+ */
+static void
+fail(const char *message, int index)
+{
+    if (failures < 10) {
+        printf("record %d: %s\n", index, message);
+    }
+    ++failures;
+}
+
+/**
+ * 範囲内の一様乱数の取得。
+ * @param min 最小値。
+ * @param max 最大値。
+ * @return 乱数。
+ */
+static double
+uniform(double min, double max)
+{
+    return min + (max - min) * rand() / RAND_MAX;
+}
+
+/**
+ * 2つの姿勢の間の回転角の取得。
+ * @param a 単位四元数。
+ * @param b 単位四元数。
+ * @return 回転角（度）。
+ */
+static double
+getAngle(const double a[], const double b[])
+{
+    double dot = fabs(a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + a[3] * b[3]);
+    return 2.0 * acos(dot < 1.0 ? dot : 1.0) * 180.0 / M_PI;
+}
+
+int
+main(void)
+{
+    CompactEncoder encoder;
+    CompactDecoder decoder;
+    CompactRecord record;
+    size_t length = 0;
+    size_t offset;
+    double positionError = 0.0;
+    double orientationError = 0.0;
+    int keyframes = 0;
+    int result;
+    int i;
+    int j;
+
+    /* 小さな動きを基本に、時々差分で表せない移動や時間の空きを混ぜる */
+    srand(1);
+    for (i = 0; i < RECORDS; ++i) {
+        for (j = 0; j < 3; ++j) {
+            positions[i][j] = i == 0 || rand() % 500 == 0 ?
+                uniform(-300.0, 300.0) : positions[i - 1][j] + uniform(-1.0, 1.0);
+        }
+        postures[i][0] = uniform(-180.0, 180.0);
+        postures[i][1] = uniform(-90.0, 90.0);
+        postures[i][2] = uniform(-180.0, 180.0);
+        times[i] = i == 0 ? 1287360000000LL :
+            times[i - 1] + (rand() % 1000 == 0 ? 70000 : 4);
+    }
+
+    initializeCompactEncoder(&encoder);
+    for (i = 0; i < RECORDS; ++i) {
+        size_t size = encodeCompactRecord(&encoder, positions[i], postures[i], times[i],
+                                          0, stream + length);
+        if (size == COMPACT_KEYFRAME_SIZE) {
+            ++keyframes;
+        } else if (size != COMPACT_DELTA_SIZE) {
+            fail("unexpected encoded size", i);
+        }
+        length += size;
+    }
+
+    initializeCompactDecoder(&decoder);
+    for (i = 0, offset = 0; offset < length; ++i) {
+        double quaternion[4];
+
+        result = decodeCompactRecord(&decoder, stream + offset, length - offset, &record);
+        if (result <= 0 || !record.valid) {
+            fail("not decoded", i);
+            break;
+        }
+        offset += result;
+        for (j = 0; j < 3; ++j) {
+            positionError = fmax(positionError, fabs(record.position[j] - positions[i][j]));
+        }
+        convertEulerToQuaternion(postures[i], quaternion);
+        orientationError = fmax(orientationError, getAngle(record.quaternion, quaternion));
+        if (record.time != times[i]) {
+            fail("time differs", i);
+        }
+    }
+    if (i != RECORDS) {
+        fail("record count differs", i);
+    }
+    printf("%d records, %d keyframes, %.2f bytes/record, "
+           "max position error %.5f mm, max orientation error %.4f deg\n",
+           RECORDS, keyframes, (double)length / RECORDS,
+           positionError * 10.0, orientationError);
+    if (positionError > POSITION_ERROR_MAX + 1e-9) {
+        fail("position error exceeds 0.005mm", -1);
+    }
+    if (orientationError > ORIENTATION_ERROR_MAX) {
+        fail("orientation error exceeds 0.3deg", -1);
+    }
+    if (keyframes == 0 || keyframes == RECORDS) {
+        fail("keyframes and deltas are not both used", -1);
+    }
+
+    /* 途中から受信した場合、最初のキーフレームまでの差分は読み飛ばして進む */
+    initializeCompactDecoder(&decoder);
+    offset = COMPACT_KEYFRAME_SIZE;
+    for (i = 1; stream[offset] == COMPACT_DELTA_HEADER; ++i) {
+        result = decodeCompactRecord(&decoder, stream + offset, length - offset, &record);
+        if (result != COMPACT_DELTA_SIZE || record.valid) {
+            fail("delta before keyframe is not skipped", i);
+            break;
+        }
+        offset += result;
+    }
+    result = decodeCompactRecord(&decoder, stream + offset, length - offset, &record);
+    if (result != COMPACT_KEYFRAME_SIZE || !record.valid || record.time != times[i]) {
+        fail("keyframe after skipped deltas is not decoded", i);
+    }
+
+    /* データが足りない場合と圧縮イベントでない場合 */
+    if (decodeCompactRecord(&decoder, stream, COMPACT_KEYFRAME_SIZE - 1, &record) >= 0) {
+        fail("truncated keyframe is accepted", 0);
+    }
+    if (decodeCompactRecord(&decoder, stream + COMPACT_KEYFRAME_SIZE,
+                            COMPACT_DELTA_SIZE - 1, &record) >= 0) {
+        fail("truncated delta is accepted", 1);
+    }
+    stream[0] = 2;
+    if (decodeCompactRecord(&decoder, stream, length, &record) >= 0) {
+        fail("other event is accepted", 0);
+    }
+
+    if (failures > 0) {
+        printf("CompactEncodingTest: %d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("CompactEncodingTest: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+/**
+ * @file UringFailureTest.c
+ * io_uringでの書き込みの発行に失敗したときのストリームの一貫性のテスト。
+ *
+ * リンク時に-Wl,--wrap=submitIoUringでsubmitIoUringを差し替え、
+ * 3回に1回失敗させる。全クライアントに全イベントが順番どおり、
+ * 過不足なく届き、切断されるクライアントがないことを確かめる。
+ *
+ * Oct. 2010 by Muroran Institute of Technology
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "../Server.h"
+#include "../Metrics.h"
+#include "../IoUring.h"
+
+#define CLIENTS_NUM 50       /**< クライアントの数 */
+#define DEVICES_NUM 4        /**< デバイスの数 */
+#define FRAMES_NUM 200       /**< 送るフレームの数 */
+#define DRAIN_INTERVAL 20    /**< 受信側を読み出すフレーム間隔 */
+#define MESSAGE_LENGTH 33    /**< 位置・姿勢メッセージの長さ */
+#define STREAM_LENGTH (FRAMES_NUM * 2 * MESSAGE_LENGTH)
+
+int __real_submitIoUring(IoUring *uring);
+
+static int submissions = 0;
+static int injected = 0;
+static int peers[CLIENTS_NUM];
+static unsigned char streams[CLIENTS_NUM][STREAM_LENGTH];
+static size_t lengths[CLIENTS_NUM];
+
+/**
+ * submitIoUringの差し替え。3回に1回、何も発行せずに失敗する。
+ */
+int
+__wrap_submitIoUring(IoUring *uring)
+{
+    if (++submissions % 3 == 0) {
+        ++injected;
+        return -1;
+    }
+    return __real_submitIoUring(uring);
+}
+
+/**
+ * 受信側のソケットから読めるだけ読み出す。
+ */
+static void
+drainPeers(void)
+{
+    int i;
+    ssize_t received;
+
+    for (i = 0; i < CLIENTS_NUM; ++i) {
+        while ((received = recv(peers[i], streams[i] + lengths[i],
+                                STREAM_LENGTH - lengths[i], MSG_DONTWAIT)) > 0) {
+            lengths[i] += received;
+        }
+    }
+}
+
+int
+main(void)
+{
+    Server server;
+    ServerConfig config;
+    double values[3];
+    int failures = 0;
+    int i;
+    int frame;
+    int device;
+    size_t offset;
+
+    initializeServerConfig(&config);
+    config.port = 0;
+    config.transport = SERVER_TRANSPORT_URING;
+    if (initializeServer(&server, DEVICES_NUM, &config)) {
+        printf("UringFailureTest: cannot initialize server\n");
+        return EXIT_FAILURE;
+    }
+    if (server.urings == NULL) {
+        printf("UringFailureTest: io_uring unavailable, skipped\n");
+        finalizeServer(&server);
+        return EXIT_SUCCESS;
+    }
+    for (i = 0; i < CLIENTS_NUM; ++i) {
+        int pair[2];
+        ServerSubscription subscription = {i % DEVICES_NUM, 0, 0};
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+            perror("socketpair");
+            return EXIT_FAILURE;
+        }
+        peers[i] = pair[1];
+        addServerClient(&server, pair[0], &subscription);
+    }
+
+    for (frame = 0; frame < FRAMES_NUM; ++frame) {
+        values[0] = values[1] = values[2] = frame;
+        for (device = 0; device < DEVICES_NUM; ++device) {
+            sendDeviceMoved(&server, device, values, frame);
+            sendDeviceSwayed(&server, device, values, frame);
+        }
+        if (frame % DRAIN_INTERVAL == DRAIN_INTERVAL - 1) {
+            drainPeers();
+        }
+    }
+    drainPeers();
+
+    /* 位置（先頭2）と姿勢（先頭3）が交互に、欠けも重複もなく届いていること */
+    for (i = 0; i < CLIENTS_NUM; ++i) {
+        if (lengths[i] != STREAM_LENGTH) {
+            printf("client %d: received %zu bytes, expected %d\n",
+                   i, lengths[i], STREAM_LENGTH);
+            ++failures;
+            continue;
+        }
+        for (offset = 0; offset < STREAM_LENGTH; offset += MESSAGE_LENGTH) {
+            if (streams[i][offset] != (offset / MESSAGE_LENGTH % 2 ? 3 : 2)) {
+                printf("client %d: unexpected header %d at %zu\n",
+                       i, streams[i][offset], offset);
+                ++failures;
+                break;
+            }
+        }
+    }
+    if (getMetric(METRIC_SERVER_DISCONNECTS) != 0) {
+        printf("%llu clients disconnected\n", getMetric(METRIC_SERVER_DISCONNECTS));
+        ++failures;
+    }
+    finalizeServer(&server);
+
+    printf("submissions %d, injected failures %d\n", submissions, injected);
+    if (injected == 0) {
+        printf("UringFailureTest: no failure was injected\n");
+        ++failures;
+    }
+    if (failures > 0) {
+        printf("UringFailureTest: %d failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("UringFailureTest: ok\n");
+    return EXIT_SUCCESS;
+}
@@ -755,8 +755,16 @@ API_EXPORTED int libusb_open(libusb_device *dev, libusb_device_handle **handle)
 	if (r)
 		return LIBUSB_ERROR_OTHER;
 
+	r = pthread_mutex_init(&_handle->sync_transfer_lock, NULL);
+	if (r) {
+		pthread_mutex_destroy(&_handle->lock);
+		free(_handle);
+		return LIBUSB_ERROR_OTHER;
+	}
+
 	_handle->dev = libusb_ref_device(dev);
 	_handle->claimed_interfaces = 0;
+	_handle->sync_transfer = NULL;
 	memset(&_handle->os_priv, 0, priv_size);
 
 	r = usbi_backend->open(_handle);
@@ -873,6 +881,8 @@ static void do_close(struct libusb_context *ctx,
 
 	usbi_backend->close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
+	libusb_free_transfer(dev_handle->sync_transfer);
+	pthread_mutex_destroy(&dev_handle->sync_transfer_lock);
 	free(dev_handle);
 }
 
@@ -1222,6 +1232,51 @@ API_EXPORTED int libusb_reset_device(libusb_device_handle *dev)
 	return usbi_backend->reset_device(dev);
 }
 
+/** \ingroup dev
+ * Allocate memory for transfer buffers that the device can access directly.
+ * On Linux this memory is mapped from usbfs, so that transfers using it are
+ * done without copying the data between user space and the kernel.
+ *
+ * The memory is tied to the device handle: free it with libusb_dev_mem_free()
+ * before closing the handle. Each transfer buffer must lie entirely within
+ * one allocation.
+ *
+ * \param dev a device handle
+ * \param length size of the buffer in bytes
+ * \returns a pointer to the new buffer, or NULL if the platform or kernel
+ * does not support it. Use ordinary memory in that case.
+ * \see libusb_dev_mem_free()
+ */
+API_EXPORTED unsigned char *libusb_dev_mem_alloc(libusb_device_handle *dev,
+	size_t length)
+{
+	usbi_dbg("length %zu", length);
+	if (usbi_backend->dev_mem_alloc)
+		return usbi_backend->dev_mem_alloc(dev, length);
+	else
+		return NULL;
+}
+
+/** \ingroup dev
+ * Free memory obtained from libusb_dev_mem_alloc().
+ *
+ * \param dev the device handle the memory was allocated for
+ * \param buffer the buffer to free
+ * \param length the length passed to libusb_dev_mem_alloc()
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms without device memory
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+API_EXPORTED int libusb_dev_mem_free(libusb_device_handle *dev,
+	unsigned char *buffer, size_t length)
+{
+	usbi_dbg("length %zu", length);
+	if (usbi_backend->dev_mem_free)
+		return usbi_backend->dev_mem_free(dev, buffer, length);
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
 /** \ingroup dev
  * Determine if a kernel driver is active on an interface. If a kernel driver
  * is active, you cannot claim the interface, and libusb will be unable to
@@ -1403,6 +1458,7 @@ API_EXPORTED void libusb_exit(struct libusb_context *ctx)
 	if (!list_empty(&ctx->open_devs))
 		usbi_warn(ctx, "application left some devices open");
 
+	libusb_stop_event_thread(ctx);
 	usbi_io_exit(ctx);
 	if (usbi_backend->exit)
 		usbi_backend->exit();
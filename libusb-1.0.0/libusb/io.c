@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -941,17 +942,41 @@ int usbi_io_init(struct libusb_context *ctx)
 	pthread_mutex_init(&ctx->event_waiters_lock, NULL);
 	pthread_cond_init(&ctx->event_waiters_cond, NULL);
 	list_init(&ctx->flying_transfers);
+	ctx->timeout_heap = NULL;
+	ctx->timeout_heap_size = 0;
+	ctx->timeout_heap_capacity = 0;
 	list_init(&ctx->pollfds);
+	ctx->pollfds_generation = 0;
+	ctx->event_fds = NULL;
+	ctx->event_fd_handles = NULL;
+	ctx->event_fds_capacity = 0;
+	ctx->event_nfds = 0;
+	/* differs from pollfds_generation so the first poll builds the array */
+	ctx->event_fds_generation = ~0U;
 
 	/* FIXME should use an eventfd on kernels that support it */
 	r = pipe(ctx->ctrl_pipe);
 	if (r < 0)
 		return LIBUSB_ERROR_OTHER;
 
-	r = usbi_add_pollfd(ctx, ctx->ctrl_pipe[0], POLLIN);
+	r = usbi_add_pollfd(ctx, ctx->ctrl_pipe[0], POLLIN, NULL);
 	if (r < 0)
 		return r;
 
+	/* must be registered right after the ctrl pipe: handle_events() expects
+	 * it at fds[1] */
+	ctx->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (ctx->timerfd >= 0) {
+		usbi_dbg("using timerfd for timeouts");
+		r = usbi_add_pollfd(ctx, ctx->timerfd, POLLIN, NULL);
+		if (r < 0) {
+			close(ctx->timerfd);
+			return r;
+		}
+	} else {
+		usbi_dbg("timerfd not available, errno=%d", errno);
+	}
+
 	return 0;
 }
 
@@ -960,6 +985,13 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_remove_pollfd(ctx, ctx->ctrl_pipe[0]);
 	close(ctx->ctrl_pipe[0]);
 	close(ctx->ctrl_pipe[1]);
+	if (ctx->timerfd >= 0) {
+		usbi_remove_pollfd(ctx, ctx->timerfd);
+		close(ctx->timerfd);
+	}
+	free(ctx->event_fds);
+	free(ctx->event_fd_handles);
+	free(ctx->timeout_heap);
 }
 
 static int calculate_timeout(struct usbi_transfer *transfer)
@@ -969,8 +1001,11 @@ static int calculate_timeout(struct usbi_transfer *transfer)
 	unsigned int timeout =
 		__USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout;
 
-	if (!timeout)
+	if (!timeout) {
+		/* the transfer may be resubmitted after using a timeout */
+		timerclear(&transfer->timeout);
 		return 0;
+	}
 
 	r = clock_gettime(CLOCK_MONOTONIC, &current_time);
 	if (r < 0) {
@@ -991,42 +1026,140 @@ static int calculate_timeout(struct usbi_transfer *transfer)
 	return 0;
 }
 
-static void add_to_flying_list(struct usbi_transfer *transfer)
+/* the timeout heap helpers below must be called with flying_transfers_lock
+ * held. */
+
+static void timeout_heap_set(struct libusb_context *ctx, int index,
+	struct usbi_transfer *transfer)
 {
-	struct usbi_transfer *cur;
-	struct timeval *timeout = &transfer->timeout;
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	
-	pthread_mutex_lock(&ctx->flying_transfers_lock);
+	ctx->timeout_heap[index] = transfer;
+	transfer->timeout_index = index;
+}
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&transfer->list, &ctx->flying_transfers);
-		goto out;
+static void timeout_heap_sift_up(struct libusb_context *ctx, int index)
+{
+	struct usbi_transfer *transfer = ctx->timeout_heap[index];
+
+	while (index > 0) {
+		int parent = (index - 1) / 2;
+		struct usbi_transfer *cur = ctx->timeout_heap[parent];
+		if (!timercmp(&transfer->timeout, &cur->timeout, <))
+			break;
+		timeout_heap_set(ctx, index, cur);
+		index = parent;
 	}
+	timeout_heap_set(ctx, index, transfer);
+}
 
-	/* if we have infinite timeout, append to end of list */
-	if (!timerisset(timeout)) {
-		list_add_tail(&transfer->list, &ctx->flying_transfers);
-		goto out;
+static void timeout_heap_sift_down(struct libusb_context *ctx, int index)
+{
+	struct usbi_transfer *transfer = ctx->timeout_heap[index];
+	int size = ctx->timeout_heap_size;
+
+	while (1) {
+		int child = index * 2 + 1;
+		struct usbi_transfer *cur;
+		if (child >= size)
+			break;
+		if (child + 1 < size && timercmp(&ctx->timeout_heap[child + 1]->timeout,
+				&ctx->timeout_heap[child]->timeout, <))
+			child++;
+		cur = ctx->timeout_heap[child];
+		if (!timercmp(&cur->timeout, &transfer->timeout, <))
+			break;
+		timeout_heap_set(ctx, index, cur);
+		index = child;
 	}
+	timeout_heap_set(ctx, index, transfer);
+}
 
-	/* otherwise, find appropriate place in list */
-	list_for_each_entry(cur, &ctx->flying_transfers, list) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timeval *cur_tv = &cur->timeout;
+static int timeout_heap_push(struct libusb_context *ctx,
+	struct usbi_transfer *transfer)
+{
+	if (ctx->timeout_heap_size == ctx->timeout_heap_capacity) {
+		int capacity = ctx->timeout_heap_capacity ?
+			ctx->timeout_heap_capacity * 2 : 16;
+		struct usbi_transfer **heap = realloc(ctx->timeout_heap,
+			sizeof(*heap) * capacity);
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->timeout_heap = heap;
+		ctx->timeout_heap_capacity = capacity;
+	}
+	ctx->timeout_heap[ctx->timeout_heap_size] = transfer;
+	timeout_heap_sift_up(ctx, ctx->timeout_heap_size++);
+	return 0;
+}
 
-		if (!timerisset(cur_tv) || (cur_tv->tv_sec > timeout->tv_sec) ||
-				(cur_tv->tv_sec == timeout->tv_sec &&
-					cur_tv->tv_usec > timeout->tv_usec)) {
-			list_add_tail(&transfer->list, &cur->list);
-			goto out;
-		}
+static void timeout_heap_remove(struct libusb_context *ctx,
+	struct usbi_transfer *transfer)
+{
+	int index = transfer->timeout_index;
+	struct usbi_transfer *last;
+
+	if (index < 0)
+		return;
+	transfer->timeout_index = -1;
+	last = ctx->timeout_heap[--ctx->timeout_heap_size];
+	if (last == transfer)
+		return;
+
+	/* move the last element into the hole and restore the heap order */
+	ctx->timeout_heap[index] = last;
+	last->timeout_index = index;
+	timeout_heap_sift_up(ctx, index);
+	timeout_heap_sift_down(ctx, last->timeout_index);
+}
+
+/* arm the timerfd to the earliest timeout on the heap, or disarm it if the
+ * heap is empty. call whenever the top of the heap changes, with
+ * flying_transfers_lock held. */
+static void arm_timerfd(struct libusb_context *ctx)
+{
+	struct itimerspec it;
+
+	if (ctx->timerfd < 0)
+		return;
+
+	memset(&it, 0, sizeof(it));
+	if (ctx->timeout_heap_size > 0) {
+		struct timeval *tv = &ctx->timeout_heap[0]->timeout;
+		it.it_value.tv_sec = tv->tv_sec;
+		it.it_value.tv_nsec = tv->tv_usec * 1000;
 	}
+	if (timerfd_settime(ctx->timerfd, TFD_TIMER_ABSTIME, &it, NULL) < 0)
+		usbi_warn(ctx, "failed to arm timerfd, errno=%d", errno);
+}
 
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&transfer->list, &ctx->flying_transfers);
-out:
+static int add_to_flying_list(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int r = 0;
+
+	pthread_mutex_lock(&ctx->flying_transfers_lock);
+	transfer->timeout_index = -1;
+	if (timerisset(&transfer->timeout))
+		r = timeout_heap_push(ctx, transfer);
+	if (r == 0) {
+		list_add_tail(&transfer->list, &ctx->flying_transfers);
+		if (transfer->timeout_index == 0)
+			arm_timerfd(ctx);
+	}
+	pthread_mutex_unlock(&ctx->flying_transfers_lock);
+	return r;
+}
+
+static void remove_from_flying_list(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int was_first;
+
+	pthread_mutex_lock(&ctx->flying_transfers_lock);
+	list_del(&transfer->list);
+	was_first = transfer->timeout_index == 0;
+	timeout_heap_remove(ctx, transfer);
+	if (was_first)
+		arm_timerfd(ctx);
 	pthread_mutex_unlock(&ctx->flying_transfers_lock);
 }
 
@@ -1067,6 +1200,7 @@ API_EXPORTED struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
 
 	memset(itransfer, 0, alloc_size);
 	itransfer->num_iso_packets = iso_packets;
+	itransfer->timeout_index = -1;
 	return __USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 }
 
@@ -1121,13 +1255,12 @@ API_EXPORTED int libusb_submit_transfer(struct libusb_transfer *transfer)
 	if (r < 0)
 		return LIBUSB_ERROR_OTHER;
 
-	add_to_flying_list(itransfer);
+	r = add_to_flying_list(itransfer);
+	if (r < 0)
+		return r;
 	r = usbi_backend->submit_transfer(itransfer);
-	if (r) {
-		pthread_mutex_lock(&TRANSFER_CTX(transfer)->flying_transfers_lock);
-		list_del(&itransfer->list);
-		pthread_mutex_unlock(&TRANSFER_CTX(transfer)->flying_transfers_lock);
-	}
+	if (r)
+		remove_from_flying_list(itransfer);
 
 	return r;
 }
@@ -1173,9 +1306,7 @@ void usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	struct libusb_context *ctx = TRANSFER_CTX(transfer);
 	uint8_t flags;
 
-	pthread_mutex_lock(&ctx->flying_transfers_lock);
-	list_del(&itransfer->list);
-	pthread_mutex_unlock(&ctx->flying_transfers_lock);
+	remove_from_flying_list(itransfer);
 
 	if (status == LIBUSB_TRANSFER_COMPLETED
 			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
@@ -1483,11 +1614,12 @@ static int handle_timeouts(struct libusb_context *ctx)
 	struct timespec systime_ts;
 	struct timeval systime;
 	struct usbi_transfer *transfer;
+	int popped = 0;
 	int r = 0;
 
 	USBI_GET_CONTEXT(ctx);
 	pthread_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers))
+	if (ctx->timeout_heap_size == 0)
 		goto out;
 
 	/* get current time */
@@ -1497,63 +1629,93 @@ static int handle_timeouts(struct libusb_context *ctx)
 
 	TIMESPEC_TO_TIMEVAL(&systime, &systime_ts);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list) {
-		struct timeval *cur_tv = &transfer->timeout;
+	/* pop all transfers that have expired timeouts off the heap. a handled
+	 * timeout is not on the heap any more, so it is not handled twice. */
+	while (ctx->timeout_heap_size > 0) {
+		transfer = ctx->timeout_heap[0];
 
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!timerisset(cur_tv))
-			goto out;
-
-		/* ignore timeouts we've already handled */
-		if (transfer->flags & USBI_TRANSFER_TIMED_OUT)
-			continue;
+		/* if the earliest timeout has not expired, nothing more to do */
+		if (timercmp(&transfer->timeout, &systime, >))
+			break;
 
-		/* if transfer has non-expired timeout, nothing more to do */
-		if ((cur_tv->tv_sec > systime.tv_sec) ||
-				(cur_tv->tv_sec == systime.tv_sec &&
-					cur_tv->tv_usec > systime.tv_usec))
-			goto out;
-	
-		/* otherwise, we've got an expired timeout to handle */
+		timeout_heap_remove(ctx, transfer);
 		handle_timeout(transfer);
+		popped = 1;
 	}
+	if (popped)
+		arm_timerfd(ctx);
 
 out:
 	pthread_mutex_unlock(&ctx->flying_transfers_lock);
 	return r;
 }
 
-/* do the actual event handling. assumes that no other thread is concurrently
- * doing the same thing. */
-static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+/* bring ctx->event_fds up to date with ctx->pollfds. the array is only
+ * rebuilt when an fd has been added or removed since the last call.
+ * must be called with events_lock held. */
+static int update_event_fds(struct libusb_context *ctx)
 {
-	int r;
 	struct usbi_pollfd *ipollfd;
 	nfds_t nfds = 0;
 	struct pollfd *fds;
+	struct libusb_device_handle **handles;
 	int i = -1;
-	int timeout_ms;
 
 	pthread_mutex_lock(&ctx->pollfds_lock);
+	if (ctx->event_fds_generation == ctx->pollfds_generation) {
+		pthread_mutex_unlock(&ctx->pollfds_lock);
+		return 0;
+	}
+
 	list_for_each_entry(ipollfd, &ctx->pollfds, list)
 		nfds++;
 
-	/* TODO: malloc when number of fd's changes, not on every poll */
-	fds = malloc(sizeof(*fds) * nfds);
-	if (!fds)
-		return LIBUSB_ERROR_NO_MEM;
+	if (nfds > ctx->event_fds_capacity) {
+		fds = realloc(ctx->event_fds, sizeof(*fds) * nfds);
+		if (fds)
+			ctx->event_fds = fds;
+		handles = realloc(ctx->event_fd_handles, sizeof(*handles) * nfds);
+		if (handles)
+			ctx->event_fd_handles = handles;
+		if (!fds || !handles) {
+			pthread_mutex_unlock(&ctx->pollfds_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		ctx->event_fds_capacity = nfds;
+	}
+	fds = ctx->event_fds;
+	handles = ctx->event_fd_handles;
 
 	list_for_each_entry(ipollfd, &ctx->pollfds, list) {
 		struct libusb_pollfd *pollfd = &ipollfd->pollfd;
-		int fd = pollfd->fd;
 		i++;
-		fds[i].fd = fd;
+		fds[i].fd = pollfd->fd;
 		fds[i].events = pollfd->events;
 		fds[i].revents = 0;
+		handles[i] = ipollfd->handle;
 	}
+	ctx->event_nfds = nfds;
+	ctx->event_fds_generation = ctx->pollfds_generation;
 	pthread_mutex_unlock(&ctx->pollfds_lock);
+	usbi_dbg("rebuilt poll array with %d fds", nfds);
+	return 0;
+}
+
+/* do the actual event handling. assumes that no other thread is concurrently
+ * doing the same thing. */
+static int handle_events(struct libusb_context *ctx, struct timeval *tv)
+{
+	int r;
+	int i;
+	nfds_t nfds;
+	struct pollfd *fds;
+	int timeout_ms;
+
+	r = update_event_fds(ctx);
+	if (r < 0)
+		return r;
+	fds = ctx->event_fds;
+	nfds = ctx->event_nfds;
 
 	timeout_ms = (tv->tv_sec * 1000) + (tv->tv_usec / 1000);
 
@@ -1565,17 +1727,31 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	r = poll(fds, nfds, timeout_ms);
 	usbi_dbg("poll() returned %d", r);
 	if (r == 0) {
-		free(fds);
 		return handle_timeouts(ctx);
 	} else if (r == -1 && errno == EINTR) {
-		free(fds);
 		return LIBUSB_ERROR_INTERRUPTED;
 	} else if (r < 0) {
-		free(fds);
 		usbi_err(ctx, "poll failed %d err=%d\n", r, errno);
 		return LIBUSB_ERROR_IO;
 	}
 
+	/* fd[1] is the timerfd when it is in use. it fires when the earliest
+	 * transfer timeout expires; handle timeouts and hide it from the
+	 * backend */
+	if (ctx->timerfd >= 0 && fds[1].revents) {
+		uint64_t expirations;
+
+		if (read(ctx->timerfd, &expirations, sizeof(expirations)) < 0
+				&& errno != EAGAIN)
+			usbi_warn(ctx, "timerfd read failed, errno=%d", errno);
+		fds[1].revents = 0;
+		i = handle_timeouts(ctx);
+		if (i < 0)
+			return i;
+		if (--r == 0)
+			return 0;
+	}
+
 	/* fd[0] is always the ctrl pipe */
 	if (fds[0].revents) {
 		/* another thread wanted to interrupt event handling, and it succeeded!
@@ -1597,7 +1773,6 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
 handled:
-	free(fds);
 	return r;
 }
 
@@ -1611,7 +1786,15 @@ static int get_next_timeout(libusb_context *ctx, struct timeval *tv,
 	struct timeval *out)
 {
 	struct timeval timeout;
-	int r = libusb_get_next_timeout(ctx, &timeout);
+	int r;
+
+	/* with a timerfd, transfer timeouts wake poll() by themselves */
+	if (ctx->timerfd >= 0) {
+		*out = *tv;
+		return 0;
+	}
+
+	r = libusb_get_next_timeout(ctx, &timeout);
 	if (r) {
 		/* timeout already expired? */
 		if (!timerisset(&timeout))
@@ -1710,6 +1893,125 @@ API_EXPORTED int libusb_handle_events(libusb_context *ctx)
 	return libusb_handle_events_timeout(ctx, &tv);
 }
 
+static void *event_thread_main(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	struct timeval tv;
+	int r;
+
+	usbi_dbg("event thread started");
+	for (;;) {
+		if (libusb_try_lock_events(ctx) == 0) {
+			/* someone stopping the thread after this check interrupts the
+			 * poll through the control pipe */
+			if (!ctx->event_thread_stop) {
+				tv.tv_sec = 60;
+				tv.tv_usec = 0;
+				r = libusb_handle_events_locked(ctx, &tv);
+				if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+					usbi_warn(ctx, "event handling failed, error %d", r);
+			}
+			libusb_unlock_events(ctx);
+		}
+
+		/* either way, wait while someone else holds the event lock (poll fds
+		 * being modified). checking for stop under the event waiters lock
+		 * means the wakeup from libusb_stop_event_thread() is not lost. */
+		libusb_lock_event_waiters(ctx);
+		if (ctx->event_thread_stop) {
+			libusb_unlock_event_waiters(ctx);
+			break;
+		}
+		if (libusb_event_handler_active(ctx))
+			libusb_wait_for_event(ctx, NULL);
+		libusb_unlock_event_waiters(ctx);
+	}
+	usbi_dbg("event thread stopped");
+	return NULL;
+}
+
+/** \ingroup poll
+ * Start an internal thread which handles all events on the context. This is
+ * an alternative to running a dedicated event handling thread in the
+ * application.
+ *
+ * While the thread runs, the synchronous I/O functions no longer handle
+ * events on the calling thread. Each waiting thread instead blocks on an
+ * eventfd of its own, which is signalled when its transfer completes, so
+ * several threads doing synchronous I/O do not contend for the event lock.
+ * Callbacks of asynchronous transfers run on the internal thread.
+ *
+ * The thread is stopped by libusb_stop_event_thread() or libusb_exit().
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success, or if the thread is already running
+ * \returns LIBUSB_ERROR_OTHER if the thread could not be created
+ */
+API_EXPORTED int libusb_start_event_thread(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (ctx->event_thread_running)
+		return 0;
+
+	ctx->event_thread_stop = 0;
+	ctx->event_thread_running = 1;
+	if (pthread_create(&ctx->event_thread, NULL, event_thread_main, ctx)) {
+		usbi_err(ctx, "failed to create event thread, errno=%d", errno);
+		ctx->event_thread_running = 0;
+		return LIBUSB_ERROR_OTHER;
+	}
+	return 0;
+}
+
+/** \ingroup poll
+ * Stop the internal event thread started by libusb_start_event_thread() and
+ * wait for it to exit. Synchronous I/O must not be in progress on other
+ * threads. Does nothing if the thread is not running.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ */
+API_EXPORTED void libusb_stop_event_thread(libusb_context *ctx)
+{
+	unsigned char dummy = 1;
+	ssize_t r;
+
+	USBI_GET_CONTEXT(ctx);
+	if (!ctx->event_thread_running)
+		return;
+
+	libusb_lock_event_waiters(ctx);
+	ctx->event_thread_stop = 1;
+	pthread_cond_broadcast(&ctx->event_waiters_cond);
+	libusb_unlock_event_waiters(ctx);
+
+	/* interrupt the poll in the same way as libusb_open() does. the dummy
+	 * data is read back once the thread has gone. */
+	pthread_mutex_lock(&ctx->pollfd_modify_lock);
+	ctx->pollfd_modify++;
+	pthread_mutex_unlock(&ctx->pollfd_modify_lock);
+	r = write(ctx->ctrl_pipe[1], &dummy, sizeof(dummy));
+	if (r <= 0)
+		usbi_warn(ctx, "internal signalling write failed");
+
+	pthread_join(ctx->event_thread, NULL);
+	ctx->event_thread_running = 0;
+
+	if (r > 0) {
+		libusb_lock_events(ctx);
+		r = read(ctx->ctrl_pipe[0], &dummy, sizeof(dummy));
+		if (r <= 0)
+			usbi_warn(ctx, "internal signalling read failed");
+		pthread_mutex_lock(&ctx->pollfd_modify_lock);
+		ctx->pollfd_modify--;
+		pthread_mutex_unlock(&ctx->pollfd_modify_lock);
+		libusb_unlock_events(ctx);
+	} else {
+		pthread_mutex_lock(&ctx->pollfd_modify_lock);
+		ctx->pollfd_modify--;
+		pthread_mutex_unlock(&ctx->pollfd_modify_lock);
+	}
+}
+
 /** \ingroup poll
  * Handle any pending events by polling file descriptors, without checking if
  * any other threads are already doing so. Must be called with the event lock
@@ -1762,6 +2064,10 @@ API_EXPORTED int libusb_handle_events_locked(libusb_context *ctx,
  * so you should call libusb_handle_events_timeout() or similar immediately.
  * A return code of 0 indicates that there are no pending timeouts.
  *
+ * If libusb_pollfds_handle_timeouts() returns 1, timeouts are also signalled
+ * through one of libusb's file descriptors, so calling this function is
+ * optional. It still reports the next timeout.
+ *
  * \param ctx the context to operate on, or NULL for the default context
  * \param tv output location for a relative time against the current
  * clock in which libusb must be called into in order to process timeout events
@@ -1771,43 +2077,24 @@ API_EXPORTED int libusb_handle_events_locked(libusb_context *ctx,
 API_EXPORTED int libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv)
 {
-	struct usbi_transfer *transfer;
 	struct timespec cur_ts;
 	struct timeval cur_tv;
-	struct timeval *next_timeout;
+	struct timeval next_timeout_tv;
+	struct timeval *next_timeout = &next_timeout_tv;
 	int r;
-	int found = 0;
 
 	USBI_GET_CONTEXT(ctx);
+
+	/* the top of the heap is the earliest timeout not yet handled */
 	pthread_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
+	if (ctx->timeout_heap_size == 0) {
 		pthread_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg("no URBs, no timeout!");
+		usbi_dbg("no URBs with pending timeouts, no timeout!");
 		return 0;
 	}
-
-	/* find next transfer which hasn't already been processed as timed out */
-	list_for_each_entry(transfer, &ctx->flying_transfers, list) {
-		if (!(transfer->flags & USBI_TRANSFER_TIMED_OUT)) {
-			found = 1;
-			break;
-		}
-	}
+	next_timeout_tv = ctx->timeout_heap[0]->timeout;
 	pthread_mutex_unlock(&ctx->flying_transfers_lock);
 
-	if (!found) {
-		usbi_dbg("all URBs have already been processed for timeouts");
-		return 0;
-	}
-
-	next_timeout = &transfer->timeout;
-
-	/* no timeout for next transfer */
-	if (!timerisset(next_timeout)) {
-		usbi_dbg("no URBs with timeouts, no timeout!");
-		return 0;
-	}
-
 	r = clock_gettime(CLOCK_MONOTONIC, &cur_ts);
 	if (r < 0) {
 		usbi_err(ctx, "failed to read monotonic clock, errno=%d", errno);
@@ -1860,7 +2147,8 @@ API_EXPORTED void libusb_set_pollfd_notifiers(libusb_context *ctx,
 /* Add a file descriptor to the list of file descriptors to be monitored.
  * events should be specified as a bitmask of events passed to poll(), e.g.
  * POLLIN and/or POLLOUT. */
-int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
+int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events,
+	struct libusb_device_handle *handle)
 {
 	struct usbi_pollfd *ipollfd = malloc(sizeof(*ipollfd));
 	if (!ipollfd)
@@ -1869,8 +2157,10 @@ int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
 	usbi_dbg("add fd %d events %d", fd, events);
 	ipollfd->pollfd.fd = fd;
 	ipollfd->pollfd.events = events;
+	ipollfd->handle = handle;
 	pthread_mutex_lock(&ctx->pollfds_lock);
 	list_add_tail(&ipollfd->list, &ctx->pollfds);
+	ctx->pollfds_generation++;
 	pthread_mutex_unlock(&ctx->pollfds_lock);
 
 	if (ctx->fd_added_cb)
@@ -1878,6 +2168,16 @@ int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events)
 	return 0;
 }
 
+/* Return the device handle registered with the fd at the given index of the
+ * array passed to the backend's handle_events(). Only valid from within
+ * handle_events(); handles cannot be closed while events are being handled,
+ * so the returned pointer stays valid for the duration of the call. */
+struct libusb_device_handle *usbi_get_pollfd_handle(
+	struct libusb_context *ctx, nfds_t index)
+{
+	return ctx->event_fd_handles[index];
+}
+
 /* Remove a file descriptor from the list of file descriptors to be polled. */
 void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 {
@@ -1899,12 +2199,29 @@ void usbi_remove_pollfd(struct libusb_context *ctx, int fd)
 	}
 
 	list_del(&ipollfd->list);
+	ctx->pollfds_generation++;
 	pthread_mutex_unlock(&ctx->pollfds_lock);
 	free(ipollfd);
 	if (ctx->fd_removed_cb)
 		ctx->fd_removed_cb(fd, ctx->fd_cb_user_data);
 }
 
+/** \ingroup poll
+ * Determine whether libusb's file descriptors also signal transfer timeouts.
+ * If so, an application that polls libusb's file descriptors itself does not
+ * need to call libusb_get_next_timeout(); activity on the file descriptors
+ * indicates that libusb_handle_events_timeout() should be called.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 1 if timeouts are handled through the file descriptors, 0 if the
+ * application must still consult libusb_get_next_timeout()
+ */
+API_EXPORTED int libusb_pollfds_handle_timeouts(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	return ctx->timerfd >= 0;
+}
+
 /** \ingroup poll
  * Retrieve a list of file descriptors that should be polled by your main loop
  * as libusb event sources.
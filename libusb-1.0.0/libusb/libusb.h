@@ -536,6 +536,7 @@ struct libusb_control_setup {
 struct libusb_context;
 struct libusb_device;
 struct libusb_device_handle;
+struct libusb_bulk_reader;
 
 /** \ingroup lib
  * Structure representing a libusb session. The concept of individual libusb
@@ -584,6 +585,16 @@ typedef struct libusb_device libusb_device;
  */
 typedef struct libusb_device_handle libusb_device_handle;
 
+/** \ingroup syncio
+ * Structure representing a prepared synchronous reader for one bulk or
+ * interrupt IN endpoint. This is an opaque type obtained from
+ * libusb_open_bulk_reader() and destroyed with libusb_close_bulk_reader().
+ *
+ * The reader allocates its transfers and buffers once, so repeated reads
+ * from the same endpoint do not allocate anything.
+ */
+typedef struct libusb_bulk_reader libusb_bulk_reader;
+
 /** \ingroup misc
  * Error codes. Most libusb functions return 0 on success or one of these
  * codes on failure.
@@ -794,6 +805,10 @@ int libusb_kernel_driver_active(libusb_device_handle *dev, int interface);
 int libusb_detach_kernel_driver(libusb_device_handle *dev, int interface);
 int libusb_attach_kernel_driver(libusb_device_handle *dev, int interface);
 
+unsigned char *libusb_dev_mem_alloc(libusb_device_handle *dev, size_t length);
+int libusb_dev_mem_free(libusb_device_handle *dev, unsigned char *buffer,
+	size_t length);
+
 /* async I/O */
 
 /** \ingroup asyncio
@@ -1091,6 +1106,27 @@ int libusb_interrupt_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
 
+/** \ingroup syncio
+ * Flags for libusb_open_bulk_reader() */
+enum libusb_bulk_reader_flags {
+	/** Submit the next read as soon as one completes, before its data is
+	 * returned to the caller, so that the endpoint always has a read
+	 * queued while the caller is busy. */
+	LIBUSB_BULK_READER_DOUBLE_BUFFER = 1<<0,
+
+	/** Use interrupt transfers rather than bulk transfers */
+	LIBUSB_BULK_READER_INTERRUPT = 1<<1,
+};
+
+int libusb_open_bulk_reader(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int length, unsigned int timeout, int flags,
+	libusb_bulk_reader **reader);
+int libusb_bulk_reader_read(libusb_bulk_reader *reader, unsigned char *data,
+	int length, int *actual_length);
+int libusb_bulk_reader_read_buffer(libusb_bulk_reader *reader,
+	unsigned char **data, int *actual_length);
+void libusb_close_bulk_reader(libusb_bulk_reader *reader);
+
 /** \ingroup desc
  * Retrieve a descriptor from the default control pipe.
  * This is a convenience function which formulates the appropriate control
@@ -1149,8 +1185,11 @@ int libusb_wait_for_event(libusb_context *ctx, struct timeval *tv);
 
 int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv);
 int libusb_handle_events(libusb_context *ctx);
+int libusb_start_event_thread(libusb_context *ctx);
+void libusb_stop_event_thread(libusb_context *ctx);
 int libusb_handle_events_locked(libusb_context *ctx, struct timeval *tv);
 int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv);
+int libusb_pollfds_handle_timeouts(libusb_context *ctx);
 
 /** \ingroup poll
  * File descriptor for polling
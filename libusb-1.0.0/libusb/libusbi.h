@@ -148,6 +148,12 @@ struct libusb_context {
 	 * something needs to modify poll fds. */
 	int ctrl_pipe[2];
 
+	/* timerfd armed to the earliest flying-transfer timeout, so that
+	 * timeouts show up as fd events with sub-millisecond precision. -1 when
+	 * the kernel does not support timerfd, in which case the poll timeout is
+	 * shortened to the next transfer timeout instead. */
+	int timerfd;
+
 	struct list_head usb_devs;
 	pthread_mutex_t usb_devs_lock;
 
@@ -156,17 +162,26 @@ struct libusb_context {
 	struct list_head open_devs;
 	pthread_mutex_t open_devs_lock;
 
-	/* this is a list of in-flight transfer handles, sorted by timeout 
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
+	/* this is a list of in-flight transfer handles, in no particular order.
+	 * transfers with a timeout are also kept in timeout_heap, a binary
+	 * min-heap ordered by expiration, so that the next timeout is found in
+	 * constant time and submission/completion cost O(log n). transfers are
+	 * taken off the heap once their timeout has been handled. both are
+	 * protected by flying_transfers_lock. the heap array grows on demand and
+	 * is never shrunk. */
 	struct list_head flying_transfers;
+	struct usbi_transfer **timeout_heap;
+	int timeout_heap_size;
+	int timeout_heap_capacity;
 	pthread_mutex_t flying_transfers_lock;
 
 	/* list of poll fds */
 	struct list_head pollfds;
 	pthread_mutex_t pollfds_lock;
 
+	/* bumped whenever pollfds changes. protected by pollfds_lock. */
+	unsigned int pollfds_generation;
+
 	/* a counter that is set when we want to interrupt event handling, in order
 	 * to modify the poll fd set. and a lock to protect it. */
 	unsigned int pollfd_modify;
@@ -180,6 +195,17 @@ struct libusb_context {
 	/* ensures that only one thread is handling events at any one time */
 	pthread_mutex_t events_lock;
 
+	/* array passed to poll() by the event handler. protected by events_lock.
+	 * rebuilt from pollfds only when pollfds_generation has moved on from
+	 * event_fds_generation. grown when more fds are registered than it can
+	 * hold, never shrunk, so that steady-state event handling does not
+	 * allocate. */
+	struct pollfd *event_fds;
+	struct libusb_device_handle **event_fd_handles;
+	nfds_t event_fds_capacity;
+	nfds_t event_nfds;
+	unsigned int event_fds_generation;
+
 	/* used to see if there is an active thread doing event handling */
 	int event_handler_active;
 
@@ -187,6 +213,14 @@ struct libusb_context {
 	 * event handling */
 	pthread_mutex_t event_waiters_lock;
 	pthread_cond_t event_waiters_cond;
+
+	/* internal event handling thread, see libusb_start_event_thread().
+	 * while it runs, synchronous I/O waits for completion on an eventfd of
+	 * the waiting thread instead of handling events itself. event_thread_stop
+	 * is protected by event_waiters_lock. */
+	pthread_t event_thread;
+	int event_thread_running;
+	int event_thread_stop;
 };
 
 struct libusb_device {
@@ -213,6 +247,14 @@ struct libusb_device_handle {
 
 	struct list_head list;
 	struct libusb_device *dev;
+
+	/* transfer reused by synchronous bulk/interrupt I/O on this handle, so
+	 * that repeated reads do not allocate. allocated on first use. the lock
+	 * is held while the transfer is in use; concurrent synchronous callers
+	 * fall back to a freshly allocated transfer. */
+	struct libusb_transfer *sync_transfer;
+	pthread_mutex_t sync_transfer_lock;
+
 	unsigned char os_priv[0];
 };
 
@@ -235,6 +277,8 @@ struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
 	struct timeval timeout;
+	/* position in ctx->timeout_heap, or -1 when not on the heap */
+	int timeout_index;
 	int transferred;
 	uint8_t flags;
 };
@@ -289,11 +333,17 @@ struct usbi_pollfd {
 	/* must come first */
 	struct libusb_pollfd pollfd;
 
+	/* device handle the fd belongs to, or NULL for internal fds */
+	struct libusb_device_handle *handle;
+
 	struct list_head list;
 };
 
-int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events);
+int usbi_add_pollfd(struct libusb_context *ctx, int fd, short events,
+	struct libusb_device_handle *handle);
 void usbi_remove_pollfd(struct libusb_context *ctx, int fd);
+struct libusb_device_handle *usbi_get_pollfd_handle(
+	struct libusb_context *ctx, nfds_t index);
 
 /* device discovery */
 
@@ -667,6 +717,26 @@ struct usbi_os_backend {
 	int (*attach_kernel_driver)(struct libusb_device_handle *handle,
 		int interface);
 
+	/* Allocate memory for transfer buffers which the device can read and
+	 * write without an intermediate copy, e.g. DMA memory mapped from the
+	 * kernel. Optional.
+	 *
+	 * Return the buffer, or NULL if the platform or the device does not
+	 * support it (the caller then falls back on ordinary memory).
+	 */
+	unsigned char *(*dev_mem_alloc)(struct libusb_device_handle *handle,
+		size_t len);
+
+	/* Free memory obtained from dev_mem_alloc. Optional, but required if
+	 * dev_mem_alloc is implemented.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - another LIBUSB_ERROR code on failure
+	 */
+	int (*dev_mem_free)(struct libusb_device_handle *handle,
+		unsigned char *buffer, size_t len);
+
 	/* Destroy a device. Optional.
 	 *
 	 * This function is called when the last reference to a device is
@@ -716,7 +786,9 @@ struct usbi_os_backend {
 	 * indicates the number of file descriptors that have reported events
 	 * (i.e. the poll() return value). This should be enough information
 	 * for you to determine which actions need to be taken on the currently
-	 * active transfers.
+	 * active transfers. usbi_get_pollfd_handle() returns the device handle
+	 * that was registered with the fd at a given index of the array, so the
+	 * handle can be found without searching the open devices.
 	 *
 	 * For any cancelled transfers, call usbi_handle_transfer_cancellation().
 	 * For completed transfers, call usbi_handle_transfer_completion().
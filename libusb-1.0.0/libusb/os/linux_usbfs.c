@@ -29,8 +29,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 
 #include "libusb.h"
@@ -71,14 +73,45 @@ static int sysfs_can_relate_devices = -1;
 /* do we have a descriptors file? */
 static int sysfs_has_descriptors = -1;
 
+/* does the kernel support USBFS_URB_BULK_CONTINUATION? (Linux 2.6.32+) used
+ * when the kernel is too old to report its capabilities per device. */
+static int supports_flag_bulk_continuation = -1;
+
 struct linux_device_priv {
 	char *sysfs_dir;
 	unsigned char *dev_descriptor;
 	unsigned char *config_descriptor;
 };
 
+/* upper bound on the URBs reaped per wakeup, so that a device completing
+ * URBs as fast as we can reap them cannot starve the other fds */
+#define MAX_REAP_BATCH		32
+
+/* reap statistics, reported through usbi_dbg() when the handle is closed */
+struct linux_reap_stats {
+	unsigned long wakeups;		/* wakeups that reaped at least one URB */
+	unsigned long completions;	/* URBs reaped in total */
+	unsigned int max_batch;		/* most URBs reaped in a single wakeup */
+	unsigned long full_batches;	/* wakeups that hit MAX_REAP_BATCH */
+};
+
+/* URB arrays of up to URB_CACHE_URBS entries (bulk transfers up to 64kb,
+ * and all control transfers) are allocated at that size and kept on a small
+ * per-handle free list when their transfer completes, so that a steady
+ * stream of small transfers does not go through the allocator every time */
+#define URB_CACHE_URBS		4
+#define URB_CACHE_SIZE		8
+
 struct linux_device_handle_priv {
 	int fd;
+	unsigned int caps;	/* USBFS_CAP_* */
+	struct linux_reap_stats reap_stats;
+
+	/* protects urb_cache: transfers are submitted from application threads
+	 * but complete in the event handling thread */
+	pthread_mutex_t urb_cache_lock;
+	struct usbfs_urb *urb_cache[URB_CACHE_SIZE];
+	int urb_cache_count;
 };
 
 enum reap_action {
@@ -92,6 +125,9 @@ enum reap_action {
 
 	/* completed multi-URB transfer in non-final URB */
 	COMPLETED_EARLY,
+
+	/* a non-final URB of a multi-URB transfer failed */
+	ERROR,
 };
 
 struct linux_transfer_priv {
@@ -105,6 +141,13 @@ struct linux_transfer_priv {
 	unsigned int awaiting_reap;
 	unsigned int awaiting_discard;
 
+	/* bulk/interrupt: URBs reaped, or never submitted, so far. the transfer
+	 * is reported once all of its URBs have retired. */
+	int num_retired;
+
+	/* bulk/interrupt: status reported for COMPLETED_EARLY and ERROR */
+	enum libusb_transfer_status reap_status;
+
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
 };
@@ -166,6 +209,26 @@ static const char *find_usbfs_path(void)
 	return ret;
 }
 
+static int kernel_version_ge(int major, int minor, int sublevel)
+{
+	struct utsname uts;
+	int atoms, kmajor, kminor, ksublevel;
+
+	if (uname(&uts) < 0)
+		return 0;
+	atoms = sscanf(uts.release, "%d.%d.%d", &kmajor, &kminor, &ksublevel);
+	if (atoms < 2)
+		return 0;
+	if (atoms < 3)
+		ksublevel = 0;
+
+	if (kmajor != major)
+		return kmajor > major;
+	if (kminor != minor)
+		return kminor > minor;
+	return ksublevel >= sublevel;
+}
+
 static int op_init(struct libusb_context *ctx)
 {
 	struct stat statbuf;
@@ -177,6 +240,12 @@ static int op_init(struct libusb_context *ctx)
 		return LIBUSB_ERROR_OTHER;
 	}
 
+	if (supports_flag_bulk_continuation == -1) {
+		supports_flag_bulk_continuation = kernel_version_ge(2, 6, 32);
+		usbi_dbg("bulk continuation flag %ssupported",
+			supports_flag_bulk_continuation ? "" : "not ");
+	}
+
 	r = stat(SYSFS_DEVICE_PATH, &statbuf);
 	if (r == 0 && S_ISDIR(statbuf.st_mode)) {
 		usbi_dbg("found usb devices in sysfs");
@@ -986,12 +1055,34 @@ static int op_open(struct libusb_device_handle *handle)
 		}
 	}
 
-	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	if (ioctl(hpriv->fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps) < 0) {
+		hpriv->caps = supports_flag_bulk_continuation ?
+			USBFS_CAP_BULK_CONTINUATION : 0;
+	}
+	usbi_dbg("usbfs capabilities 0x%x", hpriv->caps);
+
+	pthread_mutex_init(&hpriv->urb_cache_lock, NULL);
+	hpriv->urb_cache_count = 0;
+
+	return usbi_add_pollfd(HANDLE_CTX(handle), hpriv->fd, POLLOUT, handle);
 }
 
 static void op_close(struct libusb_device_handle *dev_handle)
 {
-	int fd = __device_handle_priv(dev_handle)->fd;
+	struct linux_device_handle_priv *hpriv = __device_handle_priv(dev_handle);
+	struct linux_reap_stats *stats = &hpriv->reap_stats;
+	int fd = hpriv->fd;
+	int i;
+
+	for (i = 0; i < hpriv->urb_cache_count; i++)
+		free(hpriv->urb_cache[i]);
+	hpriv->urb_cache_count = 0;
+	pthread_mutex_destroy(&hpriv->urb_cache_lock);
+
+	if (stats->wakeups)
+		usbi_dbg("reaped %lu urbs in %lu wakeups (max %u per wakeup, "
+			"%lu full batches)", stats->completions, stats->wakeups,
+			stats->max_batch, stats->full_batches);
 	usbi_remove_pollfd(HANDLE_CTX(dev_handle), fd);
 	close(fd);
 }
@@ -1222,6 +1313,33 @@ static int op_attach_kernel_driver(struct libusb_device_handle *handle,
 	return 0;
 }
 
+/* usbfs supports mmap() of DMA-able memory since Linux 4.6. URBs whose
+ * buffer lies within such a mapping are handed to the host controller
+ * directly instead of being copied through a kernel buffer. */
+static unsigned char *op_dev_mem_alloc(struct libusb_device_handle *handle,
+	size_t len)
+{
+	struct linux_device_handle_priv *hpriv = __device_handle_priv(handle);
+	unsigned char *buffer;
+
+	buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, hpriv->fd, 0);
+	if (buffer == MAP_FAILED) {
+		usbi_dbg("usbfs mmap failed, errno=%d", errno);
+		return NULL;
+	}
+	return buffer;
+}
+
+static int op_dev_mem_free(struct libusb_device_handle *handle,
+	unsigned char *buffer, size_t len)
+{
+	if (munmap(buffer, len) != 0) {
+		usbi_err(HANDLE_CTX(handle), "free dev mem failed errno %d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+	return 0;
+}
+
 static void op_destroy_device(struct libusb_device *dev)
 {
 	struct linux_device_priv *priv = __device_priv(dev);
@@ -1235,6 +1353,60 @@ static void op_destroy_device(struct libusb_device *dev)
 		free(priv->sysfs_dir);
 }
 
+/* allocate a zeroed array of num_urbs URBs for a bulk, interrupt or control
+ * transfer, preferably from the handle's cache */
+static int alloc_transfer_urbs(struct usbi_transfer *itransfer, int num_urbs)
+{
+	struct libusb_transfer *transfer =
+		__USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_device_handle_priv *hpriv =
+		__device_handle_priv(transfer->dev_handle);
+	struct usbfs_urb *urbs = NULL;
+	size_t alloc_size = num_urbs * sizeof(struct usbfs_urb);
+
+	if (num_urbs <= URB_CACHE_URBS) {
+		pthread_mutex_lock(&hpriv->urb_cache_lock);
+		if (hpriv->urb_cache_count > 0)
+			urbs = hpriv->urb_cache[--hpriv->urb_cache_count];
+		pthread_mutex_unlock(&hpriv->urb_cache_lock);
+		if (!urbs)
+			urbs = malloc(URB_CACHE_URBS * sizeof(struct usbfs_urb));
+	} else {
+		urbs = malloc(alloc_size);
+	}
+	if (!urbs)
+		return LIBUSB_ERROR_NO_MEM;
+
+	memset(urbs, 0, alloc_size);
+	tpriv->urbs = urbs;
+	tpriv->num_urbs = num_urbs;
+	return 0;
+}
+
+/* release the URB array of a bulk, interrupt or control transfer, returning
+ * it to the handle's cache if it has room */
+static void free_transfer_urbs(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		__USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_device_handle_priv *hpriv =
+		__device_handle_priv(transfer->dev_handle);
+	struct usbfs_urb *urbs = tpriv->urbs;
+
+	tpriv->urbs = NULL;
+	if (tpriv->num_urbs <= URB_CACHE_URBS) {
+		pthread_mutex_lock(&hpriv->urb_cache_lock);
+		if (hpriv->urb_cache_count < URB_CACHE_SIZE) {
+			hpriv->urb_cache[hpriv->urb_cache_count++] = urbs;
+			urbs = NULL;
+		}
+		pthread_mutex_unlock(&hpriv->urb_cache_lock);
+	}
+	free(urbs);
+}
+
 static void free_iso_urbs(struct linux_transfer_priv *tpriv)
 {
 	int i;
@@ -1248,6 +1420,27 @@ static void free_iso_urbs(struct linux_transfer_priv *tpriv)
 	free(tpriv->iso_urbs);
 }
 
+/* discard URBs first..last-1 of a bulk transfer. each of them is reaped later
+ * whether the discard succeeded or the URB had already completed (EINVAL), and
+ * counts towards num_retired then. */
+static void discard_bulk_urbs(struct usbi_transfer *itransfer, int first,
+	int last)
+{
+	struct libusb_transfer *transfer =
+		__USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct linux_device_handle_priv *dpriv =
+		__device_handle_priv(transfer->dev_handle);
+	int i;
+
+	for (i = first; i < last; i++) {
+		int tmp = ioctl(dpriv->fd, IOCTL_USBFS_DISCARDURB, &tpriv->urbs[i]);
+		if (tmp && errno != EINVAL)
+			usbi_warn(TRANSFER_CTX(transfer),
+				"unrecognised discard return %d", errno);
+	}
+}
+
 static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 	unsigned char urb_type)
 {
@@ -1257,49 +1450,63 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 	struct linux_device_handle_priv *dpriv =
 		__device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb *urbs;
+	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
+		== LIBUSB_ENDPOINT_OUT;
+	int use_bulk_continuation = dpriv->caps & USBFS_CAP_BULK_CONTINUATION;
+	int bulk_buffer_length = MAX_BULK_BUFFER_LENGTH;
 	int r;
 	int i;
-	size_t alloc_size;
-
-	/* usbfs places a 16kb limit on bulk URBs. we divide up larger requests
-	 * into smaller units to meet such restriction, then fire off all the
-	 * units at once. it would be simpler if we just fired one unit at a time,
-	 * but there is a big performance gain through doing it this way. */
-	int num_urbs = transfer->length / MAX_BULK_BUFFER_LENGTH;
+	int num_urbs;
 	int last_urb_partial = 0;
 
-	if ((transfer->length % MAX_BULK_BUFFER_LENGTH) > 0) {
+	/* kernels without a packet size limit take the whole buffer in a single
+	 * URB. otherwise usbfs places a 16kb limit on bulk URBs. we divide up
+	 * larger requests into smaller units to meet such restriction, then fire
+	 * off all the units at once. it would be simpler if we just fired one
+	 * unit at a time, but there is a big performance gain through doing it
+	 * this way. */
+	if ((dpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM) && transfer->length > 0)
+		bulk_buffer_length = transfer->length;
+
+	num_urbs = transfer->length / bulk_buffer_length;
+	if ((transfer->length % bulk_buffer_length) > 0) {
 		last_urb_partial = 1;
 		num_urbs++;
 	}
 	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
 		transfer->length);
-	alloc_size = num_urbs * sizeof(struct usbfs_urb);
-	urbs = malloc(alloc_size);
-	if (!urbs)
-		return LIBUSB_ERROR_NO_MEM;
-	memset(urbs, 0, alloc_size);
-	tpriv->urbs = urbs;
-	tpriv->num_urbs = num_urbs;
-	tpriv->awaiting_discard = 0;
-	tpriv->awaiting_reap = 0;
+	r = alloc_transfer_urbs(itransfer, num_urbs);
+	if (r < 0)
+		return r;
+	urbs = tpriv->urbs;
+	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
+	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
 
 	for (i = 0; i < num_urbs; i++) {
 		struct usbfs_urb *urb = &urbs[i];
 		urb->usercontext = itransfer;
 		urb->type = urb_type;
 		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * MAX_BULK_BUFFER_LENGTH);
+		urb->buffer = transfer->buffer + (i * bulk_buffer_length);
 		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % MAX_BULK_BUFFER_LENGTH;
+			urb->buffer_length = transfer->length % bulk_buffer_length;
 		else
-			urb->buffer_length = MAX_BULK_BUFFER_LENGTH;
+			urb->buffer_length = bulk_buffer_length;
+
+		/* with bulk continuation, a short packet in a non-final URB ends
+		 * it with -EREMOTEIO and the kernel stops the endpoint queue until
+		 * the remaining URBs of this transfer have been cancelled, so no
+		 * data following the short packet ends up in a later URB */
+		if (use_bulk_continuation) {
+			if (!is_out && i < num_urbs - 1)
+				urb->flags = USBFS_URB_SHORT_NOT_OK;
+			if (i > 0)
+				urb->flags |= USBFS_URB_BULK_CONTINUATION;
+		}
 
 		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 		if (r < 0) {
-			int j;
-
 			if (errno == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
 			} else {
@@ -1312,7 +1519,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 			 * return failure immediately. */
 			if (i == 0) {
 				usbi_dbg("first URB failed, easy peasy");
-				free(urbs);
+				free_transfer_urbs(itransfer);
 				return r;
 			}
 
@@ -1328,22 +1535,15 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer,
 			 * so, in this case we discard all the previous URBs BUT we report
 			 * that the transfer was submitted successfully. then later when
 			 * the final discard completes we can report error to the user.
+			 * the URBs that were never submitted count as retired already.
 			 */
 			tpriv->reap_action = SUBMIT_FAILED;
-			for (j = 0; j < i; j++) {
-				int tmp = ioctl(dpriv->fd, IOCTL_USBFS_DISCARDURB, &urbs[j]);
-				if (tmp == 0)
-					tpriv->awaiting_discard++;
-				else if (errno == EINVAL)
-					tpriv->awaiting_reap++;
-				else
-					usbi_warn(TRANSFER_CTX(transfer),
-						"unrecognised discard return %d", tmp);
-			}
+			tpriv->reap_status = LIBUSB_TRANSFER_ERROR;
+			tpriv->num_retired = num_urbs - i;
+			discard_bulk_urbs(itransfer, 0, i);
 
 			usbi_dbg("reporting successful submission but waiting for %d "
-				"discards and %d reaps before reporting error",
-				tpriv->awaiting_discard, tpriv->awaiting_reap);
+				"URBs to be reaped before reporting error", i);
 			return 0;
 		}
 	}
@@ -1520,11 +1720,10 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = malloc(sizeof(struct usbfs_urb));
-	if (!urb)
-		return LIBUSB_ERROR_NO_MEM;
-	memset(urb, 0, sizeof(struct usbfs_urb));
-	tpriv->urbs = urb;
+	r = alloc_transfer_urbs(itransfer, 1);
+	if (r < 0)
+		return r;
+	urb = tpriv->urbs;
 	tpriv->reap_action = NORMAL;
 
 	urb->usercontext = itransfer;
@@ -1535,7 +1734,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 
 	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
+		free_transfer_urbs(itransfer);
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
 
@@ -1595,25 +1794,9 @@ static int cancel_control_transfer(struct usbi_transfer *itransfer)
 static void cancel_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
-	struct libusb_transfer *transfer =
-		__USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct linux_device_handle_priv *dpriv =
-		__device_handle_priv(transfer->dev_handle);
-	int i;
 
 	tpriv->reap_action = CANCELLED;
-	tpriv->awaiting_reap = 0;
-	tpriv->awaiting_discard = 0;
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		int tmp = ioctl(dpriv->fd, IOCTL_USBFS_DISCARDURB, &tpriv->urbs[i]);
-		if (tmp == 0)
-			tpriv->awaiting_discard++;
-		else if (errno == EINVAL)
-			tpriv->awaiting_reap++;
-		else
-			usbi_warn(TRANSFER_CTX(transfer),
-				"unrecognised discard return %d", errno);
-	}
+	discard_bulk_urbs(itransfer, 0, tpriv->num_urbs);
 }
 
 static void cancel_iso_transfer(struct usbi_transfer *itransfer)
@@ -1672,7 +1855,7 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		free(tpriv->urbs);
+		free_transfer_urbs(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		free_iso_urbs(tpriv);
@@ -1687,6 +1870,8 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	struct usbfs_urb *urb)
 {
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct libusb_transfer *transfer =
+		__USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int num_urbs = tpriv->num_urbs;
 	int urb_idx = urb - tpriv->urbs;
 	enum libusb_transfer_status status = LIBUSB_TRANSFER_COMPLETED;
@@ -1694,119 +1879,97 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 	usbi_dbg("handling completion status %d of bulk urb %d/%d", urb->status,
 		urb_idx + 1, num_urbs);
 
-	if (urb->status == 0 ||
-			(urb->status == -EOVERFLOW && urb->actual_length > 0))
-		itransfer->transferred += urb->actual_length;
+	tpriv->num_retired++;
 
 	if (tpriv->reap_action != NORMAL) {
-		/* cancelled, submit_fail, or completed early */
-		if (urb->status == -ENOENT) {
-			usbi_dbg("CANCEL: detected a cancelled URB");
-			if (tpriv->awaiting_discard == 0)
-				usbi_err(ITRANSFER_CTX(itransfer),
-					"CANCEL: cancelled URB but not awaiting discards?");
-			else
-				tpriv->awaiting_discard--;
-		} else if (urb->status == 0) {
-			usbi_dbg("CANCEL: detected a completed URB");
-
-			/* FIXME we could solve this extreme corner case with a memmove
-			 * or something */
-			if (tpriv->reap_action == COMPLETED_EARLY)
-				usbi_warn(ITRANSFER_CTX(itransfer), "SOME DATA LOST! "
-					"(completed early but remaining urb completed)");
-
-			if (tpriv->awaiting_reap == 0)
-				usbi_err(ITRANSFER_CTX(itransfer),
-					"CANCEL: completed URB not awaiting reap?");
-			else
-				tpriv->awaiting_reap--;
-		} else if (urb->status == -EPIPE || urb->status == -EOVERFLOW) {
-			if (tpriv->awaiting_reap == 0)
-				usbi_err(ITRANSFER_CTX(itransfer),
-					"CANCEL: completed URB not awaiting reap?");
-			else
-				tpriv->awaiting_reap--;
-		} else {
-			usbi_warn(ITRANSFER_CTX(itransfer),
-				"unhandled CANCEL urb status %d", urb->status);
+		/* cancelled, submit_fail, completed early or failed */
+		usbi_dbg("abnormal reap: urb status %d", urb->status);
+
+		/* a URB that was being discarded may still have received data,
+		 * e.g. when the kernel lacks bulk continuation and the device sent
+		 * more after an early short URB. keep it, moved down to follow the
+		 * data received so far, so that the result stays contiguous. */
+		if (urb->actual_length > 0) {
+			unsigned char *target = transfer->buffer + itransfer->transferred;
+			usbi_dbg("received %d bytes of surplus data", urb->actual_length);
+			if (urb->buffer != target)
+				memmove(target, urb->buffer, urb->actual_length);
+			itransfer->transferred += urb->actual_length;
 		}
 
-		if (tpriv->awaiting_reap == 0 && tpriv->awaiting_discard == 0) {
-			usbi_dbg("CANCEL: last URB handled, reporting");
+		if (tpriv->num_retired == num_urbs) {
+			usbi_dbg("abnormal reap: last URB handled, reporting");
 			if (tpriv->reap_action == CANCELLED) {
-				free(tpriv->urbs);
+				free_transfer_urbs(itransfer);
 				usbi_handle_transfer_cancellation(itransfer);
 				return 0;
-			} else if (tpriv->reap_action == COMPLETED_EARLY) {
-				goto out;
-			} else {
-				status = LIBUSB_TRANSFER_ERROR;
-				goto out;
 			}
+			status = tpriv->reap_status;
+			goto out;
 		}
 		return 0;
 	}
 
+	if (urb->status == 0 || urb->status == -EREMOTEIO ||
+			(urb->status == -EOVERFLOW && urb->actual_length > 0))
+		itransfer->transferred += urb->actual_length;
+
 	switch (urb->status) {
 	case 0:
 		break;
+	case -EREMOTEIO:
+		/* short packet in a non-final URB with USBFS_URB_SHORT_NOT_OK */
+		break;
 	case -EPIPE:
 		usbi_dbg("detected endpoint stall");
 		status = LIBUSB_TRANSFER_STALL;
-		goto out;
+		goto fail;
 	case -EOVERFLOW:
 		/* overflow can only ever occur in the last urb */
 		usbi_dbg("overflow, actual_length=%d", urb->actual_length);
 		status = LIBUSB_TRANSFER_OVERFLOW;
-		goto out;
+		goto fail;
 	case -ETIME:
 	case -EPROTO:
 	case -EILSEQ:
 		usbi_dbg("low level error %d", urb->status);
 		status = LIBUSB_TRANSFER_ERROR;
-		goto out;
+		goto fail;
 	default:
 		usbi_warn(ITRANSFER_CTX(itransfer),
 			"unrecognised urb status %d", urb->status);
 		status = LIBUSB_TRANSFER_ERROR;
-		goto out;
+		goto fail;
 	}
 
 	/* if we're the last urb or we got less data than requested then we're
 	 * done */
 	if (urb_idx == num_urbs - 1) {
 		usbi_dbg("last URB in transfer --> complete!");
+		goto out;
 	} else if (urb->actual_length < urb->buffer_length) {
-		struct libusb_transfer *transfer =
-			__USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-		struct linux_device_handle_priv *dpriv =
-			__device_handle_priv(transfer->dev_handle);
-		int i;
-
 		usbi_dbg("short transfer %d/%d --> complete!", urb->actual_length,
 			urb->buffer_length);
 
 		/* we have to cancel the remaining urbs and wait for their completion
 		 * before reporting results */
 		tpriv->reap_action = COMPLETED_EARLY;
-		for (i = urb_idx + 1; i < tpriv->num_urbs; i++) {
-			int r = ioctl(dpriv->fd, IOCTL_USBFS_DISCARDURB, &tpriv->urbs[i]);
-			if (r == 0)
-				tpriv->awaiting_discard++;
-			else if (errno == EINVAL)
-				tpriv->awaiting_reap++;
-			else
-				usbi_warn(ITRANSFER_CTX(itransfer),
-					"unrecognised discard return %d", errno);
-		}
-		return 0;
-	} else {
+		discard_bulk_urbs(itransfer, urb_idx + 1, num_urbs);
+	}
+	return 0;
+
+fail:
+	/* the remaining URBs are still queued and must be reaped before the
+	 * transfer can be reported */
+	if (tpriv->num_retired < num_urbs) {
+		tpriv->reap_action = ERROR;
+		tpriv->reap_status = status;
+		discard_bulk_urbs(itransfer, urb_idx + 1, num_urbs);
 		return 0;
 	}
 
 out:
-	free(tpriv->urbs);
+	free_transfer_urbs(itransfer);
 	usbi_handle_transfer_completion(itransfer, status);
 	return 0;
 }
@@ -1919,7 +2082,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status != 0 && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer),
 				"cancel: unrecognised urb status %d", urb->status);
-		free(tpriv->urbs);
+		free_transfer_urbs(itransfer);
 		usbi_handle_transfer_cancellation(itransfer);
 		return 0;
 	}
@@ -1946,12 +2109,12 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
+	free_transfer_urbs(itransfer);
 	usbi_handle_transfer_completion(itransfer, status);
 	return 0;
 }
 
-static int reap_for_handle(struct libusb_device_handle *handle)
+static int reap_one(struct libusb_device_handle *handle)
 {
 	struct linux_device_handle_priv *hpriv = __device_handle_priv(handle);
 	int r;
@@ -1992,30 +2155,59 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	}
 }
 
+/* reap every URB that has completed on this handle, up to MAX_REAP_BATCH, so
+ * that URBs completing together are handled in one wakeup rather than one
+ * poll round-trip each. returns 1 if the batch was drained, 0 if the batch
+ * limit was hit (poll will report the fd again), or an error code. */
+static int reap_for_handle(struct libusb_device_handle *handle)
+{
+	struct linux_reap_stats *stats = &__device_handle_priv(handle)->reap_stats;
+	unsigned int reaped = 0;
+	int r = 0;
+
+	while (reaped < MAX_REAP_BATCH) {
+		r = reap_one(handle);
+		if (r != 0)
+			break;
+		reaped++;
+	}
+
+	if (reaped) {
+		stats->wakeups++;
+		stats->completions += reaped;
+		if (reaped > stats->max_batch)
+			stats->max_batch = reaped;
+		if (reaped == MAX_REAP_BATCH)
+			stats->full_batches++;
+	}
+	return r;
+}
+
 static int op_handle_events(struct libusb_context *ctx,
 	struct pollfd *fds, nfds_t nfds, int num_ready)
 {
 	int r;
 	int i = 0;
 
-	pthread_mutex_lock(&ctx->open_devs_lock);
+	/* the handle for each fd comes from its pollfd registration. handles
+	 * cannot be closed while events are being handled, so there is no need
+	 * to search (or lock) the open devices list. */
 	for (i = 0; i < nfds && num_ready > 0; i++) {
 		struct pollfd *pollfd = &fds[i];
 		struct libusb_device_handle *handle;
-		struct linux_device_handle_priv *hpriv = NULL;
 
 		if (!pollfd->revents)
 			continue;
 
 		num_ready--;
-		list_for_each_entry(handle, &ctx->open_devs, list) {
-			hpriv =  __device_handle_priv(handle);
-			if (hpriv->fd == pollfd->fd)
-				break;
+		handle = usbi_get_pollfd_handle(ctx, i);
+		if (!handle) {
+			usbi_dbg("ignoring events on internal fd %d", pollfd->fd);
+			continue;
 		}
 
 		if (pollfd->revents & POLLERR) {
-			usbi_remove_pollfd(HANDLE_CTX(handle), hpriv->fd);
+			usbi_remove_pollfd(HANDLE_CTX(handle), pollfd->fd);
 			usbi_handle_disconnect(handle);
 			continue;
 		}
@@ -2024,13 +2216,10 @@ static int op_handle_events(struct libusb_context *ctx,
 		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
 			continue;
 		else if (r < 0)
-			goto out;
+			return r;
 	}
 
-	r = 0;
-out:
-	pthread_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	return 0;
 }
 
 const struct usbi_os_backend linux_usbfs_backend = {
@@ -2057,6 +2246,9 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.detach_kernel_driver = op_detach_kernel_driver,
 	.attach_kernel_driver = op_attach_kernel_driver,
 
+	.dev_mem_alloc = op_dev_mem_alloc,
+	.dev_mem_free = op_dev_mem_free,
+
 	.destroy_device = op_destroy_device,
 
 	.submit_transfer = op_submit_transfer,
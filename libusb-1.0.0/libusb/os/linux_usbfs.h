@@ -61,9 +61,16 @@ struct usbfs_getdriver {
 };
 
 #define USBFS_URB_DISABLE_SPD	1
+#define USBFS_URB_SHORT_NOT_OK	USBFS_URB_DISABLE_SPD
 #define USBFS_URB_ISO_ASAP	2
+#define USBFS_URB_BULK_CONTINUATION	4
 #define USBFS_URB_QUEUE_BULK	0x10
 
+/* returned by IOCTL_USBFS_GET_CAPABILITIES */
+#define USBFS_CAP_ZERO_PACKET		0x01
+#define USBFS_CAP_BULK_CONTINUATION	0x02
+#define USBFS_CAP_NO_PACKET_SIZE_LIM	0x04
+
 enum usbfs_urb_type {
 	USBFS_URB_TYPE_ISO = 0,
 	USBFS_URB_TYPE_INTERRUPT = 1,
@@ -133,5 +140,6 @@ struct usbfs_hub_portinfo {
 #define IOCTL_USBFS_CLEAR_HALT	_IOR('U', 21, unsigned int)
 #define IOCTL_USBFS_DISCONNECT	_IO('U', 22)
 #define IOCTL_USBFS_CONNECT	_IO('U', 23)
+#define IOCTL_USBFS_GET_CAPABILITIES	_IOR('U', 26, unsigned int)
 
 #endif
@@ -19,9 +19,13 @@
 
 #include <config.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "libusbi.h"
 
@@ -33,12 +37,143 @@
  * may wish to consider using the \ref asyncio "asynchronous I/O API" instead.
  */
 
+/* completion state of a synchronous transfer. when the context has an event
+ * thread, fd is the eventfd of the waiting thread and is signalled on
+ * completion; otherwise it is -1 and the waiting thread handles events.
+ * completed is set with release semantics by the callback and read with
+ * acquire semantics by the waiter, so that the transfer's results are
+ * visible once it reads as set. */
+struct sync_wait {
+	int completed;
+	int fd;
+};
+
+/* each thread doing synchronous I/O gets one eventfd, created on first use
+ * and closed when the thread exits. stored offset by one so that NULL means
+ * "none yet". */
+static pthread_once_t sync_eventfd_once = PTHREAD_ONCE_INIT;
+static pthread_key_t sync_eventfd_key;
+
+/* held by the event thread from publishing a completion until it has
+ * signalled the eventfd. the waiter may return, and its thread exit, as soon
+ * as it sees the completion; taking this lock before closing the eventfd
+ * keeps the signal from landing on a reused descriptor. */
+static pthread_mutex_t sync_eventfd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void close_sync_eventfd(void *value)
+{
+	pthread_mutex_lock(&sync_eventfd_lock);
+	close((int) (intptr_t) value - 1);
+	pthread_mutex_unlock(&sync_eventfd_lock);
+}
+
+static void create_sync_eventfd_key(void)
+{
+	pthread_key_create(&sync_eventfd_key, close_sync_eventfd);
+}
+
+static int get_sync_eventfd(void)
+{
+	void *value;
+	int fd;
+
+	pthread_once(&sync_eventfd_once, create_sync_eventfd_key);
+	value = pthread_getspecific(sync_eventfd_key);
+	if (value)
+		return (int) (intptr_t) value - 1;
+
+	fd = eventfd(0, EFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (pthread_setspecific(sync_eventfd_key, (void *) (intptr_t) (fd + 1))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* prepare to wait for a transfer about to be submitted. if no eventfd can be
+ * had, fall back on handling events, which then just waits for the event
+ * thread to release the event lock. */
+static void init_sync_wait(struct libusb_context *ctx, struct sync_wait *wait)
+{
+	wait->completed = 0;
+	wait->fd = ctx->event_thread_running ? get_sync_eventfd() : -1;
+}
+
+static int sync_wait_completed(struct sync_wait *wait)
+{
+	return __atomic_load_n(&wait->completed, __ATOMIC_ACQUIRE);
+}
+
+/* mark a transfer as completed and wake its waiter. this must be the last
+ * thing a callback does: once completed is set, the waiter may free the
+ * transfer and return, taking wait off its stack. */
+static void complete_sync_wait(struct libusb_transfer *transfer)
+{
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	struct sync_wait *wait = transfer->user_data;
+	int fd = wait->fd;
+	uint64_t one = 1;
+	ssize_t r;
+
+	if (fd < 0) {
+		__atomic_store_n(&wait->completed, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	pthread_mutex_lock(&sync_eventfd_lock);
+	__atomic_store_n(&wait->completed, 1, __ATOMIC_RELEASE);
+	r = write(fd, &one, sizeof(one));
+	pthread_mutex_unlock(&sync_eventfd_lock);
+	if (r < 0)
+		usbi_warn(ctx, "eventfd write failed, errno=%d", errno);
+}
+
+/* wait for a transfer to complete. if waiting fails, the transfer is
+ * cancelled and the error returned once it has completed. either way the
+ * transfer is no longer in flight on return and may be freed or reused. */
+static int wait_sync_transfer(struct libusb_context *ctx,
+	struct libusb_transfer *transfer, struct sync_wait *wait)
+{
+	uint64_t count;
+	int r = 0;
+
+	if (wait->fd >= 0) {
+		/* the counter may hold a stale wakeup from an earlier transfer,
+		 * hence the loop */
+		while (!sync_wait_completed(wait)) {
+			if (read(wait->fd, &count, sizeof(count)) >= 0 || errno == EINTR)
+				continue;
+
+			/* the eventfd is unusable. every completion is also broadcast
+			 * to the event waiters, so wait for the cancellation there. */
+			usbi_warn(ctx, "eventfd read failed, errno=%d", errno);
+			libusb_cancel_transfer(transfer);
+			libusb_lock_event_waiters(ctx);
+			while (!sync_wait_completed(wait))
+				libusb_wait_for_event(ctx, NULL);
+			libusb_unlock_event_waiters(ctx);
+			return LIBUSB_ERROR_IO;
+		}
+		return 0;
+	}
+
+	while (!sync_wait_completed(wait)) {
+		int ret = libusb_handle_events(ctx);
+		if (ret < 0 && r == 0) {
+			libusb_cancel_transfer(transfer);
+			r = ret;
+		}
+	}
+	return r;
+}
+
 static void ctrl_transfer_cb(struct libusb_transfer *transfer)
 {
-	int *completed = transfer->user_data;
-	*completed = 1;
 	usbi_dbg("actual_length=%d", transfer->actual_length);
 	/* caller interprets result and frees transfer */
+	complete_sync_wait(transfer);
 }
 
 /** \ingroup syncio
@@ -75,7 +210,7 @@ API_EXPORTED int libusb_control_transfer(libusb_device_handle *dev_handle,
 {
 	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
 	unsigned char *buffer;
-	int completed = 0;
+	struct sync_wait wait;
 	int r;
 
 	if (!transfer)
@@ -92,8 +227,9 @@ API_EXPORTED int libusb_control_transfer(libusb_device_handle *dev_handle,
 	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
 		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
 
+	init_sync_wait(HANDLE_CTX(dev_handle), &wait);
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
-		ctrl_transfer_cb, &completed, timeout);
+		ctrl_transfer_cb, &wait, timeout);
 	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
@@ -101,16 +237,10 @@ API_EXPORTED int libusb_control_transfer(libusb_device_handle *dev_handle,
 		return r;
 	}
 
-	while (!completed) {
-		r = libusb_handle_events(HANDLE_CTX(dev_handle));
-		if (r < 0) {
-			libusb_cancel_transfer(transfer);
-			while (!completed)
-				if (libusb_handle_events(HANDLE_CTX(dev_handle)) < 0)
-					break;
-			libusb_free_transfer(transfer);
-			return r;
-		}
+	r = wait_sync_transfer(HANDLE_CTX(dev_handle), transfer, &wait);
+	if (r < 0) {
+		libusb_free_transfer(transfer);
+		return r;
 	}
 
 	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
@@ -142,69 +272,97 @@ API_EXPORTED int libusb_control_transfer(libusb_device_handle *dev_handle,
 
 static void bulk_transfer_cb(struct libusb_transfer *transfer)
 {
-	int *completed = transfer->user_data;
-	*completed = 1;
 	usbi_dbg("actual_length=%d", transfer->actual_length);
 	/* caller interprets results and frees transfer */
+	complete_sync_wait(transfer);
+}
+
+/* take the transfer cached on the handle, allocating it on first use. if
+ * another thread is already using it, allocate a private one instead.
+ * *cached is set to 1 when the cached transfer was taken. */
+static struct libusb_transfer *get_sync_transfer(
+	struct libusb_device_handle *dev_handle, int *cached)
+{
+	if (pthread_mutex_trylock(&dev_handle->sync_transfer_lock) == 0) {
+		if (!dev_handle->sync_transfer)
+			dev_handle->sync_transfer = libusb_alloc_transfer(0);
+		if (dev_handle->sync_transfer) {
+			*cached = 1;
+			return dev_handle->sync_transfer;
+		}
+		pthread_mutex_unlock(&dev_handle->sync_transfer_lock);
+	}
+	*cached = 0;
+	return libusb_alloc_transfer(0);
+}
+
+/* give back a transfer obtained from get_sync_transfer() */
+static void put_sync_transfer(struct libusb_device_handle *dev_handle,
+	struct libusb_transfer *transfer, int cached)
+{
+	if (!cached) {
+		libusb_free_transfer(transfer);
+		return;
+	}
+	pthread_mutex_unlock(&dev_handle->sync_transfer_lock);
+}
+
+/* translate the status of a completed bulk or interrupt transfer into the
+ * return code of the synchronous API */
+static int bulk_transfer_result(struct libusb_device_handle *dev_handle,
+	enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	default:
+		usbi_warn(HANDLE_CTX(dev_handle),
+			"unrecognised status code %d", status);
+		return LIBUSB_ERROR_OTHER;
+	}
 }
 
 static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-	int completed = 0;
+	int cached;
+	struct libusb_transfer *transfer = get_sync_transfer(dev_handle, &cached);
+	struct sync_wait wait;
 	int r;
 
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
+	init_sync_wait(HANDLE_CTX(dev_handle), &wait);
 	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
-		bulk_transfer_cb, &completed, timeout);
+		bulk_transfer_cb, &wait, timeout);
 	transfer->type = type;
 
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		put_sync_transfer(dev_handle, transfer, cached);
 		return r;
 	}
 
-	while (!completed) {
-		r = libusb_handle_events(HANDLE_CTX(dev_handle));
-		if (r < 0) {
-			libusb_cancel_transfer(transfer);
-			while (!completed)
-				if (libusb_handle_events(HANDLE_CTX(dev_handle)) < 0)
-					break;
-			libusb_free_transfer(transfer);
-			return r;
-		}
+	r = wait_sync_transfer(HANDLE_CTX(dev_handle), transfer, &wait);
+	if (r < 0) {
+		put_sync_transfer(dev_handle, transfer, cached);
+		return r;
 	}
 
 	*transferred = transfer->actual_length;
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		r = 0;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
-	}
+	r = bulk_transfer_result(dev_handle, transfer->status);
 
-	libusb_free_transfer(transfer);
+	put_sync_transfer(dev_handle, transfer, cached);
 	return r;
 }
 
@@ -305,3 +463,337 @@ API_EXPORTED int libusb_interrupt_transfer(
 		transferred, timeout, LIBUSB_TRANSFER_TYPE_INTERRUPT);
 }
 
+
+struct libusb_bulk_reader {
+	struct libusb_device_handle *dev_handle;
+	int flags;
+
+	/* one transfer (and buffer) per slot. only one of them is ever in
+	 * flight, so data is returned in the order it arrived; the second slot
+	 * is only used for double buffering, and holds the data being handed
+	 * to the caller while the next read is in flight in the other slot */
+	struct libusb_transfer *transfers[2];
+	struct sync_wait waits[2];
+
+	/* set for slots whose buffer came from libusb_dev_mem_alloc() */
+	int dev_mem[2];
+	int length;
+
+	/* slot whose transfer is in flight, or -1 */
+	int pending;
+
+	/* set when the pending transfer was submitted ahead of a read call */
+	int presubmitted;
+
+	/* when the pending transfer was submitted */
+	struct timespec submitted;
+
+	/* data received but not yet returned to the caller */
+	int current;
+	int offset;
+	int available;
+};
+
+static int submit_bulk_reader(struct libusb_bulk_reader *reader, int slot)
+{
+	int r;
+
+	init_sync_wait(HANDLE_CTX(reader->dev_handle), &reader->waits[slot]);
+	clock_gettime(CLOCK_MONOTONIC, &reader->submitted);
+	r = libusb_submit_transfer(reader->transfers[slot]);
+	if (r < 0)
+		return r;
+	reader->pending = slot;
+	return 0;
+}
+
+/* wait for the pending transfer to complete */
+static int wait_bulk_reader(struct libusb_bulk_reader *reader)
+{
+	int slot = reader->pending;
+
+	reader->pending = -1;
+	return wait_sync_transfer(HANDLE_CTX(reader->dev_handle),
+		reader->transfers[slot], &reader->waits[slot]);
+}
+
+/* copy buffered data out to the caller */
+static int copy_bulk_reader(struct libusb_bulk_reader *reader,
+	unsigned char *data, int length)
+{
+	int n = MIN(length, reader->available);
+
+	memcpy(data, reader->transfers[reader->current]->buffer + reader->offset,
+		n);
+	reader->offset += n;
+	reader->available -= n;
+	return n;
+}
+
+/* allocate a slot buffer, preferring memory the device can access directly */
+static unsigned char *alloc_bulk_reader_buffer(
+	struct libusb_bulk_reader *reader, int slot)
+{
+	unsigned char *buffer;
+
+	buffer = libusb_dev_mem_alloc(reader->dev_handle, reader->length);
+	if (buffer) {
+		reader->dev_mem[slot] = 1;
+		return buffer;
+	}
+	return malloc(reader->length);
+}
+
+static void free_bulk_reader_buffer(struct libusb_bulk_reader *reader,
+	int slot)
+{
+	unsigned char *buffer = reader->transfers[slot]->buffer;
+
+	if (reader->dev_mem[slot])
+		libusb_dev_mem_free(reader->dev_handle, buffer, reader->length);
+	else
+		free(buffer);
+}
+
+/* whether the timeout of the pending transfer has already run out */
+static int bulk_reader_expired(struct libusb_bulk_reader *reader)
+{
+	unsigned int timeout = reader->transfers[reader->pending]->timeout;
+	struct timespec now;
+	long long elapsed;
+
+	if (timeout == 0 || clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+		return 0;
+	elapsed = (now.tv_sec - reader->submitted.tv_sec) * 1000LL
+		+ (now.tv_nsec - reader->submitted.tv_nsec) / 1000000;
+	return elapsed >= timeout;
+}
+
+/* wait for the next transfer to complete (submitting it first if it is not
+ * already in flight) and make its data available */
+static int fetch_bulk_reader(struct libusb_bulk_reader *reader)
+{
+	struct libusb_transfer *transfer;
+	int expired = 0;
+	int slot;
+	int r;
+
+	/* a pre-submitted read that timed out before this call is retried
+	 * below. one that times out during the call has used up the caller's
+	 * timeout and is reported. */
+	if (reader->pending >= 0 && reader->presubmitted)
+		expired = bulk_reader_expired(reader);
+	if (reader->pending < 0) {
+		r = submit_bulk_reader(reader, reader->current);
+		if (r < 0)
+			return r;
+		reader->presubmitted = 0;
+	}
+
+	slot = reader->pending;
+	r = wait_bulk_reader(reader);
+	if (r < 0)
+		return r;
+	transfer = reader->transfers[slot];
+
+	if (expired && transfer->status == LIBUSB_TRANSFER_TIMED_OUT
+			&& transfer->actual_length == 0) {
+		usbi_dbg("pre-submitted read timed out, retrying");
+		reader->presubmitted = 0;
+		r = submit_bulk_reader(reader, slot);
+		if (r < 0)
+			return r;
+		r = wait_bulk_reader(reader);
+		if (r < 0)
+			return r;
+	}
+
+	reader->current = slot;
+	reader->offset = 0;
+	reader->available = transfer->actual_length;
+	r = bulk_transfer_result(reader->dev_handle, transfer->status);
+
+	/* queue the next read in the other slot before handing out the data.
+	 * if that fails, the next call submits it again and reports the error */
+	if ((reader->flags & LIBUSB_BULK_READER_DOUBLE_BUFFER) && r == 0
+			&& submit_bulk_reader(reader, slot ^ 1) == 0)
+		reader->presubmitted = 1;
+
+	return r;
+}
+
+/** \ingroup syncio
+ * Prepare repeated synchronous reads from a bulk or interrupt IN endpoint.
+ * The reader allocates its transfer and buffer once; libusb_bulk_reader_read()
+ * then behaves like libusb_bulk_transfer() on that endpoint without
+ * allocating anything per call.
+ *
+ * With LIBUSB_BULK_READER_DOUBLE_BUFFER, a second transfer and buffer are
+ * allocated and the next read is submitted as soon as the previous one
+ * completes, before its data is returned. The device can then deliver data
+ * while the caller is still processing the previous chunk. Only one transfer
+ * is ever in flight, so data is still returned in order.
+ *
+ * Where the platform supports it, the buffers are allocated with
+ * libusb_dev_mem_alloc() so that the device writes into them directly;
+ * otherwise ordinary memory is used.
+ *
+ * All reads from the endpoint must go through the reader while it is open,
+ * and it must be closed before the device handle. A reader must only be used
+ * by one thread.
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint the address of a valid IN endpoint
+ * \param length the number of bytes to request from the device per transfer
+ * \param timeout timeout (in millseconds) for each transfer. For no timeout,
+ * use value 0.
+ * \param flags bitwise OR of \ref libusb_bulk_reader_flags values
+ * \param reader output location for the new reader
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if the endpoint is not an IN endpoint
+ * or the length is not positive
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+API_EXPORTED int libusb_open_bulk_reader(libusb_device_handle *dev_handle,
+	unsigned char endpoint, int length, unsigned int timeout, int flags,
+	libusb_bulk_reader **reader)
+{
+	struct libusb_bulk_reader *_reader;
+	int slots = (flags & LIBUSB_BULK_READER_DOUBLE_BUFFER) ? 2 : 1;
+	int i;
+
+	if ((endpoint & LIBUSB_ENDPOINT_DIR_MASK) != LIBUSB_ENDPOINT_IN
+			|| length <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_reader = calloc(1, sizeof(*_reader));
+	if (!_reader)
+		return LIBUSB_ERROR_NO_MEM;
+	_reader->dev_handle = dev_handle;
+	_reader->flags = flags;
+	_reader->pending = -1;
+	_reader->length = length;
+
+	for (i = 0; i < slots; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+		unsigned char *buffer;
+
+		if (!transfer) {
+			libusb_close_bulk_reader(_reader);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		buffer = alloc_bulk_reader_buffer(_reader, i);
+		if (!buffer) {
+			libusb_free_transfer(transfer);
+			libusb_close_bulk_reader(_reader);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer,
+			length, bulk_transfer_cb, &_reader->waits[i], timeout);
+		if (flags & LIBUSB_BULK_READER_INTERRUPT)
+			transfer->type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+		_reader->transfers[i] = transfer;
+	}
+
+	*reader = _reader;
+	return 0;
+}
+
+/** \ingroup syncio
+ * Read from the endpoint of a prepared reader. Data left over from an
+ * earlier transfer that did not fit in the caller's buffer is returned
+ * first, without any I/O. Otherwise this waits for the next transfer to
+ * complete, submitting it first if it is not already in flight.
+ *
+ * A pre-submitted transfer whose timeout ran out before this call without
+ * receiving anything is submitted again, so that the call still waits for
+ * the full timeout. One that was still in flight when the call was made is
+ * not, so a call never waits much longer than the timeout.
+ *
+ * \param reader the reader to read from
+ * \param data buffer for the received data
+ * \param length the maximum number of bytes to copy into data
+ * \param transferred output location for the number of bytes copied
+ *
+ * \returns 0 on success (and populates <tt>transferred</tt>)
+ * \returns LIBUSB_ERROR_TIMEOUT if the transfer timed out (and populates
+ * <tt>transferred</tt>)
+ * \returns LIBUSB_ERROR_PIPE if the endpoint halted
+ * \returns LIBUSB_ERROR_OVERFLOW if the device offered more data, see
+ * \ref packetoverflow
+ * \returns LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on other failures
+ */
+API_EXPORTED int libusb_bulk_reader_read(libusb_bulk_reader *reader,
+	unsigned char *data, int length, int *transferred)
+{
+	int r = 0;
+
+	*transferred = 0;
+	if (reader->available == 0)
+		r = fetch_bulk_reader(reader);
+	*transferred = copy_bulk_reader(reader, data, length);
+	return r;
+}
+
+/** \ingroup syncio
+ * Read from the endpoint of a prepared reader without copying. Instead of
+ * filling a caller-supplied buffer, this returns a pointer to the received
+ * data inside the reader's own buffer. All data currently available is
+ * returned at once; otherwise this waits for the next transfer exactly like
+ * libusb_bulk_reader_read().
+ *
+ * The returned data stays valid until the next call on the reader (or until
+ * it is closed). With LIBUSB_BULK_READER_DOUBLE_BUFFER, the device is
+ * already writing the following chunk into the other buffer meanwhile.
+ *
+ * \param reader the reader to read from
+ * \param data output location for a pointer to the received data
+ * \param transferred output location for the number of bytes received
+ *
+ * \returns 0 on success (and populates <tt>data</tt> and
+ * <tt>transferred</tt>)
+ * \returns the same error codes as libusb_bulk_reader_read(), in which case
+ * <tt>transferred</tt> may still be non-zero
+ */
+API_EXPORTED int libusb_bulk_reader_read_buffer(libusb_bulk_reader *reader,
+	unsigned char **data, int *transferred)
+{
+	int r = 0;
+
+	if (reader->available == 0)
+		r = fetch_bulk_reader(reader);
+	*data = reader->transfers[reader->current]->buffer + reader->offset;
+	*transferred = reader->available;
+	reader->offset += reader->available;
+	reader->available = 0;
+	return r;
+}
+
+/** \ingroup syncio
+ * Destroy a reader created by libusb_open_bulk_reader(). A transfer still in
+ * flight is cancelled first. Must be called before the device handle is
+ * closed.
+ *
+ * \param reader the reader to destroy. If NULL, this function does nothing.
+ */
+API_EXPORTED void libusb_close_bulk_reader(libusb_bulk_reader *reader)
+{
+	int i;
+
+	if (!reader)
+		return;
+
+	if (reader->pending >= 0) {
+		libusb_cancel_transfer(reader->transfers[reader->pending]);
+		wait_bulk_reader(reader);
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (!reader->transfers[i])
+			continue;
+		free_bulk_reader_buffer(reader, i);
+		libusb_free_transfer(reader->transfers[i]);
+	}
+	free(reader);
+}
@@ -0,0 +1,166 @@
+/*
+ * Split bulk transfer test: short packets in multi-URB transfers
+ *
+ * Submits bulk transfers that the Linux backend splits into several URBs and
+ * ends each with a short packet in the second URB. Checks the result with
+ * the usbfs capabilities reporting bulk continuation, where the URBs are
+ * flagged so that the kernel cancels the rest of the transfer, and without
+ * the capabilities ioctl on new and old kernels, where the backend discards
+ * the rest itself and keeps any data the device sent after the short packet.
+ * Discards complete asynchronously, so each case also checks that the
+ * transfer is reported exactly once and only after all of its URBs have been
+ * reaped, including when it is cancelled after the short packet.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fake_usbfs.h"
+#include "os/linux_usbfs.h"
+
+#define URBS			4
+#define LENGTH			(URBS * MAX_BULK_BUFFER_LENGTH)
+#define SHORT_LENGTH	100
+
+struct split_case {
+	const char *what;
+	int caps;
+	int kernel_continuation;
+	/* the device also fills the URB after the short one */
+	int surplus;
+	/* the transfer is cancelled after the short URB is reaped */
+	int cancel;
+	int status;
+	int length;
+	unsigned long discards;
+};
+
+static const struct split_case cases[] = {
+	{ "bulk continuation", USBFS_CAP_BULK_CONTINUATION, 0, 0, 0,
+		LIBUSB_TRANSFER_COMPLETED, MAX_BULK_BUFFER_LENGTH + SHORT_LENGTH, 0 },
+	{ "bulk continuation, cancelled after the short packet",
+		USBFS_CAP_BULK_CONTINUATION, 0, 0, 1, LIBUSB_TRANSFER_CANCELLED,
+		MAX_BULK_BUFFER_LENGTH + SHORT_LENGTH, 0 },
+	{ "no capabilities, kernel with bulk continuation", -1, 1, 0, 0,
+		LIBUSB_TRANSFER_COMPLETED, MAX_BULK_BUFFER_LENGTH + SHORT_LENGTH, 0 },
+	{ "no capabilities, old kernel", -1, 0, 0, 0, LIBUSB_TRANSFER_COMPLETED,
+		MAX_BULK_BUFFER_LENGTH + SHORT_LENGTH, URBS - 2 },
+	{ "no capabilities, old kernel, data after the short packet", -1, 0, 1,
+		0, LIBUSB_TRANSFER_COMPLETED,
+		2 * MAX_BULK_BUFFER_LENGTH + SHORT_LENGTH, URBS - 3 },
+	{ "no capabilities, old kernel, cancelled after the short packet", -1,
+		0, 0, 1, LIBUSB_TRANSFER_CANCELLED,
+		MAX_BULK_BUFFER_LENGTH + SHORT_LENGTH, URBS - 2 },
+};
+
+static int callbacks;
+
+static void split_cb(struct libusb_transfer *transfer)
+{
+	callbacks++;
+}
+
+/* handle whatever is ready without blocking */
+static void handle_ready(libusb_context *ctx)
+{
+	struct timeval tv = { 0, 0 };
+	int i;
+
+	for (i = 0; i < 3; i++)
+		libusb_handle_events_timeout(ctx, &tv);
+}
+
+static int check_split(libusb_context *ctx, const struct split_case *c)
+{
+	static unsigned char buffer[LENGTH];
+	struct libusb_transfer *transfer;
+	libusb_device_handle *handle;
+	unsigned long discarded;
+	int failed = 0;
+	int i;
+
+	fake_usbfs_set_caps(c->caps);
+	fake_usbfs_set_kernel_bulk_continuation(c->kernel_continuation);
+	if (fake_usbfs_open(ctx, &handle) < 0) {
+		fprintf(stderr, "fake_usbfs_open failed\n");
+		return 1;
+	}
+
+	/* the fake device leaves the buffer alone, so mark what each URB
+	 * "receives" to check where the data ends up */
+	for (i = 0; i < LENGTH; i++)
+		buffer[i] = 1 + i / MAX_BULK_BUFFER_LENGTH;
+	callbacks = 0;
+	discarded = fake_usbfs_discarded();
+	transfer = libusb_alloc_transfer(0);
+	libusb_fill_bulk_transfer(transfer, handle, 0x81, buffer, LENGTH,
+		split_cb, NULL, 0);
+	if (libusb_submit_transfer(transfer) < 0) {
+		fprintf(stderr, "submit failed\n");
+		return 1;
+	}
+	fake_usbfs_complete(handle, 1);
+	fake_usbfs_complete_short(handle, SHORT_LENGTH);
+	if (c->surplus)
+		fake_usbfs_complete(handle, 1);
+	handle_ready(ctx);
+	if (c->cancel) {
+		libusb_cancel_transfer(transfer);
+		handle_ready(ctx);
+	}
+	if (callbacks != 0) {
+		fprintf(stderr, "reported before all URBs were reaped\n");
+		failed = 1;
+	}
+	fake_usbfs_finish_discards();
+	handle_ready(ctx);
+
+	printf("%s: status %d, %d bytes, %lu discarded, %d callbacks\n",
+		c->what, transfer->status, transfer->actual_length,
+		fake_usbfs_discarded() - discarded, callbacks);
+	if (callbacks != 1 || transfer->status != c->status
+			|| transfer->actual_length != c->length
+			|| fake_usbfs_discarded() - discarded != c->discards) {
+		fprintf(stderr, "expected status %d, %d bytes, %lu discarded, "
+			"1 callback\n", c->status, c->length, c->discards);
+		failed = 1;
+	}
+	if (fake_usbfs_in_flight() != 0) {
+		fprintf(stderr, "%d URBs left in flight\n", fake_usbfs_in_flight());
+		failed = 1;
+	}
+	if (c->surplus && buffer[MAX_BULK_BUFFER_LENGTH + SHORT_LENGTH] != 3) {
+		fprintf(stderr, "data after the short packet was not moved up\n");
+		failed = 1;
+	}
+
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+	return failed;
+}
+
+int main(void)
+{
+	libusb_context *ctx;
+	int failed = 0;
+	unsigned int i;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %d\n", r);
+		return 1;
+	}
+	fake_usbfs_set_async_discard(1);
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		failed |= check_split(ctx, &cases[i]);
+
+	libusb_exit(ctx);
+	printf("bulk_split_test: %s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
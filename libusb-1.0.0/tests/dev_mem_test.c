@@ -0,0 +1,217 @@
+/*
+ * Device memory test: transfers through memory mapped from usbfs
+ *
+ * Checks that a buffer from libusb_dev_mem_alloc() is mapped from the device
+ * node, that bulk transfers using it are handed to usbfs as device memory
+ * and carry their data both ways, and that it is unmapped again by
+ * libusb_dev_mem_free(). Checks that the bulk reader allocates its buffers
+ * from device memory where it can, and falls back to ordinary memory, still
+ * reading correctly and freeing nothing through libusb_dev_mem_free(), when
+ * mmap() fails or the backend has no device memory at all.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fake_usbfs.h"
+
+#define LENGTH		4096
+
+static int no_dev_mem;
+static int dev_mem_freed;
+
+unsigned char *__real_libusb_dev_mem_alloc(libusb_device_handle *dev,
+	size_t length);
+int __real_libusb_dev_mem_free(libusb_device_handle *dev,
+	unsigned char *buffer, size_t length);
+
+/* linked with --wrap for both functions. with no_dev_mem set they behave as
+ * they do for a backend without dev_mem_alloc and dev_mem_free. */
+unsigned char *__wrap_libusb_dev_mem_alloc(libusb_device_handle *dev,
+	size_t length)
+{
+	if (no_dev_mem)
+		return NULL;
+	return __real_libusb_dev_mem_alloc(dev, length);
+}
+
+int __wrap_libusb_dev_mem_free(libusb_device_handle *dev,
+	unsigned char *buffer, size_t length)
+{
+	dev_mem_freed++;
+	if (no_dev_mem)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return __real_libusb_dev_mem_free(dev, buffer, length);
+}
+
+static void fill(unsigned char *buffer, int length, int seed)
+{
+	int i;
+
+	for (i = 0; i < length; i++)
+		buffer[i] = seed + i * 7;
+}
+
+/* send a pattern and read it back, both through buffer */
+static int round_trip(libusb_device_handle *handle, unsigned char *buffer,
+	int seed)
+{
+	unsigned char expected[LENGTH];
+	int transferred;
+	int r;
+
+	fill(buffer, LENGTH, seed);
+	memcpy(expected, buffer, LENGTH);
+	r = libusb_bulk_transfer(handle, 0x01, buffer, LENGTH, &transferred,
+		1000);
+	if (r < 0 || transferred != LENGTH) {
+		fprintf(stderr, "bulk OUT: %d, %d bytes\n", r, transferred);
+		return 1;
+	}
+	memset(buffer, 0, LENGTH);
+	r = libusb_bulk_transfer(handle, 0x81, buffer, LENGTH, &transferred,
+		1000);
+	if (r < 0 || transferred != LENGTH
+			|| memcmp(buffer, expected, LENGTH) != 0) {
+		fprintf(stderr, "bulk IN: %d, %d bytes%s\n", r, transferred,
+			r < 0 ? "" : ", wrong data");
+		return 1;
+	}
+	return 0;
+}
+
+static int check_round_trip(libusb_device_handle *handle)
+{
+	unsigned long urbs = fake_usbfs_dev_mem_urbs();
+	unsigned char *buffer;
+	int failed = 0;
+
+	buffer = libusb_dev_mem_alloc(handle, LENGTH);
+	if (!buffer || fake_usbfs_dev_mem_mapped() != 1) {
+		fprintf(stderr, "libusb_dev_mem_alloc did not map the device\n");
+		return 1;
+	}
+	failed |= round_trip(handle, buffer, 1);
+	if (fake_usbfs_dev_mem_urbs() - urbs != 2) {
+		fprintf(stderr, "%lu of 2 URBs used device memory\n",
+			fake_usbfs_dev_mem_urbs() - urbs);
+		failed = 1;
+	}
+	if (libusb_dev_mem_free(handle, buffer, LENGTH) != 0
+			|| fake_usbfs_dev_mem_mapped() != 0) {
+		fprintf(stderr, "libusb_dev_mem_free did not unmap the buffer\n");
+		failed = 1;
+	}
+	printf("device memory round trip: %s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/* read through a double-buffered reader; mapped is the number of buffers
+ * expected in device memory */
+static int check_reader(libusb_device_handle *handle, const char *what,
+	int mapped)
+{
+	unsigned long urbs = fake_usbfs_dev_mem_urbs();
+	unsigned char expected[LENGTH];
+	unsigned char data[LENGTH];
+	libusb_bulk_reader *reader;
+	int transferred;
+	int failed = 0;
+	int i;
+	int r;
+
+	dev_mem_freed = 0;
+	r = libusb_open_bulk_reader(handle, 0x81, LENGTH, 1000,
+		LIBUSB_BULK_READER_DOUBLE_BUFFER, &reader);
+	if (r < 0) {
+		fprintf(stderr, "libusb_open_bulk_reader failed: %d\n", r);
+		return 1;
+	}
+	if (fake_usbfs_dev_mem_mapped() != mapped) {
+		fprintf(stderr, "%d reader buffers in device memory, expected %d\n",
+			fake_usbfs_dev_mem_mapped(), mapped);
+		failed = 1;
+	}
+
+	/* the device echoes what is sent to it. the reader submits each read
+	 * ahead of the call, when the previous one completes, so the data for
+	 * it is sent one read early. */
+	for (i = 0; i < 5 && !failed; i++) {
+		fill(data, LENGTH, 10 + i);
+		r = libusb_bulk_transfer(handle, 0x01, data, LENGTH, &transferred,
+			1000);
+		if (r < 0 || transferred != LENGTH) {
+			fprintf(stderr, "bulk OUT: %d, %d bytes\n", r, transferred);
+			failed = 1;
+		}
+		if (i == 0)
+			continue;
+		fill(expected, LENGTH, 10 + i - 1);
+		r = libusb_bulk_reader_read(reader, data, LENGTH, &transferred);
+		if (r < 0 || transferred != LENGTH
+				|| memcmp(data, expected, LENGTH) != 0) {
+			fprintf(stderr, "reader read %d: %d, %d bytes%s\n", i, r,
+				transferred, r < 0 ? "" : ", wrong data");
+			failed = 1;
+		}
+	}
+	if ((fake_usbfs_dev_mem_urbs() != urbs) != (mapped > 0)) {
+		fprintf(stderr, "reader URBs %s device memory\n",
+			mapped ? "did not use" : "used");
+		failed = 1;
+	}
+
+	libusb_close_bulk_reader(reader);
+	if (fake_usbfs_dev_mem_mapped() != 0 || dev_mem_freed != mapped) {
+		fprintf(stderr, "reader freed %d device buffers, %d left mapped\n",
+			dev_mem_freed, fake_usbfs_dev_mem_mapped());
+		failed = 1;
+	}
+	printf("bulk reader, %s: %s\n", what, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+int main(void)
+{
+	libusb_device_handle *handle;
+	libusb_context *ctx;
+	int failed = 0;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %d\n", r);
+		return 1;
+	}
+	r = fake_usbfs_open(ctx, &handle);
+	if (r < 0) {
+		fprintf(stderr, "fake_usbfs_open failed: %d\n", r);
+		return 1;
+	}
+	fake_usbfs_set_auto_complete(1);
+
+	failed |= check_round_trip(handle);
+	failed |= check_reader(handle, "device memory", 2);
+
+	fake_usbfs_set_mmap_fails(1);
+	if (libusb_dev_mem_alloc(handle, LENGTH) != NULL) {
+		fprintf(stderr, "libusb_dev_mem_alloc succeeded without mmap\n");
+		failed = 1;
+	}
+	failed |= check_reader(handle, "mmap failing", 0);
+	fake_usbfs_set_mmap_fails(0);
+
+	no_dev_mem = 1;
+	failed |= check_reader(handle, "no device memory in the backend", 0);
+	no_dev_mem = 0;
+
+	libusb_close(handle);
+	libusb_exit(ctx);
+	printf("dev_mem_test: %s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
@@ -0,0 +1,227 @@
+/*
+ * Event thread test: synchronous I/O with libusb_start_event_thread()
+ *
+ * Checks that synchronous bulk and control transfers work with the internal
+ * event thread running, after it is stopped and after it is started again;
+ * that several threads can do synchronous transfers at once, both when the
+ * device completes URBs on submission and when it completes them later, so
+ * that the waiters block on their eventfds; that short-lived threads exiting
+ * right after their transfer completes never get a wakeup written to a
+ * descriptor that has since been reused; and that libusb_exit() stops a
+ * running event thread.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "fake_usbfs.h"
+
+#define WORKERS			4
+#define TRANSFERS		500
+#define EXIT_ROUNDS		200
+
+static libusb_device_handle *handle;
+static volatile int device_running;
+static volatile int wakeup_delay;
+
+ssize_t __real_write(int fd, const void *buf, size_t count);
+
+/* linked with --wrap=write. delays the eventfd wakeups of synchronous
+ * transfers, which are the only writes of the value 1, to hold open the
+ * window between a completion being published and its waiter woken. */
+ssize_t __wrap_write(int fd, const void *buf, size_t count)
+{
+	if (wakeup_delay && count == sizeof(uint64_t)
+			&& *(const uint64_t *) buf == 1)
+		usleep(wakeup_delay);
+	return __real_write(fd, buf, count);
+}
+
+/* one synchronous bulk transfer; returns 0 on success */
+static int bulk_transfer(void)
+{
+	unsigned char data[64];
+	int transferred;
+	int r;
+
+	r = libusb_bulk_transfer(handle, 0x81, data, sizeof(data), &transferred,
+		1000);
+	if (r < 0 || transferred != sizeof(data)) {
+		fprintf(stderr, "bulk transfer: %d, %d bytes\n", r, transferred);
+		return 1;
+	}
+	return 0;
+}
+
+/* one synchronous bulk and one control transfer; returns 0 on success */
+static int sync_transfers(void)
+{
+	unsigned char data[8];
+	int r;
+
+	if (bulk_transfer())
+		return 1;
+	r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN
+		| LIBUSB_REQUEST_TYPE_VENDOR, 1, 0, 0, data, 8, 1000);
+	if (r != 8) {
+		fprintf(stderr, "control transfer: %d\n", r);
+		return 1;
+	}
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	long failed = 0;
+	int i;
+
+	for (i = 0; i < TRANSFERS && !failed; i++)
+		failed = sync_transfers();
+	return (void *) failed;
+}
+
+/* plays a device that takes a little while to answer */
+static void *device_main(void *arg)
+{
+	while (device_running) {
+		fake_usbfs_complete(NULL, 1);
+		usleep(20);
+	}
+	return NULL;
+}
+
+static int run_workers(const char *what)
+{
+	pthread_t workers[WORKERS];
+	void *ret;
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < WORKERS; i++)
+		pthread_create(&workers[i], NULL, worker_main, NULL);
+	for (i = 0; i < WORKERS; i++) {
+		pthread_join(workers[i], &ret);
+		failed |= ret != NULL;
+	}
+	printf("%d threads x %d bulk and control transfers, %s: %s\n", WORKERS,
+		TRANSFERS, what, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+static void *exiting_main(void *arg)
+{
+	return (void *) (long) bulk_transfer();
+}
+
+/* each thread does one transfer and exits. the device completes the URB on
+ * submission and lets the event thread reap it before the submitter looks,
+ * and the wakeup is delayed, so the waiter can see the completion and exit,
+ * closing its eventfd, before it is signalled. the descriptor is then
+ * reused at once and must not be written to. */
+static int check_thread_exit(void)
+{
+	unsigned long stray = 0;
+	long failed = 0;
+	uint64_t count;
+	void *ret;
+	int i;
+
+	fake_usbfs_set_auto_complete_delay(500);
+	wakeup_delay = 1000;
+	for (i = 0; i < EXIT_ROUNDS && !failed; i++) {
+		pthread_t thread;
+		int fd;
+
+		pthread_create(&thread, NULL, exiting_main, NULL);
+		pthread_join(thread, &ret);
+		failed = (long) ret;
+
+		fd = eventfd(0, EFD_NONBLOCK);
+		usleep(3000);
+		if (read(fd, &count, sizeof(count)) == sizeof(count))
+			stray++;
+		else if (errno != EAGAIN)
+			perror("eventfd read");
+		close(fd);
+	}
+	wakeup_delay = 0;
+	fake_usbfs_set_auto_complete_delay(0);
+	printf("%d short-lived threads: %lu stray wakeups%s\n", EXIT_ROUNDS,
+		stray, failed ? ", transfers FAILED" : "");
+	return failed || stray;
+}
+
+static int check_exit_while_running(void)
+{
+	libusb_context *ctx;
+
+	if (libusb_init(&ctx) < 0 || fake_usbfs_open(ctx, &handle) < 0) {
+		fprintf(stderr, "libusb_init or fake_usbfs_open failed\n");
+		return 1;
+	}
+	if (libusb_start_event_thread(ctx) < 0 || sync_transfers()) {
+		fprintf(stderr, "no transfers on a second context\n");
+		return 1;
+	}
+	libusb_close(handle);
+	libusb_exit(ctx);
+	printf("libusb_exit with the event thread running: ok\n");
+	return 0;
+}
+
+int main(void)
+{
+	libusb_context *ctx;
+	pthread_t device;
+	int failed = 0;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %d\n", r);
+		return 1;
+	}
+	r = fake_usbfs_open(ctx, &handle);
+	if (r < 0) {
+		fprintf(stderr, "fake_usbfs_open failed: %d\n", r);
+		return 1;
+	}
+	fake_usbfs_set_auto_complete(1);
+
+	r = libusb_start_event_thread(ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_start_event_thread failed: %d\n", r);
+		return 1;
+	}
+	failed |= run_workers("event thread, immediate completion");
+	failed |= check_thread_exit();
+
+	fake_usbfs_set_auto_complete(0);
+	device_running = 1;
+	pthread_create(&device, NULL, device_main, NULL);
+	failed |= run_workers("event thread, delayed completion");
+
+	libusb_stop_event_thread(ctx);
+	failed |= run_workers("event thread stopped");
+	libusb_start_event_thread(ctx);
+	failed |= run_workers("event thread restarted");
+
+	device_running = 0;
+	pthread_join(device, NULL);
+	fake_usbfs_set_auto_complete(1);
+	libusb_close(handle);
+	libusb_exit(ctx);
+
+	failed |= check_exit_while_running();
+	printf("event_thread_test: %s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
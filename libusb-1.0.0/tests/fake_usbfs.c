@@ -0,0 +1,601 @@
+/*
+ * Fake usbfs for white-box tests of the Linux backend
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+/* every system header the backend uses comes first, so that the redirects
+ * below only apply to the backend's own calls */
+#include <config.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+static int fake_open(const char *path, int flags, ...);
+static DIR *fake_opendir(const char *path);
+static int fake_ioctl(int fd, unsigned long request, ...);
+static void *fake_mmap(void *addr, size_t length, int prot, int flags, int fd,
+	off_t offset);
+static int fake_munmap(void *addr, size_t length);
+
+#define open fake_open
+#define opendir fake_opendir
+#define ioctl fake_ioctl
+#define mmap fake_mmap
+#define munmap fake_munmap
+#include "../libusb/os/linux_usbfs.c"
+#undef open
+#undef opendir
+#undef ioctl
+#undef mmap
+#undef munmap
+
+#include "fake_usbfs.h"
+
+#define FAKE_URBS_MAX		4096
+#define FAKE_DEVICES_MAX	256
+#define FAKE_MAPPINGS_MAX	64
+#define FAKE_LOOPBACK_MAX	65536
+
+/* an eventfd polls writable unless its counter is at this value */
+#define EVENTFD_FULL		0xfffffffffffffffeULL
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct fake_device {
+	int fd;
+	int ready;
+	/* URBs waiting to be reaped, oldest first */
+	struct usbfs_urb *completed[FAKE_URBS_MAX];
+	int completed_head;
+	int completed_count;
+	/* OUT data not yet returned by an IN URB */
+	unsigned char loopback[FAKE_LOOPBACK_MAX];
+	int loopback_length;
+};
+
+static struct fake_device fake_devices[FAKE_DEVICES_MAX];
+static int fake_devices_count;
+
+/* in-flight URBs of all devices, oldest first. an unlinked URB is being
+ * discarded and completes with its discard status. */
+static struct {
+	struct usbfs_urb *urb;
+	struct fake_device *device;
+	int unlinked;
+} in_flight[FAKE_URBS_MAX];
+static int in_flight_count;
+
+static int auto_complete;
+static int auto_complete_delay;
+static int async_discard;
+static int caps = -1;
+static int mmap_fails;
+static unsigned long dev_mem_urbs;
+
+/* device memory handed out through mmap() */
+static struct {
+	unsigned char *start;
+	size_t length;
+} mappings[FAKE_MAPPINGS_MAX];
+static int mappings_count;
+static unsigned long submitted;
+static unsigned long discarded;
+static int next_address = 1;
+
+static const unsigned char device_descriptor[DEVICE_DESC_LENGTH] = {
+	DEVICE_DESC_LENGTH, LIBUSB_DT_DEVICE, 0x00, 0x02, 0xff, 0, 0, 64,
+	0x34, 0x12, 0x78, 0x56, 0x00, 0x01, 0, 0, 0, 1
+};
+
+static struct fake_device *find_device(int fd)
+{
+	int i;
+
+	for (i = 0; i < fake_devices_count; i++)
+		if (fake_devices[i].fd == fd)
+			return &fake_devices[i];
+	return NULL;
+}
+
+/* make the device fd poll writable exactly when it has URBs to reap */
+static void update_ready(struct fake_device *device)
+{
+	int ready = device->completed_count > 0;
+	uint64_t value = EVENTFD_FULL;
+
+	if (ready == device->ready)
+		return;
+	if (ready) {
+		if (read(device->fd, &value, sizeof(value)) < 0)
+			perror("fake_usbfs: eventfd read");
+	} else {
+		if (write(device->fd, &value, sizeof(value)) < 0)
+			perror("fake_usbfs: eventfd write");
+	}
+	device->ready = ready;
+}
+
+static void push_completed(struct fake_device *device, struct usbfs_urb *urb)
+{
+	int tail = (device->completed_head + device->completed_count)
+		% FAKE_URBS_MAX;
+
+	device->completed[tail] = urb;
+	device->completed_count++;
+	update_ready(device);
+}
+
+/* complete an URB successfully with its full length. usbfs does not count
+ * the setup packet of a control URB. bulk and interrupt OUT data is echoed
+ * back in order by the IN URBs of the device, which end short when less
+ * than their length is waiting; with nothing waiting they end full length
+ * with their buffer untouched. */
+static void complete_urb(struct fake_device *device, struct usbfs_urb *urb)
+{
+	int is_in = urb->endpoint & LIBUSB_ENDPOINT_IN;
+
+	urb->status = 0;
+	urb->actual_length = urb->buffer_length;
+	if (urb->type == USBFS_URB_TYPE_CONTROL) {
+		urb->actual_length -= LIBUSB_CONTROL_SETUP_SIZE;
+	} else if (!is_in) {
+		int length = MIN(urb->buffer_length,
+			FAKE_LOOPBACK_MAX - device->loopback_length);
+
+		memcpy(device->loopback + device->loopback_length, urb->buffer,
+			length);
+		device->loopback_length += length;
+	} else if (device->loopback_length > 0) {
+		urb->actual_length = MIN(urb->buffer_length, device->loopback_length);
+		memcpy(urb->buffer, device->loopback, urb->actual_length);
+		device->loopback_length -= urb->actual_length;
+		memmove(device->loopback, device->loopback + urb->actual_length,
+			device->loopback_length);
+	}
+	push_completed(device, urb);
+}
+
+/* whether buffer lies within one mapping, as usbfs requires for using it
+ * without a copy */
+static int in_mapping(unsigned char *buffer, size_t length)
+{
+	int i;
+
+	for (i = 0; i < mappings_count; i++)
+		if (buffer >= mappings[i].start
+				&& buffer + length <= mappings[i].start + mappings[i].length)
+			return 1;
+	return 0;
+}
+
+static void remove_in_flight(int index)
+{
+	memmove(&in_flight[index], &in_flight[index + 1],
+		(in_flight_count - index - 1) * sizeof(in_flight[0]));
+	in_flight_count--;
+}
+
+/* end an in-flight URB with status and no data, at once or, with async
+ * discards, when the test finishes the discards */
+static void unlink_urb(int index, int status)
+{
+	struct usbfs_urb *urb = in_flight[index].urb;
+
+	urb->status = status;
+	urb->actual_length = 0;
+	if (async_discard) {
+		in_flight[index].unlinked = 1;
+		return;
+	}
+	push_completed(in_flight[index].device, urb);
+	remove_in_flight(index);
+}
+
+static int find_in_flight(struct fake_device *only, int from)
+{
+	int i;
+
+	for (i = from; i < in_flight_count; i++)
+		if ((!only || in_flight[i].device == only) && !in_flight[i].unlinked)
+			return i;
+	return -1;
+}
+
+static int fake_open(const char *path, int flags, ...)
+{
+	struct fake_device *device;
+	uint64_t value = EVENTFD_FULL;
+	va_list args;
+	mode_t mode;
+
+	if (strncmp(path, "/dev/bus/usb/", 13) != 0) {
+		va_start(args, flags);
+		mode = va_arg(args, mode_t);
+		va_end(args);
+		return open(path, flags, mode);
+	}
+
+	pthread_mutex_lock(&fake_lock);
+	if (fake_devices_count == FAKE_DEVICES_MAX) {
+		pthread_mutex_unlock(&fake_lock);
+		errno = ENOENT;
+		return -1;
+	}
+	device = &fake_devices[fake_devices_count];
+	device->fd = eventfd(0, EFD_NONBLOCK);
+	if (device->fd < 0) {
+		pthread_mutex_unlock(&fake_lock);
+		return -1;
+	}
+	/* nothing to reap yet */
+	if (write(device->fd, &value, sizeof(value)) < 0)
+		perror("fake_usbfs: eventfd write");
+	device->ready = 0;
+	device->completed_head = 0;
+	device->completed_count = 0;
+	device->loopback_length = 0;
+	fake_devices_count++;
+	pthread_mutex_unlock(&fake_lock);
+	return device->fd;
+}
+
+/* the backend only needs a non-empty usbfs directory to initialise */
+static DIR *fake_opendir(const char *path)
+{
+	if (strcmp(path, "/dev/bus/usb") == 0)
+		return opendir("/");
+	return opendir(path);
+}
+
+static int fake_ioctl(int fd, unsigned long request, ...)
+{
+	struct fake_device *device;
+	struct usbfs_urb *urb;
+	va_list args;
+	void *arg;
+	int delay;
+	int i;
+	int r = 0;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	pthread_mutex_lock(&fake_lock);
+	device = find_device(fd);
+	if (!device) {
+		pthread_mutex_unlock(&fake_lock);
+		errno = ENOTTY;
+		return -1;
+	}
+
+	switch (request) {
+	case IOCTL_USBFS_SUBMITURB:
+		urb = arg;
+		submitted++;
+		if (in_mapping(urb->buffer, urb->buffer_length))
+			dev_mem_urbs++;
+		if (auto_complete) {
+			complete_urb(device, urb);
+		} else if (in_flight_count == FAKE_URBS_MAX) {
+			errno = ENOMEM;
+			r = -1;
+		} else {
+			in_flight[in_flight_count].urb = urb;
+			in_flight[in_flight_count].device = device;
+			in_flight[in_flight_count].unlinked = 0;
+			in_flight_count++;
+		}
+		break;
+	case IOCTL_USBFS_DISCARDURB:
+		for (i = 0; i < in_flight_count; i++)
+			if (in_flight[i].urb == arg && !in_flight[i].unlinked)
+				break;
+		if (i == in_flight_count) {
+			errno = EINVAL;
+			r = -1;
+			break;
+		}
+		discarded++;
+		unlink_urb(i, -ENOENT);
+		break;
+	case IOCTL_USBFS_REAPURBNDELAY:
+		if (device->completed_count == 0) {
+			errno = EAGAIN;
+			r = -1;
+			break;
+		}
+		*(struct usbfs_urb **) arg = device->completed[device->completed_head];
+		device->completed_head = (device->completed_head + 1) % FAKE_URBS_MAX;
+		device->completed_count--;
+		update_ready(device);
+		break;
+	case IOCTL_USBFS_GET_CAPABILITIES:
+		if (caps < 0) {
+			errno = ENOTTY;
+			r = -1;
+		} else {
+			*(unsigned int *) arg = caps;
+		}
+		break;
+	case IOCTL_USBFS_SETCONFIG:
+	case IOCTL_USBFS_CLAIMINTF:
+	case IOCTL_USBFS_RELEASEINTF:
+	case IOCTL_USBFS_SETINTF:
+	case IOCTL_USBFS_CLEAR_HALT:
+	case IOCTL_USBFS_RESET:
+		break;
+	default:
+		errno = ENOTTY;
+		r = -1;
+		break;
+	}
+	delay = request == IOCTL_USBFS_SUBMITURB && r == 0 ? auto_complete_delay : 0;
+	pthread_mutex_unlock(&fake_lock);
+	if (delay)
+		usleep(delay);
+	return r;
+}
+
+/* device memory is plain anonymous memory, unless mapping is set to fail as
+ * on kernels before 4.6 */
+static void *fake_mmap(void *addr, size_t length, int prot, int flags, int fd,
+	off_t offset)
+{
+	void *buffer;
+
+	pthread_mutex_lock(&fake_lock);
+	if (!find_device(fd)) {
+		pthread_mutex_unlock(&fake_lock);
+		return mmap(addr, length, prot, flags, fd, offset);
+	}
+	if (mmap_fails || mappings_count == FAKE_MAPPINGS_MAX) {
+		pthread_mutex_unlock(&fake_lock);
+		errno = ENOMEM;
+		return MAP_FAILED;
+	}
+	buffer = mmap(NULL, length, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer != MAP_FAILED) {
+		mappings[mappings_count].start = buffer;
+		mappings[mappings_count].length = length;
+		mappings_count++;
+	}
+	pthread_mutex_unlock(&fake_lock);
+	return buffer;
+}
+
+static int fake_munmap(void *addr, size_t length)
+{
+	int i;
+
+	pthread_mutex_lock(&fake_lock);
+	for (i = 0; i < mappings_count; i++) {
+		if (mappings[i].start == addr) {
+			mappings[i] = mappings[--mappings_count];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fake_lock);
+	return munmap(addr, length);
+}
+
+int fake_usbfs_open(libusb_context *ctx, libusb_device_handle **handle)
+{
+	struct libusb_device *dev;
+	struct linux_device_priv *priv;
+	int address;
+	int r;
+
+	pthread_mutex_lock(&fake_lock);
+	address = next_address++;
+	pthread_mutex_unlock(&fake_lock);
+
+	dev = usbi_alloc_device(ctx, (unsigned long) address);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+	dev->bus_number = 1 + address / 128;
+	dev->device_address = 1 + address % 128;
+	priv = __device_priv(dev);
+	priv->sysfs_dir = NULL;
+	priv->config_descriptor = NULL;
+	priv->dev_descriptor = malloc(DEVICE_DESC_LENGTH);
+	if (!priv->dev_descriptor) {
+		libusb_unref_device(dev);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	memcpy(priv->dev_descriptor, device_descriptor, DEVICE_DESC_LENGTH);
+
+	r = usbi_sanitize_device(dev);
+	if (r == 0)
+		r = libusb_open(dev, handle);
+	libusb_unref_device(dev);
+	return r;
+}
+
+void fake_usbfs_set_auto_complete(int enabled)
+{
+	pthread_mutex_lock(&fake_lock);
+	auto_complete = enabled;
+	pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_usbfs_set_auto_complete_delay(int usec)
+{
+	pthread_mutex_lock(&fake_lock);
+	auto_complete_delay = usec;
+	pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_usbfs_set_caps(int value)
+{
+	pthread_mutex_lock(&fake_lock);
+	caps = value;
+	pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_usbfs_set_kernel_bulk_continuation(int supported)
+{
+	pthread_mutex_lock(&fake_lock);
+	supports_flag_bulk_continuation = supported;
+	pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_usbfs_set_mmap_fails(int fails)
+{
+	pthread_mutex_lock(&fake_lock);
+	mmap_fails = fails;
+	pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_usbfs_set_async_discard(int enabled)
+{
+	pthread_mutex_lock(&fake_lock);
+	async_discard = enabled;
+	pthread_mutex_unlock(&fake_lock);
+}
+
+int fake_usbfs_complete(libusb_device_handle *handle, int count)
+{
+	struct fake_device *only = NULL;
+	int completed = 0;
+	int i = 0;
+
+	pthread_mutex_lock(&fake_lock);
+	if (handle)
+		only = find_device(__device_handle_priv(handle)->fd);
+	while (completed < count && (i = find_in_flight(only, i)) >= 0) {
+		struct usbfs_urb *urb = in_flight[i].urb;
+		struct fake_device *device = in_flight[i].device;
+
+		remove_in_flight(i);
+		complete_urb(device, urb);
+		completed++;
+	}
+	pthread_mutex_unlock(&fake_lock);
+	return completed;
+}
+
+int fake_usbfs_complete_short(libusb_device_handle *handle, int length)
+{
+	struct fake_device *device;
+	struct usbfs_urb *urb;
+	unsigned char endpoint;
+	int i;
+
+	pthread_mutex_lock(&fake_lock);
+	device = find_device(__device_handle_priv(handle)->fd);
+	i = find_in_flight(device, 0);
+	if (i < 0) {
+		pthread_mutex_unlock(&fake_lock);
+		return 0;
+	}
+	urb = in_flight[i].urb;
+	endpoint = urb->endpoint;
+	remove_in_flight(i);
+	urb->actual_length = length;
+	urb->status = 0;
+	if (length < urb->buffer_length && (urb->flags & USBFS_URB_SHORT_NOT_OK)) {
+		/* the kernel stops the endpoint and cancels the URBs continuing
+		 * the same transfer */
+		urb->status = -EREMOTEIO;
+		for (i = find_in_flight(device, 0); i >= 0;
+				i = find_in_flight(device, i + 1)) {
+			if (in_flight[i].urb->endpoint != endpoint)
+				continue;
+			if (!(in_flight[i].urb->flags & USBFS_URB_BULK_CONTINUATION))
+				break;
+			unlink_urb(i--, -ECONNRESET);
+		}
+	}
+	push_completed(device, urb);
+	pthread_mutex_unlock(&fake_lock);
+	return 1;
+}
+
+int fake_usbfs_finish_discards(void)
+{
+	int finished = 0;
+	int i = 0;
+
+	pthread_mutex_lock(&fake_lock);
+	while (i < in_flight_count) {
+		if (!in_flight[i].unlinked) {
+			i++;
+			continue;
+		}
+		push_completed(in_flight[i].device, in_flight[i].urb);
+		remove_in_flight(i);
+		finished++;
+	}
+	pthread_mutex_unlock(&fake_lock);
+	return finished;
+}
+
+int fake_usbfs_in_flight(void)
+{
+	int count;
+
+	pthread_mutex_lock(&fake_lock);
+	count = in_flight_count;
+	pthread_mutex_unlock(&fake_lock);
+	return count;
+}
+
+unsigned long fake_usbfs_submitted(void)
+{
+	unsigned long count;
+
+	pthread_mutex_lock(&fake_lock);
+	count = submitted;
+	pthread_mutex_unlock(&fake_lock);
+	return count;
+}
+
+unsigned long fake_usbfs_discarded(void)
+{
+	unsigned long count;
+
+	pthread_mutex_lock(&fake_lock);
+	count = discarded;
+	pthread_mutex_unlock(&fake_lock);
+	return count;
+}
+
+int fake_usbfs_dev_mem_mapped(void)
+{
+	int count;
+
+	pthread_mutex_lock(&fake_lock);
+	count = mappings_count;
+	pthread_mutex_unlock(&fake_lock);
+	return count;
+}
+
+unsigned long fake_usbfs_dev_mem_urbs(void)
+{
+	unsigned long count;
+
+	pthread_mutex_lock(&fake_lock);
+	count = dev_mem_urbs;
+	pthread_mutex_unlock(&fake_lock);
+	return count;
+}
@@ -0,0 +1,83 @@
+/*
+ * Fake usbfs for white-box tests of the Linux backend
+ *
+ * fake_usbfs.c builds os/linux_usbfs.c with open(), opendir() and ioctl()
+ * redirected, so that the real backend code runs against simulated device
+ * nodes instead of /dev/bus/usb. Each opened device is backed by an eventfd
+ * that polls writable exactly when it has URBs waiting to be reaped, as a
+ * usbfs node does. Submitted URBs stay in flight until the test completes
+ * them or the backend discards them. Short packets end URBs the way the
+ * kernel does, according to the URB flags the backend chose. Bulk OUT data
+ * is echoed back by the following IN URBs, and device memory can be mapped
+ * from the device node.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef __FAKE_USBFS_H__
+#define __FAKE_USBFS_H__
+
+#include <libusb.h>
+
+/* create a fake device on ctx and open it. the device has one configuration
+ * and behaves like a bulk device on any endpoint. */
+int fake_usbfs_open(libusb_context *ctx, libusb_device_handle **handle);
+
+/* when set, URBs complete successfully as soon as they are submitted, with
+ * their full length or as much echoed OUT data as is waiting */
+void fake_usbfs_set_auto_complete(int enabled);
+
+/* sleep for usec after each successful submission before returning to the
+ * backend, so that the event handler can reap an auto-completed URB before
+ * the submitting thread goes on */
+void fake_usbfs_set_auto_complete_delay(int usec);
+
+/* capabilities reported by IOCTL_USBFS_GET_CAPABILITIES to devices opened
+ * from now on, or -1 (the default) for a kernel without that ioctl */
+void fake_usbfs_set_caps(int caps);
+
+/* whether a kernel without IOCTL_USBFS_GET_CAPABILITIES supports bulk
+ * continuation. call after libusb_init(), which sets it from the kernel
+ * version. */
+void fake_usbfs_set_kernel_bulk_continuation(int supported);
+
+/* when set, mmap() of the device node fails, as on kernels before 4.6 */
+void fake_usbfs_set_mmap_fails(int fails);
+
+/* when set, discarded URBs stay in flight until fake_usbfs_finish_discards(),
+ * as the kernel may still be unlinking them when the ioctl returns */
+void fake_usbfs_set_async_discard(int enabled);
+
+/* complete up to count of the oldest in-flight URBs of handle, or of any
+ * device if handle is NULL, successfully with their full length. returns the
+ * number completed. */
+int fake_usbfs_complete(libusb_device_handle *handle, int count);
+
+/* complete the oldest in-flight URB of handle with length bytes. as in the
+ * kernel, a short URB flagged USBFS_URB_SHORT_NOT_OK ends with -EREMOTEIO and
+ * the following URBs flagged USBFS_URB_BULK_CONTINUATION on its endpoint are
+ * cancelled. returns 1, or 0 if nothing was in flight. */
+int fake_usbfs_complete_short(libusb_device_handle *handle, int length);
+
+/* complete the URBs being discarded with their discard status. returns the
+ * number completed. */
+int fake_usbfs_finish_discards(void);
+
+/* number of URBs submitted and not yet completed, counting those still
+ * being discarded */
+int fake_usbfs_in_flight(void);
+
+/* total URBs submitted and discarded since startup */
+unsigned long fake_usbfs_submitted(void);
+unsigned long fake_usbfs_discarded(void);
+
+/* number of device memory mappings not yet unmapped */
+int fake_usbfs_dev_mem_mapped(void);
+
+/* total URBs submitted whose buffer lay within device memory */
+unsigned long fake_usbfs_dev_mem_urbs(void);
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Event loop benchmark: cost of one libusb_handle_events_timeout() call
+ *
+ * Opens an increasing number of fake devices and calls
+ * libusb_handle_events_timeout() with a zero timeout in a loop, with no
+ * transfers in flight. Each call builds (or reuses) the poll array, polls
+ * every fd once and handles timeouts, so this measures the fixed per-wakeup
+ * overhead of the event loop as the number of open handles grows.
+ *
+ * Usage: poll_bench [seconds per step]
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fake_usbfs.h"
+
+#define HANDLES_MAX	64
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int steps[] = { 1, 4, 16, 64 };
+	double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+	libusb_device_handle *handles[HANDLES_MAX];
+	libusb_context *ctx;
+	int opened = 0;
+	unsigned int i;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %d\n", r);
+		return 1;
+	}
+
+	printf("%8s %14s %10s\n", "handles", "iterations/s", "ns/iter");
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		struct timeval zero = { 0, 0 };
+		unsigned long iterations = 0;
+		double start, elapsed;
+
+		while (opened < steps[i]) {
+			r = fake_usbfs_open(ctx, &handles[opened]);
+			if (r < 0) {
+				fprintf(stderr, "fake_usbfs_open failed: %d\n", r);
+				return 1;
+			}
+			opened++;
+		}
+
+		start = now();
+		do {
+			int j;
+			for (j = 0; j < 1000; j++)
+				libusb_handle_events_timeout(ctx, &zero);
+			iterations += 1000;
+			elapsed = now() - start;
+		} while (elapsed < seconds);
+
+		printf("%8d %14.0f %10.1f\n", opened, iterations / elapsed,
+			elapsed * 1e9 / iterations);
+	}
+
+	while (opened > 0)
+		libusb_close(handles[--opened]);
+	libusb_exit(ctx);
+	return 0;
+}
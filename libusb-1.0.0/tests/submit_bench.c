@@ -0,0 +1,96 @@
+/*
+ * URB submission benchmark: cost of submitting and reaping a bulk transfer
+ *
+ * Submits one bulk transfer at a time to a fake device that completes each
+ * URB as soon as it is submitted, then runs the event loop until the
+ * callback has run. Reports the time spent in libusb_submit_transfer() and
+ * the time for the whole submit, reap and callback cycle, for transfer
+ * lengths that need one and four URBs.
+ *
+ * Usage: submit_bench [seconds per length]
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fake_usbfs.h"
+
+#define LENGTH_MAX	65536
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void done_cb(struct libusb_transfer *transfer)
+{
+	*(int *) transfer->user_data = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int lengths[] = { 512, 16384, 65536 };
+	static unsigned char buffer[LENGTH_MAX];
+	double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+	struct libusb_transfer *transfer;
+	libusb_device_handle *handle;
+	libusb_context *ctx;
+	unsigned int i;
+	int done;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %d\n", r);
+		return 1;
+	}
+	r = fake_usbfs_open(ctx, &handle);
+	if (r < 0) {
+		fprintf(stderr, "fake_usbfs_open failed: %d\n", r);
+		return 1;
+	}
+	fake_usbfs_set_auto_complete(1);
+	transfer = libusb_alloc_transfer(0);
+
+	printf("%8s %12s %14s %14s\n", "length", "transfers", "submit ns",
+		"cycle ns");
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		struct timeval tv = { 1, 0 };
+		unsigned long transfers = 0;
+		double start, submitted, submit = 0, elapsed;
+
+		libusb_fill_bulk_transfer(transfer, handle, 0x81, buffer,
+			lengths[i], done_cb, &done, 1000);
+		start = now();
+		do {
+			done = 0;
+			submitted = now();
+			r = libusb_submit_transfer(transfer);
+			submit += now() - submitted;
+			if (r < 0) {
+				fprintf(stderr, "submit failed: %d\n", r);
+				return 1;
+			}
+			while (!done)
+				libusb_handle_events_timeout(ctx, &tv);
+			transfers++;
+			elapsed = now() - start;
+		} while (elapsed < seconds);
+		printf("%8d %12lu %14.0f %14.0f\n", lengths[i], transfers,
+			submit * 1e9 / transfers, elapsed * 1e9 / transfers);
+	}
+
+	libusb_free_transfer(transfer);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return 0;
+}
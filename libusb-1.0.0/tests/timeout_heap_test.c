@@ -0,0 +1,346 @@
+/*
+ * Timeout heap test: ordering of the transfer timeout min-heap
+ *
+ * Submits, completes and cancels transfers with timeouts in mixed order and
+ * checks the context's timeout heap after every step: each transfer with a
+ * timeout is on the heap exactly once at the index it records, every parent
+ * expires no later than its children, transfers that have finished are off
+ * the heap, and libusb_get_next_timeout() reports the earliest deadline.
+ * Transfers whose timeout is neither the earliest nor the latest are removed
+ * both by completion and by cancellation. Finally checks that transfers left
+ * to time out are reported in deadline order after some of the others were
+ * removed.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fake_usbfs.h"
+#include "libusbi.h"
+
+#define SLOTS			64
+#define RANDOM_STEPS	3000
+#define EXPIRING		40
+
+struct slot {
+	struct libusb_transfer *transfer;
+	unsigned char buffer[64];
+	int submitted;
+	int outstanding;
+	int status;
+};
+
+static struct slot slots[SLOTS];
+static int callbacks;
+static unsigned int seed = 1;
+
+/* timed-out slots in the order they were reported */
+static int expired[EXPIRING];
+static int expired_count;
+
+static unsigned int next_random(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+static void slot_cb(struct libusb_transfer *transfer)
+{
+	struct slot *slot = transfer->user_data;
+
+	slot->outstanding = 0;
+	slot->status = transfer->status;
+	if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT
+			&& expired_count < EXPIRING)
+		expired[expired_count++] = slot - slots;
+	callbacks++;
+}
+
+static struct timeval *slot_deadline(int i)
+{
+	return &__LIBUSB_TRANSFER_TO_USBI_TRANSFER(slots[i].transfer)->timeout;
+}
+
+static int submit_slot(libusb_device_handle *handle, int i,
+	unsigned int timeout)
+{
+	libusb_fill_bulk_transfer(slots[i].transfer, handle, 0x81,
+		slots[i].buffer, sizeof(slots[i].buffer), slot_cb, &slots[i],
+		timeout);
+	if (libusb_submit_transfer(slots[i].transfer) < 0) {
+		fprintf(stderr, "submit failed\n");
+		return 1;
+	}
+	slots[i].submitted = 1;
+	slots[i].outstanding = 1;
+	return 0;
+}
+
+/* handle events until another callback has run */
+static void wait_callback(libusb_context *ctx)
+{
+	struct timeval tv = { 0, 10000 };
+	int target = callbacks + 1;
+
+	while (callbacks < target)
+		libusb_handle_events_timeout(ctx, &tv);
+}
+
+/* check the heap against the outstanding slots; returns 0 if consistent */
+static int check_heap(libusb_context *ctx, const char *when)
+{
+	struct timeval next, now, *earliest = NULL;
+	struct timespec ts;
+	int outstanding = 0;
+	int failed = 0;
+	int size;
+	int i;
+
+	pthread_mutex_lock(&ctx->flying_transfers_lock);
+	size = ctx->timeout_heap_size;
+	for (i = 0; i < size; i++) {
+		struct usbi_transfer *transfer = ctx->timeout_heap[i];
+
+		if (transfer->timeout_index != i) {
+			fprintf(stderr, "%s: heap entry %d records index %d\n", when, i,
+				transfer->timeout_index);
+			failed = 1;
+		}
+		if (i > 0 && timercmp(&transfer->timeout,
+				&ctx->timeout_heap[(i - 1) / 2]->timeout, <)) {
+			fprintf(stderr, "%s: heap entry %d expires before its parent\n",
+				when, i);
+			failed = 1;
+		}
+	}
+	for (i = 0; i < SLOTS; i++) {
+		int index = __LIBUSB_TRANSFER_TO_USBI_TRANSFER(
+			slots[i].transfer)->timeout_index;
+
+		if (!slots[i].outstanding) {
+			if (slots[i].submitted && index != -1) {
+				fprintf(stderr, "%s: finished slot %d still on the heap\n",
+					when, i);
+				failed = 1;
+			}
+			continue;
+		}
+		outstanding++;
+		if (index < 0 || index >= size
+				|| ctx->timeout_heap[index]
+				!= __LIBUSB_TRANSFER_TO_USBI_TRANSFER(slots[i].transfer)) {
+			fprintf(stderr, "%s: slot %d not on the heap at index %d\n",
+				when, i, index);
+			failed = 1;
+		}
+		if (!earliest || timercmp(slot_deadline(i), earliest, <))
+			earliest = slot_deadline(i);
+	}
+	if (size != outstanding) {
+		fprintf(stderr, "%s: %d transfers on the heap, %d outstanding\n", when,
+			size, outstanding);
+		failed = 1;
+	}
+	pthread_mutex_unlock(&ctx->flying_transfers_lock);
+
+	/* the next timeout is relative, so compare it as a deadline */
+	i = libusb_get_next_timeout(ctx, &next);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now.tv_sec = ts.tv_sec;
+	now.tv_usec = ts.tv_nsec / 1000;
+	if (i != (earliest != NULL)) {
+		fprintf(stderr, "%s: libusb_get_next_timeout returned %d\n", when, i);
+		failed = 1;
+	} else if (earliest) {
+		struct timeval deadline, error;
+
+		timeradd(&now, &next, &deadline);
+		if (timercmp(&deadline, earliest, >))
+			timersub(&deadline, earliest, &error);
+		else
+			timersub(earliest, &deadline, &error);
+		if (error.tv_sec > 0 || error.tv_usec > 10000) {
+			fprintf(stderr, "%s: next timeout %ld.%06lds off\n", when,
+				(long) error.tv_sec, (long) error.tv_usec);
+			failed = 1;
+		}
+	}
+	return failed;
+}
+
+/* seven transfers with timeouts of 1 to 7 seconds, submitted out of order,
+ * then removed from the middle, the top and the bottom of the heap */
+static int check_middle_removal(libusb_context *ctx,
+	libusb_device_handle *handle)
+{
+	static const int seconds[] = { 4, 2, 6, 1, 3, 5, 7 };
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < 7; i++) {
+		if (submit_slot(handle, i, seconds[i] * 1000))
+			return 1;
+		failed |= check_heap(ctx, "insert");
+	}
+
+	/* the 3 second timeout, neither first nor last, is cancelled */
+	libusb_cancel_transfer(slots[4].transfer);
+	wait_callback(ctx);
+	failed |= check_heap(ctx, "cancel middle");
+
+	/* the oldest URB, with the 4 second timeout, completes */
+	fake_usbfs_complete(handle, 1);
+	wait_callback(ctx);
+	if (slots[0].outstanding || slots[0].status != LIBUSB_TRANSFER_COMPLETED) {
+		fprintf(stderr, "oldest transfer did not complete\n");
+		failed = 1;
+	}
+	failed |= check_heap(ctx, "complete middle");
+
+	/* the earliest and the latest */
+	libusb_cancel_transfer(slots[3].transfer);
+	wait_callback(ctx);
+	failed |= check_heap(ctx, "cancel earliest");
+	libusb_cancel_transfer(slots[6].transfer);
+	wait_callback(ctx);
+	failed |= check_heap(ctx, "cancel latest");
+
+	for (i = 0; i < 7; i++) {
+		if (!slots[i].outstanding)
+			continue;
+		libusb_cancel_transfer(slots[i].transfer);
+		wait_callback(ctx);
+		failed |= check_heap(ctx, "cancel rest");
+	}
+	printf("removal from the middle of the heap: %s\n",
+		failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/* random submissions, completions of the oldest URB and cancellations of a
+ * random transfer, with timeouts far enough out not to expire */
+static int check_random(libusb_context *ctx, libusb_device_handle *handle)
+{
+	int submits = 0, completions = 0, cancels = 0;
+	int failed = 0;
+	int step;
+	int i;
+
+	for (step = 0; step < RANDOM_STEPS && !failed; step++) {
+		int op = next_random() % 3;
+		int pick = next_random() % SLOTS;
+
+		if (op == 0 || fake_usbfs_in_flight() == 0) {
+			for (i = 0; i < SLOTS && slots[pick].outstanding; i++)
+				pick = (pick + 1) % SLOTS;
+			if (i == SLOTS)
+				continue;
+			if (submit_slot(handle, pick, 10000 + next_random() % 20000))
+				return 1;
+			failed |= check_heap(ctx, "random insert");
+			submits++;
+		} else if (op == 1) {
+			fake_usbfs_complete(handle, 1);
+			wait_callback(ctx);
+			failed |= check_heap(ctx, "random completion");
+			completions++;
+		} else {
+			while (!slots[pick].outstanding)
+				pick = (pick + 1) % SLOTS;
+			libusb_cancel_transfer(slots[pick].transfer);
+			wait_callback(ctx);
+			failed |= check_heap(ctx, "random cancel");
+			cancels++;
+		}
+	}
+
+	for (i = 0; i < SLOTS; i++) {
+		if (!slots[i].outstanding)
+			continue;
+		libusb_cancel_transfer(slots[i].transfer);
+		wait_callback(ctx);
+	}
+	failed |= check_heap(ctx, "random cleanup");
+	printf("%d random steps (%d submits, %d completions, %d cancels): %s\n",
+		step, submits, completions, cancels, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+/* timeouts between 20ms and 400ms; a fifth are cancelled and the oldest
+ * three complete, the rest must be reported in deadline order */
+static int check_expiry_order(libusb_context *ctx,
+	libusb_device_handle *handle)
+{
+	int failed = 0;
+	int left = 0;
+	int i;
+
+	expired_count = 0;
+	for (i = 0; i < EXPIRING; i++)
+		if (submit_slot(handle, i, 20 + (i * 173) % 380))
+			return 1;
+	for (i = 2; i < EXPIRING; i += 5) {
+		libusb_cancel_transfer(slots[i].transfer);
+		wait_callback(ctx);
+	}
+	for (i = 0; i < 3; i++) {
+		fake_usbfs_complete(handle, 1);
+		wait_callback(ctx);
+	}
+	failed |= check_heap(ctx, "before expiry");
+	for (i = 0; i < EXPIRING; i++)
+		left += slots[i].outstanding;
+	while (expired_count < left)
+		wait_callback(ctx);
+	failed |= check_heap(ctx, "after expiry");
+
+	for (i = 1; i < expired_count; i++) {
+		if (timercmp(slot_deadline(expired[i]),
+				slot_deadline(expired[i - 1]), <)) {
+			fprintf(stderr, "slot %d timed out before slot %d\n",
+				expired[i - 1], expired[i]);
+			failed = 1;
+		}
+	}
+	printf("%d of %d transfers timed out in deadline order: %s\n",
+		expired_count, EXPIRING, failed ? "FAILED" : "ok");
+	return failed;
+}
+
+int main(void)
+{
+	libusb_device_handle *handle;
+	libusb_context *ctx;
+	int failed = 0;
+	int r;
+	int i;
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %d\n", r);
+		return 1;
+	}
+	r = fake_usbfs_open(ctx, &handle);
+	if (r < 0) {
+		fprintf(stderr, "fake_usbfs_open failed: %d\n", r);
+		return 1;
+	}
+	for (i = 0; i < SLOTS; i++)
+		slots[i].transfer = libusb_alloc_transfer(0);
+
+	failed |= check_middle_removal(ctx, handle);
+	failed |= check_random(ctx, handle);
+	failed |= check_expiry_order(ctx, handle);
+
+	for (i = 0; i < SLOTS; i++)
+		libusb_free_transfer(slots[i].transfer);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	printf("timeout_heap_test: %s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
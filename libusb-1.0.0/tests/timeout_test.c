@@ -0,0 +1,355 @@
+/*
+ * Transfer timeout test: timeouts fire on time with the timerfd
+ *
+ * Checks that libusb_get_next_timeout() reports the real next deadline while
+ * timeouts are also signalled through the timerfd, that transfers which
+ * never complete are reported as LIBUSB_TRANSFER_TIMED_OUT no earlier than
+ * their deadline and at most LATENESS_MAX_MS after it while another device
+ * keeps the event loop busy, that a transfer completing before its
+ * deadline is not reported again when the deadline passes, and that a
+ * double-buffered bulk reader call never waits much longer than the
+ * reader's timeout.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fake_usbfs.h"
+
+#define TIMED_TRANSFERS		200
+#define LOAD_TRANSFERS		8
+#define LATENESS_MAX_MS		50.0
+
+struct timed {
+	double deadline;
+	double fired;
+	int status;
+	int callbacks;
+};
+
+static libusb_device_handle *load_handle;
+static volatile int load_running;
+static unsigned long load_completed;
+static int load_outstanding;
+static int timed_done;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void timed_cb(struct libusb_transfer *transfer)
+{
+	struct timed *timed = transfer->user_data;
+
+	timed->fired = now();
+	timed->status = transfer->status;
+	timed->callbacks++;
+	timed_done++;
+}
+
+static void load_cb(struct libusb_transfer *transfer)
+{
+	load_completed++;
+	if (load_running && libusb_submit_transfer(transfer) == 0)
+		return;
+	load_outstanding--;
+}
+
+/* plays the busy device: completes its URBs as fast as they come in */
+static void *device_main(void *arg)
+{
+	while (load_running) {
+		fake_usbfs_complete(load_handle, LOAD_TRANSFERS);
+		usleep(200);
+	}
+	return NULL;
+}
+
+static int submit_timed(libusb_device_handle *handle,
+	struct libusb_transfer *transfer, struct timed *timed,
+	unsigned char *buffer, unsigned int timeout)
+{
+	libusb_fill_bulk_transfer(transfer, handle, 0x81, buffer, 64, timed_cb,
+		timed, timeout);
+	timed->deadline = now() + timeout / 1000.0;
+	timed->callbacks = 0;
+	return libusb_submit_transfer(transfer);
+}
+
+static int check_next_timeout(libusb_context *ctx,
+	libusb_device_handle *handle)
+{
+	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	unsigned char buffer[64];
+	struct timed timed;
+	struct timeval tv;
+	double next = 0;
+	int failed = 0;
+	int r;
+
+	if (submit_timed(handle, transfer, &timed, buffer, 500) < 0) {
+		fprintf(stderr, "submit failed\n");
+		return 1;
+	}
+	r = libusb_get_next_timeout(ctx, &tv);
+	if (r == 1)
+		next = tv.tv_sec + tv.tv_usec / 1e6;
+	printf("next timeout with one 500ms transfer: r=%d, %.3fs\n", r, next);
+	if (r != 1 || next <= 0.45 || next > 0.5) {
+		fprintf(stderr, "wrong next timeout\n");
+		failed = 1;
+	}
+
+	libusb_cancel_transfer(transfer);
+	while (!timed.callbacks)
+		libusb_handle_events(ctx);
+	libusb_free_transfer(transfer);
+	if (timed.status != LIBUSB_TRANSFER_CANCELLED) {
+		fprintf(stderr, "cancelled transfer has status %d\n", timed.status);
+		failed = 1;
+	}
+	r = libusb_get_next_timeout(ctx, &tv);
+	if (r != 0) {
+		fprintf(stderr, "timeout left after cancellation: r=%d\n", r);
+		failed = 1;
+	}
+	return failed;
+}
+
+static int check_timeouts_under_load(libusb_context *ctx,
+	libusb_device_handle *handle)
+{
+	struct libusb_transfer *load[LOAD_TRANSFERS];
+	struct libusb_transfer *transfers[TIMED_TRANSFERS];
+	static struct timed timed[TIMED_TRANSFERS];
+	static unsigned char buffers[TIMED_TRANSFERS + LOAD_TRANSFERS][64];
+	unsigned long discarded = fake_usbfs_discarded();
+	struct timeval tv = { 0, 100000 };
+	double lateness, max = 0, sum = 0;
+	pthread_t device;
+	int failed = 0;
+	int i;
+
+	timed_done = 0;
+	load_running = 1;
+	for (i = 0; i < LOAD_TRANSFERS; i++) {
+		load[i] = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(load[i], load_handle, 0x82,
+			buffers[TIMED_TRANSFERS + i], 64, load_cb, NULL, 0);
+		if (libusb_submit_transfer(load[i]) < 0) {
+			fprintf(stderr, "load submit failed\n");
+			return 1;
+		}
+		load_outstanding++;
+	}
+	if (pthread_create(&device, NULL, device_main, NULL)) {
+		fprintf(stderr, "pthread_create failed\n");
+		return 1;
+	}
+
+	/* deadlines between 10ms and 308ms, submitted in no particular order */
+	for (i = 0; i < TIMED_TRANSFERS; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (submit_timed(handle, transfers[i], &timed[i], buffers[i],
+				10 + (i * 37) % 299) < 0) {
+			fprintf(stderr, "submit failed\n");
+			return 1;
+		}
+	}
+	while (timed_done < TIMED_TRANSFERS)
+		libusb_handle_events_timeout(ctx, &tv);
+
+	load_running = 0;
+	pthread_join(device, NULL);
+	for (i = 0; i < LOAD_TRANSFERS; i++)
+		libusb_cancel_transfer(load[i]);
+	while (load_outstanding > 0)
+		libusb_handle_events_timeout(ctx, &tv);
+	for (i = 0; i < LOAD_TRANSFERS; i++)
+		libusb_free_transfer(load[i]);
+
+	for (i = 0; i < TIMED_TRANSFERS; i++) {
+		libusb_free_transfer(transfers[i]);
+		lateness = (timed[i].fired - timed[i].deadline) * 1000;
+		if (timed[i].status != LIBUSB_TRANSFER_TIMED_OUT
+				|| timed[i].callbacks != 1) {
+			fprintf(stderr, "transfer %d: status %d, %d callbacks\n", i,
+				timed[i].status, timed[i].callbacks);
+			failed = 1;
+		}
+		if (lateness < 0) {
+			fprintf(stderr, "transfer %d timed out %.3fms early\n", i,
+				-lateness);
+			failed = 1;
+		}
+		if (lateness > max)
+			max = lateness;
+		sum += lateness;
+	}
+	printf("%d timeouts while the other device completed %lu transfers: "
+		"mean %.3fms, max %.3fms late\n", TIMED_TRANSFERS, load_completed,
+		sum / TIMED_TRANSFERS, max);
+	if (max > LATENESS_MAX_MS) {
+		fprintf(stderr, "timeouts fired more than %.0fms late\n",
+			LATENESS_MAX_MS);
+		failed = 1;
+	}
+	if (fake_usbfs_discarded() - discarded
+			!= TIMED_TRANSFERS + LOAD_TRANSFERS) {
+		fprintf(stderr, "%lu URBs discarded, expected %d\n",
+			fake_usbfs_discarded() - discarded,
+			TIMED_TRANSFERS + LOAD_TRANSFERS);
+		failed = 1;
+	}
+	return failed;
+}
+
+static int check_completed_before_timeout(libusb_context *ctx,
+	libusb_device_handle *handle)
+{
+	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct timeval tv = { 0, 10000 };
+	unsigned char buffer[64];
+	struct timed timed;
+	double end;
+
+	if (submit_timed(handle, transfer, &timed, buffer, 50) < 0) {
+		fprintf(stderr, "submit failed\n");
+		return 1;
+	}
+	fake_usbfs_complete(handle, 1);
+	end = timed.deadline + 0.1;
+	while (now() < end)
+		libusb_handle_events_timeout(ctx, &tv);
+	libusb_free_transfer(transfer);
+	if (timed.callbacks != 1 || timed.status != LIBUSB_TRANSFER_COMPLETED) {
+		fprintf(stderr, "completed transfer: status %d, %d callbacks\n",
+			timed.status, timed.callbacks);
+		return 1;
+	}
+	return 0;
+}
+
+static void *complete_later(void *arg)
+{
+	usleep(5000);
+	fake_usbfs_complete(arg, 1);
+	return NULL;
+}
+
+/* read from the reader while another thread completes the transfer */
+static int read_completed(libusb_device_handle *handle,
+	libusb_bulk_reader *reader)
+{
+	unsigned char data[64];
+	pthread_t device;
+	int transferred;
+	int r;
+
+	pthread_create(&device, NULL, complete_later, handle);
+	r = libusb_bulk_reader_read(reader, data, sizeof(data), &transferred);
+	pthread_join(device, NULL);
+	if (r < 0 || transferred != sizeof(data)) {
+		fprintf(stderr, "reader read: %d, %d bytes\n", r, transferred);
+		return 1;
+	}
+	return 0;
+}
+
+/* a read that times out; returns how long it took, or -1 */
+static double read_timed_out(libusb_bulk_reader *reader)
+{
+	unsigned char data[64];
+	int transferred;
+	double start = now();
+	int r;
+
+	r = libusb_bulk_reader_read(reader, data, sizeof(data), &transferred);
+	if (r != LIBUSB_ERROR_TIMEOUT) {
+		fprintf(stderr, "reader read did not time out: %d\n", r);
+		return -1;
+	}
+	return now() - start;
+}
+
+/* the next read is submitted while the previous one returns its data. if it
+ * times out during the following call, that call must not wait again; if it
+ * timed out before the call, it is retried with the full timeout. */
+static int check_bulk_reader_timeout(libusb_device_handle *handle)
+{
+	libusb_bulk_reader *reader;
+	double during, before;
+	int failed = 0;
+
+	if (libusb_open_bulk_reader(handle, 0x81, 64, 100,
+			LIBUSB_BULK_READER_DOUBLE_BUFFER, &reader) < 0) {
+		fprintf(stderr, "libusb_open_bulk_reader failed\n");
+		return 1;
+	}
+	if (read_completed(handle, reader))
+		return 1;
+	usleep(50000);
+	during = read_timed_out(reader);
+	if (read_completed(handle, reader))
+		return 1;
+	usleep(150000);
+	before = read_timed_out(reader);
+	libusb_close_bulk_reader(reader);
+
+	printf("100ms reader timeout, pre-submitted read expiring 50ms into the "
+		"call: %.0fms, expired before the call: %.0fms\n", during * 1000,
+		before * 1000);
+	if (during < 0 || during > 0.08) {
+		fprintf(stderr, "read waited past the pre-submitted timeout\n");
+		failed = 1;
+	}
+	if (before < 0.09 || before > 0.15) {
+		fprintf(stderr, "expired read was not retried with the full timeout\n");
+		failed = 1;
+	}
+	return failed;
+}
+
+int main(void)
+{
+	libusb_device_handle *handle;
+	libusb_context *ctx;
+	int failed = 0;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r < 0) {
+		fprintf(stderr, "libusb_init failed: %d\n", r);
+		return 1;
+	}
+	if (fake_usbfs_open(ctx, &handle) < 0
+			|| fake_usbfs_open(ctx, &load_handle) < 0) {
+		fprintf(stderr, "fake_usbfs_open failed\n");
+		return 1;
+	}
+	printf("timeouts handled through the poll fds: %d\n",
+		libusb_pollfds_handle_timeouts(ctx));
+
+	failed |= check_next_timeout(ctx, handle);
+	failed |= check_timeouts_under_load(ctx, handle);
+	failed |= check_completed_before_timeout(ctx, handle);
+	failed |= check_bulk_reader_timeout(handle);
+
+	libusb_close(handle);
+	libusb_close(load_handle);
+	libusb_exit(ctx);
+	printf("timeout_test: %s\n", failed ? "FAILED" : "ok");
+	return failed;
+}